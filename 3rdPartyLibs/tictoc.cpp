@@ -44,12 +44,38 @@ using namespace std;
 using namespace TICTOC;
 
 tictoc::tictoc() {
+#ifdef WIN32
+    InitializeCriticalSection(&mutex);
+#else
+    pthread_mutex_init(&mutex, NULL);
+#endif
     tim = new Timer();
     tim->start();
     enabled = true;
 }
 tictoc::~tictoc() {
     delete tim;
+#ifdef WIN32
+    DeleteCriticalSection(&mutex);
+#else
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+void tictoc::lock() {
+#ifdef WIN32
+    EnterCriticalSection(&mutex);
+#else
+    pthread_mutex_lock(&mutex);
+#endif
+}
+
+void tictoc::unlock() {
+#ifdef WIN32
+    LeaveCriticalSection(&mutex);
+#else
+    pthread_mutex_unlock(&mutex);
+#endif
 }
 
 struct TICTOC::_tictoc_data {
@@ -83,6 +109,7 @@ void tictoc::tic(const string &name, bool notick) {
     if (!enabled || notick)
         return;
     
+    lock();
     _tictoc_data *td;
     map<string, _tictoc_data>::iterator it;
     it = tt.find(name);
@@ -96,6 +123,7 @@ void tictoc::tic(const string &name, bool notick) {
         ++(td->numblowntics);
     }
     td->ticked = true;
+    unlock();
 }
 void tictoc::tic(const char* name, bool notick) {
     tic (string(name), notick);
@@ -105,14 +133,17 @@ double tictoc::toc(const string &name, bool notock) {
     if (!enabled || notock) {
         return 0;
     }
+    lock();
     _tictoc_data *td;
     map<string, _tictoc_data>::iterator it;
     it = tt.find(name);
     if (it == tt.end()) {
+        unlock();
         return NOT_FOUND; //key not found
     }
     td = &(it->second);
     if (!td->ticked) {
+        unlock();
         return NOT_TICKED; //toc called without tic
     }
     ++(td->ncalls);
@@ -121,6 +152,7 @@ double tictoc::toc(const string &name, bool notock) {
     td->maxtime = et > td->maxtime ? et : td->maxtime;
     td->mintime = et < td->mintime ? et : td->mintime;
     td->totaltime += et;
+    unlock();
     return et;
 }
 
@@ -144,11 +176,13 @@ void tdpToSS (stringstream &s, const pair<string, _tictoc_data> *p) {
 string tictoc::generateReport() {
     stringstream s;
     map<string, _tictoc_data>::iterator it;
+    lock();
     for (it = tt.begin(); it != tt.end(); ++it) {
         s<<"-\n";
         tdpToSS(s, *it);
         
     }
+    unlock();
     return s.str();
 }
 char *tictoc::generateReportCstr() {
@@ -164,7 +198,9 @@ double tictoc::clock() {
 }
 
 void tictoc::clear() {
+    lock();
     tt.clear();
+    unlock();
 }
 
 tictoc &TICTOC::timer() {
@@ -45,6 +45,13 @@
 
 #include <map>
 #include <cstring>
+
+#ifdef WIN32   // Windows system specific
+#include <windows.h>
+#else          // Unix based system specific
+#include <pthread.h>
+#endif
+
 class Timer;
 
 namespace TICTOC {
@@ -126,6 +133,18 @@ namespace TICTOC {
         std::map <std::string, struct _tictoc_data> tt;
         Timer *tim;
         bool enabled;
+
+        /* tic and toc may be called from more than one thread at a time
+         * (the display thread and the pipelined closed loop stages)
+         * so access to the map and to the timer is serialized.
+         */
+        void lock();
+        void unlock();
+#ifdef WIN32
+        CRITICAL_SECTION mutex;
+#else
+        pthread_mutex_t mutex;
+#endif
     };
 
     /* tictoc timer
@@ -42,6 +42,11 @@
 #include <string.h>
 #include "AndysOpenCVLib.h"
 #include <limits.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define PRINTOUT 0
 
@@ -134,6 +139,9 @@ Frame* CreateFrame(CvSize size){
 	/*** Allocate memory for the image ***/
 	myFrame->binary=(unsigned char *) malloc(size.width* size.height * sizeof(unsigned char));
 	myFrame->iplimg=cvCreateImage(size, IPL_DEPTH_8U, 1);
+	myFrame->ownImageData=myFrame->iplimg->imageData;
+	myFrame->iplimg16=NULL;
+	myFrame->roi=cvRect(0,0,0,0);
 
 	/*** Set Binary Image to Zero ***/
 	int count=0;
@@ -153,6 +161,7 @@ Frame* CreateFrame(CvSize size){
  */
 void DestroyFrame(Frame** myFrame){
 	cvReleaseImage(&( (*myFrame)->iplimg));
+	if ((*myFrame)->iplimg16!=NULL) cvReleaseImage(&( (*myFrame)->iplimg16));
 	free( (*myFrame)->binary);
 	free(*myFrame);
 	*myFrame=NULL;
@@ -220,6 +229,992 @@ void SetFrame(Frame* myFrame, int value){
 	copyIplImageToCharArray(myFrame->iplimg,myFrame->binary);
 }
 
+/*
+ * Point the frame's iplImage at someone else's image buffer without copying.
+ *
+ * Only imageData is swapped. imageDataOrigin is left alone,
+ * so cvReleaseImage() in DestroyFrame() still frees the frame's own memory.
+ */
+void LendBufferToFrame(unsigned char* buf, Frame* myFrame){
+	myFrame->iplimg->imageData=(char*) buf;
+}
+
+/*
+ * Point the frame's iplImage back at its own memory and
+ * return the buffer that had been lent to it (or NULL).
+ */
+unsigned char* ReclaimFrameBuffer(Frame* myFrame){
+	if (myFrame->iplimg->imageData==myFrame->ownImageData) return NULL;
+	unsigned char* buf=(unsigned char*) myFrame->iplimg->imageData;
+	myFrame->iplimg->imageData=myFrame->ownImageData;
+	return buf;
+}
+
+/*
+ * Copy an image buffer whose rows are step bytes apart into the frame's iplImage.
+ */
+void LoadFrameWithBuffer(unsigned char* buf, int step, Frame* myFrame){
+	IplImage* img=myFrame->iplimg;
+	for (int y=0; y<myFrame->size.height; y++){
+		memcpy(img->imageData+y*img->widthStep, buf+y*step, myFrame->size.width);
+	}
+	myFrame->roi=cvRect(0,0,myFrame->size.width,myFrame->size.height);
+}
+
+static int SameRect(CvRect a, CvRect b){
+	return (a.x==b.x && a.y==b.y && a.width==b.width && a.height==b.height);
+}
+
+/*
+ * Copy a buffer that holds only the roi part of the frame into the same place in the frame's iplImage.
+ */
+void LoadFrameRegionWithBuffer(unsigned char* buf, int step, CvRect roi, Frame* myFrame){
+	IplImage* img=myFrame->iplimg;
+	/** Whatever was loaded outside of the new region is stale **/
+	if (!SameRect(roi,myFrame->roi)) cvSetZero(img);
+	for (int y=0; y<roi.height; y++){
+		memcpy(img->imageData+(roi.y+y)*img->widthStep+roi.x, buf+y*step, roi.width);
+	}
+	myFrame->roi=roi;
+}
+
+
+
+/***************************************************************
+ * High Bit Depth Frames
+ ***************************************************************
+ */
+
+/*
+ * A Conv16 worked out into what the conversion loop needs.
+ *
+ * Window: out = (((min(v-low,range) << shift) * mult) >> 16 + 64) >> 7
+ * The shift makes the most of 16 bits and the multiplier carries 7 extra bits
+ * for rounding, which comes to within one level of (v-low)*255/range.
+ */
+typedef struct Conv16KernelStruct{
+	int mode;
+	int shift;
+	unsigned short low;
+	unsigned short range;
+	unsigned short mult;
+}Conv16Kernel;
+
+static void PrepareConv16Kernel(Conv16* conv, Conv16Kernel* k){
+	k->mode=conv->mode;
+	if (conv->mode==CONV16_SHIFT){
+		k->shift= (conv->bitDepth > 8) ? conv->bitDepth-8 : 0;
+		return;
+	}
+	int range=conv->high-conv->low;
+	if (range < 1) range=1;
+	if (range > 65535) range=65535;
+	int shift=0;
+	while ((range << (shift+1)) <= 65535) shift++;
+	k->low=(unsigned short) ((conv->low < 0) ? 0 : conv->low);
+	k->range=(unsigned short) range;
+	k->shift=shift;
+	k->mult=(unsigned short) ((255.0*128.0*65536.0)/(range << shift)+0.5);
+}
+
+/*
+ * Copy a row of 16 bit pixels (if copy is not NULL) and convert it to 8 bits in the same pass.
+ */
+static void ConvertRow16(const unsigned short* src, unsigned short* copy, unsigned char* dst, int width, Conv16Kernel* k){
+	int x=0;
+#ifdef __SSE2__
+	const __m128i shift=_mm_cvtsi32_si128(k->shift);
+	if (k->mode==CONV16_SHIFT){
+		for (; x+16 <= width; x+=16){
+			__m128i a=_mm_loadu_si128((const __m128i*) (src+x));
+			__m128i b=_mm_loadu_si128((const __m128i*) (src+x+8));
+			if (copy!=NULL){
+				_mm_storeu_si128((__m128i*) (copy+x),a);
+				_mm_storeu_si128((__m128i*) (copy+x+8),b);
+			}
+			_mm_storeu_si128((__m128i*) (dst+x),_mm_packus_epi16(_mm_srl_epi16(a,shift),_mm_srl_epi16(b,shift)));
+		}
+	} else {
+		const __m128i low=_mm_set1_epi16((short) k->low);
+		const __m128i range=_mm_set1_epi16((short) k->range);
+		const __m128i mult=_mm_set1_epi16((short) k->mult);
+		const __m128i half=_mm_set1_epi16(64);
+		for (; x+16 <= width; x+=16){
+			__m128i a=_mm_loadu_si128((const __m128i*) (src+x));
+			__m128i b=_mm_loadu_si128((const __m128i*) (src+x+8));
+			if (copy!=NULL){
+				_mm_storeu_si128((__m128i*) (copy+x),a);
+				_mm_storeu_si128((__m128i*) (copy+x+8),b);
+			}
+			/** Clip to low..high: below low saturates to 0, and min(d,range) is d-max(d-range,0) **/
+			a=_mm_subs_epu16(a,low);
+			b=_mm_subs_epu16(b,low);
+			a=_mm_sub_epi16(a,_mm_subs_epu16(a,range));
+			b=_mm_sub_epi16(b,_mm_subs_epu16(b,range));
+			a=_mm_mulhi_epu16(_mm_sll_epi16(a,shift),mult);
+			b=_mm_mulhi_epu16(_mm_sll_epi16(b,shift),mult);
+			a=_mm_srli_epi16(_mm_add_epi16(a,half),7);
+			b=_mm_srli_epi16(_mm_add_epi16(b,half),7);
+			_mm_storeu_si128((__m128i*) (dst+x),_mm_packus_epi16(a,b));
+		}
+	}
+#endif
+
+	/** Whatever is left of the row **/
+	if (copy!=NULL) memcpy(copy+x,src+x,(width-x)*sizeof(unsigned short));
+	for (; x<width; x++){
+		unsigned int v=src[x];
+		if (k->mode==CONV16_SHIFT){
+			v>>=k->shift;
+			dst[x]=(unsigned char) ((v > 255) ? 255 : v);
+		} else {
+			v= (v > k->low) ? v-k->low : 0;
+			if (v > k->range) v=k->range;
+			v=((((v << k->shift)*k->mult) >> 16)+64) >> 7;
+			dst[x]=(unsigned char) v;
+		}
+	}
+}
+
+/*
+ * Copy a high bit depth buffer into the frame's iplimg16 and convert it to 8 bits into its iplImage.
+ */
+void LoadFrameWithBuffer16(unsigned char* buf, int step, Conv16* conv, Frame* myFrame){
+	LoadFrameRegionWithBuffer16(buf,step,cvRect(0,0,myFrame->size.width,myFrame->size.height),conv,myFrame);
+}
+
+void LoadFrameRegionWithBuffer16(unsigned char* buf, int step, CvRect roi, Conv16* conv, Frame* myFrame){
+	if (myFrame->iplimg16==NULL) myFrame->iplimg16=cvCreateImage(myFrame->size,IPL_DEPTH_16U,1);
+	IplImage* img=myFrame->iplimg;
+	IplImage* img16=myFrame->iplimg16;
+	if (!SameRect(roi,myFrame->roi)){
+		cvSetZero(img);
+		cvSetZero(img16);
+	}
+	Conv16Kernel k;
+	PrepareConv16Kernel(conv,&k);
+	for (int y=0; y<roi.height; y++){
+		ConvertRow16((unsigned short*) (buf+y*step),(unsigned short*) (img16->imageData+(roi.y+y)*img16->widthStep)+roi.x,
+				(unsigned char*) img->imageData+(roi.y+y)*img->widthStep+roi.x,roi.width,&k);
+	}
+	myFrame->roi=roi;
+}
+
+void SetConv16Shift(Conv16* conv, int bitDepth){
+	conv->mode=CONV16_SHIFT;
+	conv->bitDepth=bitDepth;
+	conv->low=0;
+	conv->high=(1 << bitDepth)-1;
+}
+
+int SetConv16Window(Conv16* conv, int bitDepth, int low, int high){
+	if (high <= low){
+		printf("Error! The window's high end (%d) must be above its low end (%d).\n",high,low);
+		return -1;
+	}
+	conv->mode=CONV16_WINDOW;
+	conv->bitDepth=bitDepth;
+	conv->low=low;
+	conv->high=high;
+	return 0;
+}
+
+int Conv16Level(Conv16* conv, int level8){
+	if (conv->mode==CONV16_SHIFT){
+		int shift= (conv->bitDepth > 8) ? conv->bitDepth-8 : 0;
+		/** Everything that shifts down to level8 or below **/
+		return ((level8+1) << shift)-1;
+	}
+	return conv->low+(level8*(conv->high-conv->low)+127)/255;
+}
+
+/*
+ * Threshold a 16 bit image into an 8 bit one.
+ */
+void ThresholdImage16(IplImage* src, IplImage* dst, int thresh){
+	if (thresh < 0) thresh=0;
+	if (thresh > 65535) thresh=65535;
+	CvRect r=cvGetImageROI(src);
+	CvRect d=cvGetImageROI(dst);
+	int width=r.width;
+	for (int y=0; y<r.height; y++){
+		const unsigned short* in=(const unsigned short*) (src->imageData+(r.y+y)*src->widthStep)+r.x;
+		unsigned char* out=(unsigned char*) dst->imageData+(d.y+y)*dst->widthStep+d.x;
+		int x=0;
+#ifdef __SSE2__
+		const __m128i t=_mm_set1_epi16((short) thresh);
+		const __m128i zero=_mm_setzero_si128();
+		for (; x+16 <= width; x+=16){
+			/** v > thresh exactly when v-thresh doesn't saturate to 0 **/
+			__m128i a=_mm_cmpeq_epi16(_mm_subs_epu16(_mm_loadu_si128((const __m128i*) (in+x)),t),zero);
+			__m128i b=_mm_cmpeq_epi16(_mm_subs_epu16(_mm_loadu_si128((const __m128i*) (in+x+8)),t),zero);
+			_mm_storeu_si128((__m128i*) (out+x),_mm_xor_si128(_mm_packs_epi16(a,b),_mm_cmpeq_epi8(zero,zero)));
+		}
+#endif
+		for (; x<width; x++) out[x]= (in[x] > thresh) ? 255 : 0;
+	}
+}
+
+
+/****/
+/* Smoothing and thresholding in one pass */
+
+#define SMOOTH_MAXBOXES 3
+
+/*
+ * Split the Gaussian that cvSmooth() uses for a GaussSize*2+1 kernel into box filters,
+ * each summing from lo[i] pixels before to hi[i] pixels after a pixel.
+ * Returns the number of boxes and puts what the boxes, run across and then down,
+ * multiply an image by in *norm.
+ */
+static int GaussianBoxes(int GaussSize, int* lo, int* hi, int* norm){
+	int n=0, i;
+	if (GaussSize==1){
+		/** 1 2 1: a two pixel box leaning back and then one leaning forward **/
+		n=2;
+		lo[0]=1; hi[0]=0;
+		lo[1]=0; hi[1]=1;
+	} else if (GaussSize > 1){
+		/** Three odd boxes, m of them w wide and the rest w+2, with the same variance as the Gaussian **/
+		double sigma=0.3*(GaussSize-1)+0.8;
+		double var=sigma*sigma;
+		int w=(int) sqrt(4*var+1);
+		if (w%2==0) w--;
+		int m=cvRound((12*var-3*w*w-12*w-9)/(-4.0*w-4));
+		for (i=0; i<3; i++){
+			int half= (i < m) ? w/2 : w/2+1;
+			if (half==0) continue; // a one pixel box does nothing
+			lo[n]=hi[n]=half;
+			n++;
+		}
+	}
+	*norm=1;
+	for (i=0; i<n; i++) *norm*=lo[i]+hi[i]+1;
+	*norm*=*norm;
+	return n;
+}
+
+/*
+ * Running sums across four rows at once: out[x] is in[x-lo]+...+in[x+hi], with the
+ * end pixels repeated. The rows are interleaved (in[4*x+k] is pixel x of row k) so
+ * the four sums run side by side instead of one after another.
+ */
+static void BoxRows4(const int* in, int* out, int n, int lo, int hi){
+	int x;
+#ifdef __SSE2__
+	__m128i sum=_mm_setzero_si128();
+	for (x=-lo; x<=hi; x++) sum=_mm_add_epi32(sum,_mm_loadu_si128((const __m128i*) (in+4*((x < 0) ? 0 : (x < n) ? x : n-1))));
+	const __m128i first=_mm_loadu_si128((const __m128i*) in);
+	const __m128i last=_mm_loadu_si128((const __m128i*) (in+4*(n-1)));
+	int body=(n-hi-1 > lo) ? n-hi-1 : lo;
+	for (x=0; x<lo && x<n; x++){
+		_mm_storeu_si128((__m128i*) (out+4*x),sum);
+		int add=(x+hi+1 < n) ? x+hi+1 : n-1;
+		sum=_mm_add_epi32(sum,_mm_sub_epi32(_mm_loadu_si128((const __m128i*) (in+4*add)),first));
+	}
+	/** Only the ends need clamping **/
+	const int* add=in+4*(x+hi+1);
+	const int* sub=in+4*(x-lo);
+	for (; x<body; x++, add+=4, sub+=4){
+		_mm_storeu_si128((__m128i*) (out+4*x),sum);
+		sum=_mm_add_epi32(sum,_mm_sub_epi32(_mm_loadu_si128((const __m128i*) add),_mm_loadu_si128((const __m128i*) sub)));
+	}
+	for (; x<n; x++){
+		_mm_storeu_si128((__m128i*) (out+4*x),sum);
+		sum=_mm_add_epi32(sum,_mm_sub_epi32(last,_mm_loadu_si128((const __m128i*) (in+4*((x-lo > 0) ? x-lo : 0)))));
+	}
+#else
+	int k;
+	int sum[4]={0,0,0,0};
+	for (x=-lo; x<=hi; x++){
+		const int* p=in+4*((x < 0) ? 0 : (x < n) ? x : n-1);
+		for (k=0; k<4; k++) sum[k]+=p[k];
+	}
+	for (x=0; x<n; x++){
+		const int* add=in+4*((x+hi+1 < n) ? x+hi+1 : n-1);
+		const int* sub=in+4*((x-lo > 0) ? x-lo : 0);
+		for (k=0; k<4; k++){
+			out[4*x+k]=sum[k];
+			sum[k]+=add[k]-sub[k];
+		}
+	}
+#endif
+}
+
+/*
+ * out[x]=in[x]
+ */
+static void WidenRow(const unsigned char* in, int* out, int n){
+	int x=0;
+#ifdef __SSE2__
+	const __m128i zero=_mm_setzero_si128();
+	for (; x+16 <= n; x+=16){
+		__m128i v=_mm_loadu_si128((const __m128i*) (in+x));
+		__m128i lo=_mm_unpacklo_epi8(v,zero);
+		__m128i hi=_mm_unpackhi_epi8(v,zero);
+		_mm_storeu_si128((__m128i*) (out+x),_mm_unpacklo_epi16(lo,zero));
+		_mm_storeu_si128((__m128i*) (out+x+4),_mm_unpackhi_epi16(lo,zero));
+		_mm_storeu_si128((__m128i*) (out+x+8),_mm_unpacklo_epi16(hi,zero));
+		_mm_storeu_si128((__m128i*) (out+x+12),_mm_unpackhi_epi16(hi,zero));
+	}
+#endif
+	for (; x<n; x++) out[x]=in[x];
+}
+
+/*
+ * Direct sum across a single row for a box 2 or 3 wide (lo and hi are 0 or 1):
+ * out[x] is in[x-lo]+...+in[x+hi], with the end pixels repeated.
+ */
+static void NarrowBoxRow(const int* in, int* out, int n, int lo, int hi){
+	int x=0;
+	if (n < 3){
+		for (x=0; x<n; x++) out[x]=in[(x-lo > 0) ? x-lo : 0]+((lo && hi) ? in[x] : 0)+in[(x+hi < n) ? x+hi : n-1];
+		return;
+	}
+	out[0]=in[0]*(lo+1)+((hi) ? in[1] : 0);
+	x=1;
+	const int* a=in-lo;
+	const int* b=in+hi;
+	if (lo && hi){
+#ifdef __SSE2__
+		for (; x+4 <= n-1; x+=4){
+			__m128i v=_mm_add_epi32(_mm_loadu_si128((const __m128i*) (a+x)),_mm_loadu_si128((const __m128i*) (in+x)));
+			_mm_storeu_si128((__m128i*) (out+x),_mm_add_epi32(v,_mm_loadu_si128((const __m128i*) (b+x))));
+		}
+#endif
+		for (; x<n-1; x++) out[x]=a[x]+in[x]+b[x];
+	} else {
+#ifdef __SSE2__
+		for (; x+4 <= n-1; x+=4){
+			_mm_storeu_si128((__m128i*) (out+x),_mm_add_epi32(_mm_loadu_si128((const __m128i*) (a+x)),_mm_loadu_si128((const __m128i*) (b+x))));
+		}
+#endif
+		for (; x<n-1; x++) out[x]=a[x]+b[x];
+	}
+	out[n-1]=in[n-1]*(hi+1)+((lo) ? in[n-2] : 0);
+}
+
+/*
+ * out[4*x+k]=in[k][x]
+ */
+static void InterleaveRows4(const unsigned char** in, int* out, int n){
+	int x=0, k;
+#ifdef __SSE2__
+	const __m128i zero=_mm_setzero_si128();
+	for (; x+16 <= n; x+=16){
+		__m128i r0=_mm_loadu_si128((const __m128i*) (in[0]+x));
+		__m128i r1=_mm_loadu_si128((const __m128i*) (in[1]+x));
+		__m128i r2=_mm_loadu_si128((const __m128i*) (in[2]+x));
+		__m128i r3=_mm_loadu_si128((const __m128i*) (in[3]+x));
+		__m128i lo01=_mm_unpacklo_epi8(r0,r1);
+		__m128i lo23=_mm_unpacklo_epi8(r2,r3);
+		__m128i hi01=_mm_unpackhi_epi8(r0,r1);
+		__m128i hi23=_mm_unpackhi_epi8(r2,r3);
+		__m128i q[4];
+		q[0]=_mm_unpacklo_epi16(lo01,lo23);
+		q[1]=_mm_unpackhi_epi16(lo01,lo23);
+		q[2]=_mm_unpacklo_epi16(hi01,hi23);
+		q[3]=_mm_unpackhi_epi16(hi01,hi23);
+		/** Each q holds four pixels of all four rows; widen them to ints **/
+		for (k=0; k<4; k++){
+			__m128i lo=_mm_unpacklo_epi8(q[k],zero);
+			__m128i hi=_mm_unpackhi_epi8(q[k],zero);
+			int* o=out+4*(x+4*k);
+			_mm_storeu_si128((__m128i*) o,_mm_unpacklo_epi16(lo,zero));
+			_mm_storeu_si128((__m128i*) (o+4),_mm_unpackhi_epi16(lo,zero));
+			_mm_storeu_si128((__m128i*) (o+8),_mm_unpacklo_epi16(hi,zero));
+			_mm_storeu_si128((__m128i*) (o+12),_mm_unpackhi_epi16(hi,zero));
+		}
+	}
+#endif
+	for (; x<n; x++){
+		for (k=0; k<4; k++) out[4*x+k]=in[k][x];
+	}
+}
+
+/*
+ * out[k][x]=in[4*x+k]
+ */
+static void DeinterleaveRows4(const int* in, int** out, int n){
+	int x=0, k;
+#ifdef __SSE2__
+	for (; x+4 <= n; x+=4){
+		__m128i v0=_mm_loadu_si128((const __m128i*) (in+4*x));
+		__m128i v1=_mm_loadu_si128((const __m128i*) (in+4*x+4));
+		__m128i v2=_mm_loadu_si128((const __m128i*) (in+4*x+8));
+		__m128i v3=_mm_loadu_si128((const __m128i*) (in+4*x+12));
+		__m128i t0=_mm_unpacklo_epi32(v0,v1);
+		__m128i t1=_mm_unpacklo_epi32(v2,v3);
+		__m128i t2=_mm_unpackhi_epi32(v0,v1);
+		__m128i t3=_mm_unpackhi_epi32(v2,v3);
+		_mm_storeu_si128((__m128i*) (out[0]+x),_mm_unpacklo_epi64(t0,t1));
+		_mm_storeu_si128((__m128i*) (out[1]+x),_mm_unpackhi_epi64(t0,t1));
+		_mm_storeu_si128((__m128i*) (out[2]+x),_mm_unpacklo_epi64(t2,t3));
+		_mm_storeu_si128((__m128i*) (out[3]+x),_mm_unpackhi_epi64(t2,t3));
+	}
+#endif
+	for (; x<n; x++){
+		for (k=0; k<4; k++) out[k][x]=in[4*x+k];
+	}
+}
+
+/*
+ * One step of a running sum down the columns: out=prev+add-sub. out may be prev.
+ */
+static void BoxColumnStep(const int* prev, const int* add, const int* sub, int* out, int n){
+	int x=0;
+#ifdef __SSE2__
+	for (; x+4 <= n; x+=4){
+		__m128i v=_mm_add_epi32(_mm_loadu_si128((const __m128i*) (prev+x)),_mm_loadu_si128((const __m128i*) (add+x)));
+		_mm_storeu_si128((__m128i*) (out+x),_mm_sub_epi32(v,_mm_loadu_si128((const __m128i*) (sub+x))));
+	}
+#endif
+	for (; x<n; x++) out[x]=prev[x]+add[x]-sub[x];
+}
+
+/*
+ * Rows at each level of the smoothing. Level 0 is the source rows smoothed across,
+ * level i is level 0 after i boxes down. Level i holds just the last nrows[i] rows it
+ * made, which is all that box i+1 needs to move its running sum down a row (unless
+ * the boxes are narrow, level 0 is made four rows at a time, so it holds three more).
+ */
+typedef struct SmoothLevelsStruct{
+	IplImage* src;
+	CvRect r;
+	int n;
+	int lo[SMOOTH_MAXBOXES];
+	int hi[SMOOTH_MAXBOXES];
+	int narrow; // 1 if every box is narrow enough to sum directly
+	int stride;
+	int* rows[SMOOTH_MAXBOXES+1];
+	int nrows[SMOOTH_MAXBOXES+1];
+	int made[SMOOTH_MAXBOXES+1];
+	int* across[2];
+} SmoothLevels;
+
+static int* LevelRow(SmoothLevels* L, int v, int y){
+	return L->rows[v]+(y % L->nrows[v])*L->stride;
+}
+
+/*
+ * Make the rows of level v up to and including row upto.
+ */
+static void MakeLevelRows(SmoothLevels* L, int v, int upto){
+	int last=L->r.height-1;
+	while (L->made[v] <= upto){
+		int y=L->made[v];
+		int* out=LevelRow(L,v,y);
+		int width=L->r.width;
+		int i, x;
+		if (v==0 && (L->n==0 || L->narrow)){
+			const unsigned char* in=(const unsigned char*) L->src->imageData+(L->r.y+y)*L->src->widthStep+L->r.x;
+			int* a= (L->n > 0) ? L->across[0] : out;
+			WidenRow(in,a,width);
+			for (i=0; i<L->n; i++){
+				int* b= (i==L->n-1) ? out : L->across[(i+1)%2];
+				NarrowBoxRow(a,b,width,L->lo[i],L->hi[i]);
+				a=b;
+			}
+		} else if (v==0){
+			/** Smooth the next four source rows across, interleaved **/
+			const unsigned char* in[4];
+			int k, nk=(last-y+1 < 4) ? last-y+1 : 4;
+			for (k=0; k<4; k++){
+				int row=(y+k < last) ? y+k : last;
+				in[k]=(const unsigned char*) L->src->imageData+(L->r.y+row)*L->src->widthStep+L->r.x;
+			}
+			int* a=L->across[0];
+			InterleaveRows4(in,a,width);
+			for (i=0; i<L->n; i++){
+				int* b=L->across[(i+1)%2];
+				BoxRows4(a,b,width,L->lo[i],L->hi[i]);
+				a=b;
+			}
+			int* o[4];
+			for (k=0; k<4; k++) o[k]= (k < nk) ? LevelRow(L,0,y+k) : L->across[(a==L->across[0]) ? 1 : 0]; // rows past the end go nowhere
+			DeinterleaveRows4(a,o,width);
+			L->made[0]+=nk-1;
+		} else {
+			int lo=L->lo[v-1];
+			int hi=L->hi[v-1];
+			MakeLevelRows(L,v-1,(y+hi < last) ? y+hi : last);
+			if (y==0){
+				memset(out,0,width*sizeof(int));
+				for (i=-lo; i<=hi; i++){
+					const int* add=LevelRow(L,v-1,(i < 0) ? 0 : (i < last) ? i : last);
+					for (x=0; x<width; x++) out[x]+=add[x];
+				}
+			} else {
+				int add=(y+hi < last) ? y+hi : last;
+				int sub=(y-1-lo > 0) ? y-1-lo : 0;
+				BoxColumnStep(LevelRow(L,v,y-1),LevelRow(L,v-1,add),LevelRow(L,v-1,sub),out,width);
+			}
+		}
+		L->made[v]++;
+	}
+}
+
+/*
+ * out[x]=255 where sum[x] >= cut and 0 elsewhere.
+ */
+static void CutRow(const int* sum, unsigned char* out, int n, int cut){
+	int x=0;
+#ifdef __SSE2__
+	const __m128i c=_mm_set1_epi32(cut-1);
+	for (; x+16 <= n; x+=16){
+		__m128i a=_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (sum+x)),c);
+		__m128i b=_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (sum+x+4)),c);
+		__m128i d=_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (sum+x+8)),c);
+		__m128i e=_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (sum+x+12)),c);
+		_mm_storeu_si128((__m128i*) (out+x),_mm_packs_epi16(_mm_packs_epi32(a,b),_mm_packs_epi32(d,e)));
+	}
+#endif
+	for (; x<n; x++) out[x]= (sum[x] >= cut) ? 255 : 0;
+}
+
+/*
+ * out[x]=255 where in[x] > thresh and 0 elsewhere, for thresh from 0 to 255.
+ */
+static void CutRow8(const unsigned char* in, unsigned char* out, int n, int thresh){
+	int x=0;
+#ifdef __SSE2__
+	const __m128i t=_mm_set1_epi8((char) thresh);
+	const __m128i zero=_mm_setzero_si128();
+	for (; x+16 <= n; x+=16){
+		__m128i v=_mm_cmpeq_epi8(_mm_subs_epu8(_mm_loadu_si128((const __m128i*) (in+x)),t),zero);
+		_mm_storeu_si128((__m128i*) (out+x),_mm_xor_si128(v,_mm_cmpeq_epi8(zero,zero)));
+	}
+#endif
+	for (; x<n; x++) out[x]= (in[x] > thresh) ? 255 : 0;
+}
+
+static void StartRunMask(RunMask* rm, CvRect r);
+static void AddRowRuns(RunMask* rm, const unsigned char* row, int n, int y);
+
+/*
+ * Smooth and threshold in one pass, into dst or (if dst is NULL) into runs.
+ */
+static void SmoothThresholdInto(IplImage* src, IplImage* dst, RunMask* runs, IplImage* copy, IplImage* smooth, int GaussSize, int thresh, SmoothBuffer* buf){
+	SmoothLevels L;
+	int norm, v, y;
+	L.src=src;
+	L.r=cvGetImageROI(src);
+	if (GaussSize > 20) GaussSize=20; // much bigger and the sums overflow
+	L.n=GaussianBoxes(GaussSize,L.lo,L.hi,&norm);
+	L.narrow=1;
+	for (v=0; v<L.n; v++){
+		if (L.lo[v]+L.hi[v] > 2) L.narrow=0;
+	}
+	L.stride=(L.r.width+3) & ~3;
+
+	/** Carve the rows out of buf **/
+	int total=9; // the 8 rows across and one more to cut the mask into
+	for (v=0; v<=L.n; v++){
+		L.nrows[v]= (v < L.n) ? L.lo[v]+L.hi[v]+2 : 1;
+		total+=L.nrows[v];
+	}
+	if (L.n > 0 && !L.narrow){
+		L.nrows[0]+=3;
+		total+=3;
+	}
+	if (buf->size < total*L.stride){
+		free(buf->mem);
+		buf->size=total*L.stride;
+		buf->mem=(int*) malloc(buf->size*sizeof(int));
+	}
+	int* next=buf->mem;
+	for (v=0; v<=L.n; v++){
+		L.rows[v]=next;
+		L.made[v]=0;
+		next+=L.nrows[v]*L.stride;
+	}
+	L.across[0]=next;
+	L.across[1]=next+4*L.stride;
+	unsigned char* cutRow=(unsigned char*) (next+8*L.stride);
+	if (runs!=NULL) StartRunMask(runs,L.r);
+
+	/**
+	 * The smoothed pixel is the sum rounded to the nearest multiple of norm, and it is
+	 * above thresh exactly when the sum is at least cut, so the sums never need dividing.
+	 */
+	if (thresh < -1) thresh=-1;
+	if (thresh > 255) thresh=255;
+	int cut=(thresh+1)*norm-norm/2;
+
+	CvRect d= (dst!=NULL) ? cvGetImageROI(dst) : L.r;
+	CvRect c= (copy!=NULL) ? cvGetImageROI(copy) : d;
+	CvRect s= (smooth!=NULL) ? cvGetImageROI(smooth) : d;
+	for (y=0; y<L.r.height; y++){
+		unsigned char* out= (dst!=NULL) ? (unsigned char*) dst->imageData+(d.y+y)*dst->widthStep+d.x : cutRow;
+		if (L.n==0 && thresh >= 0){
+			/** Nothing to smooth **/
+			const unsigned char* in=(const unsigned char*) src->imageData+(L.r.y+y)*src->widthStep+L.r.x;
+			CutRow8(in,out,L.r.width,thresh);
+			if (copy!=NULL) memcpy(copy->imageData+(c.y+y)*copy->widthStep+c.x,out,L.r.width);
+			if (smooth!=NULL) memcpy(smooth->imageData+(s.y+y)*smooth->widthStep+s.x,in,L.r.width);
+			if (runs!=NULL) AddRowRuns(runs,out,L.r.width,y);
+			continue;
+		}
+		MakeLevelRows(&L,L.n,y);
+		const int* sum=LevelRow(&L,L.n,y);
+		CutRow(sum,out,L.r.width,cut);
+		if (copy!=NULL) memcpy(copy->imageData+(c.y+y)*copy->widthStep+c.x,out,L.r.width);
+		if (smooth!=NULL){
+			unsigned char* sm=(unsigned char*) smooth->imageData+(s.y+y)*smooth->widthStep+s.x;
+			for (int x=0; x<L.r.width; x++) sm[x]=(unsigned char) ((sum[x]+norm/2)/norm);
+		}
+		if (runs!=NULL) AddRowRuns(runs,out,L.r.width,y);
+	}
+	if (runs!=NULL) runs->rowStart[L.r.height]=runs->nruns;
+}
+
+void SmoothThreshold(IplImage* src, IplImage* dst, IplImage* copy, IplImage* smooth, int GaussSize, int thresh, SmoothBuffer* buf){
+	SmoothThresholdInto(src,dst,NULL,copy,smooth,GaussSize,thresh,buf);
+}
+
+void SmoothThresholdRuns(IplImage* src, RunMask* runs, IplImage* copy, IplImage* smooth, int GaussSize, int thresh, SmoothBuffer* buf){
+	SmoothThresholdInto(src,NULL,runs,copy,smooth,GaussSize,thresh,buf);
+}
+
+void MakeSmoothKernel(SmoothKernel* k, int GaussSize, int thresh){
+	int lo[SMOOTH_MAXBOXES], hi[SMOOTH_MAXBOXES], norm, i, d, t;
+	if (GaussSize > 20) GaussSize=20;
+	int n=GaussianBoxes(GaussSize,lo,hi,&norm);
+
+	/** Run the boxes over a single 1 **/
+	k->lo=0;
+	k->hi=0;
+	k->weight[0]=1;
+	for (i=0; i<n; i++){
+		int next[2*SMOOTH_MAXREACH+1];
+		for (d=-(k->lo+lo[i]); d<=k->hi+hi[i]; d++){
+			int sum=0;
+			for (t=-lo[i]; t<=hi[i]; t++){
+				if (d-t >= -k->lo && d-t <= k->hi) sum+=k->weight[k->lo+d-t];
+			}
+			next[k->lo+lo[i]+d]=sum;
+		}
+		k->lo+=lo[i];
+		k->hi+=hi[i];
+		memcpy(k->weight,next,(k->lo+k->hi+1)*sizeof(int));
+	}
+
+	if (thresh < -1) thresh=-1;
+	if (thresh > 255) thresh=255;
+	k->cut=(thresh+1)*norm-norm/2;
+}
+
+void SmoothThresholdSpan(IplImage* src, CvPoint pt, int n, unsigned char* out, SmoothKernel* k, SmoothBuffer* buf){
+	CvRect r=cvGetImageROI(src);
+	int step=src->widthStep;
+	const unsigned char* base=(const unsigned char*) src->imageData+r.y*step+r.x;
+	int reach=k->lo+k->hi;
+	int w=n+reach;
+	int i, j, d;
+	if (buf->size < w){
+		free(buf->mem);
+		buf->size=w;
+		buf->mem=(int*) malloc(buf->size*sizeof(int));
+	}
+
+	/** Down each column that the span reaches, then across **/
+	int* col=buf->mem;
+	int x0=pt.x-k->lo;
+	int inside=(x0 >= 0 && x0+w <= r.width);
+	memset(col,0,w*sizeof(int));
+	for (d=-k->lo; d<=k->hi; d++){
+		int y=pt.y+d;
+		if (y < 0) y=0;
+		if (y > r.height-1) y=r.height-1;
+		const unsigned char* row=base+y*step;
+		int wt=k->weight[k->lo+d];
+		if (inside){
+			for (i=0; i<w; i++) col[i]+=wt*row[x0+i];
+		} else {
+			for (i=0; i<w; i++){
+				int x=x0+i;
+				col[i]+=wt*row[(x < 0) ? 0 : (x < r.width) ? x : r.width-1];
+			}
+		}
+	}
+	for (i=0; i<n; i++){
+		int sum=0;
+		for (j=0; j<=reach; j++) sum+=k->weight[j]*col[i+j];
+		out[i]= (sum >= k->cut) ? 255 : 0;
+	}
+}
+
+void ReleaseSmoothBuffer(SmoothBuffer* buf){
+	free(buf->mem);
+	buf->mem=NULL;
+	buf->size=0;
+}
+
+
+/****/
+/* Run length encoded masks */
+
+/*
+ * Empty rm out to take the runs of the r part of an image, one row at a time.
+ */
+static void StartRunMask(RunMask* rm, CvRect r){
+	rm->r=r;
+	rm->nruns=0;
+	rm->nblobs=0;
+	if (rm->rowCapacity < r.height+1){
+		free(rm->rowStart);
+		rm->rowCapacity=r.height+1;
+		rm->rowStart=(int*) malloc(rm->rowCapacity*sizeof(int));
+	}
+}
+
+/*
+ * Append the runs of nonzero pixels in row (row y of the mask) to rm.
+ *
+ * Uses SSE2 when the compiler has it: 16 pixels at a time, with only the
+ * pixels where a run starts or ends looked at one by one.
+ */
+static void AddRowRuns(RunMask* rm, const unsigned char* row, int n, int y){
+	/** A row has at most one run for every two pixels **/
+	if (rm->nruns+(n+1)/2 > rm->runCapacity){
+		rm->runCapacity=2*(rm->nruns+(n+1)/2);
+		rm->runs=(MaskRun*) realloc(rm->runs,rm->runCapacity*sizeof(MaskRun));
+		rm->label=(int*) realloc(rm->label,rm->runCapacity*sizeof(int));
+	}
+	rm->rowStart[y]=rm->nruns;
+	MaskRun* run=rm->runs+rm->nruns;
+
+	int x=0;
+	int start=-1; // where the run we are in started (-1 = not in one)
+#ifdef __SSE2__
+	const __m128i zero=_mm_setzero_si128();
+	for (; x+16 <= n; x+=16){
+		int on=~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (row+x)),zero)) & 0xFFFF;
+
+		/** Bit k is set where pixel x+k differs from the one before it: runs start and end there, in turn **/
+		int edges=(on ^ ((on << 1) | (start >= 0))) & 0xFFFF;
+		while (edges){
+			int k=__builtin_ctz(edges);
+			edges&=edges-1;
+			if (start < 0) start=x+k;
+			else {
+				run->y=y;
+				run->start=start;
+				run->end=x+k;
+				run++;
+				start=-1;
+			}
+		}
+	}
+#endif
+	for (; x<=n; x++){
+		if (x < n && row[x]!=0){
+			if (start < 0) start=x;
+		} else if (start >= 0){
+			run->y=y;
+			run->start=start;
+			run->end=x;
+			run++;
+			start=-1;
+		}
+	}
+	rm->nruns=(int) (run-rm->runs);
+}
+
+void MaskToRuns(IplImage* mask, RunMask* runs){
+	CvRect r=cvGetImageROI(mask);
+	StartRunMask(runs,r);
+	for (int y=0; y<r.height; y++){
+		AddRowRuns(runs,(const unsigned char*) mask->imageData+(r.y+y)*mask->widthStep+r.x,r.width,y);
+	}
+	runs->rowStart[r.height]=runs->nruns;
+}
+
+/*
+ * The run that stands for the set that run i is in.
+ * It is always the set's first run, so a run never points at a later one.
+ */
+static int RunSet(int* parent, int i){
+	while (parent[i]!=i){
+		parent[i]=parent[parent[i]];
+		i=parent[i];
+	}
+	return i;
+}
+
+int LabelRuns(RunMask* rm){
+	MaskRun* runs=rm->runs;
+	int* set=rm->label;
+	int i, y;
+	for (i=0; i<rm->nruns; i++) set[i]=i;
+
+	/** Join each run to the runs in the row above that touch it, diagonally included **/
+	for (y=1; y<rm->r.height; y++){
+		int above=rm->rowStart[y-1];
+		int aboveEnd=rm->rowStart[y];
+		for (int b=rm->rowStart[y]; b<rm->rowStart[y+1]; b++){
+			while (above < aboveEnd && runs[above].end < runs[b].start) above++;
+			for (int a=above; a < aboveEnd && runs[a].start <= runs[b].end; a++){
+				int sa=RunSet(set,a);
+				int sb=RunSet(set,b);
+				if (sa < sb) set[sb]=sa;
+				else if (sb < sa) set[sa]=sb;
+			}
+		}
+	}
+
+	/**
+	 * Number the blobs in the order their first runs come in. Every run points at an earlier
+	 * run of the same blob, which has already been numbered, or at itself if it is the first
+	 */
+	rm->nblobs=0;
+	for (i=0; i<rm->nruns; i++){
+		MaskRun* run=&(runs[i]);
+		int l;
+		if (set[i]==i){
+			if (rm->nblobs==rm->blobCapacity){
+				rm->blobCapacity= (rm->blobCapacity > 0) ? 2*rm->blobCapacity : 256;
+				rm->blobs=(RunBlob*) realloc(rm->blobs,rm->blobCapacity*sizeof(RunBlob));
+			}
+			l=rm->nblobs++;
+			RunBlob* blob=&(rm->blobs[l]);
+			blob->area=0;
+			blob->rect=cvRect(run->start,run->y,run->end-run->start,1);
+			blob->firstRun=i;
+		} else {
+			l=set[set[i]];
+		}
+		set[i]=l;
+
+		RunBlob* blob=&(rm->blobs[l]);
+		blob->area+=run->end-run->start;
+		CvRect* r=&(blob->rect);
+		if (run->start < r->x){
+			r->width+=r->x-run->start;
+			r->x=run->start;
+		}
+		if (run->end > r->x+r->width) r->width=run->end-r->x;
+		r->height=run->y-r->y+1;
+	}
+	return rm->nblobs;
+}
+
+int LargestRunBlob(RunMask* rm){
+	int biggest=-1;
+	for (int l=0; l<rm->nblobs; l++){
+		if (biggest < 0 || rm->blobs[l].area > rm->blobs[biggest].area) biggest=l;
+	}
+	return biggest;
+}
+
+int RunBlobBorder(RunMask* rm, int blob, CvPoint* pts, int maxpts){
+	RunBlob* b=&(rm->blobs[blob]);
+
+	/** Paint just this blob's runs, with a ring of background around them **/
+	int w=b->rect.width+2;
+	int h=b->rect.height+2;
+	int step=(w+3) & ~3;
+	if (rm->paintCapacity < step*h){
+		free(rm->paint);
+		rm->paintCapacity=step*h;
+		rm->paint=(unsigned char*) malloc(rm->paintCapacity);
+	}
+	memset(rm->paint,0,step*h);
+	for (int y=b->rect.y; y < b->rect.y+b->rect.height; y++){
+		unsigned char* row=rm->paint+(y-b->rect.y+1)*step+1-b->rect.x;
+		for (int i=rm->rowStart[y]; i<rm->rowStart[y+1]; i++){
+			if (rm->label[i]==blob) memset(row+rm->runs[i].start,255,rm->runs[i].end-rm->runs[i].start);
+		}
+	}
+
+	/** The start of the blob's first run is its top left pixel, which is where cvFindContours() starts **/
+	IplImage img;
+	cvInitImageHeader(&img,cvSize(w,h),IPL_DEPTH_8U,1);
+	cvSetData(&img,rm->paint,step);
+	CvPoint first;
+	int hole;
+	int n=FollowBlobBorder(&img,cvPoint(rm->runs[b->firstRun].start-b->rect.x+1,1),pts,maxpts,&first,&hole);
+	for (int k=0; k < n && k < maxpts; k++){
+		pts[k].x+=b->rect.x-1;
+		pts[k].y+=b->rect.y-1;
+	}
+	return n;
+}
+
+void ReleaseRunMask(RunMask* rm){
+	free(rm->runs);
+	free(rm->label);
+	free(rm->rowStart);
+	free(rm->blobs);
+	free(rm->paint);
+	memset(rm,0,sizeof(RunMask));
+}
+
+
+
+
+/***************************************************************
+ * Flat arrays of points
+ ***************************************************************
+ */
+
+void InitPointBuf(PointBuf* buf, int seqType){
+	buf->pts=NULL;
+	buf->n=0;
+	buf->capacity=0;
+	buf->seqType=seqType;
+}
+
+void ReservePointBuf(PointBuf* buf, int n){
+	if (n <= buf->capacity) return;
+	/** cvAlloc() hands back 32 byte aligned memory **/
+	int capacity=2*n;
+	CvPoint* pts=(CvPoint*) cvAlloc(capacity*sizeof(CvPoint));
+	if (buf->n > 0) memcpy(pts,buf->pts,buf->n*sizeof(CvPoint));
+	if (buf->pts!=NULL) cvFree(&(buf->pts));
+	buf->pts=pts;
+	buf->capacity=capacity;
+}
+
+void SetPointBuf(PointBuf* buf, const CvPoint* pts, int n){
+	buf->n=0;
+	ReservePointBuf(buf,n);
+	memcpy(buf->pts,pts,n*sizeof(CvPoint));
+	buf->n=n;
+}
+
+void SetPointBufFromSeq(PointBuf* buf, CvSeq* seq){
+	buf->n=0;
+	ReservePointBuf(buf,seq->total);
+	cvCvtSeqToArray(seq,buf->pts,CV_WHOLE_SEQ);
+	buf->n=seq->total;
+}
+
+CvSeq* PointBufSeq(PointBuf* buf){
+	return cvMakeSeqHeaderForArray(buf->seqType,sizeof(CvContour),sizeof(CvPoint),buf->pts,buf->n,(CvSeq*) &(buf->header),&(buf->block));
+}
+
+CvRect PointBufRect(PointBuf* buf){
+	if (buf->n==0) return cvRect(0,0,0,0);
+	int xmin=buf->pts[0].x, xmax=xmin;
+	int ymin=buf->pts[0].y, ymax=ymin;
+	for (int i=1; i<buf->n; i++){
+		int x=buf->pts[i].x;
+		int y=buf->pts[i].y;
+		if (x < xmin) xmin=x;
+		if (x > xmax) xmax=x;
+		if (y < ymin) ymin=y;
+		if (y > ymax) ymax=y;
+	}
+	return cvRect(xmin,ymin,xmax-xmin+1,ymax-ymin+1);
+}
+
+void ReleasePointBuf(PointBuf* buf){
+	if (buf->pts!=NULL) cvFree(&(buf->pts));
+	buf->n=0;
+	buf->capacity=0;
+}
+
 
 
 
@@ -345,6 +1340,68 @@ void LongestContour(CvSeq* contours, CvSeq** ContourOfInterest){
 	*ContourOfInterest=cvCloneSeq(biggestContour);
 }
 
+/*
+ * Follow the outer border of a blob.
+ *
+ * This is Suzuki and Abe's border following as cvFindContours() does it: a walk
+ * around the Moore neighborhood (the 8 surrounding pixels) of each border pixel,
+ * counterclockwise from the pixel it came from, to find the next one.
+ */
+int FollowBlobBorder(IplImage* mask, CvPoint start, CvPoint* pts, int maxpts, CvPoint* first, int* hole){
+	/** Neighbors counterclockwise from the right, twice round so a search can run past the end **/
+	static const int dx[8]={1,1,0,-1,-1,-1,0,1};
+	static const int dy[8]={0,-1,-1,-1,0,1,1,1};
+	CvRect r=cvGetImageROI(mask);
+	int step=mask->widthStep;
+	int deltas[16];
+	for (int k=0; k<16; k++) deltas[k]=dy[k%8]*step+dx[k%8];
+
+	const unsigned char* i0=(const unsigned char*) mask->imageData+(r.y+start.y)*step+r.x+start.x;
+	const unsigned char* i1=NULL;
+	CvPoint pt=start;
+	*first=start;
+	*hole=0;
+
+	/** The first neighbor clockwise from the left one (which is 0) **/
+	int s=4;
+	do {
+		s=(s-1) & 7;
+		i1=i0+deltas[s];
+		if (*i1 !=0) break;
+	} while (s!=4);
+	if (s==4){
+		/** A blob of one pixel **/
+		if (pts!=NULL && maxpts > 0) pts[0]=start;
+		return 1;
+	}
+
+	int n=0;
+	long area=0;
+	const unsigned char* i3=i0;
+	for (;;){
+		const unsigned char* i4;
+		for (;;){
+			i4=i3+deltas[++s];
+			if (*i4 !=0) break;
+		}
+		s&=7;
+		if (pts!=NULL && n < maxpts) pts[n]=pt;
+		n++;
+		if (pt.y < first->y || (pt.y==first->y && pt.x < first->x)) *first=pt;
+		/** Twice the area the border goes around, signed by which way it goes around **/
+		area+=pt.x*dy[s]-pt.y*dx[s];
+		pt.x+=dx[s];
+		pt.y+=dy[s];
+		if (i4==i0 && i3==i1) break;
+		i3=i4;
+		s=(s+4) & 7;
+	}
+
+	/** Outer borders go around counterclockwise (as the image is displayed) and holes clockwise **/
+	if (area > 0) *hole=1;
+	return n;
+}
+
 /*
  * Takes the cross product of two vectors representated in cartesian coordinates as CvPoint (x,y)
  *
@@ -431,12 +1488,15 @@ void DrawSequence(IplImage** image, CvSeq* Seq) {
  *	then the last point should be fairly close.
  */
 
-void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int Numsegments) {
+void resampleSeqConstPtsPerArcLength(PointBuf* sequence, PointBuf* ResampledSeq, int Numsegments) {
 	if (sequence==NULL || ResampledSeq==NULL) {
 		printf("Error! sequence passed to resampleSeqConstPtsPerArcLength() is NULL!\n");
 		return;
 	}
-	if (sequence->total < 1) printf("Error! Sequence passed to resampleSeq() is empty!\n");
+	if (sequence->n < 1) {
+		printf("Error! Sequence passed to resampleSeq() is empty!\n");
+		return;
+	}
 
 
 	/**********************************
@@ -444,7 +1504,7 @@ void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int N
 	 * calculating cumsum
 	 */
 
-	/** Let's create a struct that holds our decimated subsampled sequence, and the cumsum arclength **/
+	/** Let's create a struct that holds a point of the decimated subsampled sequence, and the cumsum arclength **/
 	typedef struct PtAndSumStruct
 	{
 	    int x;
@@ -452,39 +1512,35 @@ void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int N
 	    float sum;
 	}PtAndSum;
 
-
-	CvSeq* decimated = cvCreateSeq(0, sizeof(CvSeq), sizeof(PtAndSum), sequence->storage);
-
-
-
-
-
+	/**
+	 * The decimated points are just every n'th point of sequence, so rather than
+	 * store them they are picked out again in Part II, where the cumsum is added up
+	 * again the same way. Only the last two are remembered.
+	 */
 
 	/** n-1 is the number of decimated points between sampled points**/
-	float n = (float) ( sequence->total -1 )/ (float) ( Numsegments-1);
-	CvSeqReader reader;
-	CvSeqWriter writer;
-	cvStartReadSeq(sequence, &reader, 0);
-	cvStartAppendToSeq(decimated, &writer);
+	float n = (float) ( sequence->n -1 )/ (float) ( Numsegments-1);
+	float decimation=n;
 	CvPoint* tempPt;
 	PtAndSum curr;
+	PtAndSum secondToLast;
 
 
-	tempPt = (CvPoint*) reader.ptr;
+	tempPt = sequence->pts;
 	curr.x=tempPt->x; curr.y=tempPt->y; curr.sum=0;
+	secondToLast=curr;
 
 
 	int i=0;
 	int tempPos;
 
-
-
-
-
 	while (i<Numsegments){
 		tempPos=(int) (i *n + 0.5);
-		cvSetSeqReaderPos(&reader, tempPos, 0);
-		tempPt = (CvPoint*) reader.ptr;
+		if (!(tempPos < sequence->n && tempPos >= 0)){
+			printf(" Error. Position to set sequence reader to is out of range in resampleSeq()\n");
+			return;
+		}
+		tempPt = &(sequence->pts[tempPos]);
 
 		/** Current sum= cumsum at prev pt + distance between current Pt and Previous Pt **/
 		curr.sum=curr.sum+dist(*tempPt,cvPoint(curr.x,curr.y));
@@ -493,23 +1549,12 @@ void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int N
 		curr.x=tempPt->x;
 		curr.y=tempPt->y;
 
-
-		CV_WRITE_SEQ_ELEM( curr, writer );
-		if (!(tempPos < sequence->total && tempPos >= 0)){
-					printf(" Error. Position to set sequence reader to is out of range in resampleSeq()\n");
-		}
+		if (i==Numsegments-2) secondToLast=curr;
 		i++;
 	}
-
-	cvEndWriteSeq(&writer);
-
-
+	PtAndSum last=curr;
 
 
-
-	int totalArcLength=curr.sum;
-//	printf("Moving on to part II\n");
-
 	/**************************************************
 	 * Part II: Interpolate so as to keep constant
 	 * number of pts per arc length
@@ -529,20 +1574,19 @@ void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int N
 	 */
 
 	/** n-1 is the optimum arc length between points**/
-		n = (float) ( curr.sum)/ (float) ( Numsegments-1); //Andy: these -1's make sense. I tested for the case 10 pts equally spaced distance 1 apart.**/
-
+		n = (float) ( last.sum)/ (float) ( Numsegments-1); //Andy: these -1's make sense. I tested for the case 10 pts equally spaced distance 1 apart.**/
 
-		PtAndSum* prevVertex;
-		PtAndSum* currVertex;
 
+		PtAndSum prevVertex;
+		PtAndSum currVertex;
 
-		/** Start reading through sequence of decimated points **/
-		cvStartReadSeq(decimated, &reader, 0);
 
-		/** Start Writing output **/
-		cvStartAppendToSeq(ResampledSeq, &writer);
+		/** Start reading through the decimated points **/
+		ReservePointBuf(ResampledSeq,Numsegments);
 
-		currVertex = (PtAndSum*) reader.ptr;
+		currVertex.x=sequence->pts[0].x;
+		currVertex.y=sequence->pts[0].y;
+		currVertex.sum=0;
 		prevVertex = currVertex;
 		double DistBetVertices=0;
 		double t=0;
@@ -557,28 +1601,15 @@ void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int N
 			s=(float)i* n; // The point should lie a distance s along the arc length
 
 
-			k=0;
-
 			/** Loop until we find some vertices that do s **/
-			while (!(  (s>= prevVertex->sum )&& (s <= currVertex->sum) )){
-
-
-
-//				printf("\n\ns=%f,i=%d,k=%d\n",s,i,k);
-//				printf("prevVertex->sum = %f\n",prevVertex->sum );
-//				printf("currVertex->sum = %f\n",currVertex->sum );
-
-
+			while (!(  (s>= prevVertex.sum )&& (s <= currVertex.sum) )){
 
 				/** Special case when we are seeking to find the vertices that enclose the last point **/
-				if (i==Numsegments-1){
+				if (i==Numsegments-1 || k==Numsegments-1){
 					/** select the second-to-last vertex of the sequence **/
-					cvSetSeqReaderPos(&reader,decimated->total-2,0);
-					prevVertex= (PtAndSum*) reader.ptr;
+					prevVertex=secondToLast;
 					/** set the current vertex to the end vertex of the sequence **/
-					CV_NEXT_SEQ_ELEM(sizeof(PtAndSum),reader);
-					currVertex = (PtAndSum*) reader.ptr;
-					k++; // just for kicks increment k
+					currVertex=last;
 					break;
 				}
 
@@ -586,21 +1617,19 @@ void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int N
 				prevVertex=currVertex;
 
 				/** Increment currVertex**/
-				CV_NEXT_SEQ_ELEM(sizeof(PtAndSum),reader);
 				k++;
-				currVertex = (PtAndSum*) reader.ptr;
-
-
-
+				tempPt = &(sequence->pts[(int) (k *decimation + 0.5)]);
+				currVertex.sum=currVertex.sum+dist(*tempPt,cvPoint(currVertex.x,currVertex.y));
+				currVertex.x=tempPt->x;
+				currVertex.y=tempPt->y;
 			}
 
 
 			/** Interpolate & record output 	**/
-			DistBetVertices=(double) currVertex->sum - (double) prevVertex->sum;
-//			printf("DistBetVertices=%f\n",DistBetVertices);
+			DistBetVertices=(double) currVertex.sum - (double) prevVertex.sum;
 
-			/** t is the arc length beyond the previous vertex (s=prevVertex->sum+t)**/
-			t = (double) s - prevVertex->sum; //Think of t as the parameter in a parametric equation
+			/** t is the arc length beyond the previous vertex (s=prevVertex.sum+t)**/
+			t = (double) s - prevVertex.sum; //Think of t as the parameter in a parametric equation
 
 			if (t<0) printf("ERROR! This should never happen!\n");
 
@@ -611,22 +1640,20 @@ void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int N
 				unitVec.y=0;
 			} else {
 				/** Calculate the unit vector that points from prevVertex to currVertex **/
-				unitVec=cvPoint2D32f( (double) (currVertex->x-prevVertex->x) / (double) DistBetVertices  ,
-						(double) (currVertex->y-prevVertex->y) / (double) DistBetVertices);
+				unitVec=cvPoint2D32f( (double) (currVertex.x-prevVertex.x) / (double) DistBetVertices  ,
+						(double) (currVertex.y-prevVertex.y) / (double) DistBetVertices);
 			}
 
 			/** Parametric equation **/
-			interpPt=cvPoint((int) ((int) prevVertex->x+unitVec.x * t+0.5),(int) ((int) prevVertex->y +unitVec.y * t+0.5));
+			interpPt=cvPoint((int) ((int) prevVertex.x+unitVec.x * t+0.5),(int) ((int) prevVertex.y +unitVec.y * t+0.5));
 
 			/** Actually write the newly found interpolated point **/
-			CV_WRITE_SEQ_ELEM(interpPt, writer);
+			ResampledSeq->pts[i]=interpPt;
 
 			i++;
 
 		}
-
-
-		cvEndWriteSeq(&writer);
+		ResampledSeq->n=Numsegments;
 }
 
 
@@ -639,16 +1666,12 @@ void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int N
  *	Note that this function resampleSeq always includes the first point of the sequence
  *	in the new sequence, but it does not necessarily include the last point.
  */
-void resampleSeq(CvSeq* sequence, CvSeq* ResampledSeq, int Numsegments) {
-	if (sequence->total < 1) printf("Error! Sequence passed to resampleSeq() is empty!\n");
+void resampleSeq(PointBuf* sequence, PointBuf* ResampledSeq, int Numsegments) {
+	if (sequence->n < 1) printf("Error! Sequence passed to resampleSeq() is empty!\n");
 
-	float n = (float) ( sequence->total -1 )/ (float) ( Numsegments-1);
-	CvSeqReader reader;
-	CvSeqWriter writer;
-	cvStartReadSeq(sequence, &reader, 0);
-	cvStartAppendToSeq(ResampledSeq, &writer);
-	if (PRINTOUT) printf("Seq->total=%d; n=%f\n", sequence->total, n);
-	CvPoint* tempPt;
+	float n = (float) ( sequence->n -1 )/ (float) ( Numsegments-1);
+	if (PRINTOUT) printf("Seq->total=%d; n=%f\n", sequence->n, n);
+	ReservePointBuf(ResampledSeq,Numsegments);
 	int i=0;
 	int tempPos;
 
@@ -656,17 +1679,14 @@ void resampleSeq(CvSeq* sequence, CvSeq* ResampledSeq, int Numsegments) {
 
 	while (i<Numsegments){
 		tempPos=(int) (i *n + 0.5);
-		cvSetSeqReaderPos(&reader, tempPos, 0);
-		tempPt = (CvPoint*) reader.ptr;
-		CV_WRITE_SEQ_ELEM( *tempPt, writer );
-		if (!(tempPos < sequence->total && tempPos >= 0)){
-					printf(" Error. Position to set sequence reader to is out of range in resampleSeq()\n");
+		if (!(tempPos < sequence->n && tempPos >= 0)){
+			printf(" Error. Position to set sequence reader to is out of range in resampleSeq()\n");
+			tempPos=CropNumber(0,sequence->n-1,tempPos);
 		}
+		ResampledSeq->pts[i]=sequence->pts[tempPos];
 		i++;
 	}
-
-
-	cvEndWriteSeq(&writer);
+	ResampledSeq->n=Numsegments;
 }
 
 
@@ -822,44 +1842,24 @@ int CvtPolySeq2ContourSeq(CvSeq* polygon, CvSeq* contour ){
 
 
 /*
- * Given two CvSeq containing CvPoint's this function returns the midpoint.
- * Note that the two CvSeq's have to be resampled to the same length.
+ * Given two PointBufs of CvPoint's this function returns the midpoint.
+ * Note that the two have to be resampled to the same length.
  * Use, for example, ResampleSeq().
  *
  */
-void FindCenterline(CvSeq* NBoundA, CvSeq* NBoundB, CvSeq* centerline) {
-
-	CvSeqReader readerA;
-	CvSeqReader readerB;
-	CvSeqWriter writer;
-	cvStartReadSeq(NBoundA, &readerA, 0);
-	cvStartReadSeq(NBoundB, &readerB, 0);
-	//Set our pointer to the location along the boundary of the Tail.
-	cvStartAppendToSeq(centerline, &writer);
-
-	CvPoint* SideA;
-	CvPoint* SideB;
-	CvPoint MidPt;
-
-	int i = 0;
-	do {
-		SideA = (CvPoint*) readerA.ptr;
-		SideB = (CvPoint*) readerB.ptr;
-
-		MidPt = cvPoint((int) (SideA->x + SideB->x) / 2, (int) (SideA->y
-				+ SideB->y) / 2);
-		//	if (PRINTOUT) printf("SideA= ( %d, %d )\tSideB= ( %d, %d )\n", SideA->x, SideA->y,SideB->x,SideB->y);
-		//	if (PRINTOUT) printf("MidPt= ( %d, %d )\n", MidPt.x, MidPt.y);
-		//Find the midpoint, and write it to the sequence (auto-increments)
-		CV_WRITE_SEQ_ELEM( MidPt, writer);
-
-		//Push the pointers along the boundaries in opposite directions
-		CV_NEXT_SEQ_ELEM(sizeof(CvPoint),readerA);
-		CV_NEXT_SEQ_ELEM(sizeof(CvPoint),readerB);
-		i++;
-
-	} while (i < NBoundA->total);
-	cvEndWriteSeq(&writer);
+void FindCenterline(PointBuf* NBoundA, PointBuf* NBoundB, PointBuf* centerline) {
+	int n=NBoundA->n;
+	ReservePointBuf(centerline,n);
+	const CvPoint* SideA=NBoundA->pts;
+	const CvPoint* SideB=NBoundB->pts;
+	CvPoint* MidPt=centerline->pts;
+
+	//Find the midpoints, walking along both boundaries together
+	for (int i=0; i<n; i++) {
+		MidPt[i] = cvPoint((int) (SideA[i].x + SideB[i].x) / 2, (int) (SideA[i].y
+				+ SideB[i].y) / 2);
+	}
+	centerline->n=n;
 
 }
 
@@ -938,10 +1938,99 @@ CvPoint FindNormalPt(CvPoint* Centerline, CvPoint* CenterVec, CvSeq* Contour){
  *
  */
 
-/*void SegmentSides (const CvSeq *contourA, const CvSeq *contourB, const CvSeq *centerline, CvSeq *segmentedA, CvSeq *segmentedB) {
+#ifdef __SSE2__
+/*
+ * |dot(p(k),t) - xt| for the four points p[0] to p[3], where tt holds the
+ * tangent as (t.x,0,t.y,0,...) in shorts. _mm_madd_epi16() multiplies the
+ * low halves of the coordinates by the tangent and the high halves by 0,
+ * which gives the right products as long as the coordinates and the tangent
+ * fit in 16 bits.
+ */
+static __m128i AbsPerpDots4(const CvPoint* p, __m128i tt, __m128i xt){
+	__m128i p01=_mm_madd_epi16(_mm_loadu_si128((const __m128i*) p),tt);
+	__m128i p23=_mm_madd_epi16(_mm_loadu_si128((const __m128i*) (p+2)),tt);
+	__m128i xs=_mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(p01),_mm_castsi128_ps(p23),_MM_SHUFFLE(2,0,2,0)));
+	__m128i ys=_mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(p01),_mm_castsi128_ps(p23),_MM_SHUFFLE(3,1,3,1)));
+	__m128i d=_mm_sub_epi32(_mm_add_epi32(xs,ys),xt);
+	__m128i sign=_mm_srai_epi32(d,31);
+	return _mm_sub_epi32(_mm_xor_si128(d,sign),sign);
+}
+#endif
+
+/*
+ * Returns 1 if all the coordinates of the n points fit in 16 bits:
+ * v+32768 is below 65536 for every one of them exactly when none of
+ * them has any of the upper 16 bits set.
+ */
+static int PointsFit16(const CvPoint* pts, int n){
+	unsigned int bits=0;
+	int k=0;
+#ifdef __SSE2__
+	const __m128i half=_mm_set1_epi32(32768);
+	__m128i acc=_mm_setzero_si128();
+	for (; k+2 <= n; k+=2) acc=_mm_or_si128(acc,_mm_add_epi32(_mm_loadu_si128((const __m128i*) (pts+k)),half));
+	unsigned int lanes[4];
+	_mm_storeu_si128((__m128i*) lanes,acc);
+	bits=lanes[0] | lanes[1] | lanes[2] | lanes[3];
+#endif
+	for (; k<n; k++) bits|=(unsigned int) (pts[k].x+32768) | (unsigned int) (pts[k].y+32768);
+	return (bits & 0xFFFF0000)==0;
+}
+
+/*
+ * FindPerpPoint(), with SSE2 if simd says that the coordinates and the tangent
+ * fit in 16 bits (see AbsPerpDots4()). Each of the four lanes keeps the first
+ * smallest of its points and where it was, and the lanes are compared at the end.
+ */
+static int PerpPointInWindow (CvPoint x, CvPoint t, const PointBuf *a, int startInd, int endInd, int simd) {
+	int j, trialadp, bestadp, bestInd = startInd;
+	const CvPoint* pts=a->pts;
+	bestadp = INT_MAX;
+	startInd = startInd > 0 ? startInd : 0;
+	endInd = endInd < a->n ? endInd : a->n;
+	j = startInd;
+#ifdef __SSE2__
+	if (simd && endInd-startInd >= 8){
+		/** |dot(a(k),t) - dot(x,t)| is the same as |dot(a(k)-x,t)| **/
+		const __m128i tt=_mm_setr_epi16((short) t.x,0,(short) t.y,0,(short) t.x,0,(short) t.y,0);
+		const __m128i xt=_mm_set1_epi32(x.x*t.x + x.y*t.y);
+		const __m128i four=_mm_set1_epi32(4);
+		__m128i index=_mm_setr_epi32(j,j+1,j+2,j+3);
+		__m128i best=_mm_set1_epi32(INT_MAX);
+		__m128i bestIndex=index;
+		for (; j+4 <= endInd; j+=4){
+			__m128i d=AbsPerpDots4(pts+j,tt,xt);
+			__m128i less=_mm_cmplt_epi32(d,best);
+			best=_mm_or_si128(_mm_and_si128(less,d),_mm_andnot_si128(less,best));
+			bestIndex=_mm_or_si128(_mm_and_si128(less,index),_mm_andnot_si128(less,bestIndex));
+			index=_mm_add_epi32(index,four);
+		}
+		int lanes[4], lanesIndex[4], k;
+		_mm_storeu_si128((__m128i*) lanes,best);
+		_mm_storeu_si128((__m128i*) lanesIndex,bestIndex);
+		for (k=0; k<4; k++) {
+			if (lanes[k] < bestadp || (lanes[k]==bestadp && lanesIndex[k] < bestInd)) {
+				bestadp = lanes[k];
+				bestInd = lanesIndex[k];
+			}
+		}
+	}
+#endif
+	for (; j < endInd; j++) {
+		trialadp =  ((pts[j].x - x.x)*t.x + (pts[j].y - x.y)*t.y);
+		trialadp = trialadp < 0 ? -trialadp : trialadp;
+		if (trialadp < bestadp) {
+			bestadp = trialadp;
+			bestInd = j;
+		}
+	}
+	return bestInd;
+}
+
+/*void SegmentSides (const PointBuf *contourA, const PointBuf *contourB, const PointBuf *centerline, PointBuf *segmentedA, PointBuf *segmentedB) {
  * all sequences are allocated sequences of CvPoint
  * const sequences are input
- * non const sequences are output and should be empty
+ * non const sequences are output and have their points replaced
  * contourA and contourB should be oriented so that they run from the nearest point to c0 (e.g. the head
  * to the nearest point to cN
  *
@@ -958,7 +2047,7 @@ CvPoint FindNormalPt(CvPoint* Centerline, CvPoint* CenterVec, CvSeq* Contour){
  *
  * MHG 9/16/09
  */
-void SegmentSides (const CvSeq *contourA, const CvSeq *contourB, const CvSeq *centerline, CvSeq *segmentedA, CvSeq *segmentedB) {
+void SegmentSides (const PointBuf *contourA, const PointBuf *contourB, const PointBuf *centerline, PointBuf *segmentedA, PointBuf *segmentedB) {
 	int j,lastA, lastB;
 	int ptincrement;
 	int noduplicates = 0;
@@ -967,45 +2056,55 @@ void SegmentSides (const CvSeq *contourA, const CvSeq *contourB, const CvSeq *ce
 
 
 	/** This defines the search area with which we will look for a point on the boundary **/
-	ptincrement = 3*((contourA->total > contourB->total ? contourA->total : contourB->total) / centerline->total + 1);
+	ptincrement = 3*((contourA->n > contourB->n ? contourA->n : contourB->n) / centerline->n + 1);
+
+	ReservePointBuf(segmentedA,centerline->n);
+	ReservePointBuf(segmentedB,centerline->n);
+	const CvPoint* c=centerline->pts;
+
+	/** The SSE2 search needs the coordinates to fit in 16 bits, which they do for any boundary found in an image **/
+	int fits16 = PointsFit16(contourA->pts,contourA->n) && PointsFit16(contourB->pts,contourB->n);
 
 
 
 	lastA=0;
 	lastB=0;
 	/** walk along the centerline and find the points perpendicular to the tangent of the centerline along the boundary **/
-		for (j = 0; j < centerline->total; j++) {
+		for (j = 0; j < centerline->n; j++) {
 
 			/** Find the point behind current on the centerline **/
 			if (j==0){
 				/** If current is the first point on the centerline **/
 				/** Use the Head as backwards **/
-				backward = *(CvPoint *) cvGetSeqElem (contourA, 0);
+				backward = contourA->pts[0];
 			}else{
-				backward = *(CvPoint *) cvGetSeqElem (centerline, j - 1);
+				backward = c[j - 1];
 			}
 
 			/** Find the current point along the centerline **/
-			current = *(CvPoint *) cvGetSeqElem (centerline, j);
+			current = c[j];
 
 			/** Find the point in front of current on the centerline **/
-			if (j==centerline->total-1){
+			if (j==centerline->n-1){
 				/** If current is the last point on the centerline **/
 				/** use the tail as forward **/
-				forward = *(CvPoint *) cvGetSeqElem (contourA, centerline->total-1);
+				forward = contourA->pts[centerline->n-1];
 			}else{
-				forward = *(CvPoint *) cvGetSeqElem (centerline, j+1);
+				forward = c[j+1];
 			}
 			/** The tangent vector is forward minus backward **/
 			tangent.x = forward.x - backward.x;
 			tangent.y = forward.y - backward.y;
 
 			/** Find the index along the boundary for the perpendicular pointer and store it **/
-			lastA = FindPerpPoint (current, tangent, contourA, lastA - ptincrement, lastA + ptincrement);
-			lastB = FindPerpPoint (current, tangent, contourB, lastB - ptincrement, lastB + ptincrement);
-			cvSeqPush (segmentedA, cvGetSeqElem(contourA, lastA));
-			cvSeqPush (segmentedB, cvGetSeqElem(contourB, lastB));
+			int simd = fits16 && tangent.x > -32768 && tangent.x < 32768 && tangent.y > -32768 && tangent.y < 32768;
+			lastA = PerpPointInWindow (current, tangent, contourA, lastA - ptincrement, lastA + ptincrement, simd);
+			lastB = PerpPointInWindow (current, tangent, contourB, lastB - ptincrement, lastB + ptincrement, simd);
+			segmentedA->pts[j] = contourA->pts[lastA];
+			segmentedB->pts[j] = contourB->pts[lastB];
 		}
+		segmentedA->n=centerline->n;
+		segmentedB->n=centerline->n;
 
 }
 
@@ -1028,7 +2127,7 @@ int FirstDoesNotMatch (CvPoint a, const CvSeq *b, int startInd, int dir) {
 	}
 	return -1;
 }
-/*int FindPerpPoint (CvPoint x, CvPoint t, const CvSeq *a, int startInd, int endInd) {
+/*int FindPerpPoint (CvPoint x, CvPoint t, const PointBuf *a, int startInd, int endInd) {
  *
  * a is sequence of CvPoint
  * finds the point in a that minimizes abs(dot (a(k)-x, t)) k in [startInd,endInd)
@@ -1038,22 +2137,8 @@ int FirstDoesNotMatch (CvPoint a, const CvSeq *b, int startInd, int dir) {
  *
  ** MHG 9/16/09
  */
-int FindPerpPoint (CvPoint x, CvPoint t, const CvSeq *a, int startInd, int endInd) {
-	int j, trialadp, bestadp, bestInd = startInd;
-	CvPoint current;
-	bestadp = INT_MAX;
-	startInd = startInd > 0 ? startInd : 0;
-	endInd = endInd < a->total ? endInd : a->total;
-	for (j = startInd; j < endInd; j++) {
-		current = *(CvPoint *) cvGetSeqElem (a, j);
-		trialadp =  ((current.x - x.x)*t.x + (current.y - x.y)*t.y);
-		trialadp = trialadp < 0 ? -trialadp : trialadp;
-		if (trialadp < bestadp) {
-			bestadp = trialadp;
-			bestInd = j;
-		}
-	}
-	return bestInd;
+int FindPerpPoint (CvPoint x, CvPoint t, const PointBuf *a, int startInd, int endInd) {
+	return PerpPointInWindow (x, t, a, startInd, endInd, 0);
 }
 
 
@@ -1100,61 +2185,216 @@ void ConvolveInt1D (const int *src, int *dst, int length, int *kernel, int kleng
 	}
 }
 
-void ConvolveCvPtSeq (const CvSeq *src, CvSeq *dst, int *kernel, int klength, int normfactor) {
-	int j, *x, *y, *xc, *yc;
-	CvPoint pt;
-
-	x = (int *) malloc (src->total * sizeof(int));
-	y = (int *) malloc (src->total * sizeof(int));
-	xc = (int *) malloc (src->total * sizeof(int));
-	yc = (int *) malloc (src->total * sizeof(int));
+/*
+ * ConvolveInt1D() on the x's and y's of length points at once, from src into
+ * dst (which can't be src).
+ *
+ * Only the first and last klength/2 or so points need their indices clamped
+ * to the ends; the ones in between are done without. With SSE2, and when the
+ * coordinates and the kernel fit in 16 bits, those are done two points (four
+ * numbers) per _mm_madd_epi16(), which multiplies the low half of each by the
+ * kernel and the high half by 0. The division and rounding are done in
+ * doubles as in ConvolveInt1D(), so the results are the same.
+ */
+static void ConvolvePoints (const CvPoint *src, CvPoint *dst, int length, const int *kernel, int klength, int normfactor) {
+	int j, k, ind, anchor, sumx, sumy;
+	anchor = klength/2;
 
-	for (j = 0; j < src->total; j++) {
-		x[j] = ((CvPoint *) cvGetSeqElem(src, j))->x;
-		y[j] = ((CvPoint *) cvGetSeqElem(src, j))->y;
+	/** Points whose whole kernel lands inside the sequence **/
+	int lo = anchor < length ? anchor : length;
+	int hi = length - klength + anchor + 1;
+	if (hi < lo) hi = lo;
+
+	j = lo;
+#ifdef __SSE2__
+	int fits16 = PointsFit16(src, length);
+	for (k = 0; k < klength; k++) if (kernel[k] < 0 || kernel[k] > 32767) fits16 = 0;
+	if (fits16) {
+		const __m128d norm=_mm_set1_pd((double) normfactor);
+		const __m128d half=_mm_set1_pd(0.5);
+		for (; j+4 <= hi; j+=4) {
+			__m128i acc0=_mm_setzero_si128();
+			__m128i acc1=_mm_setzero_si128();
+			const CvPoint* p=src+j-anchor;
+			for (k = 0; k < klength; k++) {
+				__m128i tap=_mm_set1_epi32(kernel[k]);
+				acc0=_mm_add_epi32(acc0,_mm_madd_epi16(_mm_loadu_si128((const __m128i*) (p+k)),tap));
+				acc1=_mm_add_epi32(acc1,_mm_madd_epi16(_mm_loadu_si128((const __m128i*) (p+k+2)),tap));
+			}
+			__m128i r0=_mm_cvttpd_epi32(_mm_add_pd(_mm_div_pd(_mm_cvtepi32_pd(acc0),norm),half));
+			__m128i r1=_mm_cvttpd_epi32(_mm_add_pd(_mm_div_pd(_mm_cvtepi32_pd(_mm_srli_si128(acc0,8)),norm),half));
+			__m128i r2=_mm_cvttpd_epi32(_mm_add_pd(_mm_div_pd(_mm_cvtepi32_pd(acc1),norm),half));
+			__m128i r3=_mm_cvttpd_epi32(_mm_add_pd(_mm_div_pd(_mm_cvtepi32_pd(_mm_srli_si128(acc1,8)),norm),half));
+			_mm_storeu_si128((__m128i*) (dst+j),_mm_unpacklo_epi64(r0,r1));
+			_mm_storeu_si128((__m128i*) (dst+j+2),_mm_unpacklo_epi64(r2,r3));
+		}
+	}
+#endif
+	for (; j < hi; j++) {
+		const CvPoint* p=src+j-anchor;
+		sumx = 0;
+		sumy = 0;
+		for (k = 0; k < klength; k++) {
+			sumx = sumx + p[k].x*kernel[k];
+			sumy = sumy + p[k].y*kernel[k];
+		}
+		dst[j].x = (int) (1.0*sumx/normfactor + 0.5);
+		dst[j].y = (int) (1.0*sumy/normfactor + 0.5);
 	}
-	ConvolveInt1D(x, xc, src->total, kernel, klength, normfactor);
-	ConvolveInt1D(y, yc, src->total, kernel, klength, normfactor);
 
-	for (j = 0; j < src->total; j++) {
-		pt.x = xc[j];
-		pt.y = yc[j];
-		cvSeqPush(dst, &pt);
+	/** The ends, padded with the end points **/
+	for (j = 0; j < length; j++) {
+		if (j == lo) j = hi;
+		if (j >= length) break;
+		sumx = 0;
+		sumy = 0;
+		for (k = 0; k < klength; k++) {
+			ind = j + k - anchor;
+			ind = ind > 0 ? ind : 0;
+			ind = ind < length ? ind : (length - 1);
+			sumx = sumx + src[ind].x*kernel[k];
+			sumy = sumy + src[ind].y*kernel[k];
+		}
+		dst[j].x = (int) (1.0*sumx/normfactor + 0.5);
+		dst[j].y = (int) (1.0*sumy/normfactor + 0.5);
 	}
+}
 
-	free(x);
-	free(y);
-	free(xc);
-	free(yc);
+void ConvolveCvPtSeq (const PointBuf *src, PointBuf *dst, int *kernel, int klength, int normfactor) {
+	ReservePointBuf(dst,src->n);
+	ConvolvePoints(src->pts, dst->pts, src->n, kernel, klength, normfactor);
+	dst->n=src->n;
 }
 
-void CreateGaussianKernel (double sigma, int **kernel, int *klength, int *normfactor) {
-	int ll, ul, x;
+/*
+ * The length of the kernel CreateGaussianKernel() makes for sigma, and
+ * filling one in. Returns the normfactor.
+ */
+static int GaussianKernelLength (double sigma) {
+	int ll = (int) (-3 * sigma) - 1;
+	int ul = (int) (3 * sigma) + 1;
+	return ul - ll + 1;
+}
+
+static int FillGaussianKernel (double sigma, int *kernel) {
+	int ll, x, klength, normfactor;
 	double n;
 	ll = (int) (-3 * sigma) - 1;
-	ul = (int) (3 * sigma) + 1;
-	*klength = ul - ll + 1;
-	*kernel = (int*) malloc (*klength * sizeof(int));
+	klength = GaussianKernelLength(sigma);
 
-	*normfactor = 0;
+	normfactor = 0;
 	if (PRINTOUT) printf ("kernel = ");
 	n = exp(-1.0*ll*ll/(2*sigma*sigma));
-	for (x = 0; x < *klength; x++) {
-		(*kernel)[x] =(int) (exp(-1.0*(x+ll)*(x+ll)/(2*sigma*sigma))/n + 0.5);
-		*normfactor += (*kernel)[x];
-		if (PRINTOUT) printf ("%d\t", (*kernel)[x]);
+	for (x = 0; x < klength; x++) {
+		kernel[x] =(int) (exp(-1.0*(x+ll)*(x+ll)/(2*sigma*sigma))/n + 0.5);
+		normfactor += kernel[x];
+		if (PRINTOUT) printf ("%d\t", kernel[x]);
 	}
-	if (PRINTOUT) printf("\nnormfactor = %d\n", *normfactor);
+	if (PRINTOUT) printf("\nnormfactor = %d\n", normfactor);
+	return normfactor;
+}
 
+void CreateGaussianKernel (double sigma, int **kernel, int *klength, int *normfactor) {
+	*klength = GaussianKernelLength(sigma);
+	*kernel = (int*) malloc (*klength * sizeof(int));
+	*normfactor = FillGaussianKernel(sigma, *kernel);
 }
 
-CvSeq *smoothPtSequence (const CvSeq *src, double sigma, CvMemStorage *mem) {
+void smoothPtSequence (const PointBuf *src, PointBuf *dst, double sigma) {
 	int *kernel, klength, normfactor;
-	CvSeq *dst = cvCreateSeq(CV_SEQ_ELTYPE_POINT, sizeof(CvSeq), sizeof(CvPoint), mem);
 	CreateGaussianKernel(sigma, &kernel, &klength, &normfactor);
 	ConvolveCvPtSeq(src, dst, kernel, klength, normfactor);
 	free(kernel);
-	return dst;
+}
+
+/*
+ * Recursive Gaussian of Young and van Vliet ("Recursive implementation of the
+ * Gaussian filter," Signal Processing 44 (1995) 139-151) on the x's and y's of
+ * n points, run forward and then backward. The ends are padded with the end
+ * points, as ConvolvePoints() does. w is scratch for 2*n doubles. sigma
+ * should be at least 0.5.
+ */
+static void RecursiveGaussianPoints (const CvPoint *src, CvPoint *dst, int n, double sigma, double *w) {
+	int j;
+	double q = (sigma >= 2.5) ? 0.98711*sigma - 0.96330 : 3.97156 - 4.14554*sqrt(1 - 0.26891*sigma);
+	double b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q;
+	double b1 = (2.44413*q + 2.85619*q*q + 1.26661*q*q*q)/b0;
+	double b2 = -(1.4281*q*q + 1.26661*q*q*q)/b0;
+	double b3 = 0.422205*q*q*q/b0;
+	double B = 1 - (b1 + b2 + b3);
+
+	/** A constant comes out as itself, so the filter starts as if the end point went on forever **/
+	double x1 = src[0].x, x2 = x1, x3 = x1;
+	double y1 = src[0].y, y2 = y1, y3 = y1;
+	for (j = 0; j < n; j++) {
+		double x = B*src[j].x + b1*x1 + b2*x2 + b3*x3;
+		double y = B*src[j].y + b1*y1 + b2*y2 + b3*y3;
+		x3 = x2; x2 = x1; x1 = x;
+		y3 = y2; y2 = y1; y1 = y;
+		w[2*j] = x;
+		w[2*j+1] = y;
+	}
+	x2 = x3 = x1;
+	y2 = y3 = y1;
+	for (j = n-1; j >= 0; j--) {
+		double x = B*w[2*j] + b1*x1 + b2*x2 + b3*x3;
+		double y = B*w[2*j+1] + b1*y1 + b2*y2 + b3*y3;
+		x3 = x2; x2 = x1; x1 = x;
+		y3 = y2; y2 = y1; y1 = y;
+		dst[j].x = (int) floor(x + 0.5);
+		dst[j].y = (int) floor(y + 0.5);
+	}
+}
+
+void InitPtSmoother (PtSmoother *s) {
+	memset(s, 0, sizeof(PtSmoother));
+}
+
+void SmoothPointBuf (PtSmoother *s, const PointBuf *src, PointBuf *dst, double sigma) {
+	int n = src->n;
+	int k;
+	ReservePointBuf(dst, n);
+	dst->n = n;
+	if (n == 0) return;
+
+	if (s->IIRSigma > 0 && sigma >= s->IIRSigma) {
+		if (s->workSize < 2*n) {
+			if (s->work != NULL) free(s->work);
+			s->workSize = 4*n;
+			s->work = (double*) malloc(s->workSize*sizeof(double));
+		}
+		RecursiveGaussianPoints(src->pts, dst->pts, n, sigma, s->work);
+		return;
+	}
+
+	/** Look for this sigma's kernel, and make it if it isn't there **/
+	int steps = cvRound(sigma*PTSMOOTH_STEPS);
+	if (steps < 1) steps = 1;
+	for (k = 0; k < PTSMOOTH_CACHE; k++) if (s->steps[k] == steps) break;
+	if (k == PTSMOOTH_CACHE) {
+		k = s->next;
+		s->next = (s->next+1) % PTSMOOTH_CACHE;
+		double qsigma = (double) steps/PTSMOOTH_STEPS;
+		int klength = GaussianKernelLength(qsigma);
+		if (s->capacity[k] < klength) {
+			if (s->kernel[k] != NULL) free(s->kernel[k]);
+			s->capacity[k] = klength;
+			s->kernel[k] = (int*) malloc(klength*sizeof(int));
+		}
+		s->steps[k] = steps;
+		s->klength[k] = klength;
+		s->normfactor[k] = FillGaussianKernel(qsigma, s->kernel[k]);
+	}
+	ConvolvePoints(src->pts, dst->pts, n, s->kernel[k], s->klength[k], s->normfactor[k]);
+}
+
+void ReleasePtSmoother (PtSmoother *s) {
+	int k;
+	for (k = 0; k < PTSMOOTH_CACHE; k++) if (s->kernel[k] != NULL) free(s->kernel[k]);
+	if (s->work != NULL) free(s->work);
+	double IIRSigma = s->IIRSigma;
+	InitPtSmoother(s);
+	s->IIRSigma = IIRSigma;
 }
 
 
@@ -65,14 +65,38 @@ typedef struct MemoryManagementStruct{
  * This is useful in conjuncture with the TransformLib.h library that converts
  * from CCD to DLP space.
  *
+ * Frames from cameras with more than 8 bits per pixel also keep the frame as it
+ * came from the camera, in a 16 bit container (low bits), in iplimg16.
+ * iplimg is then the 8 bit conversion of it (see LoadFrameWithBuffer16()).
+ *
+ * A frame can also be loaded from a buffer that holds only part of it, such as
+ * a camera's region of interest (see LoadFrameRegionWithBuffer()).
+ *
  */
 typedef struct FrameStruct{
 	unsigned char * binary;
 	IplImage* iplimg;
 	CvSize size;
+	char* ownImageData; // iplimg's own pixel memory (see LendBufferToFrame())
+	IplImage* iplimg16; // IPL_DEPTH_16U frame from the camera (NULL until a high bit depth frame is loaded)
+	CvRect roi; // part of the frame's own memory that was last loaded from a buffer
 }Frame;
 
 
+/*
+ * How to convert a high bit depth (9 to 16 bit) frame to 8 bits
+ */
+#define CONV16_SHIFT 0 // keep the top 8 of the camera's bits
+#define CONV16_WINDOW 1 // map low..high onto 0..255 linearly and clip everything outside
+
+typedef struct Conv16Struct{
+	int mode;
+	int bitDepth; // bits per pixel from the camera
+	int low; // CONV16_WINDOW only
+	int high;
+}Conv16;
+
+
 
 /*
  * Creates a frame. Allocates memory for frame structure.
@@ -132,6 +156,294 @@ void LoadFrameWithImage(IplImage* imgsrc, Frame* myFrame);
  */
 void SetFrame(Frame* myFrame, int value);
 
+/*
+ * Point the frame's iplImage at someone else's image buffer (for example a
+ * frame grabber DMA buffer) without copying anything.
+ *
+ * The buffer must have size myFrame->size and rows laid out like the iplImage's (widthStep).
+ * Only the iplImage component is updated. The binary component is left alone.
+ * The frame's own memory is untouched and is what DestroyFrame() frees.
+ */
+void LendBufferToFrame(unsigned char* buf, Frame* myFrame);
+
+/*
+ * Point the frame's iplImage back at its own memory.
+ *
+ * Returns the buffer that had been lent to the frame, or NULL if there was none,
+ * so that it can be handed back to its owner.
+ */
+unsigned char* ReclaimFrameBuffer(Frame* myFrame);
+
+/*
+ * Copy an image buffer whose rows are step bytes apart into the frame's iplImage.
+ * Use this when the rows of a buffer don't line up with the iplImage and so can't be lent.
+ *
+ * NOTE: the buffer must have size myFrame->size
+ * Only the iplImage component is updated. The binary component is left alone.
+ */
+void LoadFrameWithBuffer(unsigned char* buf, int step, Frame* myFrame);
+
+/*
+ * Copy a high bit depth buffer (16 bit pixels, rows step bytes apart) into the
+ * frame's iplimg16 and, in the same pass, convert it to 8 bits into the
+ * frame's iplImage as conv says. iplimg16 is allocated the first time.
+ *
+ * Uses SSE2 when the compiler has it.
+ * Only the iplImage components are updated. The binary component is left alone.
+ */
+void LoadFrameWithBuffer16(unsigned char* buf, int step, Conv16* conv, Frame* myFrame);
+
+/*
+ * Copy a buffer that holds only the roi part of the frame (rows step bytes apart)
+ * into the same place in the frame's iplImage, so that coordinates in the frame
+ * are the same as if the whole frame had been loaded.
+ *
+ * Everything outside of roi is 0. The rest of the frame is only cleared when roi
+ * is not the same as last time, so a region that stays put costs nothing but its own pixels.
+ * Only the iplImage component is updated. The binary component is left alone.
+ */
+void LoadFrameRegionWithBuffer(unsigned char* buf, int step, CvRect roi, Frame* myFrame);
+
+/*
+ * Same for a high bit depth buffer, which goes into iplimg16 and is converted
+ * to 8 bits into iplImage as conv says (see LoadFrameWithBuffer16()).
+ */
+void LoadFrameRegionWithBuffer16(unsigned char* buf, int step, CvRect roi, Conv16* conv, Frame* myFrame);
+
+/*
+ * Set the 16 bit to 8 bit conversion up to keep the top 8 bits of a bitDepth bit camera.
+ */
+void SetConv16Shift(Conv16* conv, int bitDepth);
+
+/*
+ * Set the 16 bit to 8 bit conversion up to map low..high onto 0..255.
+ * Returns 0, or -1 if high is not above low.
+ */
+int SetConv16Window(Conv16* conv, int bitDepth, int low, int high);
+
+/*
+ * The 16 bit level that conv converts to the 8 bit level level8.
+ * Use it to threshold a 16 bit image where an 8 bit one would have been thresholded.
+ */
+int Conv16Level(Conv16* conv, int level8);
+
+/*
+ * Threshold a 16 bit image: pixels above thresh become 255 in the 8 bit dst and the rest 0.
+ * Like cvThreshold(), only the images' regions of interest (which must be the same size) are used.
+ * Uses SSE2 when the compiler has it.
+ */
+void ThresholdImage16(IplImage* src, IplImage* dst, int thresh);
+
+/*
+ * Scratch rows for SmoothThreshold(). Start it out as {NULL,0}: it grows as needed
+ * and is kept from call to call. Free it with ReleaseSmoothBuffer().
+ */
+typedef struct SmoothBufferStruct{
+	int* mem;
+	int size; // ints in mem
+} SmoothBuffer;
+
+/*
+ * Gaussian smooth an 8 bit image and threshold it in a single pass:
+ * pixels whose smoothed value is above thresh become 255 in dst and the rest 0.
+ *
+ * This gives the mask that
+ * 		cvSmooth(src,smooth,CV_GAUSSIAN,GaussSize*2+1);
+ * 		cvThreshold(smooth,dst,thresh,255,CV_THRESH_BINARY);
+ * would, without ever writing out the smoothed image. The Gaussian is built out of
+ * stacked box filters in integer arithmetic (1 2 1 for GaussSize 1, up to three boxes
+ * with the Gaussian's variance above that), so the time it takes doesn't grow with
+ * GaussSize. Rows stream through a few cached rows of buf.
+ *
+ * copy, if not NULL, gets a second copy of the mask, and smooth, if not NULL, the
+ * smoothed image. Only the images' regions of interest (which must be the same
+ * size) are used. Each box takes the pixels past the edge of the region to be the
+ * edge pixels, so the outermost pixel or two can differ slightly from cvSmooth().
+ * Uses SSE2 when the compiler has it.
+ */
+void SmoothThreshold(IplImage* src, IplImage* dst, IplImage* copy, IplImage* smooth, int GaussSize, int thresh, SmoothBuffer* buf);
+
+/** Farthest the smoothing in SmoothThreshold() reaches on either side of a pixel **/
+#define SMOOTH_MAXREACH 24
+
+/*
+ * The smoothing and threshold of SmoothThreshold() as a single kernel, for
+ * smoothing and thresholding just a few pixels at a time (see SmoothThresholdSpan()).
+ * The stacked boxes come to the same weights across and down.
+ */
+typedef struct SmoothKernelStruct{
+	int lo; // how far the kernel reaches before a pixel
+	int hi; // and after it
+	int weight[2*SMOOTH_MAXREACH+1]; // weight[lo+d] multiplies the pixel d away
+	int cut; // a pixel is above the threshold when its weighted sum is at least cut
+} SmoothKernel;
+
+/*
+ * Make the kernel of SmoothThreshold(...,GaussSize,thresh,...).
+ */
+void MakeSmoothKernel(SmoothKernel* k, int GaussSize, int thresh);
+
+/*
+ * Smooth and threshold just the n pixels of src from pt across (relative to
+ * src's region of interest) into out: 255 where the smoothed value is above the
+ * threshold and 0 elsewhere, the same as SmoothThreshold() gives for them.
+ * Pixels past the edge of the region are taken to be the edge pixels, so within
+ * the kernel's reach of the edge this can differ slightly from SmoothThreshold().
+ *
+ * It takes about twice k.lo+k.hi+1 multiplies per pixel, so it pays off over
+ * SmoothThreshold() where only a thin band of pixels is needed.
+ * buf is scratch (see SmoothBuffer).
+ */
+void SmoothThresholdSpan(IplImage* src, CvPoint pt, int n, unsigned char* out, SmoothKernel* k, SmoothBuffer* buf);
+
+/*
+ * Free the scratch rows of a SmoothBuffer.
+ */
+void ReleaseSmoothBuffer(SmoothBuffer* buf);
+
+/*
+ * A run of nonzero pixels in one row of a mask.
+ */
+typedef struct MaskRunStruct{
+	int y;
+	int start;
+	int end; // one past the last pixel of the run
+} MaskRun;
+
+/*
+ * An 8-connected blob of runs.
+ */
+typedef struct RunBlobStruct{
+	int area; // pixels
+	CvRect rect; // bounding box
+	int firstRun; // its topmost (then leftmost) run
+} RunBlob;
+
+/*
+ * A mask held as the runs of nonzero pixels in each row, in order, instead of as
+ * an image, and the blobs the runs make up (see LabelRuns()). A worm takes up a
+ * small part of the frame, so this is kilobytes where the image is megabytes.
+ *
+ * Coordinates are relative to the region of the image the runs came from (r).
+ * Start it out as all zeros: the arrays grow as needed and are kept from call to
+ * call. Free them with ReleaseRunMask().
+ */
+typedef struct RunMaskStruct{
+	CvRect r;
+
+	MaskRun* runs;
+	int nruns;
+	int* rowStart; // the runs of row y are runs[rowStart[y]] up to runs[rowStart[y+1]]
+
+	/** Filled in by LabelRuns() **/
+	int* label; // the blob each run is in
+	RunBlob* blobs;
+	int nblobs;
+
+	/** Scratch for RunBlobBorder() **/
+	unsigned char* paint;
+
+	int runCapacity;
+	int rowCapacity;
+	int blobCapacity;
+	int paintCapacity;
+} RunMask;
+
+/*
+ * Like SmoothThreshold(), but the mask comes out as runs (with no blobs yet)
+ * instead of being written to an image. Each row of the mask is cut into a row of buf
+ * and taken apart into runs while it is still in the cache.
+ */
+void SmoothThresholdRuns(IplImage* src, RunMask* runs, IplImage* copy, IplImage* smooth, int GaussSize, int thresh, SmoothBuffer* buf);
+
+/*
+ * Take the region of interest of a mask apart into runs (with no blobs yet).
+ * Uses SSE2 when the compiler has it.
+ */
+void MaskToRuns(IplImage* mask, RunMask* runs);
+
+/*
+ * Find the 8-connected blobs that the runs make up (the ones cvFindContours()
+ * would find an outer contour for), with each one's area and bounding box.
+ * Each run is joined to the runs in the row above that touch it, so this takes
+ * time in proportion to the number of runs rather than the number of pixels.
+ *
+ * Blobs are numbered in the order of their topmost, leftmost pixels.
+ * Returns the number of blobs.
+ */
+int LabelRuns(RunMask* runs);
+
+/*
+ * The blob with the most pixels, or -1 if there are none. Run LabelRuns() first.
+ */
+int LargestRunBlob(RunMask* runs);
+
+/*
+ * Find the outer contour of a blob, the same points in the same order as
+ * cvFindContours(...,CV_RETR_EXTERNAL,CV_CHAIN_APPROX_NONE) would. Only the blob's
+ * own runs are painted (into a scratch image the size of its bounding box)
+ * and only its border is followed (see FollowBlobBorder()).
+ *
+ * Up to maxpts points go into pts. Returns the number of points in the contour,
+ * which can be more than maxpts.
+ */
+int RunBlobBorder(RunMask* runs, int blob, CvPoint* pts, int maxpts);
+
+/*
+ * Free the arrays of a RunMask.
+ */
+void ReleaseRunMask(RunMask* runs);
+
+/*
+ * A flat array of points, used for the worm's outline, centerline and sides.
+ *
+ * Unlike a CvSeq the points are all in one block, so the i'th point is just pts[i].
+ * The block is 32 byte aligned (it comes from cvAlloc()) and is kept from frame to
+ * frame, so it is only reallocated when a frame needs more points than ever before.
+ * PointBufSeq() wraps the points in a CvSeq header, without copying them, for
+ * anything that wants a CvSeq such as cvWrite() or cvDrawContours().
+ */
+typedef struct PointBufStruct{
+	CvPoint* pts;
+	int n; // number of points in pts
+	int capacity;
+	int seqType; // kind of CvSeq PointBufSeq() makes, e.g. CV_SEQ_POLYGON for a closed outline
+	CvContour header; // for PointBufSeq()
+	CvSeqBlock block;
+} PointBuf;
+
+/*
+ * Set up an empty PointBuf. seqType is the type PointBufSeq() gives its CvSeq.
+ */
+void InitPointBuf(PointBuf* buf, int seqType);
+
+/*
+ * Make room for n points, keeping the ones already there.
+ */
+void ReservePointBuf(PointBuf* buf, int n);
+
+/*
+ * Copy n points (or a CvSeq of CvPoints) into buf.
+ */
+void SetPointBuf(PointBuf* buf, const CvPoint* pts, int n);
+void SetPointBufFromSeq(PointBuf* buf, CvSeq* seq);
+
+/*
+ * A CvSeq of the points in buf. The sequence uses buf's own memory, so it is
+ * read only and only good until buf next changes.
+ */
+CvSeq* PointBufSeq(PointBuf* buf);
+
+/*
+ * The smallest rectangle that holds all of the points in buf.
+ */
+CvRect PointBufRect(PointBuf* buf);
+
+/*
+ * Free the points of a PointBuf.
+ */
+void ReleasePointBuf(PointBuf* buf);
+
 /*
  * copies the 8 bit image data in src to the character array arr
  * arr must be preallocated and be src->width*src->height in size
@@ -175,6 +487,20 @@ void SafeDrawSquare(IplImage** image, CvPoint* pt, int radius);
  */
 void LongestContour(CvSeq* contours, CvSeq** ContourOfInterest);
 
+/*
+ * Follow the outer border of the blob (8-connected nonzero pixels) that start is on,
+ * point for point the way cvFindContours() does. start must be a nonzero pixel whose
+ * left neighbor is 0. Coordinates are relative to the image's region of interest,
+ * and the pixels along the edge of the region must be 0 (cvFindContours() zeroes them).
+ *
+ * Up to maxpts points go into pts (which may be NULL). Returns the number of points
+ * in the border, which can be more than maxpts. *first is set to the topmost (then
+ * leftmost) point of the border: following from there gives exactly the contour that
+ * cvFindContours() finds for the blob. *hole is set to 1 if start turned out to be on
+ * the border of a hole in a blob instead of on the outside of one.
+ */
+int FollowBlobBorder(IplImage* mask, CvPoint start, CvPoint* pts, int maxpts, CvPoint* first, int* hole);
+
 
 /*
  * Takes the cross product of two vectors representated in cartesian coordinates as CvPoint (x,y)
@@ -225,7 +551,7 @@ void DrawSequence(IplImage** image, CvSeq* Seq);
  * would take too long.
  *
  */
-void resampleSeq(CvSeq* sequence,CvSeq* ResampledSeq, int Numsegments);
+void resampleSeq(PointBuf* sequence,PointBuf* ResampledSeq, int Numsegments);
 
 
 /*
@@ -241,7 +567,7 @@ void resampleSeq(CvSeq* sequence,CvSeq* ResampledSeq, int Numsegments);
  *	then the last point should be fairly close.
  */
 
-void resampleSeqConstPtsPerArcLength(CvSeq* sequence, CvSeq* ResampledSeq, int Numsegments);
+void resampleSeqConstPtsPerArcLength(PointBuf* sequence, PointBuf* ResampledSeq, int Numsegments);
 
 /*
  *
@@ -282,10 +608,10 @@ int GetLineFromEndPts(CvPoint a, CvPoint b, CvSeq* contour);
 int CvtPolySeq2ContourSeq(CvSeq* polygon, CvSeq* contour );
 
 /*
- * Given two CvSeq containing CvPoint's this function returns the midpoint.
+ * Given two PointBufs of CvPoint's this function returns the midpoint.
  *
  */
-void FindCenterline(CvSeq* NBoundA,CvSeq* NBoundB,CvSeq* centerline);
+void FindCenterline(PointBuf* NBoundA,PointBuf* NBoundB,PointBuf* centerline);
 
 /*
  * Given a point, and a boundary, this function returns the coordinates of the closest point on the boundary.
@@ -307,10 +633,10 @@ CvPoint FindNormalPt(CvPoint* Centerline, CvPoint* CenterVec, CvSeq* Contour);
  *
  */
 
-/*void SegmentSides (const CvSeq *contourA, const CvSeq *contourB, const CvSeq *centerline, CvSeq *segmentedA, CvSeq *segmentedB) {
+/*void SegmentSides (const PointBuf *contourA, const PointBuf *contourB, const PointBuf *centerline, PointBuf *segmentedA, PointBuf *segmentedB) {
  * all sequences are allocated sequences of CvPoint
  * const sequences are input
- * non const sequences are output and should be empty
+ * non const sequences are output and have their points replaced
  * contourA and contourB should be oriented so that they run from the nearest point to c0 (e.g. the head
  * to the nearest point to cN
  *
@@ -327,7 +653,7 @@ CvPoint FindNormalPt(CvPoint* Centerline, CvPoint* CenterVec, CvSeq* Contour);
  *
  * MHG 9/16/09
  */
-void SegmentSides (const CvSeq *contourA, const CvSeq *contourB, const CvSeq *centerline, CvSeq *segmentedA, CvSeq *segmentedB);
+void SegmentSides (const PointBuf *contourA, const PointBuf *contourB, const PointBuf *centerline, PointBuf *segmentedA, PointBuf *segmentedB);
 
 
 
@@ -343,7 +669,7 @@ void SegmentSides (const CvSeq *contourA, const CvSeq *contourB, const CvSeq *ce
 int FirstDoesNotMatch (CvPoint a, const CvSeq *b, int startInd, int dir);
 
 
-/*int FindPerpPoint (CvPoint x, CvPoint t, const CvSeq *a, int startInd, int endInd) {
+/*int FindPerpPoint (CvPoint x, CvPoint t, const PointBuf *a, int startInd, int endInd) {
  *
  * a is sequence of CvPoint
  * finds the point in a that minimizes abs(dot (a(k)-x, t)) k in [startInd,endInd)
@@ -353,7 +679,7 @@ int FirstDoesNotMatch (CvPoint a, const CvSeq *b, int startInd, int dir);
  *
  ** MHG 9/16/09
  */
-int FindPerpPoint (CvPoint x, CvPoint t, const CvSeq *a, int startInd, int endInd);
+int FindPerpPoint (CvPoint x, CvPoint t, const PointBuf *a, int startInd, int endInd);
 
 
 /* void RemoveSequentialDuplicatePoints (CvSeq *seq)
@@ -372,12 +698,57 @@ void RemoveSequentialDuplicatePoints (CvSeq *seq);
 //Marc's functions for convolution
 void ConvolveInt1D (const int *src, int *dst, int length, int *kernel, int klength, int normfactor);
 
-void ConvolveCvPtSeq (const CvSeq *src, CvSeq *dst, int *kernel, int klength, int normfactor);
+void ConvolveCvPtSeq (const PointBuf *src, PointBuf *dst, int *kernel, int klength, int normfactor);
 
 void CreateGaussianKernel (double sigma, int **kernel, int *klength, int *normfactor);
 
 
-CvSeq *smoothPtSequence (const CvSeq *src, double sigma, CvMemStorage *mem);
+void smoothPtSequence (const PointBuf *src, PointBuf *dst, double sigma);
+
+
+/** Sigmas are rounded to 1/PTSMOOTH_STEPS of a point before their kernel is looked up **/
+#define PTSMOOTH_STEPS 32
+
+/** Kernels a PtSmoother keeps **/
+#define PTSMOOTH_CACHE 4
+
+/*
+ * Smooths sequences of points with a Gaussian (see SmoothPointBuf()), keeping
+ * the kernels it has made and its scratch from call to call. Set it up with
+ * InitPtSmoother() and free it with ReleasePtSmoother().
+ */
+typedef struct PtSmootherStruct{
+	/** Kernels for the last few sigmas, made by CreateGaussianKernel() for sigma rounded to steps/PTSMOOTH_STEPS **/
+	int steps[PTSMOOTH_CACHE]; // 0 = none
+	int* kernel[PTSMOOTH_CACHE];
+	int capacity[PTSMOOTH_CACHE];
+	int klength[PTSMOOTH_CACHE];
+	int normfactor[PTSMOOTH_CACHE];
+	int next; // entry to replace next
+
+	/** Smooth with a recursive Gaussian instead whenever sigma is at least this (0 = never) **/
+	double IIRSigma;
+	double* work; // two doubles per point for it
+	int workSize;
+} PtSmoother;
+
+void InitPtSmoother (PtSmoother *s);
+
+/*
+ * smoothPtSequence() without allocating anything once it has seen sigma
+ * (to within 1/PTSMOOTH_STEPS of a point) and the length of src. dst can't
+ * be src.
+ *
+ * With s->IIRSigma set, sigmas at least that large are done with a recursive
+ * Gaussian whose cost doesn't grow with sigma. Its results are close to, but
+ * not the same as, the kernel's.
+ */
+void SmoothPointBuf (PtSmoother *s, const PointBuf *src, PointBuf *dst, double sigma);
+
+/*
+ * Frees the kernels and scratch (but keeps IIRSigma).
+ */
+void ReleasePtSmoother (PtSmoother *s);
 
 
 
@@ -101,6 +101,16 @@ void T2Cam_AllocateCamData(CamData** CameraDataStruct){
 	assert(0);
 }
 
+/*
+ * Block until the camera has delivered a frame newer than lastFrameSeen,
+ * or until timeout ms have passed.
+ */
+int T2Cam_WaitForNewFrame(CamData* Camera, unsigned long lastFrameSeen, int timeout){
+	T2Cam_errormsg();
+	assert(0);
+	return 0;
+}
+
 /*
  * Show the Device Selection Dialog, initilize the camera and store the resulting
  * framegrabber handle in CamData->hgrabber.
@@ -34,6 +34,7 @@
  */
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <Talk2DLP.h>
 
 /**
@@ -50,11 +51,26 @@
  *
  * So to avoid linker errors I am writing this DontTalk2DLP.c
  * which basically redefines all of the hardware specific functions.
+ *
+ * Instead of projecting them, every frame sent to the (nonexistent) DLP is
+ * captured as a checksum. When the DLP is turned off the checksum of every
+ * frame is written to DLPCapture.txt and a digest of the whole session is
+ * printed, so that a headless replay of a session (see Journal.h) run with two
+ * different builds can be checked for identical DLP patterns.
  */
 
 
 
 
+/** File that the checksum of every captured frame is written to **/
+#define T2DLP_CAPTUREFILE "DLPCapture.txt"
+
+/** Checksums of every frame sent so far. A cleared DLP is recorded as 0 **/
+static unsigned int* CapturedFrames=NULL;
+static long NumCaptured=0;
+static long MaxCaptured=0;
+
+
 void T2DLP_errormsg(){
 	printf("\n\nERROR.\n");
 	printf("It appears as though a DLP-specific function was called.\n");
@@ -62,24 +78,63 @@ void T2DLP_errormsg(){
 	printf("Try running the software in DLP simulation mode with the -s switch.\n\n");
 }
 
+/*
+ * FNV-1a checksum of a whole DLP frame (one byte per mirror)
+ */
+static unsigned int ChecksumDLPFrame(unsigned char* image){
+	unsigned int hash=2166136261u;
+	long k;
+	for (k=0; k<(long) NSIZEX*NSIZEY; k++){
+		hash^=image[k];
+		hash*=16777619u;
+	}
+	return hash;
+}
 
-long T2DLP_on(){
-	T2DLP_errormsg();
-	assert(0);
+static void CaptureDLPFrame(unsigned int checksum){
+	if (NumCaptured==MaxCaptured){
+		MaxCaptured= (MaxCaptured==0) ? 4096 : 2*MaxCaptured;
+		CapturedFrames=(unsigned int*) realloc(CapturedFrames,MaxCaptured*sizeof(unsigned int));
+	}
+	CapturedFrames[NumCaptured++]=checksum;
+}
 
-	return 0;
+
+long T2DLP_on(){
+	printf("No DLP. Frames sent to the DLP will be captured as checksums instead.\n");
+	NumCaptured=0;
+	return 1;
 }
+
 int T2DLP_off(long alpid)
 {
-	T2DLP_errormsg();
-	assert(0);
+	/** Digest of the whole session, in order **/
+	unsigned int digest=2166136261u;
+	long k;
+	for (k=0; k<NumCaptured; k++){
+		digest^=CapturedFrames[k];
+		digest*=16777619u;
+	}
+	printf("Captured %ld DLP frames. Session digest: %08x\n",NumCaptured,digest);
+
+	FILE* fp=fopen(T2DLP_CAPTUREFILE,"w");
+	if (fp!=NULL){
+		for (k=0; k<NumCaptured; k++) fprintf(fp,"%ld %08x\n",k,CapturedFrames[k]);
+		fclose(fp);
+		printf("Wrote the checksum of every DLP frame to %s\n",T2DLP_CAPTUREFILE);
+	}
+
+	free(CapturedFrames);
+	CapturedFrames=NULL;
+	NumCaptured=0;
+	MaxCaptured=0;
 	return 0;
 }//takes an ID of the DMD
 
 int T2DLP_SendFrame(unsigned char *image, long alpid){
-	T2DLP_errormsg();
-	assert(0);
-	return 0;
+	if (image==NULL) return T2DLP_SAD;
+	CaptureDLPFrame(ChecksumDLPFrame(image));
+	return T2DLP_HAPPY;
 }
 
 unsigned char *SampleImages( unsigned long nSizeX, unsigned long nSizeY ){
@@ -93,7 +148,6 @@ unsigned char *SampleImages( unsigned long nSizeX, unsigned long nSizeY ){
  * Clear the DLP mirrors
  */
 int T2DLP_clear(long myDLP){
-	T2DLP_errormsg();
-	assert(0);
-	return 0;
+	CaptureDLPFrame(0);
+	return T2DLP_HAPPY;
 }
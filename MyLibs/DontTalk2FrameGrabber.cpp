@@ -30,11 +30,14 @@
 /** C includes **/
 #include <assert.h>
 #include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
 #include    <conio.h>
 
 /** BitFlow SDK includes **/
 
 
+#include "RTThreads.h"
 #include "Talk2FrameGrabber.h"
 
 /*
@@ -49,8 +52,41 @@
  *
  * So to avoid linker errors I am writing this DontTalk2FrameGrabber.cpp
  * which basically redefines all of the hardware specific functions.
+ *
+ * TurnOnFrameGrabber() returns a simulated frame grabber instead of failing.
+ * It produces a synthetic image (a bright bar sweeping across a dark field) at
+ * T2FG_SIM_FPS, either one snap at a time with AcquireFrame() or continuously into
+ * a ring of host buffers, so that the buffer lifecycle and the throughput of
+ * continuous acquisition can be benchmarked without the hardware.
+ *
+ * The region of interest can be moved with FrameGrabberMoveRegionOfInterest(),
+ * in which case only the part of the bar that falls inside it is drawn, at the
+ * same place on the sensor as before. That way the bookkeeping of region of
+ * interest offsets can be checked against where the bar must be.
  */
 
+/** Simulated camera **/
+#define T2FG_SIM_XSIZE 1024
+#define T2FG_SIM_YSIZE 768
+#define T2FG_SIM_FPS 50
+
+typedef struct SimRingStruct{
+	unsigned char* buf[T2FG_MAXBUFFERS];
+	unsigned long frameCount[T2FG_MAXBUFFERS]; // frame count of the frame held in each buffer
+	double arrival[T2FG_MAXBUFFERS]; // RT_Now() when the frame in each buffer was finished
+
+	/** Buffers that hold a frame that has not yet been lent out, oldest first **/
+	int queue[T2FG_MAXBUFFERS];
+	int head;
+	int count;
+
+	unsigned long nframes; // frames produced so far
+	RTMutex lock;
+	RTFlag arrived; // set every time a frame is queued
+	RTFlag stop; // set to tell the thread to exit
+	RTThread* thread;
+} SimRing;
+
 
 
 void T2FrameGrabber_errormsg(){
@@ -61,12 +97,66 @@ void T2FrameGrabber_errormsg(){
 }
 
 FrameGrabber* CreateFrameGrabberObject(){
+	FrameGrabber* fg;
+
+	fg= (FrameGrabber*) malloc(sizeof(FrameGrabber));
+
+	fg->pBitmap = BFNULL;
+	fg->hDspSrf = -1;
+	fg->Running = FALSE;
+	fg->hBoard=NULL;
+	fg->HostBuf=BFNULL;
+	fg->WasOneShot = FALSE;
+	fg->ContinuousData= FALSE;
+
+	fg->RingRunning=FALSE;
+	fg->NumBuffers=0;
+	for (int k=0; k<T2FG_MAXBUFFERS; k++) fg->RingLent[k]=0;
+	fg->RingFrameCount=0;
+	fg->RingFrameBase=0;
+	fg->RingFrames=0;
+	fg->RingDropped=0;
+	fg->NumLent=0;
+	fg->MaxLent=0;
+	fg->RingStart=0;
+	fg->RingClockOffset=0;
+	fg->RoiX=0;
+	fg->RoiY=0;
+	fg->SensorXsize=0;
+	fg->SensorYsize=0;
+	fg->RoiMoves=0;
+	fg->Sim=NULL;
+	return fg;
 
-	T2FrameGrabber_errormsg();
-	assert(0);
-
-	return 0;
+}
 
+/*
+ * Draw synthetic frame number n into buf: a bright bar sweeping across a dark field.
+ *
+ * The bar sweeps across the whole sensor. Only the region of interest is drawn.
+ */
+static void DrawSimulatedFrame(FrameGrabber* fg, unsigned char* buf, unsigned long n){
+	int xsize=(int) fg->xsize;
+	int ysize=(int) fg->ysize;
+	memset(buf, 20, xsize*ysize);
+
+	int barw=(int) fg->SensorXsize/8;
+	int barh=(int) fg->SensorYsize/16;
+	int x0=(int) ((n*8) % (fg->SensorXsize-barw));
+	int y0=((int) fg->SensorYsize-barh)/2;
+
+	/** Clip the bar to the region of interest **/
+	int left=x0-fg->RoiX;
+	int right=left+barw;
+	int top=y0-fg->RoiY;
+	int bottom=top+barh;
+	if (left < 0) left=0;
+	if (right > xsize) right=xsize;
+	if (top < 0) top=0;
+	if (bottom > ysize) bottom=ysize;
+	for (int y=top; y<bottom && left<right; y++){
+		memset(buf + y*xsize + left, 230, right-left);
+	}
 }
 
 /*
@@ -78,10 +168,17 @@ FrameGrabber* CreateFrameGrabberObject(){
  *
  */
 FrameGrabber* TurnOnFrameGrabber(){
-	T2FrameGrabber_errormsg();
-		assert(0);
-		return 0;
-
+	printf("No frame grabber libraries. Simulating a %dx%d camera at %d fps.\n",T2FG_SIM_XSIZE,T2FG_SIM_YSIZE,T2FG_SIM_FPS);
+	FrameGrabber* fg= CreateFrameGrabberObject();
+	fg->xsize=T2FG_SIM_XSIZE;
+	fg->ysize=T2FG_SIM_YSIZE;
+	fg->SensorXsize=fg->xsize;
+	fg->SensorYsize=fg->ysize;
+	fg->BitDepth=8;
+	fg->ImageSize=fg->xsize*fg->ysize;
+	fg->HostBuf=(PBFU8) malloc(fg->ImageSize);
+	fg->keeplooping=0; // used as the snap counter
+	return fg;
 }
 
 
@@ -129,17 +226,227 @@ int PrepareFrameGrabberForAcquire(FrameGrabber* fg){
  * The acquired frame is plopped into fg->Hostbuf
  */
 int AcquireFrame(FrameGrabber* fg){
-	T2FrameGrabber_errormsg();
-	assert(0);
-
-	return 0;
+	RT_Sleep(1000/T2FG_SIM_FPS);
+	DrawSimulatedFrame(fg, fg->HostBuf, (unsigned long) fg->keeplooping++);
+	return T2FG_SUCCESS;
 }
 
 
 int CloseFrameGrabber(FrameGrabber* fg){
+	if (fg->RingRunning) StopContinuousAcquisition(fg);
+	free(fg->HostBuf);
+	free(fg);
+	printf("Simulated frame grabber is closed.\n");
+	return 1;
+}
 
-	T2FrameGrabber_errormsg();
-	assert(0);
 
-	return 0;
+/************************************************/
+/*   Simulated continuous acquisition
+ *
+ */
+/************************************************/
+
+/*
+ * Plays the part of the board: every 1/T2FG_SIM_FPS seconds a frame is drawn
+ * into a buffer that is neither lent out nor waiting in the queue. If there is
+ * no such buffer the oldest queued frame is overwritten (dropped), just like
+ * the board does in CirErIgnore mode.
+ */
+static void SimRingThread(void* arg){
+	FrameGrabber* fg=(FrameGrabber*) arg;
+	SimRing* sim=(SimRing*) fg->Sim;
+	double next=RT_Now();
+
+	while (1){
+		/** Wait until the next frame is due, or until we are told to stop **/
+		next+=1.0/T2FG_SIM_FPS;
+		int wait=(int) (1000*(next-RT_Now()));
+		if (RT_WaitFlag(&(sim->stop), (wait > 0) ? wait : 0)) break;
+
+		/** Find a buffer to draw into **/
+		RT_LockMutex(&(sim->lock));
+		int k=-1;
+		for (int i=0; i<fg->NumBuffers && k<0; i++){
+			if (fg->RingLent[i]) continue;
+			int queued=0;
+			for (int j=0; j<sim->count; j++){
+				if (sim->queue[(sim->head+j) % T2FG_MAXBUFFERS]==i) queued=1;
+			}
+			if (!queued) k=i;
+		}
+		if (k<0 && sim->count > 0){
+			/** Overwrite the oldest frame that has not been lent out **/
+			k=sim->queue[sim->head];
+			sim->head=(sim->head+1) % T2FG_MAXBUFFERS;
+			sim->count--;
+		}
+		if (k<0) sim->nframes++; // Every buffer is lent out, so this frame is lost
+		RT_UnlockMutex(&(sim->lock));
+		if (k<0) continue;
+
+		/** Frame counts carry on across restarts of the ring, and so does the bar **/
+		DrawSimulatedFrame(fg, sim->buf[k], fg->RingFrameBase+sim->nframes);
+
+		RT_LockMutex(&(sim->lock));
+		sim->nframes++;
+		sim->frameCount[k]=sim->nframes;
+		sim->arrival[k]=RT_Now();
+		sim->queue[(sim->head+sim->count) % T2FG_MAXBUFFERS]=k;
+		sim->count++;
+		RT_UnlockMutex(&(sim->lock));
+		RT_SetFlag(&(sim->arrived));
+	}
+}
+
+/*
+ * Allocate numBuffers host buffers of the current image size and start the
+ * thread that fills them. The ring statistics are left alone.
+ */
+static int StartRing(FrameGrabber* fg, int numBuffers){
+	SimRing* sim=(SimRing*) malloc(sizeof(SimRing));
+	for (int k=0; k<numBuffers; k++){
+		sim->buf[k]=(unsigned char*) malloc(fg->ImageSize);
+		sim->frameCount[k]=0;
+		sim->arrival[k]=0;
+	}
+	sim->head=0;
+	sim->count=0;
+	sim->nframes=0;
+	RT_InitMutex(&(sim->lock));
+	RT_InitFlag(&(sim->arrived));
+	RT_InitFlag(&(sim->stop));
+
+	fg->Sim=sim;
+	fg->NumBuffers=numBuffers;
+	for (int k=0; k<T2FG_MAXBUFFERS; k++) fg->RingLent[k]=0;
+	fg->NumLent=0;
+
+	sim->thread=RT_StartThread(SimRingThread, (void*) fg);
+	if (sim->thread==NULL){
+		printf("Cannot create the simulated acquisition thread.\n");
+		return T2FG_ERROR;
+	}
+	fg->RingRunning=TRUE;
+	return T2FG_SUCCESS;
+}
+
+/*
+ * Stop the thread and free the ring. The ring statistics are left alone.
+ */
+static void StopRing(FrameGrabber* fg){
+	SimRing* sim=(SimRing*) fg->Sim;
+	RT_SetFlag(&(sim->stop));
+	RT_JoinThread(&(sim->thread));
+	fg->RingRunning=FALSE;
+
+	for (int k=0; k<fg->NumBuffers; k++) free(sim->buf[k]);
+	RT_ReleaseFlag(&(sim->arrived));
+	RT_ReleaseFlag(&(sim->stop));
+	RT_ReleaseMutex(&(sim->lock));
+	free(sim);
+	fg->Sim=NULL;
+}
+
+int StartContinuousAcquisition(FrameGrabber* fg, int numBuffers){
+	if (numBuffers > T2FG_MAXBUFFERS) numBuffers=T2FG_MAXBUFFERS;
+	if (numBuffers < 2) numBuffers=2;
+	printf("Allocating %d simulated host buffers for continuous acquisition.\n",numBuffers);
+
+	fg->RingFrameCount=0;
+	fg->RingFrameBase=0;
+	fg->RingFrames=0;
+	fg->RingDropped=0;
+	fg->MaxLent=0;
+	fg->RingStart=RT_Now();
+	return StartRing(fg, numBuffers);
+}
+
+int AcquireRingBuffer(FrameGrabber* fg, int timeout, unsigned char** buf, double* captured){
+	SimRing* sim=(SimRing*) fg->Sim;
+	double giveup=RT_Now()+timeout/1000.0;
+
+	while (1){
+		RT_LockMutex(&(sim->lock));
+		if (sim->count > 0){
+			/** Lend out the oldest frame **/
+			int k=sim->queue[sim->head];
+			sim->head=(sim->head+1) % T2FG_MAXBUFFERS;
+			sim->count--;
+			fg->RingLent[k]=1;
+			fg->NumLent++;
+			if (fg->NumLent > fg->MaxLent) fg->MaxLent=fg->NumLent;
+			unsigned long count=fg->RingFrameBase+sim->frameCount[k];
+			if (fg->RingFrames > 0 && count > fg->RingFrameCount+1) fg->RingDropped+=count - fg->RingFrameCount - 1;
+			fg->RingFrameCount=count;
+			fg->RingFrames++;
+			*captured=sim->arrival[k];
+			RT_UnlockMutex(&(sim->lock));
+			*buf=sim->buf[k];
+			return T2FG_SUCCESS;
+		}
+		/** Cleared under the lock, so a frame queued from now on sets it again **/
+		RT_ClearFlag(&(sim->arrived));
+		RT_UnlockMutex(&(sim->lock));
+
+		int wait=(int) (1000*(giveup-RT_Now()));
+		if (wait <= 0) return T2FG_TIMEOUT;
+		RT_WaitFlag(&(sim->arrived),wait);
+	}
+}
+
+int ReleaseRingBuffer(FrameGrabber* fg, unsigned char* buf){
+	SimRing* sim=(SimRing*) fg->Sim;
+	RT_LockMutex(&(sim->lock));
+	for (int k=0; k<fg->NumBuffers; k++){
+		if (fg->RingLent[k] && sim->buf[k]==buf){
+			fg->RingLent[k]=0;
+			fg->NumLent--;
+			RT_UnlockMutex(&(sim->lock));
+			return T2FG_SUCCESS;
+		}
+	}
+	RT_UnlockMutex(&(sim->lock));
+	printf("Error in ReleaseRingBuffer(): this buffer was not lent out by the ring.\n");
+	return T2FG_ERROR;
+}
+
+int StopContinuousAcquisition(FrameGrabber* fg){
+	if (!fg->RingRunning) return T2FG_SUCCESS;
+	StopRing(fg);
+
+	double elapsed=RT_Now()-fg->RingStart;
+	printf("Continuous acquisition (simulated): %ld frames in %.1f s (%.1f fps) through %d buffers, %ld dropped, at most %d lent out at once.\n",
+			fg->RingFrames,elapsed,(elapsed > 0) ? fg->RingFrames/elapsed : 0,fg->NumBuffers,fg->RingDropped,fg->MaxLent);
+	if (fg->RoiMoves > 0) printf("The region of interest was moved %ld times.\n",fg->RoiMoves);
+	return T2FG_SUCCESS;
+}
+
+int FrameGrabberMoveRegionOfInterest(FrameGrabber* fg, int xoff, int yoff, int xsize, int ysize){
+	if (xoff==fg->RoiX && yoff==fg->RoiY && xsize==(int) fg->xsize && ysize==(int) fg->ysize) return T2FG_SUCCESS;
+	if (xoff < 0 || yoff < 0 || xsize <= 0 || ysize <= 0 || xsize % 4 != 0
+			|| xoff+xsize > (int) fg->SensorXsize || yoff+ysize > (int) fg->SensorYsize){
+		printf("Error in FrameGrabberMoveRegionOfInterest(): %dx%d at (%d,%d) does not fit the %dx%d sensor.\n",
+				xsize,ysize,xoff,yoff,(int) fg->SensorXsize,(int) fg->SensorYsize);
+		return T2FG_ERROR;
+	}
+
+	/** Like the board, the ring has to start over with buffers of the new size **/
+	int ring=fg->RingRunning;
+	int numBuffers=fg->NumBuffers;
+	if (ring){
+		if (fg->NumLent > 0) return T2FG_TIMEOUT;
+		StopRing(fg);
+		fg->RingFrameBase=fg->RingFrameCount;
+	}
+
+	fg->RoiX=xoff;
+	fg->RoiY=yoff;
+	fg->xsize=(BFU32) xsize;
+	fg->ysize=(BFU32) ysize;
+	fg->ImageSize=(BFU32) (xsize*ysize);
+	fg->RoiMoves++;
+
+	if (ring) return StartRing(fg, numBuffers);
+	return T2FG_SUCCESS;
 }
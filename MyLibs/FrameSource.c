@@ -0,0 +1,1264 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * FrameSource.c
+ *
+ * The frame sources: BitFlow frame grabber, ImagingSource USB camera,
+ * video file, raw frame file and synthetic worm. See FrameSource.h
+ *
+ * A source's acquire() and release() are not reentrant. They must be called
+ * from one thread at a time (in practice, the thread that grabs frames).
+ */
+
+//Standard C headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//OpenCV Headers
+#include <highgui.h>
+#include <cv.h>
+#include <cxcore.h>
+
+//Andy's Personal Headers
+#include "RTThreads.h"
+#include "RawFrames.h"
+#include "SyntheticWorm.h"
+#include "Talk2Camera.h"
+#include "Talk2FrameGrabber.h"
+
+#include "FrameSource.h"
+
+
+/************************************************/
+/*   Buffer Pool
+ *
+ * Sources that have to copy (or draw) each frame do so into one of a
+ * small pool of buffers, which is then lent out.
+ */
+/************************************************/
+
+typedef struct FSPoolStruct{
+	int step;
+	unsigned char* buf[FS_POOLSIZE];
+	int lent[FS_POOLSIZE];
+} FSPool;
+
+static void CreatePool(FSPool* pool, int rowBytes, int height){
+	/** Rows are aligned like an IplImage's so the buffers can be lent straight to a Frame **/
+	pool->step=(rowBytes+3) & ~3;
+	for (int k=0; k<FS_POOLSIZE; k++){
+		pool->buf[k]=(unsigned char*) malloc(pool->step*height);
+		pool->lent[k]=0;
+	}
+}
+
+static void ReleasePool(FSPool* pool){
+	for (int k=0; k<FS_POOLSIZE; k++){
+		free(pool->buf[k]);
+		pool->buf[k]=NULL;
+		pool->lent[k]=0;
+	}
+}
+
+/*
+ * Returns a buffer that is not lent out, or NULL if they all are.
+ */
+static unsigned char* TakePoolBuffer(FSPool* pool){
+	for (int k=0; k<FS_POOLSIZE; k++){
+		if (!(pool->lent[k])){
+			pool->lent[k]=1;
+			return pool->buf[k];
+		}
+	}
+	printf("Error! All %d frame source buffers are lent out.\n",FS_POOLSIZE);
+	return NULL;
+}
+
+static int ReturnPoolBuffer(FSPool* pool, unsigned char* data){
+	for (int k=0; k<FS_POOLSIZE; k++){
+		if (pool->buf[k]==data){
+			pool->lent[k]=0;
+			return FS_SUCCESS;
+		}
+	}
+	printf("Error! Tried to release a buffer that does not belong to this frame source.\n");
+	return FS_ERROR;
+}
+
+/*
+ * Copy height rows of width bytes from one buffer to another.
+ */
+static void CopyRows(unsigned char* src, int srcStep, unsigned char* dst, int dstStep, int width, int height){
+	for (int y=0; y<height; y++){
+		memcpy(dst+y*dstStep, src+y*srcStep, width);
+	}
+}
+
+
+/************************************************/
+/*   Pacing
+ *
+ * Video files and the synthetic generator have no clock of their own,
+ * so a frame is made to "arrive" every interval seconds.
+ */
+/************************************************/
+
+/*
+ * Sleep until tDue, unless that is more than timeout ms away.
+ * Returns FS_SUCCESS if the frame is due or FS_TIMEOUT.
+ */
+static int WaitUntilDue(double tDue, int timeout){
+	int wait=(int) (1000*(tDue-RT_Now()));
+	if (wait<=0) return FS_SUCCESS;
+	if (timeout>=0 && wait>timeout){
+		RT_Sleep(timeout);
+		return FS_TIMEOUT;
+	}
+	RT_Sleep(wait);
+	return FS_SUCCESS;
+}
+
+/*
+ * Returns the arrival time of the frame that is due now and schedules the next one.
+ * The schedule doesn't slip if the reader has fallen behind: the frames it missed
+ * are waiting for it, like in a camera's buffer.
+ */
+static double ScheduleNextFrame(double* tDue, double interval){
+	double t=(*tDue > 0) ? *tDue : RT_Now();
+	*tDue=t+interval;
+	return t;
+}
+
+
+/************************************************/
+/*   BitFlow Frame Grabber
+ *
+ */
+/************************************************/
+
+typedef struct BitFlowStateStruct{
+	FrameGrabber* fg;
+	int numRingBuffers;
+	FSPool pool; // only used when snapping one frame at a time
+	unsigned long nsnapped;
+} BitFlowState;
+
+static int BitFlowStart(FrameSource* src){
+	BitFlowState* s=(BitFlowState*) src->state;
+	s->fg=TurnOnFrameGrabber();
+
+	printf("Checking frame size of frame grabber..\n");
+	/** Check to see that our image sizes are all the same. **/
+	if ((int) s->fg->xsize != src->width || (int) s->fg->ysize != src->height) {
+		printf("Error in BitFlowStart!\n");
+		printf("Size from framegrabber does not match the size of the frame source!\n");
+		printf(" fg->xsize=%d\n", (int) s->fg->xsize);
+		printf(" src->width=%d\n", src->width);
+		printf(" fg->ysize=%d\n", (int) s->fg->ysize);
+		printf(" src->height=%d\n", src->height);
+		CloseFrameGrabber(s->fg);
+		s->fg=NULL;
+		return FS_ERROR;
+	}
+	printf("Frame size checks out..");
+	src->bitDepth=(int) s->fg->BitDepth;
+
+	if (s->numRingBuffers > 0 && StartContinuousAcquisition(s->fg, s->numRingBuffers) != T2FG_SUCCESS) {
+		printf("Falling back to acquiring one frame at a time.\n");
+		s->numRingBuffers = 0;
+	}
+	if (s->numRingBuffers == 0) CreatePool(&(s->pool),src->width*FS_BYTESPERPIXEL(src->bitDepth),src->height);
+	/** Only the ring keeps acquiring while we are busy. A snap is always a fresh frame **/
+	src->backlog=(s->numRingBuffers > 0);
+	s->nsnapped=0;
+	return FS_SUCCESS;
+}
+
+/*
+ * The part of the sensor that the board is acquiring
+ */
+static void BitFlowROI(FrameGrabber* fg, FrameInfo* info){
+	info->roiX=fg->RoiX;
+	info->roiY=fg->RoiY;
+	info->roiWidth=(int) fg->xsize;
+	info->roiHeight=(int) fg->ysize;
+}
+
+static int BitFlowAcquire(FrameSource* src, int timeout, FrameBuffer* buf){
+	BitFlowState* s=(BitFlowState*) src->state;
+	FrameGrabber* fg=s->fg;
+
+	if (fg->RingRunning){
+		/** No copy: lend out the DMA buffer itself **/
+		int ret=AcquireRingBuffer(fg, timeout, &(buf->data), &(buf->info.timestamp));
+		if (ret==T2FG_TIMEOUT) return FS_TIMEOUT;
+		if (ret!=T2FG_SUCCESS) return FS_ERROR;
+		buf->step=(int) fg->xsize*FS_BYTESPERPIXEL(src->bitDepth);
+		buf->info.seq=fg->RingFrameCount;
+		buf->info.bitDepth=src->bitDepth;
+		BitFlowROI(fg,&(buf->info));
+		return FS_SUCCESS;
+	}
+
+	/** The board snaps every frame into the same host buffer, so the frame has to be copied out **/
+	unsigned char* dest=TakePoolBuffer(&(s->pool));
+	if (dest==NULL) return FS_ERROR;
+	if (AcquireFrame(fg)==T2FG_ERROR){
+		ReturnPoolBuffer(&(s->pool),dest);
+		return FS_ERROR;
+	}
+	/** The snap returns as soon as the frame has arrived **/
+	buf->info.timestamp=RT_Now();
+	int rowBytes=(int) fg->xsize*FS_BYTESPERPIXEL(src->bitDepth);
+	CopyRows(fg->HostBuf,rowBytes,dest,s->pool.step,rowBytes,(int) fg->ysize);
+	buf->data=dest;
+	buf->step=s->pool.step;
+	buf->info.seq=++(s->nsnapped);
+	buf->info.bitDepth=src->bitDepth;
+	BitFlowROI(fg,&(buf->info));
+	return FS_SUCCESS;
+}
+
+static int BitFlowRelease(FrameSource* src, unsigned char* data){
+	BitFlowState* s=(BitFlowState*) src->state;
+	if (s->fg->RingRunning){
+		return (ReleaseRingBuffer(s->fg, data)==T2FG_SUCCESS) ? FS_SUCCESS : FS_ERROR;
+	}
+	return ReturnPoolBuffer(&(s->pool),data);
+}
+
+static int BitFlowSetROI(FrameSource* src, int x, int y, int width, int height){
+	BitFlowState* s=(BitFlowState*) src->state;
+	FrameGrabber* fg=s->fg;
+
+	/** The board only takes widths that are a multiple of 4 **/
+	width=(width+3) & ~3;
+	if (width > (int) fg->SensorXsize) width=(int) fg->SensorXsize;
+	if (x+width > (int) fg->SensorXsize) x=(int) fg->SensorXsize-width;
+
+	int ret=FrameGrabberMoveRegionOfInterest(fg,x,y,width,height);
+	if (ret==T2FG_TIMEOUT) return FS_TIMEOUT;
+
+	/** If the ring could not be started again the board is back to snapping frames **/
+	if (s->numRingBuffers > 0 && !(fg->RingRunning)){
+		printf("Falling back to acquiring one frame at a time.\n");
+		s->numRingBuffers=0;
+		CreatePool(&(s->pool),src->width*FS_BYTESPERPIXEL(src->bitDepth),src->height);
+		src->backlog=0;
+	}
+	return (ret==T2FG_SUCCESS) ? FS_SUCCESS : FS_ERROR;
+}
+
+static int BitFlowStop(FrameSource* src){
+	BitFlowState* s=(BitFlowState*) src->state;
+	/** Stops the ring too **/
+	CloseFrameGrabber(s->fg);
+	s->fg=NULL;
+	if (s->numRingBuffers == 0) ReleasePool(&(s->pool));
+	return FS_SUCCESS;
+}
+
+static void BitFlowDestroy(FrameSource* src){
+	free(src->state);
+}
+
+/*
+ * BitFlow frame grabber.
+ *
+ * If numRingBuffers > 0 the board acquires continuously into a ring of that many
+ * DMA buffers which are lent out as is. Otherwise frames are snapped one at a time
+ * and copied out of the board's single host buffer.
+ *
+ * The region of interest is the board's. Moving it restarts the ring.
+ */
+FrameSource* CreateBitFlowSource(int width, int height, int numRingBuffers){
+	FrameSource* src=(FrameSource*) malloc(sizeof(FrameSource));
+	BitFlowState* s=(BitFlowState*) malloc(sizeof(BitFlowState));
+	s->fg=NULL;
+	s->numRingBuffers=numRingBuffers;
+	s->nsnapped=0;
+
+	src->name="BitFlow frame grabber";
+	src->width=width;
+	src->height=height;
+	src->bitDepth=8;
+	src->backlog=(numRingBuffers > 0);
+	src->start=BitFlowStart;
+	src->acquire=BitFlowAcquire;
+	src->release=BitFlowRelease;
+	src->stop=BitFlowStop;
+	src->destroy=BitFlowDestroy;
+	src->state=s;
+	src->running=0;
+	src->avoidCore=-1;
+	src->truth=NULL;
+	src->setROI=BitFlowSetROI;
+	return src;
+}
+
+
+/************************************************/
+/*   ImagingSource USB Camera
+ *
+ */
+/************************************************/
+
+typedef struct ImagingSourceStateStruct{
+	CamData* cam;
+	unsigned long lastFrameSeen; // most recently observed camera frame number
+	FSPool pool;
+} ImagingSourceState;
+
+static int ImagingSourceStart(FrameSource* src){
+	ImagingSourceState* s=(ImagingSourceState*) src->state;
+
+	/** Turn on Camera **/
+	T2Cam_InitializeLib();
+	T2Cam_AllocateCamData(&(s->cam));
+	T2Cam_ShowDeviceSelectionDialog(&(s->cam));
+	/** Start Grabbing Frames and Update the Internal Frame Number iFrameNumber **/
+	T2Cam_GrabFramesAsFastAsYouCan(&(s->cam));
+
+	s->lastFrameSeen=0;
+	CreatePool(&(s->pool),src->width,src->height);
+	return FS_SUCCESS;
+}
+
+static int ImagingSourceAcquire(FrameSource* src, int timeout, FrameBuffer* buf){
+	ImagingSourceState* s=(ImagingSourceState*) src->state;
+
+	/** Sleep until the camera callback tells us a new frame has arrived **/
+	if (!T2Cam_WaitForNewFrame(s->cam, s->lastFrameSeen, timeout)) return FS_TIMEOUT;
+
+	unsigned char* dest=TakePoolBuffer(&(s->pool));
+	if (dest==NULL) return FS_ERROR;
+
+	s->lastFrameSeen=s->cam->iFrameNumber;
+	buf->info.seq=s->lastFrameSeen;
+	buf->info.timestamp=s->cam->iArrivalTime;
+	buf->info.bitDepth=src->bitDepth;
+
+	/** The callback keeps writing into iImageData, so take a copy **/
+	CopyRows(s->cam->iImageData,src->width,dest,s->pool.step,src->width,src->height);
+	buf->data=dest;
+	buf->step=s->pool.step;
+	return FS_SUCCESS;
+}
+
+static int ImagingSourceRelease(FrameSource* src, unsigned char* data){
+	ImagingSourceState* s=(ImagingSourceState*) src->state;
+	return ReturnPoolBuffer(&(s->pool),data);
+}
+
+static int ImagingSourceStop(FrameSource* src){
+	ImagingSourceState* s=(ImagingSourceState*) src->state;
+	T2Cam_TurnOff(&(s->cam));
+	T2Cam_CloseLib();
+	ReleasePool(&(s->pool));
+	return FS_SUCCESS;
+}
+
+static void ImagingSourceDestroy(FrameSource* src){
+	free(src->state);
+}
+
+/*
+ * ImagingSource USB camera.
+ */
+FrameSource* CreateImagingSourceSource(int width, int height){
+	FrameSource* src=(FrameSource*) malloc(sizeof(FrameSource));
+	ImagingSourceState* s=(ImagingSourceState*) malloc(sizeof(ImagingSourceState));
+	s->cam=NULL;
+	s->lastFrameSeen=0;
+
+	src->name="ImagingSource USB camera";
+	src->width=width;
+	src->height=height;
+	src->bitDepth=8;
+	src->backlog=0;
+	src->start=ImagingSourceStart;
+	src->acquire=ImagingSourceAcquire;
+	src->release=ImagingSourceRelease;
+	src->stop=ImagingSourceStop;
+	src->destroy=ImagingSourceDestroy;
+	src->state=s;
+	src->running=0;
+	src->avoidCore=-1;
+	src->truth=NULL;
+	src->setROI=NULL;
+	return src;
+}
+
+
+/************************************************/
+/*   Video File
+ *
+ * A background thread decodes the video and converts each frame to grayscale
+ * into a free buffer of the pool, so decoding overlaps with the closed loop.
+ * The decoder can get up to FS_POOLSIZE frames ahead (less any that are lent out).
+ *
+ * Paced:	frame k arrives (k-1)/fps seconds after the first, as it did when it
+ * 			was recorded. If the closed loop falls behind, decoded frames wait
+ * 			in the fifo, like they would in a camera's buffer.
+ * Unpaced:	every frame is delivered as soon as it has been decoded.
+ */
+/************************************************/
+
+typedef struct VideoFileStateStruct{
+	const char* fname;
+	CvCapture* capture;
+	int paced;
+	double interval; // seconds between frames at the video's own frame rate
+	int warned;
+	FSPool pool;
+
+	/** Decoded frames waiting to be acquired, oldest first **/
+	unsigned char* fifo[FS_POOLSIZE];
+	unsigned long fifoSeq[FS_POOLSIZE];
+	int head;
+	int count;
+	int ended; // the decoder has reached the end of the video
+
+	RTMutex lock; // protects the pool and the fifo
+	RTSemaphore freeBufs; // counts the buffers the decoder may decode into
+	RTSemaphore decoded; // counts the frames in the fifo (plus one once the video has ended)
+	RTThread* decoder;
+	volatile int quit;
+
+	double tFirst; // time at which the first frame arrived (paced)
+
+	/** Decode vs. analysis time **/
+	RTStats Decode; // decoding and converting a frame
+	RTStats Analysis; // from handing a frame out to coming back for the next one
+	RTStats Starved; // the closed loop waiting on the decoder
+	double tReturned;
+} VideoFileState;
+
+/*
+ * Convert a decoded video frame to grayscale in place in a buffer.
+ */
+static void ConvertVideoFrame(FrameSource* src, VideoFileState* s, IplImage* tempImg, unsigned char* dest){
+	IplImage gray;
+	cvInitImageHeader(&gray, cvSize(src->width,src->height), IPL_DEPTH_8U, 1);
+	cvSetData(&gray, dest, s->pool.step);
+	if (tempImg->width==src->width && tempImg->height==src->height){
+		if (tempImg->nChannels==1) cvCopy(tempImg,&gray,0);
+		else cvCvtColor(tempImg,&gray,CV_RGB2GRAY);
+		return;
+	}
+
+	if (!(s->warned)){
+		printf("Warning! Video frames are %dx%d but the frame source is %dx%d. Resizing every frame.\n",
+				tempImg->width,tempImg->height,src->width,src->height);
+		s->warned=1;
+	}
+	IplImage* tempImgGray=cvCreateImage(cvGetSize(tempImg),IPL_DEPTH_8U,1);
+	if (tempImg->nChannels==1) cvCopy(tempImg,tempImgGray,0);
+	else cvCvtColor(tempImg,tempImgGray,CV_RGB2GRAY);
+	cvResize(tempImgGray,&gray,CV_INTER_LINEAR);
+	cvReleaseImage(&tempImgGray);
+}
+
+/*
+ * Decoder thread
+ */
+static void VideoDecodeThread(void* arg){
+	FrameSource* src=(FrameSource*) arg;
+	VideoFileState* s=(VideoFileState*) src->state;
+	unsigned long n=0;
+	double t0;
+	if (src->avoidCore >= 0) RT_AvoidCore(src->avoidCore);
+
+	while (1){
+		/** Wait for a buffer to decode into **/
+		RT_WaitSemaphore(&(s->freeBufs),RT_INFINITE);
+		if (s->quit) break;
+		t0=RT_Now();
+
+		RT_LockMutex(&(s->lock));
+		unsigned char* dest=TakePoolBuffer(&(s->pool));
+		RT_UnlockMutex(&(s->lock));
+
+		/** Grab the frame from the video **/
+		IplImage* tempImg=cvQueryFrame(s->capture);
+		/*
+		 * Note: tempImg belongs to the capture. for some reason things crash when you go cvReleaseImage(&tempImg)
+		 */
+		if (tempImg==NULL){
+			RT_LockMutex(&(s->lock));
+			ReturnPoolBuffer(&(s->pool),dest);
+			s->ended=1;
+			RT_UnlockMutex(&(s->lock));
+			RT_PostSemaphore(&(s->decoded),1);
+			break;
+		}
+		ConvertVideoFrame(src,s,tempImg,dest);
+		RT_AddSample(&(s->Decode),RT_Now()-t0);
+
+		RT_LockMutex(&(s->lock));
+		int k=(s->head+s->count) % FS_POOLSIZE;
+		s->fifo[k]=dest;
+		s->fifoSeq[k]=++n;
+		s->count++;
+		RT_UnlockMutex(&(s->lock));
+		RT_PostSemaphore(&(s->decoded),1);
+	}
+}
+
+/*
+ * Free what VideoFileStart() set up, once the decoder thread is gone (or never started)
+ */
+static void VideoFileRelease(VideoFileState* s){
+	cvReleaseCapture(&(s->capture));
+	RT_ReleaseSemaphore(&(s->freeBufs));
+	RT_ReleaseSemaphore(&(s->decoded));
+	RT_ReleaseMutex(&(s->lock));
+	ReleasePool(&(s->pool));
+}
+
+static int VideoFileStart(FrameSource* src){
+	VideoFileState* s=(VideoFileState*) src->state;
+	/** Define the File catpure **/
+	s->capture=cvCreateFileCapture(s->fname);
+	if (s->capture==NULL){
+		printf("Error! Could not open video file %s\n",s->fname);
+		return FS_ERROR;
+	}
+
+	double fps=cvGetCaptureProperty(s->capture,CV_CAP_PROP_FPS);
+	if (fps <= 0 || fps > 10000) {
+		printf("The video doesn't say what its frame rate is. Assuming %d fps.\n",FS_DEFAULT_FPS);
+		fps=FS_DEFAULT_FPS;
+	}
+	s->interval=1.0/fps;
+	if (s->paced) printf("Replaying video at %.1f fps.\n",fps);
+	else printf("Replaying video as fast as it can be decoded and analyzed.\n");
+
+	s->warned=0;
+	s->head=0;
+	s->count=0;
+	s->ended=0;
+	s->quit=0;
+	s->tFirst=0;
+	s->tReturned=0;
+	RT_ClearStats(&(s->Decode),"Decode");
+	RT_ClearStats(&(s->Analysis),"Analysis");
+	RT_ClearStats(&(s->Starved),"Waiting for the decoder");
+	CreatePool(&(s->pool),src->width,src->height);
+
+	RT_InitMutex(&(s->lock));
+	RT_InitSemaphore(&(s->freeBufs),FS_POOLSIZE,FS_POOLSIZE);
+	RT_InitSemaphore(&(s->decoded),0,FS_POOLSIZE+1);
+	s->decoder=RT_StartThread(VideoDecodeThread,src);
+	if (s->decoder==NULL){
+		printf("Error! Could not start the video decoder thread.\n");
+		VideoFileRelease(s);
+		return FS_ERROR;
+	}
+	return FS_SUCCESS;
+}
+
+/*
+ * Take the oldest decoded frame off of the fifo.
+ * The caller must already have taken it off of the decoded semaphore.
+ */
+static unsigned char* PopDecoded(VideoFileState* s, unsigned long* seq){
+	RT_LockMutex(&(s->lock));
+	unsigned char* data=s->fifo[s->head];
+	*seq=s->fifoSeq[s->head];
+	s->head=(s->head+1) % FS_POOLSIZE;
+	s->count--;
+	RT_UnlockMutex(&(s->lock));
+	return data;
+}
+
+/*
+ * Sequence number of the oldest decoded frame, or 0 if there is none.
+ */
+static unsigned long PeekDecoded(VideoFileState* s){
+	RT_LockMutex(&(s->lock));
+	unsigned long seq=(s->count > 0) ? s->fifoSeq[s->head] : 0;
+	RT_UnlockMutex(&(s->lock));
+	return seq;
+}
+
+static double VideoArrivalTime(VideoFileState* s, unsigned long seq){
+	return s->tFirst+(seq-1)*s->interval;
+}
+
+static int VideoFileAcquire(FrameSource* src, int timeout, FrameBuffer* buf){
+	VideoFileState* s=(VideoFileState*) src->state;
+	double tEnter=RT_Now();
+	/** A call that only checks (timeout 0) is the closed loop skipping ahead, not coming back for more **/
+	if (s->tReturned > 0 && timeout!=0){
+		RT_AddSample(&(s->Analysis),tEnter-s->tReturned);
+		s->tReturned=0;
+	}
+
+	/** Wait for the decoder **/
+	if (!RT_WaitSemaphore(&(s->decoded),timeout)) return FS_TIMEOUT;
+	unsigned long seq=PeekDecoded(s);
+	if (seq==0){
+		/** The video has ended. Leave the semaphore signaled so that every later call says so too **/
+		RT_PostSemaphore(&(s->decoded),1);
+		return FS_END;
+	}
+	if (timeout!=0) RT_AddSample(&(s->Starved),RT_Now()-tEnter);
+
+	double timestamp=RT_Now();
+	if (s->paced){
+		/** Fake like we're waiting for the camera **/
+		if (s->tFirst==0) s->tFirst=timestamp;
+		timestamp=VideoArrivalTime(s,seq);
+		if (WaitUntilDue(timestamp,timeout)!=FS_SUCCESS){
+			RT_PostSemaphore(&(s->decoded),1);
+			return FS_TIMEOUT;
+		}
+	}
+	unsigned char* data=PopDecoded(s,&seq);
+
+	buf->data=data;
+	buf->step=s->pool.step;
+	buf->info.seq=seq;
+	buf->info.timestamp=timestamp;
+	buf->info.bitDepth=src->bitDepth;
+	s->tReturned=RT_Now();
+	return FS_SUCCESS;
+}
+
+static int VideoFileRelease(FrameSource* src, unsigned char* data){
+	VideoFileState* s=(VideoFileState*) src->state;
+	RT_LockMutex(&(s->lock));
+	int ret=ReturnPoolBuffer(&(s->pool),data);
+	RT_UnlockMutex(&(s->lock));
+	/** The decoder can use it again **/
+	if (ret==FS_SUCCESS) RT_PostSemaphore(&(s->freeBufs),1);
+	return ret;
+}
+
+static int VideoFileStop(FrameSource* src){
+	VideoFileState* s=(VideoFileState*) src->state;
+	s->quit=1;
+	RT_PostSemaphore(&(s->freeBufs),1);
+	RT_JoinThread(&(s->decoder));
+
+	printf("Video replay (%s):\n",s->paced ? "paced" : "as fast as possible");
+	RT_PrintStats(&(s->Decode));
+	RT_PrintStats(&(s->Analysis));
+	RT_PrintStats(&(s->Starved));
+	if (!(s->paced) && s->Decode.n > 0 && s->Analysis.n > 0){
+		double decode=s->Decode.sum/s->Decode.n;
+		double analysis=s->Analysis.sum/s->Analysis.n;
+		printf("  Replay is %s bound.\n",(decode > analysis) ? "decode" : "analysis");
+	}
+
+	VideoFileRelease(s);
+	return FS_SUCCESS;
+}
+
+static void VideoFileDestroy(FrameSource* src){
+	free(src->state);
+}
+
+/*
+ * Video file.
+ */
+FrameSource* CreateVideoFileSource(const char* fname, int width, int height, int paced){
+	FrameSource* src=(FrameSource*) malloc(sizeof(FrameSource));
+	VideoFileState* s=(VideoFileState*) malloc(sizeof(VideoFileState));
+	s->fname=fname;
+	s->capture=NULL;
+	s->paced=paced;
+	s->interval=1.0/FS_DEFAULT_FPS;
+	s->decoder=NULL;
+
+	src->name="video file";
+	src->width=width;
+	src->height=height;
+	src->bitDepth=8;
+	src->backlog=paced;
+	src->start=VideoFileStart;
+	src->acquire=VideoFileAcquire;
+	src->release=VideoFileRelease;
+	src->stop=VideoFileStop;
+	src->destroy=VideoFileDestroy;
+	src->state=s;
+	src->running=0;
+	src->avoidCore=-1;
+	src->truth=NULL;
+	src->setROI=NULL;
+	return src;
+}
+
+
+/************************************************/
+/*   Raw Frame File
+ *
+ * Frames are lent straight out of the memory mapped file, so replay costs no copies.
+ * Every frame is delivered. Paced replay waits until each frame is due according
+ * to the time stamps that were recorded with it.
+ */
+/************************************************/
+
+typedef struct RawFileStateStruct{
+	const char* fname;
+	RawReader* reader;
+	int paced;
+	long next; // index of the next frame in the file
+	double tFirst; // when the first frame was replayed
+	double tFirstRecorded; // when the first frame was recorded
+} RawFileState;
+
+static int RawFileStart(FrameSource* src){
+	RawFileState* s=(RawFileState*) src->state;
+	s->reader=OpenRawFile(s->fname);
+	if (s->reader==NULL) return FS_ERROR;
+	if (s->reader->header.width!=src->width || s->reader->header.height!=src->height){
+		printf("Error! Frames in %s are %dx%d but the frame source is %dx%d.\n",s->fname,
+				s->reader->header.width,s->reader->header.height,src->width,src->height);
+		CloseRawFile(&(s->reader));
+		return FS_ERROR;
+	}
+	src->bitDepth=s->reader->header.bitDepth;
+	s->next=0;
+	s->tFirst=0;
+	return FS_SUCCESS;
+}
+
+static int RawFileAcquire(FrameSource* src, int timeout, FrameBuffer* buf){
+	RawFileState* s=(RawFileState*) src->state;
+	RawRecordHeader* rec;
+	unsigned char* data;
+	if (GetRawFrame(s->reader,s->next,&rec,&data)!=RAW_SUCCESS) return FS_END;
+
+	double timestamp=RT_Now();
+	if (s->paced){
+		if (s->tFirst==0){
+			s->tFirst=timestamp;
+			s->tFirstRecorded=rec->timestamp;
+		}
+		timestamp=s->tFirst+(rec->timestamp-s->tFirstRecorded);
+		if (WaitUntilDue(timestamp,timeout)!=FS_SUCCESS) return FS_TIMEOUT;
+	}
+	s->next++;
+
+	/** No copy: lend out the frame inside the mapping **/
+	buf->data=data;
+	buf->step=s->reader->header.step;
+	buf->info.seq=rec->frameNum;
+	buf->info.timestamp=timestamp;
+	buf->info.bitDepth=src->bitDepth;
+	return FS_SUCCESS;
+}
+
+static int RawFileRelease(FrameSource* src, unsigned char* data){
+	/** The mapping stays put until the source is stopped **/
+	return FS_SUCCESS;
+}
+
+static int RawFileStop(FrameSource* src){
+	RawFileState* s=(RawFileState*) src->state;
+	printf("Replayed %ld of %ld raw frames.\n",s->next,s->reader->nframes);
+	CloseRawFile(&(s->reader));
+	return FS_SUCCESS;
+}
+
+static void RawFileDestroy(FrameSource* src){
+	free(src->state);
+}
+
+/*
+ * Raw frame file.
+ */
+FrameSource* CreateRawFileSource(const char* fname, int width, int height, int paced){
+	FrameSource* src=(FrameSource*) malloc(sizeof(FrameSource));
+	RawFileState* s=(RawFileState*) malloc(sizeof(RawFileState));
+	s->fname=fname;
+	s->reader=NULL;
+	s->paced=paced;
+	s->next=0;
+	s->tFirst=0;
+	s->tFirstRecorded=0;
+
+	src->name="raw frame file";
+	src->width=width;
+	src->height=height;
+	src->bitDepth=8;
+	src->backlog=paced;
+	src->start=RawFileStart;
+	src->acquire=RawFileAcquire;
+	src->release=RawFileRelease;
+	src->stop=RawFileStop;
+	src->destroy=RawFileDestroy;
+	src->state=s;
+	src->running=0;
+	src->avoidCore=-1;
+	src->truth=NULL;
+	src->setROI=NULL;
+	return src;
+}
+
+
+/************************************************/
+/*   Synthetic Generator
+ *
+ */
+/************************************************/
+
+typedef struct SyntheticStateStruct{
+	SynthWormModel model;
+	SynthWormRenderer* renderer;
+	double interval;
+	double tDue; // time at which the next frame arrives
+	unsigned long n;
+	FSPool pool;
+
+	/** Right answer for the most recent frames, indexed by seq % (2*FS_POOLSIZE) **/
+	SynthWormTruth truth[2*FS_POOLSIZE];
+} SyntheticState;
+
+static int SyntheticStart(FrameSource* src){
+	SyntheticState* s=(SyntheticState*) src->state;
+	s->tDue=0;
+	s->n=0;
+	CreatePool(&(s->pool),src->width,src->height);
+	s->renderer=CreateSynthWormRenderer(&(s->model),src->width,src->height);
+	int k;
+	for (k=0; k<2*FS_POOLSIZE; k++) s->truth[k].seq=0;
+	return FS_SUCCESS;
+}
+
+static int SyntheticAcquire(FrameSource* src, int timeout, FrameBuffer* buf){
+	SyntheticState* s=(SyntheticState*) src->state;
+	if (s->tDue > 0 && WaitUntilDue(s->tDue,timeout)!=FS_SUCCESS) return FS_TIMEOUT;
+
+	/** Draw straight into the lent buffer **/
+	unsigned char* dest=TakePoolBuffer(&(s->pool));
+	if (dest==NULL) return FS_ERROR;
+	unsigned long seq=++(s->n);
+
+	/** Model time moves on by exactly one frame, however late we are **/
+	RenderSynthWorm(s->renderer,seq,(seq-1)*s->interval,dest,s->pool.step,&(s->truth[seq%(2*FS_POOLSIZE)]));
+
+	buf->data=dest;
+	buf->step=s->pool.step;
+	buf->info.seq=seq;
+	buf->info.timestamp=ScheduleNextFrame(&(s->tDue),s->interval);
+	buf->info.bitDepth=src->bitDepth;
+	return FS_SUCCESS;
+}
+
+static int SyntheticRelease(FrameSource* src, unsigned char* data){
+	SyntheticState* s=(SyntheticState*) src->state;
+	return ReturnPoolBuffer(&(s->pool),data);
+}
+
+static int SyntheticStop(FrameSource* src){
+	SyntheticState* s=(SyntheticState*) src->state;
+	ReleasePool(&(s->pool));
+	DestroySynthWormRenderer(&(s->renderer));
+	return FS_SUCCESS;
+}
+
+static void SyntheticDestroy(FrameSource* src){
+	free(src->state);
+}
+
+static int SyntheticTruth(FrameSource* src, unsigned long seq, SynthWormTruth* truth){
+	SyntheticState* s=(SyntheticState*) src->state;
+	SynthWormTruth* t=&(s->truth[seq%(2*FS_POOLSIZE)]);
+	if (t->seq!=seq) return FS_ERROR;
+	*truth=*t;
+	return FS_SUCCESS;
+}
+
+/*
+ * Synthetic worm.
+ */
+FrameSource* CreateSyntheticSource(int width, int height, SynthWormModel* model){
+	FrameSource* src=(FrameSource*) malloc(sizeof(FrameSource));
+	SyntheticState* s=(SyntheticState*) malloc(sizeof(SyntheticState));
+	if (model!=NULL) s->model=*model;
+	else SetDefaultSynthWormModel(&(s->model),width,height);
+	s->renderer=NULL;
+	s->interval=1.0/s->model.fps;
+	s->tDue=0;
+	s->n=0;
+
+	src->name="synthetic worm";
+	src->width=width;
+	src->height=height;
+	src->bitDepth=8;
+	src->backlog=1;
+	src->start=SyntheticStart;
+	src->acquire=SyntheticAcquire;
+	src->release=SyntheticRelease;
+	src->stop=SyntheticStop;
+	src->destroy=SyntheticDestroy;
+	src->truth=SyntheticTruth;
+	src->setROI=NULL;
+	src->state=s;
+	src->running=0;
+	src->avoidCore=-1;
+	return src;
+}
+
+
+/************************************************/
+/*   Using a source
+ *
+ */
+/************************************************/
+
+int StartFrameSource(FrameSource* src){
+	printf("Starting frame source: %s\n",src->name);
+	src->nacquired=0;
+	src->ndropped=0;
+	src->nlent=0;
+	src->maxLent=0;
+	src->lastSeq=0;
+	src->pixelsAcquired=0;
+	RT_InitMutex(&(src->roiLock));
+	src->roiRequests=0;
+	src->roiApplied=0;
+	src->roi[0]=0;
+	src->roi[1]=0;
+	src->roi[2]=src->width;
+	src->roi[3]=src->height;
+	src->roiMoves=0;
+	if (src->start(src)!=FS_SUCCESS){
+		printf("Error! Could not start frame source: %s\n",src->name);
+		RT_ReleaseMutex(&(src->roiLock));
+		return FS_ERROR;
+	}
+	src->tStart=RT_Now();
+	src->running=1;
+	return FS_SUCCESS;
+}
+
+/*
+ * Move the region of interest to the one asked for last.
+ * If the source can't move it right now (buffers lent out) it is tried again before the next frame.
+ */
+static void MoveFrameSourceROI(FrameSource* src){
+	int r[4];
+	RT_LockMutex(&(src->roiLock));
+	long request=src->roiRequests;
+	for (int k=0; k<4; k++) r[k]=src->roiAsked[k];
+	RT_UnlockMutex(&(src->roiLock));
+	if (r[0]==src->roi[0] && r[1]==src->roi[1] && r[2]==src->roi[2] && r[3]==src->roi[3]){
+		src->roiApplied=request;
+		return;
+	}
+
+	int ret=src->setROI(src,r[0],r[1],r[2],r[3]);
+	if (ret==FS_TIMEOUT) return;
+	src->roiApplied=request;
+	if (ret!=FS_SUCCESS) return;
+	for (int k=0; k<4; k++) src->roi[k]=r[k];
+	src->roiMoves++;
+}
+
+int AcquireFrameBuffer(FrameSource* src, int timeout, FrameBuffer* buf){
+	/** A source that never started (or has stopped) has no more frames to give **/
+	if (!(src->running)) return FS_END;
+	if (src->roiRequests!=src->roiApplied) MoveFrameSourceROI(src);
+
+	/** Sources without a region of interest deliver whole frames **/
+	buf->info.roiX=0;
+	buf->info.roiY=0;
+	buf->info.roiWidth=src->width;
+	buf->info.roiHeight=src->height;
+	int ret=src->acquire(src,timeout,buf);
+	if (ret!=FS_SUCCESS) return ret;
+
+	/** Any gap in the sequence numbers is a frame that never made it to us **/
+	if (src->nacquired > 0 && buf->info.seq > src->lastSeq+1) src->ndropped+=(long) (buf->info.seq-src->lastSeq-1);
+	src->lastSeq=buf->info.seq;
+	src->nacquired++;
+	src->pixelsAcquired+=(double) buf->info.roiWidth*buf->info.roiHeight;
+	src->nlent++;
+	if (src->nlent > src->maxLent) src->maxLent=src->nlent;
+	return FS_SUCCESS;
+}
+
+int ReleaseFrameBuffer(FrameSource* src, unsigned char* data){
+	if (src==NULL || data==NULL || !(src->running)) return FS_SUCCESS;
+	int ret=src->release(src,data);
+	if (ret==FS_SUCCESS) src->nlent--;
+	return ret;
+}
+
+int StopFrameSource(FrameSource* src){
+	if (!(src->running)) return FS_SUCCESS;
+	PrintFrameSourceReport(src);
+	src->running=0;
+	RT_ReleaseMutex(&(src->roiLock));
+	return src->stop(src);
+}
+
+void DestroyFrameSource(FrameSource** src){
+	if (*src==NULL) return;
+	StopFrameSource(*src);
+	(*src)->destroy(*src);
+	free(*src);
+	*src=NULL;
+}
+
+void PrintFrameSourceReport(FrameSource* src){
+	double elapsed=RT_Now()-src->tStart;
+	printf("\nFrame source: %s (%dx%d, %d bit)\n",src->name,src->width,src->height,src->bitDepth);
+	printf("\tframes acquired: %ld (%.1f fps)\n",src->nacquired, (elapsed>0) ? src->nacquired/elapsed : 0.0);
+	printf("\tframes dropped: %ld\n",src->ndropped);
+	printf("\tbuffers lent out: %d now, %d at most\n",src->nlent,src->maxLent);
+	if (src->setROI!=NULL && src->nacquired > 0){
+		printf("\tpixels acquired: %.1f%% of whole frames (region of interest moved %ld times)\n",
+				100.0*src->pixelsAcquired/((double) src->nacquired*src->width*src->height),src->roiMoves);
+	}
+}
+
+int SkipToNewestFrame(FrameSource* src, FrameBuffer* buf, FrameAccount* a){
+	if (!(src->backlog)) return 0;
+	FrameBuffer next;
+	int nskipped=0;
+	while (nskipped < FS_MAXSKIP && AcquireFrameBuffer(src,0,&next)==FS_SUCCESS){
+		ReleaseFrameBuffer(src,buf->data);
+		if (a!=NULL) AccountForSkippedFrame(a,&(buf->info));
+		*buf=next;
+		nskipped++;
+	}
+	return nskipped;
+}
+
+int SetFrameSourceROI(FrameSource* src, int x, int y, int width, int height){
+	if (src->setROI==NULL || !(src->running)) return FS_ERROR;
+
+	/** Clip to the frame **/
+	if (x < 0){
+		width+=x;
+		x=0;
+	}
+	if (y < 0){
+		height+=y;
+		y=0;
+	}
+	if (x+width > src->width) width=src->width-x;
+	if (y+height > src->height) height=src->height-y;
+	if (width <= 0 || height <= 0) return FS_ERROR;
+
+	RT_LockMutex(&(src->roiLock));
+	src->roiAsked[0]=x;
+	src->roiAsked[1]=y;
+	src->roiAsked[2]=width;
+	src->roiAsked[3]=height;
+	src->roiRequests++;
+	RT_UnlockMutex(&(src->roiLock));
+	return FS_SUCCESS;
+}
+
+int GetFrameTruth(FrameSource* src, unsigned long seq, SynthWormTruth* truth){
+	if (src==NULL || src->truth==NULL || !(src->running)) return FS_ERROR;
+	return src->truth(src,seq,truth);
+}
+
+
+/************************************************/
+/*   Frame accounting
+ *
+ */
+/************************************************/
+
+void ClearFrameAccount(FrameAccount* a){
+	a->nframes=0;
+	a->nskipped=0;
+	a->ngaps=0;
+	a->nmissing=0;
+	a->nlate=0;
+	a->nilluminated=0;
+	a->lastSeq=0;
+	a->lastCapture=0;
+	a->interval=0;
+	RT_ClearStats(&(a->Age),"Capture to illumination");
+	RT_ClearHistogram(&(a->AgeHist),"Frame age at illumination",FS_AGE_BINWIDTH,1000,"ms");
+	RT_ClearHistogram(&(a->GapHist),"Frames missing per gap",1,1,"frames");
+}
+
+/*
+ * Follow the sequence numbers from one frame that the closed loop acquired to the next.
+ */
+static void AccountForSequence(FrameAccount* a, FrameInfo* info){
+	if (a->nframes+a->nskipped > 0 && info->seq > a->lastSeq){
+		unsigned long gap=info->seq-a->lastSeq-1;
+		if (gap > 0){
+			a->ngaps++;
+			a->nmissing+=(long) gap;
+			RT_AddToHistogram(&(a->GapHist),(double) gap);
+		}
+
+		/** Time between frames at the camera, however many of them we missed **/
+		double dt=(info->timestamp-a->lastCapture)/(info->seq-a->lastSeq);
+		if (dt > 0) a->interval= (a->interval > 0) ? 0.95*a->interval+0.05*dt : dt;
+	}
+	a->lastSeq=info->seq;
+	a->lastCapture=info->timestamp;
+}
+
+void AccountForCapture(FrameAccount* a, FrameInfo* info){
+	AccountForSequence(a,info);
+	a->nframes++;
+}
+
+void AccountForSkippedFrame(FrameAccount* a, FrameInfo* info){
+	AccountForSequence(a,info);
+	a->nskipped++;
+}
+
+double AccountForIllumination(FrameAccount* a, double tCaptured, double tIlluminated){
+	double age=tIlluminated-tCaptured;
+	RT_AddSample(&(a->Age),age);
+	RT_AddToHistogram(&(a->AgeHist),age);
+	if (a->interval > 0 && age > a->interval) a->nlate++;
+	a->nilluminated++;
+	return age;
+}
+
+void PrintFrameAccount(FrameAccount* a){
+	printf("\nFrame accounting:\n");
+	long ncaptured=a->nframes+a->nskipped+a->nmissing;
+	printf("\tframes grabbed: %ld, illuminated: %ld\n",a->nframes,a->nilluminated);
+	printf("\tframes skipped: %ld (%.1f%% of the frames the camera captured, passed over for a newer frame)\n",a->nskipped,
+			(ncaptured > 0) ? 100.0*a->nskipped/ncaptured : 0.0);
+	printf("\tframes missing: %ld in %ld gaps (%.1f%% of the frames the camera captured)\n",a->nmissing,a->ngaps,
+			(ncaptured > 0) ? 100.0*a->nmissing/ncaptured : 0.0);
+	printf("\tframes late: %ld (older than the %.2f ms between frames when illuminated)\n",a->nlate,1000*a->interval);
+	RT_PrintStats(&(a->Age));
+	RT_PrintHistogram(&(a->AgeHist));
+	RT_PrintHistogram(&(a->GapHist));
+}
+
+
+/************************************************/
+/*   Region of interest that follows the worm
+ *
+ */
+/************************************************/
+
+void InitROITracker(ROITracker* t, FrameSource* src, int margin){
+	t->margin=margin;
+	t->x=0;
+	t->y=0;
+	t->width=src->width;
+	t->height=src->height;
+	t->hasLast=0;
+	t->lastX=0;
+	t->lastY=0;
+	t->vx=0;
+	t->vy=0;
+	t->nlost=0;
+	t->nframes=0;
+	t->nmoves=0;
+}
+
+int UpdateROITracker(ROITracker* t, FrameSource* src, int found, int left, int top, int right, int bottom){
+	t->nframes++;
+	if (!found){
+		/** Look everywhere once the worm has been gone for a while **/
+		t->hasLast=0;
+		if (++(t->nlost) < FS_ROI_LOST || (t->width==src->width && t->height==src->height)) return 0;
+		t->x=0;
+		t->y=0;
+		t->width=src->width;
+		t->height=src->height;
+		t->nmoves++;
+		SetFrameSourceROI(src,t->x,t->y,t->width,t->height);
+		return 1;
+	}
+	t->nlost=0;
+
+	/** Velocity of the worm, smoothed over a few frames **/
+	double cx=0.5*(left+right);
+	double cy=0.5*(top+bottom);
+	if (t->hasLast){
+		t->vx=0.5*t->vx+0.5*(cx-t->lastX);
+		t->vy=0.5*t->vy+0.5*(cy-t->lastY);
+	}
+	t->lastX=cx;
+	t->lastY=cy;
+	t->hasLast=1;
+
+	/** Stretch the bounding box to where the worm will be by the time a new window takes effect **/
+	int dx=(int) (t->vx*FS_ROI_LEAD);
+	int dy=(int) (t->vy*FS_ROI_LEAD);
+	if (dx < 0) left+=dx; else right+=dx;
+	if (dy < 0) top+=dy; else bottom+=dy;
+
+	/** Hysteresis: keep the window while the worm stays well inside it and it isn't far too big **/
+	int keep=t->margin/2;
+	int needWidth=right-left+1+2*t->margin;
+	int needHeight=bottom-top+1+2*t->margin;
+	int inside= (left-keep >= t->x || t->x==0) && (top-keep >= t->y || t->y==0)
+			&& (right+keep < t->x+t->width || t->x+t->width==src->width)
+			&& (bottom+keep < t->y+t->height || t->y+t->height==src->height);
+	int tooBig= (t->width > 2*needWidth && t->width > needWidth+2*t->margin)
+			|| (t->height > 2*needHeight && t->height > needHeight+2*t->margin);
+	if (inside && !tooBig) return 0;
+
+	/** A new window reaches twice as far ahead of the worm, so that it lasts **/
+	if (dx < 0) left+=dx; else right+=dx;
+	if (dy < 0) top+=dy; else bottom+=dy;
+	needWidth=right-left+1+2*t->margin;
+	needHeight=bottom-top+1+2*t->margin;
+
+	/** Slide it back onto the frame at the edges **/
+	int width= (needWidth < src->width) ? needWidth : src->width;
+	int height= (needHeight < src->height) ? needHeight : src->height;
+	int x=left-t->margin;
+	int y=top-t->margin;
+	if (x+width > src->width) x=src->width-width;
+	if (y+height > src->height) y=src->height-height;
+	if (x < 0) x=0;
+	if (y < 0) y=0;
+
+	t->x=x;
+	t->y=y;
+	t->width=width;
+	t->height=height;
+	t->nmoves++;
+	SetFrameSourceROI(src,x,y,width,height);
+	return 1;
+}
+
+void PrintROITracker(ROITracker* t, FrameSource* src){
+	printf("\nRegion of interest following the worm (%d pixel margin):\n",t->margin);
+	printf("\tmoved %ld times in %ld frames (%.1f%% of frames)\n",t->nmoves,t->nframes,
+			(t->nframes > 0) ? 100.0*t->nmoves/t->nframes : 0.0);
+	printf("\tnow %dx%d at (%d,%d), %.1f%% of the %dx%d frame\n",t->width,t->height,t->x,t->y,
+			100.0*t->width*t->height/((double) src->width*src->height),src->width,src->height);
+}
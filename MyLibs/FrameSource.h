@@ -0,0 +1,423 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * FrameSource.h
+ *
+ * A frame source is anything that delivers grayscale frames to the closed loop:
+ * the BitFlow frame grabber, the ImagingSource USB camera, a video file, a raw
+ * frame file (see RawFrames.h) or a synthetic generator. Every source has the same four operations
+ *
+ * 		start		- open the device (or file) and begin delivering frames
+ * 		acquire		- wait up to timeout ms for the next frame
+ * 		release		- hand a frame's buffer back to the source
+ * 		stop		- stop delivering frames and close the device
+ *
+ * Buffers are lent, not copied. acquire() returns a pointer to memory that
+ * belongs to the source and stays valid (and untouched by the source) until
+ * it is handed back with release(). A source only copies when its device would
+ * otherwise overwrite the frame (e.g. the USB camera's callback buffer).
+ * The BitFlow ring lends its DMA buffers directly.
+ *
+ * Every frame carries a sequence number, the time at which it arrived and its bit depth.
+ * Frames with more than 8 bits per pixel come in 16 bit containers (low bits, little endian).
+ *
+ * A source that knows what is in its frames (the synthetic worm) also hands out
+ * the right answer for each frame, by sequence number.
+ *
+ * A source with a region of interest (the BitFlow frame grabber) can be asked to
+ * deliver only a window of the sensor. Every frame says which window it covers,
+ * so whoever loads it can put it back in the right place and everything downstream
+ * stays in whole sensor coordinates. An ROITracker moves the window along with the worm.
+ *
+ * To add a new source, write a Create...Source() function that fills in a
+ * FrameSource with its own operations and state. Nothing else needs to change.
+ *
+ * Sources that behave like a camera keep delivering frames on their own clock, so
+ * when the closed loop is slower than the camera a backlog builds up. Whether the
+ * backlog is worked through or skipped is up to the closed loop (see SkipToNewestFrame()).
+ *
+ * A FrameAccount follows frames from the camera to the DLP: how many the closed
+ * loop never saw (gaps in the sequence numbers), how many it skipped to get to a
+ * newer frame and how old each frame was by the time it was illuminated.
+ *
+ * Depends on RTThreads.h and SyntheticWorm.h
+ */
+
+#ifndef FRAMESOURCE_H_
+#define FRAMESOURCE_H_
+
+#ifndef RTTHREADS_H_
+ #error "#include RTThreads.h" must appear in source files before "#include FrameSource.h"
+#endif
+#ifndef SYNTHETICWORM_H_
+ #error "#include SyntheticWorm.h" must appear in source files before "#include FrameSource.h"
+#endif
+
+/** Return codes **/
+#define FS_ERROR -1
+#define FS_SUCCESS 0
+#define FS_TIMEOUT 1
+#define FS_END 2 // the source has run out of frames (e.g. end of the video file) or isn't running
+
+/** Bytes in one pixel of a frame with this many bits per pixel **/
+#define FS_BYTESPERPIXEL(bitDepth) (((bitDepth) > 8) ? 2 : 1)
+
+/** Number of buffers that sources which copy can have lent out (or decoded ahead) at once **/
+#define FS_POOLSIZE 8
+
+/** Frame rate assumed for video files that don't say what theirs is **/
+#define FS_DEFAULT_FPS 10
+
+/** Most frames that SkipToNewestFrame() will skip in one go **/
+#define FS_MAXSKIP 64
+
+/** Width of the bins of the frame age histogram (seconds) **/
+#define FS_AGE_BINWIDTH 0.005
+
+/** Frames it takes a new region of interest to reach the closed loop, that the worm's motion is extrapolated over **/
+#define FS_ROI_LEAD 3
+
+/** Frames in a row without a worm after which the region of interest goes back to the whole sensor **/
+#define FS_ROI_LOST 3
+
+
+/*
+ * Information about a single frame
+ */
+typedef struct FrameInfoStruct{
+	unsigned long seq; // sequence number assigned by the source. Gaps mean frames were dropped
+	double timestamp; // time (in seconds, on the RT_Now() clock) at which the frame arrived
+	int bitDepth; // bits per pixel
+
+	/** Window of the sensor that the frame covers (the whole frame unless the source has a region of interest) **/
+	int roiX;
+	int roiY;
+	int roiWidth;
+	int roiHeight;
+} FrameInfo;
+
+
+/*
+ * A frame lent out by a source
+ */
+typedef struct FrameBufferStruct{
+	unsigned char* data; // first pixel of the first row
+	int step; // bytes from the start of one row to the start of the next
+	FrameInfo info;
+} FrameBuffer;
+
+
+typedef struct FrameSourceStruct FrameSource;
+struct FrameSourceStruct{
+	const char* name;
+
+	/** Size of the frames that this source delivers **/
+	int width;
+	int height;
+	int bitDepth;
+
+	/** Operations **/
+	int (*start)(FrameSource* src);
+	int (*acquire)(FrameSource* src, int timeout, FrameBuffer* buf);
+	int (*release)(FrameSource* src, unsigned char* data);
+	int (*stop)(FrameSource* src);
+	void (*destroy)(FrameSource* src); // free the state
+	int (*truth)(FrameSource* src, unsigned long seq, SynthWormTruth* truth); // NULL if the source doesn't know what is in its frames
+	int (*setROI)(FrameSource* src, int x, int y, int width, int height); // NULL if the source always delivers whole frames
+
+	/** Source specific state **/
+	void* state;
+
+	int running;
+
+	/** 1 if frames queue up while the closed loop is busy, so a newer one may already be waiting **/
+	int backlog;
+
+	/** Core that the source's own threads (if any) must stay off of (-1 = any core) **/
+	int avoidCore;
+
+	/** Region of interest asked for with SetFrameSourceROI(), moved to before the next acquire **/
+	RTMutex roiLock;
+	int roiAsked[4]; // x, y, width, height
+	volatile long roiRequests;
+	long roiApplied; // request that was last taken care of
+	int roi[4]; // window being delivered now
+	long roiMoves;
+
+	/** Statistics **/
+	long nacquired; // frames lent out
+	long ndropped; // frames that arrived but were never lent out (gaps in the sequence number)
+	int nlent; // buffers currently lent out
+	int maxLent;
+	unsigned long lastSeq;
+	double tStart;
+	double pixelsAcquired; // pixels in the frames lent out (less than nacquired whole frames if there is a region of interest)
+};
+
+
+/*
+ * What happened to the frames between the camera and the DLP
+ */
+typedef struct FrameAccountStruct{
+	long nframes; // frames grabbed by the closed loop
+	long nskipped; // frames that were waiting but were passed over for a newer one
+	long ngaps; // times that one or more frames were missing just before a frame
+	long nmissing; // frames the camera captured that the closed loop never saw
+	long nlate; // frames illuminated after the camera had already captured the next one
+	long nilluminated;
+
+	/** Previous frame **/
+	unsigned long lastSeq;
+	double lastCapture;
+	double interval; // running estimate of the time between frames at the camera (seconds)
+
+	RTStats Age; // capture to illumination
+	RTHistogram AgeHist;
+	RTHistogram GapHist; // frames missing per gap
+} FrameAccount;
+
+
+/*
+ * Keeps a source's region of interest on the worm.
+ *
+ * The window is the worm's bounding box, stretched in the direction that the worm
+ * is moving by twice as far as it will move in FS_ROI_LEAD frames, plus a margin on
+ * every side. It stays put (hysteresis) for as long as the worm, stretched by FS_ROI_LEAD
+ * frames of motion, stays more than half a margin from its edges and the window hasn't
+ * become more than twice as wide or tall as it needs to be.
+ */
+typedef struct ROITrackerStruct{
+	int margin; // pixels kept between the worm and the edge of the window
+	int x, y, width, height; // window that the source was last asked for
+
+	/** Motion of the center of the worm's bounding box **/
+	int hasLast;
+	double lastX;
+	double lastY;
+	double vx; // pixels per frame, smoothed
+	double vy;
+
+	int nlost; // frames in a row without a worm
+
+	/** Statistics **/
+	long nframes;
+	long nmoves;
+} ROITracker;
+
+
+/************************************************/
+/*   Sources
+ *
+ */
+/************************************************/
+
+/*
+ * BitFlow frame grabber.
+ *
+ * If numRingBuffers > 0 the board acquires continuously into a ring of that many
+ * DMA buffers which are lent out as is, and frames queue up in the ring while
+ * the closed loop is busy. Otherwise frames are snapped one at a time and copied
+ * out of the board's single host buffer, so every frame is a fresh one.
+ */
+FrameSource* CreateBitFlowSource(int width, int height, int numRingBuffers);
+
+/*
+ * ImagingSource USB camera.
+ *
+ * The camera's callback keeps writing into the same buffer, so each frame is
+ * copied once into a buffer that is then lent out. Only the newest frame is ever
+ * available: frames that arrive while the closed loop is busy are overwritten.
+ */
+FrameSource* CreateImagingSourceSource(int width, int height);
+
+/*
+ * Video file.
+ *
+ * A background thread decodes ahead and converts each frame to grayscale
+ * straight into a buffer that is then lent out.
+ *
+ * If paced is 1, frames arrive at the video's own frame rate, reproducing live
+ * timing: if the reader falls behind, frames queue up (up to FS_POOLSIZE of them)
+ * like they would in a camera's buffer. If paced is 0, every frame is delivered as fast as it can be decoded, for
+ * benchmarking throughput.
+ *
+ * When the source stops it reports the time spent decoding vs. analyzing each frame.
+ */
+FrameSource* CreateVideoFileSource(const char* fname, int width, int height, int paced);
+
+/*
+ * Raw frame file recorded with a RawWriter (see RawFrames.h).
+ *
+ * Frames are lent straight out of the memory mapped file and every one is delivered.
+ * If paced is 1, frames are replayed with the timing they were recorded with.
+ * If paced is 0, as fast as they are asked for.
+ */
+FrameSource* CreateRawFileSource(const char* fname, int width, int height, int paced);
+
+/*
+ * Synthetic worm.
+ *
+ * Needs no hardware or files. Renders a crawling worm (see SyntheticWorm.h) at
+ * model->fps frames per second, at any frame size. Time in the model advances by
+ * exactly one frame interval per frame, so the frames are the same from run to run.
+ * Frames keep arriving on schedule if the reader falls behind, so they queue up.
+ * The right answer for each frame can be had from GetFrameTruth().
+ * If model is NULL, SetDefaultSynthWormModel() is used.
+ */
+FrameSource* CreateSyntheticSource(int width, int height, SynthWormModel* model);
+
+
+/************************************************/
+/*   Using a source
+ *
+ */
+/************************************************/
+
+/*
+ * Returns FS_SUCCESS or FS_ERROR
+ */
+int StartFrameSource(FrameSource* src);
+
+/*
+ * Wait up to timeout ms for the next frame. A timeout of 0 just checks.
+ * On success buf describes the frame, which must later be handed back with ReleaseFrameBuffer().
+ *
+ * Returns FS_SUCCESS, FS_TIMEOUT, FS_END or FS_ERROR
+ */
+int AcquireFrameBuffer(FrameSource* src, int timeout, FrameBuffer* buf);
+
+/*
+ * Hand a buffer from AcquireFrameBuffer() back to the source.
+ * NULL is ignored.
+ */
+int ReleaseFrameBuffer(FrameSource* src, unsigned char* data);
+
+/*
+ * Stop the source and print its statistics.
+ * Buffers that are still lent out become invalid.
+ */
+int StopFrameSource(FrameSource* src);
+
+/*
+ * Stop the source if need be, free it and set the pointer to NULL.
+ */
+void DestroyFrameSource(FrameSource** src);
+
+/*
+ * Print frames acquired, dropped and buffers lent out.
+ */
+void PrintFrameSourceReport(FrameSource* src);
+
+/*
+ * Skip over the backlog: as long as the source already has a newer frame waiting,
+ * hand buf back and take the newer frame instead (at most FS_MAXSKIP of them).
+ * Every frame passed over is counted in a (which may be NULL).
+ *
+ * Does nothing for sources that don't queue up frames.
+ *
+ * Returns the number of frames skipped.
+ */
+int SkipToNewestFrame(FrameSource* src, FrameBuffer* buf, FrameAccount* a);
+
+/*
+ * Ask the source to deliver only the width x height window of its frames at (x,y)
+ * from now on. The window is clipped to the frame. It is moved just before the
+ * next frame is acquired, by the thread that acquires, so this may be called from any thread.
+ *
+ * Returns FS_SUCCESS, or FS_ERROR if the source has no region of interest.
+ */
+int SetFrameSourceROI(FrameSource* src, int x, int y, int width, int height);
+
+/*
+ * Get the right answer for frame seq, if the source knows it.
+ * Only recent frames (at least those still lent out) are kept.
+ *
+ * Returns FS_SUCCESS, or FS_ERROR if the source doesn't know.
+ */
+int GetFrameTruth(FrameSource* src, unsigned long seq, SynthWormTruth* truth);
+
+
+/************************************************/
+/*   Frame accounting
+ *
+ */
+/************************************************/
+
+void ClearFrameAccount(FrameAccount* a);
+
+/*
+ * Count a frame that the closed loop has just grabbed. Any gap in the
+ * sequence numbers since the previous one is counted as missing frames.
+ */
+void AccountForCapture(FrameAccount* a, FrameInfo* info);
+
+/*
+ * Count a frame that the closed loop acquired but passed over for a newer one.
+ */
+void AccountForSkippedFrame(FrameAccount* a, FrameInfo* info);
+
+/*
+ * Count a frame, captured at tCaptured, whose illumination pattern has just been
+ * sent to the DLP at tIlluminated. A frame is late if it is older than the time
+ * between frames at the camera, i.e. a newer frame was already waiting.
+ *
+ * Returns the frame's age (seconds).
+ */
+double AccountForIllumination(FrameAccount* a, double tCaptured, double tIlluminated);
+
+/*
+ * Print the counters and the histograms.
+ */
+void PrintFrameAccount(FrameAccount* a);
+
+
+/************************************************/
+/*   Region of interest that follows the worm
+ *
+ */
+/************************************************/
+
+/*
+ * Start with the whole frame of a running source.
+ */
+void InitROITracker(ROITracker* t, FrameSource* src, int margin);
+
+/*
+ * Tell the tracker where the worm was on the latest frame: its bounding box
+ * from (left,top) to (right,bottom) inclusive, in whole frame coordinates.
+ * found is 0 if the worm wasn't found. Moves the source's region of interest if need be.
+ *
+ * Returns 1 if the region of interest was moved, 0 otherwise.
+ */
+int UpdateROITracker(ROITracker* t, FrameSource* src, int found, int left, int top, int right, int bottom);
+
+void PrintROITracker(ROITracker* t, FrameSource* src);
+
+
+#endif /* FRAMESOURCE_H_ */
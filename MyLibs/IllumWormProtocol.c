@@ -703,7 +703,7 @@ void IllumRectWorm(IplImage* rectWorm,Protocol* p,int step,int FlipLR){
 CvPoint CvtPtWormSpaceToImageSpace(CvPoint WormPt, SegmentedWorm* worm, CvSize gridSize, int FlipLR){
 
 	/** Find the coordinate in imspace of the pt on centerline corresponding to this y value **/
-	CvPoint* PtOnCenterline=(CvPoint*) cvGetSeqElem(worm->Centerline,WormPt.y);
+	CvPoint* PtOnCenterline=&(worm->Centerline.pts[WormPt.y]);
 
 	/** Find the Corresponding y-value point on the boundary **/
 
@@ -722,11 +722,11 @@ CvPoint CvtPtWormSpaceToImageSpace(CvPoint WormPt, SegmentedWorm* worm, CvSize g
 	float sign = 1.0;
 	if ( WormPt.x>0 ){
 		/** We'll use the right boundary **/
-		PtOnBound=(CvPoint*) cvGetSeqElem(worm->RightBound,WormPt.y);
+		PtOnBound=&(worm->RightBound.pts[WormPt.y]);
 		//sign=1;
 	}else {
 		/** We'll use the left boundary **/
-		PtOnBound=(CvPoint*) cvGetSeqElem(worm->LeftBound,WormPt.y);
+		PtOnBound=&(worm->LeftBound.pts[WormPt.y]);
 		sign = -1.0;
 	}
 
@@ -802,8 +802,8 @@ void IllumWorm(SegmentedWorm* segworm, CvSeq* IllumMontage, IplImage* img,CvSize
 
 	if (DEBUG)	{
 		IplImage* TempImage=cvCreateImage(cvGetSize(img),IPL_DEPTH_8U,1);
-		DrawSequence(&TempImage,segworm->LeftBound);
-		DrawSequence(&TempImage, segworm->RightBound);
+		DrawSequence(&TempImage,PointBufSeq(&(segworm->LeftBound)));
+		DrawSequence(&TempImage, PointBufSeq(&(segworm->RightBound)));
 		double weighting=0.4;
 		cvAddWeighted(img,weighting,TempImage,1,0,TempImage);
 		cvShowImage("Debug",TempImage);
@@ -830,16 +830,8 @@ void IllumWorm(SegmentedWorm* segworm, CvSeq* IllumMontage, IplImage* img,CvSize
  */
 int IlluminateFromProtocol(SegmentedWorm* SegWorm,Frame* dest, Protocol* p,WormAnalysisParam* Params){
 
-	/** Check to See if the Worm->Segmented has any NULL values**/
-	if (SegWorm->Centerline==NULL || SegWorm->LeftBound==NULL || SegWorm->RightBound ==NULL ){
-		printf("Error! The Worm->Segmented had NULL children. in SimpleIlluminateWorm()\n");
-		return -1;
-	}
-
-
-
 	/** Check to See that the Segmented Values are Not Zero **/
-	if (SegWorm->Centerline->total==0 || SegWorm->LeftBound->total==0 || SegWorm->RightBound->total ==0 ){
+	if (SegWorm->Centerline.n==0 || SegWorm->LeftBound.n==0 || SegWorm->RightBound.n ==0 ){
 		printf("Error! At least one of the following: Centerline or Right and Left Boundaries in Worm->Segmented has zero points in SimpleIlluminateWorm()\n");
 		return -1;
 	}
@@ -0,0 +1,269 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * Journal.c
+ *
+ * Session journal recording and headless replay. See Journal.h
+ */
+
+//Standard C headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//OpenCV Headers
+#include <cxcore.h>
+#include <highgui.h>
+#include <cv.h>
+
+//Andy's Personal Headers
+#include "RTThreads.h"
+#include "AndysOpenCVLib.h"
+#include "WormAnalysis.h"
+#include "Journal.h"
+
+
+/************************************************/
+/*   Recording
+ *
+ */
+/************************************************/
+
+/*
+ * Write out a single record
+ */
+static int WriteJournalRecord(Journal* j, int frameNum, int type, int index, int value){
+	JournalRecord rec;
+	rec.frameNum=frameNum;
+	rec.type=(short) type;
+	rec.index=(short) index;
+	rec.value=value;
+	if (fwrite(&rec,sizeof(JournalRecord),1,j->fp)!=1) return JOURNAL_ERROR;
+	return JOURNAL_SUCCESS;
+}
+
+/*
+ * Create a journal and write out a snapshot of the parameters as they are now.
+ * Returns NULL if the file can't be created.
+ */
+Journal* CreateJournal(const char* fname, WormAnalysisParam* Params){
+	if (fname==NULL || Params==NULL) return NULL;
+
+	FILE* fp=fopen(fname,"wb");
+	if (fp==NULL){
+		printf("Error! Could not create session journal %s\n",fname);
+		return NULL;
+	}
+
+	JournalFileHeader header;
+	memset(&header,0,sizeof(JournalFileHeader));
+	strcpy(header.magic,JOURNAL_MAGIC);
+	header.version=JOURNAL_VERSION;
+	header.nparams=JOURNAL_NUMPARAMS;
+
+	Journal* j=(Journal*) malloc(sizeof(Journal));
+	j->fp=fp;
+	j->nkeys=0;
+	j->frameNum=0;
+	j->nparams=0;
+	j->nkeystrokes=0;
+	memcpy(j->last,Params,sizeof(j->last));
+	RT_InitMutex(&(j->lock));
+
+	/** Header, then the parameters at the start of the session **/
+	if (fwrite(&header,sizeof(JournalFileHeader),1,fp)!=1 ||
+			fwrite(j->last,sizeof(j->last),1,fp)!=1){
+		printf("Error! Could not write to session journal %s\n",fname);
+		fclose(fp);
+		RT_ReleaseMutex(&(j->lock));
+		free(j);
+		return NULL;
+	}
+
+	printf("Recording session journal to %s\n",fname);
+	return j;
+}
+
+/*
+ * Note that the user pressed a key. Safe to call from any thread.
+ * The key is written out with the next frame.
+ */
+void JournalKey(Journal* j, int key){
+	if (j==NULL || key<0) return;
+	RT_LockMutex(&(j->lock));
+	if (j->nkeys<JOURNAL_MAXKEYS) j->keys[j->nkeys++]=key;
+	RT_UnlockMutex(&(j->lock));
+}
+
+/*
+ * Call once per frame from the thread that grabs frames.
+ * Writes out every parameter that changed since the last frame and
+ * every key stroke since the last frame, stamped with frameNum.
+ */
+void JournalFrame(Journal* j, int frameNum, WormAnalysisParam* Params){
+	if (j==NULL || Params==NULL) return;
+	int* now=(int*) Params;
+	int k;
+	j->frameNum=frameNum;
+
+	/** Parameters that changed **/
+	for (k=0; k<JOURNAL_NUMPARAMS; k++){
+		if (now[k]==j->last[k]) continue;
+		j->last[k]=now[k];
+		WriteJournalRecord(j,frameNum,JOURNAL_PARAM,k,j->last[k]);
+		j->nparams++;
+	}
+
+	/** Key strokes since the last frame **/
+	if (j->nkeys==0) return;
+	RT_LockMutex(&(j->lock));
+	for (k=0; k<j->nkeys; k++){
+		WriteJournalRecord(j,frameNum,JOURNAL_KEY,0,j->keys[k]);
+	}
+	j->nkeystrokes+=j->nkeys;
+	j->nkeys=0;
+	RT_UnlockMutex(&(j->lock));
+}
+
+/*
+ * Flush and close the journal.
+ */
+void CloseJournal(Journal** j){
+	if (j==NULL || *j==NULL) return;
+
+	/** Key strokes after the last frame (usually the escape key that ended the session) **/
+	int k;
+	for (k=0; k<(*j)->nkeys; k++){
+		WriteJournalRecord(*j,(*j)->frameNum+1,JOURNAL_KEY,0,(*j)->keys[k]);
+	}
+	(*j)->nkeystrokes+=(*j)->nkeys;
+
+	fclose((*j)->fp);
+	printf("Session journal: %ld parameter changes and %ld key strokes.\n",(*j)->nparams,(*j)->nkeystrokes);
+	RT_ReleaseMutex(&((*j)->lock));
+	free(*j);
+	*j=NULL;
+}
+
+
+/************************************************/
+/*   Replay
+ *
+ */
+/************************************************/
+
+/*
+ * Read in a journal and load the parameters as they were at the start of the session.
+ * Returns NULL if the file can't be read or was recorded with a different WormAnalysisParam.
+ */
+JournalReplay* OpenJournal(const char* fname, WormAnalysisParam* Params){
+	if (fname==NULL || Params==NULL) return NULL;
+
+	FILE* fp=fopen(fname,"rb");
+	if (fp==NULL){
+		printf("Error! Could not open session journal %s\n",fname);
+		return NULL;
+	}
+
+	JournalFileHeader header;
+	if (fread(&header,sizeof(JournalFileHeader),1,fp)!=1 || strncmp(header.magic,JOURNAL_MAGIC,8)!=0){
+		printf("Error! %s is not a session journal.\n",fname);
+		fclose(fp);
+		return NULL;
+	}
+	if (header.version!=JOURNAL_VERSION || header.nparams!=JOURNAL_NUMPARAMS){
+		printf("Error! %s was recorded by a different version of MindControl.\n",fname);
+		fclose(fp);
+		return NULL;
+	}
+
+	JournalReplay* r=(JournalReplay*) malloc(sizeof(JournalReplay));
+	r->records=NULL;
+	r->nrecords=0;
+	r->next=0;
+	r->napplied=0;
+
+	if (fread(r->start,sizeof(r->start),1,fp)!=1){
+		printf("Error! Session journal %s is truncated.\n",fname);
+		fclose(fp);
+		free(r);
+		return NULL;
+	}
+
+	/** The records are small, so simply read them all in **/
+	fseek(fp,0,SEEK_END);
+	long size=ftell(fp)-(long) (sizeof(JournalFileHeader)+sizeof(r->start));
+	fseek(fp,(long) (sizeof(JournalFileHeader)+sizeof(r->start)),SEEK_SET);
+	long nrecords=size/(long) sizeof(JournalRecord);
+	if (nrecords>0){
+		r->records=(JournalRecord*) malloc(nrecords*sizeof(JournalRecord));
+		r->nrecords=(long) fread(r->records,sizeof(JournalRecord),nrecords,fp);
+	}
+	fclose(fp);
+
+	memcpy(Params,r->start,sizeof(r->start));
+	printf("Replaying session journal %s (%ld events)\n",fname,r->nrecords);
+	return r;
+}
+
+/*
+ * Apply every parameter change stamped with a frame up to and including frameNum.
+ * Returns JOURNAL_STOP once the recorded escape key has been reached
+ * and JOURNAL_SUCCESS otherwise.
+ */
+int ReplayJournal(JournalReplay* r, int frameNum, WormAnalysisParam* Params){
+	if (r==NULL || Params==NULL) return JOURNAL_SUCCESS;
+	int* now=(int*) Params;
+
+	while (r->next<r->nrecords && r->records[r->next].frameNum<=frameNum){
+		JournalRecord* rec=&(r->records[r->next++]);
+		if (rec->type==JOURNAL_PARAM && rec->index>=0 && rec->index<JOURNAL_NUMPARAMS){
+			now[rec->index]=rec->value;
+			r->napplied++;
+		}
+
+		/** The user stopped the session here **/
+		if (rec->type==JOURNAL_KEY && rec->value==27){
+			printf("Session journal: reached the end of the recorded session at frame %d.\n",frameNum);
+			return JOURNAL_STOP;
+		}
+	}
+	return JOURNAL_SUCCESS;
+}
+
+/*
+ * Free the replay.
+ */
+void CloseJournalReplay(JournalReplay** r){
+	if (r==NULL || *r==NULL) return;
+	printf("Session journal: replayed %ld of %ld events, %ld parameter changes.\n",(*r)->next,(*r)->nrecords,(*r)->napplied);
+	if ((*r)->records!=NULL) free((*r)->records);
+	free(*r);
+	*r=NULL;
+}
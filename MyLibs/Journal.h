@@ -0,0 +1,189 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * Journal.h
+ *
+ * A session journal records everything the user did to a running experiment so
+ * that the whole experiment can be replayed later, without a GUI and as fast as
+ * the CPU allows, from a raw frame recording (see RawFrames.h).
+ *
+ * A .journal file is a JournalFileHeader, followed by a snapshot of every
+ * parameter in WormAnalysisParam at the start of the session, followed by one
+ * JournalRecord per event. Each record is stamped with the number of the frame
+ * that was being grabbed when the event took effect:
+ *
+ * 		JOURNAL_PARAM	- a parameter changed (by a key stroke, a trackbar or the
+ * 						  closed loop itself). index is the position of the int in
+ * 						  WormAnalysisParam that changed, value is its new value.
+ * 		JOURNAL_KEY		- the user pressed a key. value is the key.
+ *
+ * WormAnalysisParam is made up entirely of ints (CvSize and CvPoint are pairs of
+ * ints), so the parameters are compared once per frame as an array of ints and
+ * only the ones that changed are written.
+ *
+ * During replay the parameter records are applied at the start of the frame they
+ * are stamped with, so the closed loop sees the same parameters on the same frames
+ * as it did during the original session. The replay stops at the recorded escape key.
+ *
+ * Anything driven by the wall clock (timed DLP flashes and head-tail sweeps) will
+ * of course not replay identically when the replay runs faster than real time.
+ *
+ * Depends on RTThreads.h and WormAnalysis.h
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#ifndef RTTHREADS_H_
+ #error "#include RTThreads.h" must appear in source files before "#include Journal.h"
+#endif
+#ifndef WORMANALYSIS_H_
+ #error "#include WormAnalysis.h" must appear in source files before "#include Journal.h"
+#endif
+
+#define JOURNAL_ERROR -1
+#define JOURNAL_SUCCESS 0
+#define JOURNAL_STOP 1 // the replay has reached the end of the recorded session
+
+#define JOURNAL_MAGIC "MCJRNL"
+#define JOURNAL_VERSION 1
+
+/** Record types **/
+#define JOURNAL_PARAM 0
+#define JOURNAL_KEY 1
+
+/** Number of ints in WormAnalysisParam **/
+#define JOURNAL_NUMPARAMS ((int) (sizeof(WormAnalysisParam) / sizeof(int)))
+
+/** Key strokes that can be waiting to be written out at any one time **/
+#define JOURNAL_MAXKEYS 64
+
+
+/*
+ * File header
+ */
+typedef struct JournalFileHeaderStruct{
+	char magic[8]; // JOURNAL_MAGIC
+	int version;
+	int nparams; // number of ints in the parameter snapshot that follows
+} JournalFileHeader;
+
+/*
+ * A single event. Exactly 12 bytes.
+ */
+typedef struct JournalRecordStruct{
+	int frameNum;
+	short type; // JOURNAL_PARAM or JOURNAL_KEY
+	short index; // which parameter (JOURNAL_PARAM only)
+	int value;
+} JournalRecord;
+
+
+/************************************************/
+/*   Recording
+ *
+ */
+/************************************************/
+
+typedef struct JournalStruct{
+	FILE* fp;
+
+	/** Parameters as they were at the last frame **/
+	int last[JOURNAL_NUMPARAMS];
+	int frameNum;
+
+	/** Key strokes from the display thread that have not yet been written out **/
+	int keys[JOURNAL_MAXKEYS];
+	int nkeys;
+	RTMutex lock;
+
+	/** Statistics **/
+	long nparams;
+	long nkeystrokes;
+} Journal;
+
+/*
+ * Create a journal and write out a snapshot of the parameters as they are now.
+ * Returns NULL if the file can't be created.
+ */
+Journal* CreateJournal(const char* fname, WormAnalysisParam* Params);
+
+/*
+ * Note that the user pressed a key. Safe to call from any thread.
+ * The key is written out with the next frame.
+ */
+void JournalKey(Journal* j, int key);
+
+/*
+ * Call once per frame from the thread that grabs frames.
+ * Writes out every parameter that changed since the last frame and
+ * every key stroke since the last frame, stamped with frameNum.
+ */
+void JournalFrame(Journal* j, int frameNum, WormAnalysisParam* Params);
+
+/*
+ * Flush and close the journal.
+ */
+void CloseJournal(Journal** j);
+
+
+/************************************************/
+/*   Replay
+ *
+ */
+/************************************************/
+
+typedef struct JournalReplayStruct{
+	int start[JOURNAL_NUMPARAMS]; // parameters at the start of the session
+	JournalRecord* records;
+	long nrecords;
+	long next; // next record to apply
+	long napplied;
+} JournalReplay;
+
+/*
+ * Read in a journal and load the parameters as they were at the start of the session.
+ * Returns NULL if the file can't be read or was recorded with a different WormAnalysisParam.
+ */
+JournalReplay* OpenJournal(const char* fname, WormAnalysisParam* Params);
+
+/*
+ * Apply every parameter change stamped with a frame up to and including frameNum.
+ * Returns JOURNAL_STOP once the recorded escape key has been reached
+ * and JOURNAL_SUCCESS otherwise.
+ */
+int ReplayJournal(JournalReplay* r, int frameNum, WormAnalysisParam* Params);
+
+/*
+ * Free the replay.
+ */
+void CloseJournalReplay(JournalReplay** r);
+
+
+#endif /* JOURNAL_H_ */
@@ -0,0 +1,613 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * Pipeline.c
+ *
+ * Runs the closed loop as four overlapping stages on separate threads.
+ * See Pipeline.h for an overview.
+ */
+
+//Standard C headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+//OpenCV Headers
+#include <highgui.h>
+#include <cv.h>
+#include <cxcore.h>
+
+//Timer Lib
+#include "../3rdPartyLibs/tictoc.h"
+
+//Andy's Personal Headers
+#include "AndysOpenCVLib.h"
+#include "RTThreads.h"
+#include "TaskGraph.h"
+#include "SyntheticWorm.h"
+#include "FrameSource.h"
+#include "RawFrames.h"
+#include "Talk2Camera.h"
+#include "Talk2FrameGrabber.h"
+#include "Talk2DLP.h"
+#include "Talk2Stage.h"
+#include "AndysComputations.h"
+#include "WormAnalysis.h"
+#include "IllumWormProtocol.h"
+#include "TransformLib.h"
+#include "WriteOutWorm.h"
+#include "Journal.h"
+#include "experiment.h"
+
+#include "Pipeline.h"
+
+
+/** How long the acquire stage waits for a free slot before checking if the user wants to stop (ms) **/
+#define PIPE_POLL_MS 100
+
+/** Returned by PopPipeQueue() when nothing arrived in time **/
+#define PIPE_TIMEOUT -2
+
+
+/************************************************/
+/*   Queues
+ *
+ */
+/************************************************/
+
+static void InitializePipeQueue(PipeQueue* q){
+	q->head=0;
+	q->count=0;
+	RT_InitMutex(&(q->lock));
+	RT_InitSemaphore(&(q->filled),0,PIPE_NUMSLOTS+1);
+	q->depthSum=0;
+	q->pops=0;
+	q->maxDepth=0;
+}
+
+static void ReleasePipeQueue(PipeQueue* q){
+	RT_ReleaseMutex(&(q->lock));
+	RT_ReleaseSemaphore(&(q->filled));
+}
+
+/*
+ * Add a slot index (or PIPE_STOP) to the back of the queue
+ */
+static void PushPipeQueue(PipeQueue* q, int item){
+	RT_LockMutex(&(q->lock));
+	q->items[(q->head + q->count) % (PIPE_NUMSLOTS+1)]=item;
+	q->count++;
+	RT_UnlockMutex(&(q->lock));
+	RT_PostSemaphore(&(q->filled),1);
+}
+
+/*
+ * Take the slot index at the front of the queue.
+ * Waits up to timeout ms (or RT_INFINITE) for something to arrive.
+ *
+ * Returns the slot index, PIPE_STOP or PIPE_TIMEOUT
+ */
+static int PopPipeQueue(PipeQueue* q, int timeout){
+	if (!RT_WaitSemaphore(&(q->filled),timeout)) return PIPE_TIMEOUT;
+
+	RT_LockMutex(&(q->lock));
+	/** Keep track of how many frames were backed up in front of this stage **/
+	q->depthSum+=q->count;
+	q->pops++;
+	if (q->count > q->maxDepth) q->maxDepth=q->count;
+
+	int item=q->items[q->head];
+	q->head=(q->head+1) % (PIPE_NUMSLOTS+1);
+	q->count--;
+	RT_UnlockMutex(&(q->lock));
+	return item;
+}
+
+
+/************************************************/
+/*   Statistics
+ *
+ */
+/************************************************/
+
+static void AddStageTime(PipeStageStats* stats, double t){
+	stats->nframes++;
+	stats->busy+=t;
+	if (t > stats->maxBusy) stats->maxBusy=t;
+}
+
+static void ClearPipeLatency(PipeLatency* lat){
+	lat->n=0;
+	lat->sum=0;
+	lat->min=0;
+	lat->max=0;
+}
+
+static void AddPipeLatency(PipeLatency* lat, double t){
+	if (lat->n==0 || t < lat->min) lat->min=t;
+	if (t > lat->max) lat->max=t;
+	lat->sum+=t;
+	lat->n++;
+}
+
+static void PrintPipeLatency(const char* name, PipeLatency* lat){
+	if (lat->n==0){
+		printf("  %s: no frames\n",name);
+		return;
+	}
+	printf("  %s: mean %.2f ms, min %.2f ms, max %.2f ms (%ld frames)\n",name,
+			1000*lat->sum/lat->n,1000*lat->min,1000*lat->max,lat->n);
+}
+
+
+/*
+ * Print per-stage occupancy, queue depths and end-to-end latency.
+ */
+void PrintPipelineReport(Pipeline* P){
+	double wall=P->tStop - P->tStart;
+	if (wall <= 0) wall=1;
+
+	printf("\nPipeline report (%d frames in flight, %.1f s):\n",PIPE_NUMSLOTS,wall);
+	printf("  %-12s %8s %10s %10s %10s %12s\n","stage","frames","mean(ms)","max(ms)","occupancy","mean queue");
+	for (int k=0; k<PIPE_NUMSTAGES; k++){
+		PipeStageStats* s=&(P->stats[k]);
+		PipeQueue* q=&(P->queue[k]);
+		printf("  %-12s %8ld %10.2f %10.2f %9.1f%% %12.2f\n",s->name,s->nframes,
+				(s->nframes > 0) ? 1000*s->busy/s->nframes : 0,
+				1000*s->maxBusy,
+				100*s->busy/wall,
+				(q->pops > 0) ? (double) q->depthSum/q->pops : 0);
+	}
+	printf("  Throughput: %.1f fps\n",P->stats[PIPE_OUTPUT].nframes/wall);
+	PrintPipeLatency("Latency acquisition to DLP",&(P->LatencyToDLP));
+	PrintPipeLatency("Latency acquisition to end of output",&(P->LatencyToDone));
+	printf("\n");
+}
+
+
+/************************************************/
+/*   Creating and Destroying
+ *
+ */
+/************************************************/
+
+/*
+ * Allocate a pipeline with PIPE_NUMSLOTS frames in flight for the master experiment.
+ * The master experiment must already be initialized and the video input rolling.
+ */
+Pipeline* CreatePipeline(Experiment* exp){
+	Pipeline* P=(Pipeline*) malloc(sizeof(Pipeline));
+	P->exp=exp;
+	CvSize size=exp->fromCCD->size;
+
+	/** Every slot starts out as a copy of the master with its own per-frame objects **/
+	for (int i=0; i<PIPE_NUMSLOTS; i++){
+		PipeSlot* slot=&(P->slots[i]);
+		slot->view=*exp;
+		slot->view.e=0;
+
+		slot->view.fromCCD=CreateFrame(size);
+		slot->view.forDLP=CreateFrame(size);
+		slot->view.IlluminationFrame=CreateFrame(size);
+
+		slot->view.Worm=CreateWormAnalysisDataStruct();
+		InitializeEmptyWormImages(slot->view.Worm,size);
+		SetWormBinning(slot->view.Worm,exp->Worm->Bin);
+		slot->view.Worm->RunLength=exp->Worm->RunLength;
+		slot->view.Worm->Refine=exp->Worm->Refine;
+		slot->view.Worm->Smoother.IIRSigma=exp->Worm->Smoother.IIRSigma;
+		ShareWormSearch(slot->view.Worm,exp->Worm);
+		slot->view.segWormDLP=CreateSegmentedWormStruct();
+
+		slot->analyze=0;
+		slot->tAcquired=0;
+		slot->tSentToDLP=0;
+		slot->tDone=0;
+	}
+
+	/** Queues **/
+	for (int k=0; k<PIPE_NUMSTAGES; k++){
+		InitializePipeQueue(&(P->queue[k]));
+	}
+	/** All of the slots start out free **/
+	for (int i=0; i<PIPE_NUMSLOTS; i++){
+		PushPipeQueue(&(P->queue[PIPE_ACQUIRE]),i);
+	}
+
+	/** The acquire stage keeps its own copy so that the frame it has waited for persists **/
+	P->acq=*exp;
+	P->nframes=exp->Worm->frameNum;
+
+	P->DispImg=exp->CurrentSelectedImg;
+	P->UserWantsToStop=NULL;
+	P->ret=EXP_SUCCESS;
+
+	/** Statistics **/
+	const char* names[PIPE_NUMSTAGES]={"Acquire","Segment","Illuminate","Output"};
+	for (int k=0; k<PIPE_NUMSTAGES; k++){
+		P->stats[k].name=names[k];
+		P->stats[k].nframes=0;
+		P->stats[k].busy=0;
+		P->stats[k].maxBusy=0;
+	}
+	ClearPipeLatency(&(P->LatencyToDLP));
+	ClearPipeLatency(&(P->LatencyToDone));
+	P->tStart=0;
+	P->tStop=0;
+
+	return P;
+}
+
+
+/*
+ * Release a slot's worm object.
+ *
+ * Note: SegmentWorm() points Segmented->Head, Tail and centerOfWorm into
+ * the worm's point buffers, so those can't be free()'d here.
+ */
+static void ReleasePipeWorm(WormAnalysisData* Worm){
+	if (Worm->ImgOrig !=NULL) cvReleaseImage(&(Worm->ImgOrig));
+	if (Worm->ImgThresh !=NULL) cvReleaseImage(&(Worm->ImgThresh));
+	if (Worm->ImgSmooth !=NULL) cvReleaseImage(&(Worm->ImgSmooth));
+	if (Worm->ImgMask !=NULL) cvReleaseImage(&(Worm->ImgMask));
+	if (Worm->ImgBinned !=NULL) cvReleaseImage(&(Worm->ImgBinned));
+	ReleaseSmoothBuffer(&(Worm->SmoothBuf));
+	ReleaseRunMask(&(Worm->Runs));
+	if (Worm->TracePts !=NULL) free(Worm->TracePts);
+	if (Worm->RefineMem !=NULL) free(Worm->RefineMem);
+	if (Worm->CurveMem !=NULL) cvFree(&(Worm->CurveMem));
+	ReleasePtSmoother(&(Worm->Smoother));
+	ReleasePointBuf(&(Worm->Boundary));
+	ReleasePointBuf(&(Worm->Centerline));
+	ReleasePointBuf(&(Worm->BoundA));
+	ReleasePointBuf(&(Worm->BoundB));
+	ReleasePointBuf(&(Worm->Resampled));
+	ReleasePointBuf(&(Worm->SmoothCenterline));
+	ReleasePointBuf(&(Worm->Segmented->Centerline));
+	ReleasePointBuf(&(Worm->Segmented->LeftBound));
+	ReleasePointBuf(&(Worm->Segmented->RightBound));
+	cvReleaseMemStorage(&(Worm->Segmented->MemSegStorage));
+	cvReleaseMemStorage(&(Worm->MemScratchStorage));
+	cvReleaseMemStorage(&(Worm->MemStorage));
+	free(Worm->Segmented);
+	free(Worm);
+}
+
+/*
+ * Free up all of the memory associated with the pipeline's slots.
+ * Nothing in the master experiment is released.
+ */
+void DestroyPipeline(Pipeline** P){
+	FrameSource* src=(*P)->exp->src;
+
+	/** Hand any buffers that are still lent out back to the frame source **/
+	if ((*P)->acq.HasPendingFrame) ReleaseFrameBuffer(src,(*P)->acq.PendingFrame.data);
+
+	for (int i=0; i<PIPE_NUMSLOTS; i++){
+		Experiment* view=&((*P)->slots[i].view);
+		ReleaseFrameBuffer(src,ReclaimFrameBuffer(view->fromCCD));
+		DestroyFrame(&(view->fromCCD));
+		DestroyFrame(&(view->forDLP));
+		DestroyFrame(&(view->IlluminationFrame));
+		DestroySegmentedWormStruct(view->segWormDLP);
+		ReleasePipeWorm(view->Worm);
+	}
+	for (int k=0; k<PIPE_NUMSTAGES; k++){
+		ReleasePipeQueue(&((*P)->queue[k]));
+	}
+	free(*P);
+	*P=NULL;
+}
+
+
+/************************************************/
+/*   Stages
+ *
+ */
+/************************************************/
+
+/*
+ * Acquire stage.
+ *
+ * Takes a free slot, waits for a frame, grabs it and loads it into the slot's worm.
+ * The transient illumination timing and sweep are advanced here on the master
+ * because they depend on the wall clock, not on the frame.
+ */
+static void PipeAcquireThread(void* arg){
+	Pipeline* P=(Pipeline*) arg;
+	Experiment* exp=P->exp;
+	Experiment* acq=&(P->acq);
+	int i=PIPE_TIMEOUT;
+	int ret;
+	double t0;
+
+	SetupAuxiliaryThread(exp);
+
+	while (!RT_IsFlagSet(P->UserWantsToStop)){
+		/** Wait for a free slot **/
+		if (i<0) i=PopPipeQueue(&(P->queue[PIPE_ACQUIRE]),PIPE_POLL_MS);
+		if (i<0) continue;
+		PipeSlot* slot=&(P->slots[i]);
+
+		if (!WaitForFrame(acq,PIPE_POLL_MS)) continue;
+		t0=RT_Now();
+
+		/** Grab the frame straight into the slot **/
+		acq->fromCCD=slot->view.fromCCD;
+		acq->Worm=slot->view.Worm;
+		acq->Worm->frameNum=P->nframes;
+		slot->view.e=0;
+
+		TICTOC::timer().tic("GrabFrame()");
+		ret=GrabFrame(acq);
+		TICTOC::timer().toc("GrabFrame()");
+
+		if (ret==EXP_VIDEO_RAN_OUT){
+			printf("Video ran out!\n");
+			P->ret=EXP_VIDEO_RAN_OUT;
+			break;
+		}
+		if (ret==EXP_ERROR){
+			/** Loop again to try to get another frame **/
+			printf("Trying again to grab a frame...\n");
+			continue;
+		}
+		P->nframes=acq->Worm->frameNum;
+		slot->view.FrameMeta=acq->FrameMeta;
+		slot->tAcquired=RT_Now();
+
+		/** Do we even bother doing analysis?**/
+		slot->analyze=exp->Params->OnOff;
+		if (slot->analyze){
+			/** Handle Transient Illumination Timing **/
+			HandleIlluminationTiming(exp);
+
+			/** Handle head-tail illumination sweep **/
+			HandleIlluminationSweep(exp);
+
+			/** The stage velocity is set by the display thread on the master **/
+			slot->view.Worm->stageVelocity=exp->Worm->stageVelocity;
+
+			/** Load Image into Our Worm Objects **/
+			if (slot->view.e == 0) slot->view.e=RefreshWormMemStorage(slot->view.Worm);
+			if (slot->view.e == 0) slot->view.e=LoadWormImg(slot->view.Worm,slot->view.fromCCD->iplimg);
+		}
+
+		AddStageTime(&(P->stats[PIPE_ACQUIRE]),RT_Now()-t0);
+		PushPipeQueue(&(P->queue[PIPE_SEGMENT]),i);
+		i=PIPE_TIMEOUT;
+	}
+
+	/** Tell the downstream stages to finish up **/
+	PushPipeQueue(&(P->queue[PIPE_SEGMENT]),PIPE_STOP);
+}
+
+
+/*
+ * Segment stage.
+ *
+ * Segments the worm and transforms the segmented worm into DLP space.
+ * Frames are segmented in order, so the head/tail tracker (used for temporal
+ * analysis) is shared by all slots.
+ */
+static void PipeSegmentThread(void* arg){
+	Pipeline* P=(Pipeline*) arg;
+	int i;
+	double t0;
+
+	SetupClosedLoopThread(P->exp);
+
+	while ((i=PopPipeQueue(&(P->queue[PIPE_SEGMENT]),RT_INFINITE))!=PIPE_STOP){
+		if (i<0) continue;
+		PipeSlot* slot=&(P->slots[i]);
+		Experiment* exp=&(slot->view);
+		t0=RT_Now();
+
+		if (slot->analyze){
+			TICTOC::timer().tic("EntireSegmentation");
+			/** Do Segmentation **/
+			DoSegmentation(exp);
+			TICTOC::timer().toc("EntireSegmentation");
+
+			TICTOC::timer().tic("TransformSegWormCam2DLP");
+			if (exp->e == 0){
+				TransformSegWormCam2DLP(exp->Worm->Segmented, exp->segWormDLP,exp->Calib);
+			}
+			TICTOC::timer().toc("TransformSegWormCam2DLP");
+		}
+
+		AddStageTime(&(P->stats[PIPE_SEGMENT]),RT_Now()-t0);
+		PushPipeQueue(&(P->queue[PIPE_ILLUMINATE]),i);
+	}
+
+	PushPipeQueue(&(P->queue[PIPE_ILLUMINATE]),PIPE_STOP);
+}
+
+
+/*
+ * Illuminate stage.
+ *
+ * Generates the illumination pattern and sends it to the DLP.
+ * This is the only stage that talks to the DLP.
+ */
+static void PipeIlluminateThread(void* arg){
+	Pipeline* P=(Pipeline*) arg;
+	int i;
+	double t0;
+
+	SetupClosedLoopThread(P->exp);
+
+	while ((i=PopPipeQueue(&(P->queue[PIPE_ILLUMINATE]),RT_INFINITE))!=PIPE_STOP){
+		if (i<0) continue;
+		PipeSlot* slot=&(P->slots[i]);
+		Experiment* exp=&(slot->view);
+		t0=RT_Now();
+
+		if (slot->analyze){
+			/** If the DLP is not displaying right now, than turn off the mirrors */
+			ClearDLPifNotDisplayingNow(exp);
+
+			/*** Do Some Illumination ***/
+			if (exp->e == 0) DoIllumination(exp);
+
+			TICTOC::timer().tic("SendFrameToDLP");
+			if (exp->e == 0) exp->e=SendFrameToDLP(exp); // Send image to DLP
+			TICTOC::timer().toc("SendFrameToDLP");
+			slot->tSentToDLP=RT_Now();
+		}
+
+		AddStageTime(&(P->stats[PIPE_ILLUMINATE]),RT_Now()-t0);
+		PushPipeQueue(&(P->queue[PIPE_OUTPUT]),i);
+	}
+
+	PushPipeQueue(&(P->queue[PIPE_OUTPUT]),PIPE_STOP);
+}
+
+
+/*
+ * Output stage.
+ *
+ * Builds the heads up display, prepares the selected display, writes to disk,
+ * publishes the most recent frame to the master (for the display thread and the
+ * stage tracker) and returns the slot to the acquire stage.
+ *
+ * Runs on the calling thread until the stop marker arrives.
+ */
+static void PipeOutputStage(Pipeline* P){
+	Experiment* master=P->exp;
+	int i;
+	double t0;
+
+	while ((i=PopPipeQueue(&(P->queue[PIPE_OUTPUT]),RT_INFINITE))!=PIPE_STOP){
+		if (i<0) continue;
+		PipeSlot* slot=&(P->slots[i]);
+		Experiment* exp=&(slot->view);
+		t0=RT_Now();
+
+		if (slot->analyze){
+			/*** DIsplay Some Monitoring Output ***/
+			if (exp->e == 0) CreateWormHUDS(exp->HUDS,exp->Worm,exp->Params,exp->IlluminationFrame);
+
+			if (exp->e == 0 &&  EverySoOften(exp->Worm->frameNum,exp->Params->DispRate) ){
+				TICTOC::timer().tic("DisplayOnScreen");
+				/** The selected image belongs to this slot, so copy it to where the display thread looks **/
+				exp->CurrentSelectedImg=P->DispImg;
+				PrepareSelectedDisplay(exp);
+				if (exp->CurrentSelectedImg != P->DispImg){
+					/** The thresholded image is smaller when the worm is binned **/
+					if (exp->CurrentSelectedImg->width == P->DispImg->width) cvCopy(exp->CurrentSelectedImg,P->DispImg);
+					else cvResize(exp->CurrentSelectedImg,P->DispImg,CV_INTER_NN);
+				}
+				TICTOC::timer().toc("DisplayOnScreen");
+			}
+
+			if (exp->e == 0) {
+				TICTOC::timer().tic("DoWriteToDisk()");
+				exp->e=DoWriteToDisk(exp);
+				TICTOC::timer().toc("DoWriteToDisk()");
+			}
+
+			if (exp->e != 0) {
+				printf("\nError in main loop. :(\n");
+				if (master->stageIsPresent) {
+					printf("\tAuto-safety STAGE SHUTOFF!\n");
+					ShutOffStage(master);
+				}
+			}
+
+			if (exp->e == 0) *(master->Worm->Segmented->centerOfWorm)=*(exp->Worm->Segmented->centerOfWorm);
+		} else {
+			/** When the analysis is off the display thread shows the raw frame **/
+			cvCopy(exp->fromCCD->iplimg,master->fromCCD->iplimg);
+		}
+
+		/** Publish the most recent frame to the master **/
+		master->Worm->frameNum=exp->Worm->frameNum;
+		master->Worm->timestamp=exp->Worm->timestamp;
+
+		/** Calculate the frame rate and every second print the result **/
+		CalculateAndPrintFrameRate(master);
+
+		slot->tDone=RT_Now();
+		if (slot->analyze){
+			AddPipeLatency(&(P->LatencyToDLP),slot->tSentToDLP - slot->tAcquired);
+			AddPipeLatency(&(P->LatencyToDone),slot->tDone - slot->tAcquired);
+		}
+		AddStageTime(&(P->stats[PIPE_OUTPUT]),slot->tDone-t0);
+
+		/** Recycle the slot **/
+		PushPipeQueue(&(P->queue[PIPE_ACQUIRE]),i);
+	}
+}
+
+
+/*
+ * Run the closed loop as a pipeline until the user wants to stop
+ * or until the video runs out.
+ *
+ * Returns EXP_SUCCESS, EXP_VIDEO_RAN_OUT or EXP_ERROR
+ */
+int RunPipeline(Experiment* exp, RTFlag* UserWantsToStop){
+	Pipeline* P=CreatePipeline(exp);
+	P->UserWantsToStop=UserWantsToStop;
+	printf("Starting pipelined closed loop with %d frames in flight.\n",PIPE_NUMSLOTS);
+
+	/** Start the stages from the back of the pipeline forward **/
+	int stage[3]={PIPE_ILLUMINATE,PIPE_SEGMENT,PIPE_ACQUIRE};
+	RTThreadFunc func[3]={PipeIlluminateThread,PipeSegmentThread,PipeAcquireThread};
+	RTThread* threads[3];
+	int nthreads=0;
+
+	P->tStart=RT_Now();
+	for (int k=0; k<3; k++){
+		threads[k] = RT_StartThread(func[k], (void*) P);
+		if (threads[k] == NULL) {
+			printf("Cannot create pipeline thread for the %s stage.\n",P->stats[stage[k]].name);
+			/** Tell the stages that are already running to finish **/
+			PushPipeQueue(&(P->queue[stage[k]+1]),PIPE_STOP);
+			P->ret=EXP_ERROR;
+			break;
+		}
+		nthreads++;
+	}
+
+	/** The output stage runs here until everything upstream has finished **/
+	PipeOutputStage(P);
+
+	for (int k=0; k<nthreads; k++){
+		RT_JoinThread(&(threads[k]));
+	}
+	P->tStop=RT_Now();
+
+	PrintPipelineReport(P);
+
+	int ret=P->ret;
+	DestroyPipeline(&P);
+	return ret;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * Pipeline.h
+ *
+ * The pipeline is an alternative to the giant sequential while loop in main.cpp.
+ *
+ * The closed loop is broken up into four stages, each of which runs on its own thread:
+ *
+ * 		Acquire		- wait for a frame, grab it and load it into a worm object
+ * 		Segment		- DoSegmentation() and TransformSegWormCam2DLP()
+ * 		Illuminate	- DoIllumination() and T2DLP_SendFrame()
+ * 		Output		- CreateWormHUDS(), PrepareSelectedDisplay() and DoWriteToDisk()
+ *
+ * Frames move from stage to stage through bounded queues. There are a fixed number
+ * of slots (frames in flight). Each slot carries its own copy of everything that
+ * changes from frame to frame (the Frame objects, the Worm object and the segmented
+ * worm in DLP space), so frame N+1 can be acquired and segmented while frame N is
+ * being illuminated and sent to the DLP.
+ *
+ * Stages receive the slot as an Experiment object that is a shallow copy of the
+ * master experiment with the per-frame members pointed at the slot. That way the
+ * existing action chunks in experiment.c can be used unmodified in either mode.
+ *
+ * At the end of the run the pipeline prints how busy each stage was (occupancy)
+ * and the end-to-end latency from acquisition to the DLP and to the end of output.
+ *
+ * Depends on experiment.h and everything that experiment.h depends on.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#ifndef EXPERIMENT_H_
+ #error "#include experiment.h" must appear in source files before "#include Pipeline.h"
+#endif
+#ifndef RTTHREADS_H_
+ #error "#include RTThreads.h" must appear in source files before "#include Pipeline.h"
+#endif
+
+/** Number of frames that can be in flight at once **/
+#define PIPE_NUMSLOTS 4
+
+/** Stages **/
+#define PIPE_ACQUIRE 0
+#define PIPE_SEGMENT 1
+#define PIPE_ILLUMINATE 2
+#define PIPE_OUTPUT 3
+#define PIPE_NUMSTAGES 4
+
+/** Marker that is passed down the queues to tell each stage to shut down **/
+#define PIPE_STOP -1
+
+
+/*
+ * A single frame in flight
+ */
+typedef struct PipeSlotStruct{
+	/** Shallow copy of the master experiment with the per-frame members pointing to this slot **/
+	Experiment view;
+
+	/** 1 if the analysis was on when this frame was acquired **/
+	int analyze;
+
+	/** Time stamps (in seconds) **/
+	double tAcquired; // GrabFrame() returned
+	double tSentToDLP; // the illumination pattern was sent to the DLP
+	double tDone; // output has finished
+} PipeSlot;
+
+
+/*
+ * Bounded queue of slot indices connecting two stages.
+ *
+ * Every slot is in exactly one queue or being worked on by exactly one stage,
+ * so a queue never holds more than PIPE_NUMSLOTS entries (plus the stop marker).
+ */
+typedef struct PipeQueueStruct{
+	int items[PIPE_NUMSLOTS+1];
+	int head;
+	int count;
+	RTMutex lock;
+	RTSemaphore filled; // counts the entries in the queue
+
+	/** Occupancy statistics **/
+	long depthSum; // sum of the depth seen by every pop
+	long pops;
+	int maxDepth;
+} PipeQueue;
+
+
+/*
+ * Timing statistics for a single stage
+ */
+typedef struct PipeStageStatsStruct{
+	const char* name;
+	long nframes;
+	double busy; // seconds spent working on frames
+	double maxBusy; // longest time spent on a single frame
+} PipeStageStats;
+
+
+/*
+ * Latency statistics
+ */
+typedef struct PipeLatencyStruct{
+	long n;
+	double sum;
+	double min;
+	double max;
+} PipeLatency;
+
+
+typedef struct PipelineStruct{
+	/** The master experiment **/
+	Experiment* exp;
+
+	/** Frames in flight **/
+	PipeSlot slots[PIPE_NUMSLOTS];
+
+	/** Queues feeding each stage. The acquire stage is fed by the free queue **/
+	PipeQueue queue[PIPE_NUMSTAGES];
+
+	/** Acquisition state that persists across frames **/
+	Experiment acq;
+	int nframes;
+
+	/** Image that the display thread shows (the master's CurrentSelectedImg) **/
+	IplImage* DispImg;
+
+	/** Set by the user (from the display thread) to stop the pipeline **/
+	RTFlag* UserWantsToStop;
+
+	/** Return value of RunPipeline() **/
+	int ret;
+
+	/** Statistics **/
+	PipeStageStats stats[PIPE_NUMSTAGES];
+	PipeLatency LatencyToDLP;
+	PipeLatency LatencyToDone;
+	double tStart;
+	double tStop;
+} Pipeline;
+
+
+/*
+ * Allocate a pipeline with PIPE_NUMSLOTS frames in flight for the master experiment.
+ * The master experiment must already be initialized and the video input rolling.
+ */
+Pipeline* CreatePipeline(Experiment* exp);
+
+/*
+ * Free up all of the memory associated with the pipeline's slots.
+ * Nothing in the master experiment is released.
+ */
+void DestroyPipeline(Pipeline** P);
+
+/*
+ * Run the closed loop as a pipeline until the user wants to stop
+ * or until the video runs out.
+ *
+ * The Output stage runs on the calling thread.
+ * The Acquire, Segment and Illuminate stages each get their own thread.
+ * The Segment and Illuminate stages are the closed loop threads (see SetupClosedLoopThread()).
+ *
+ * Returns EXP_SUCCESS, EXP_VIDEO_RAN_OUT or EXP_ERROR
+ */
+int RunPipeline(Experiment* exp, RTFlag* UserWantsToStop);
+
+/*
+ * Print per-stage occupancy, queue depths and end-to-end latency.
+ */
+void PrintPipelineReport(Pipeline* P);
+
+
+#endif /* PIPELINE_H_ */
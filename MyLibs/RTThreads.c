@@ -0,0 +1,501 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * RTThreads.c
+ *
+ * A small portable threading layer for the closed loop.
+ * See RTThreads.h for an overview.
+ */
+
+//Standard C headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+
+#include "RTThreads.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sched.h>
+#include <sys/time.h>
+#endif
+
+#ifndef WIN32
+/** Clock that the timed waits are measured on. Only Linux lets condition variables use the monotonic clock **/
+#if defined(__linux__)
+#define RT_WAITCLOCK CLOCK_MONOTONIC
+#else
+#define RT_WAITCLOCK CLOCK_REALTIME
+#endif
+
+/*
+ * Set up a condition variable whose timed waits are measured on RT_WAITCLOCK
+ */
+static void RT_InitCond(pthread_cond_t* cond){
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+#if defined(__linux__)
+	pthread_condattr_setclock(&attr,RT_WAITCLOCK);
+#endif
+	pthread_cond_init(cond,&attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/*
+ * Work out the absolute time, timeout ms from now, at which a timed wait gives up
+ */
+static void RT_Deadline(struct timespec* deadline, int timeout){
+	clock_gettime(RT_WAITCLOCK,deadline);
+	long nsec=deadline->tv_nsec + (timeout % 1000)*1000000L;
+	deadline->tv_sec+=timeout/1000 + nsec/1000000000L;
+	deadline->tv_nsec=nsec % 1000000000L;
+}
+#endif
+
+
+/************************************************/
+/*   Threads
+ *
+ */
+/************************************************/
+
+#ifdef WIN32
+static DWORD WINAPI RT_ThreadStart(LPVOID arg){
+	RTThread* t=(RTThread*) arg;
+	t->func(t->arg);
+	return 0;
+}
+#else
+static void* RT_ThreadStart(void* arg){
+	RTThread* t=(RTThread*) arg;
+	t->func(t->arg);
+	return NULL;
+}
+#endif
+
+RTThread* RT_StartThread(RTThreadFunc func, void* arg){
+	RTThread* t=(RTThread*) malloc(sizeof(RTThread));
+	t->func=func;
+	t->arg=arg;
+#ifdef WIN32
+	DWORD dwThreadId;
+	t->handle=CreateThread(NULL, 0, RT_ThreadStart, (void*) t, 0, &dwThreadId);
+	if (t->handle==NULL){
+		free(t);
+		return NULL;
+	}
+#else
+	if (pthread_create(&(t->handle), NULL, RT_ThreadStart, (void*) t)!=0){
+		free(t);
+		return NULL;
+	}
+#endif
+	return t;
+}
+
+void RT_JoinThread(RTThread** t){
+	if (*t==NULL) return;
+#ifdef WIN32
+	WaitForSingleObject((*t)->handle,INFINITE);
+	CloseHandle((*t)->handle);
+#else
+	pthread_join((*t)->handle,NULL);
+#endif
+	free(*t);
+	*t=NULL;
+}
+
+void RT_Sleep(int ms){
+	if (ms <= 0) return;
+#ifdef WIN32
+	Sleep((DWORD) ms);
+#else
+	struct timespec ts;
+	ts.tv_sec=ms/1000;
+	ts.tv_nsec=(ms % 1000)*1000000L;
+	/** Keep sleeping for whatever is left if a signal wakes us up early **/
+	while (nanosleep(&ts,&ts)!=0 && errno==EINTR);
+#endif
+}
+
+
+/************************************************/
+/*   Flags
+ *
+ */
+/************************************************/
+
+void RT_InitFlag(RTFlag* f){
+#ifdef WIN32
+	/** Manual reset event: stays set until it is cleared **/
+	f->event=CreateEvent(NULL,TRUE,FALSE,NULL);
+#else
+	pthread_mutex_init(&(f->mutex),NULL);
+	RT_InitCond(&(f->cond));
+	f->value=0;
+#endif
+}
+
+void RT_ReleaseFlag(RTFlag* f){
+#ifdef WIN32
+	CloseHandle(f->event);
+#else
+	pthread_cond_destroy(&(f->cond));
+	pthread_mutex_destroy(&(f->mutex));
+#endif
+}
+
+void RT_SetFlag(RTFlag* f){
+#ifdef WIN32
+	SetEvent(f->event);
+#else
+	pthread_mutex_lock(&(f->mutex));
+	f->value=1;
+	pthread_cond_broadcast(&(f->cond));
+	pthread_mutex_unlock(&(f->mutex));
+#endif
+}
+
+void RT_ClearFlag(RTFlag* f){
+#ifdef WIN32
+	ResetEvent(f->event);
+#else
+	pthread_mutex_lock(&(f->mutex));
+	f->value=0;
+	pthread_mutex_unlock(&(f->mutex));
+#endif
+}
+
+int RT_IsFlagSet(RTFlag* f){
+#ifdef WIN32
+	return (WaitForSingleObject(f->event,0)==WAIT_OBJECT_0);
+#else
+	pthread_mutex_lock(&(f->mutex));
+	int value=f->value;
+	pthread_mutex_unlock(&(f->mutex));
+	return value;
+#endif
+}
+
+int RT_WaitFlag(RTFlag* f, int timeout){
+#ifdef WIN32
+	DWORD ms= (timeout < 0) ? INFINITE : (DWORD) timeout;
+	return (WaitForSingleObject(f->event,ms)==WAIT_OBJECT_0);
+#else
+	struct timespec deadline;
+	if (timeout >= 0) RT_Deadline(&deadline,timeout);
+
+	pthread_mutex_lock(&(f->mutex));
+	int ret=0;
+	while (!(f->value) && ret!=ETIMEDOUT){
+		if (timeout < 0) ret=pthread_cond_wait(&(f->cond),&(f->mutex));
+		else ret=pthread_cond_timedwait(&(f->cond),&(f->mutex),&deadline);
+	}
+	int value=f->value;
+	pthread_mutex_unlock(&(f->mutex));
+	return value;
+#endif
+}
+
+
+/************************************************/
+/*   Mutexes
+ *
+ */
+/************************************************/
+
+void RT_InitMutex(RTMutex* m){
+#ifdef WIN32
+	InitializeCriticalSection(&(m->cs));
+#else
+	pthread_mutex_init(&(m->mutex),NULL);
+#endif
+}
+
+void RT_ReleaseMutex(RTMutex* m){
+#ifdef WIN32
+	DeleteCriticalSection(&(m->cs));
+#else
+	pthread_mutex_destroy(&(m->mutex));
+#endif
+}
+
+void RT_LockMutex(RTMutex* m){
+#ifdef WIN32
+	EnterCriticalSection(&(m->cs));
+#else
+	pthread_mutex_lock(&(m->mutex));
+#endif
+}
+
+void RT_UnlockMutex(RTMutex* m){
+#ifdef WIN32
+	LeaveCriticalSection(&(m->cs));
+#else
+	pthread_mutex_unlock(&(m->mutex));
+#endif
+}
+
+
+/************************************************/
+/*   Semaphores
+ *
+ */
+/************************************************/
+
+void RT_InitSemaphore(RTSemaphore* s, int count, int max){
+#ifdef WIN32
+	s->sem=CreateSemaphore(NULL,count,max,NULL);
+#else
+	pthread_mutex_init(&(s->mutex),NULL);
+	RT_InitCond(&(s->cond));
+	s->count=count;
+	s->max=max;
+#endif
+}
+
+void RT_ReleaseSemaphore(RTSemaphore* s){
+#ifdef WIN32
+	CloseHandle(s->sem);
+#else
+	pthread_cond_destroy(&(s->cond));
+	pthread_mutex_destroy(&(s->mutex));
+#endif
+}
+
+void RT_PostSemaphore(RTSemaphore* s, int n){
+	if (n <= 0) return;
+#ifdef WIN32
+	ReleaseSemaphore(s->sem,n,NULL);
+#else
+	pthread_mutex_lock(&(s->mutex));
+	/** Like Win32, never count past the maximum **/
+	if (s->count + n <= s->max) {
+		s->count+=n;
+		if (n==1) pthread_cond_signal(&(s->cond));
+		else pthread_cond_broadcast(&(s->cond));
+	}
+	pthread_mutex_unlock(&(s->mutex));
+#endif
+}
+
+int RT_WaitSemaphore(RTSemaphore* s, int timeout){
+#ifdef WIN32
+	DWORD ms= (timeout < 0) ? INFINITE : (DWORD) timeout;
+	return (WaitForSingleObject(s->sem,ms)==WAIT_OBJECT_0);
+#else
+	struct timespec deadline;
+	if (timeout > 0) RT_Deadline(&deadline,timeout);
+
+	pthread_mutex_lock(&(s->mutex));
+	int ret=0;
+	while (s->count==0 && timeout!=0 && ret!=ETIMEDOUT){
+		if (timeout < 0) ret=pthread_cond_wait(&(s->cond),&(s->mutex));
+		else ret=pthread_cond_timedwait(&(s->cond),&(s->mutex),&deadline);
+	}
+	int taken=0;
+	if (s->count > 0){
+		s->count--;
+		taken=1;
+	}
+	pthread_mutex_unlock(&(s->mutex));
+	return taken;
+#endif
+}
+
+
+/************************************************/
+/*   CPU pinning & priority
+ *
+ */
+/************************************************/
+
+int RT_NumberOfProcessors(){
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int) info.dwNumberOfProcessors;
+#else
+	return (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+int RT_PinThisThread(int core){
+	if (core < 0 || core >= RT_NumberOfProcessors()) {
+		printf("Error in RT_PinThisThread(): there is no core %d.\n",core);
+		return RT_ERROR;
+	}
+#ifdef WIN32
+	if (SetThreadAffinityMask(GetCurrentThread(),((DWORD_PTR) 1) << core)==0) return RT_ERROR;
+	return RT_SUCCESS;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core,&set);
+	if (pthread_setaffinity_np(pthread_self(),sizeof(set),&set)!=0) return RT_ERROR;
+	return RT_SUCCESS;
+#else
+	printf("CPU pinning is not supported on this platform.\n");
+	return RT_ERROR;
+#endif
+}
+
+int RT_AvoidCore(int core){
+	if (core < 0) return RT_SUCCESS;
+#ifdef WIN32
+	DWORD_PTR procMask, sysMask;
+	if (!GetProcessAffinityMask(GetCurrentProcess(),&procMask,&sysMask)) return RT_ERROR;
+	DWORD_PTR mask=procMask & ~(((DWORD_PTR) 1) << core);
+	if (mask==0) return RT_ERROR; // There is nowhere else to go
+	if (SetThreadAffinityMask(GetCurrentThread(),mask)==0) return RT_ERROR;
+	return RT_SUCCESS;
+#elif defined(__linux__)
+	cpu_set_t set;
+	if (pthread_getaffinity_np(pthread_self(),sizeof(set),&set)!=0) return RT_ERROR;
+	CPU_CLR(core,&set);
+	if (CPU_COUNT(&set)==0) return RT_ERROR; // There is nowhere else to go
+	if (pthread_setaffinity_np(pthread_self(),sizeof(set),&set)!=0) return RT_ERROR;
+	return RT_SUCCESS;
+#else
+	return RT_ERROR;
+#endif
+}
+
+int RT_SetRealTimePriority(){
+#ifdef WIN32
+	if (!SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_TIME_CRITICAL)) return RT_ERROR;
+	return RT_SUCCESS;
+#else
+	struct sched_param param;
+	/** Leave the very top priority for the kernel's own threads **/
+	param.sched_priority=sched_get_priority_max(SCHED_FIFO)-1;
+	if (pthread_setschedparam(pthread_self(),SCHED_FIFO,&param)!=0) return RT_ERROR;
+	return RT_SUCCESS;
+#endif
+}
+
+
+/************************************************/
+/*   Timing statistics
+ *
+ */
+/************************************************/
+
+double RT_Now(){
+#ifdef WIN32
+	static double period=0; // seconds per tick of the performance counter
+	LARGE_INTEGER count;
+	if (period==0){
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		period=1.0/(double) freq.QuadPart;
+	}
+	QueryPerformanceCounter(&count);
+	return count.QuadPart*period;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+#else
+	struct timeval curr_tv;
+	gettimeofday(&curr_tv, NULL);
+	return curr_tv.tv_sec + (curr_tv.tv_usec / 1000000.0);
+#endif
+}
+
+void RT_ClearStats(RTStats* s, const char* name){
+	s->name=name;
+	s->n=0;
+	s->sum=0;
+	s->sumsq=0;
+	s->min=0;
+	s->max=0;
+	s->last=0;
+}
+
+void RT_AddSample(RTStats* s, double x){
+	if (s->n==0 || x < s->min) s->min=x;
+	if (s->n==0 || x > s->max) s->max=x;
+	s->sum+=x;
+	s->sumsq+=x*x;
+	s->n++;
+}
+
+void RT_Tick(RTStats* s){
+	double now=RT_Now();
+	if (s->last > 0) RT_AddSample(s,now-s->last);
+	s->last=now;
+}
+
+void RT_PrintStats(RTStats* s){
+	if (s->n==0){
+		printf("  %-28s no samples\n",s->name);
+		return;
+	}
+	double mean=s->sum/s->n;
+	double var=s->sumsq/s->n - mean*mean;
+	if (var < 0) var=0;
+	printf("  %-28s n=%ld mean=%.2f ms jitter(sd)=%.3f ms min=%.2f ms max=%.2f ms\n",s->name,s->n,
+			1000*mean,1000*sqrt(var),1000*s->min,1000*s->max);
+}
+
+void RT_ClearHistogram(RTHistogram* h, const char* name, double binWidth, double scale, const char* unit){
+	int k;
+	h->name=name;
+	h->binWidth=binWidth;
+	h->scale=scale;
+	h->unit=unit;
+	h->n=0;
+	for (k=0; k<RT_HISTBINS; k++) h->bins[k]=0;
+}
+
+void RT_AddToHistogram(RTHistogram* h, double x){
+	int k= (x < 0) ? 0 : (int) (x/h->binWidth);
+	if (k > RT_HISTBINS-1) k=RT_HISTBINS-1;
+	h->bins[k]++;
+	h->n++;
+}
+
+void RT_PrintHistogram(RTHistogram* h){
+	int k, j;
+	printf("  %s (n=%ld):\n",h->name,h->n);
+	if (h->n==0) return;
+	for (k=0; k<RT_HISTBINS; k++){
+		if (h->bins[k]==0) continue;
+		double lo=k*h->binWidth*h->scale;
+		double hi=(k+1)*h->binWidth*h->scale;
+		if (k==RT_HISTBINS-1) printf("    %8.1f +       %s %8ld ",lo,h->unit,h->bins[k]);
+		else printf("    %8.1f - %-6.1f %s %8ld ",lo,hi,h->unit,h->bins[k]);
+		int bar=(int) (40*h->bins[k]/h->n);
+		for (j=0; j<bar; j++) printf("#");
+		printf("\n");
+	}
+}
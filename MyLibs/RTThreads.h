@@ -0,0 +1,309 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * RTThreads.h
+ *
+ * A small portable threading layer for the closed loop.
+ *
+ * It provides
+ * 		threads					- RT_StartThread(), RT_JoinThread()
+ * 		flags with wait/notify	- so that threads can hand off to one another
+ * 								  without polling a global bool in a Sleep() loop
+ * 		mutexes & semaphores	- for queues and pools of worker threads
+ * 		CPU pinning & priority	- pin the time critical closed loop thread to its own core,
+ * 								  optionally with real-time scheduling (SCHED_FIFO on POSIX,
+ * 								  TIME_CRITICAL on Windows), and keep everything else off that core
+ * 		timing statistics		- to measure the jitter of the closed loop
+ * 		histograms				- to see how the frame age and dropped frames are distributed
+ *
+ * On Windows this is implemented with the Win32 API. Everywhere else it uses pthreads.
+ *
+ * To isolate a core on Linux, boot with isolcpus=N and run with -c N.
+ */
+
+#ifndef RTTHREADS_H_
+#define RTTHREADS_H_
+
+#ifdef WIN32   // Windows system specific
+#include <windows.h>
+#else          // Unix based system specific
+#include <pthread.h>
+#endif
+
+/** Error codes **/
+#define RT_ERROR -1
+#define RT_SUCCESS 0
+
+/** Passed as a timeout to wait forever **/
+#define RT_INFINITE -1
+
+typedef void (*RTThreadFunc)(void* arg);
+
+typedef struct RTThreadStruct{
+	RTThreadFunc func;
+	void* arg;
+#ifdef WIN32
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+} RTThread;
+
+/*
+ * A flag that one thread sets and another thread waits on.
+ * Once set it stays set until it is cleared.
+ */
+typedef struct RTFlagStruct{
+#ifdef WIN32
+	HANDLE event;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	volatile int value;
+#endif
+} RTFlag;
+
+/*
+ * A mutual exclusion lock.
+ */
+typedef struct RTMutexStruct{
+#ifdef WIN32
+	CRITICAL_SECTION cs;
+#else
+	pthread_mutex_t mutex;
+#endif
+} RTMutex;
+
+/*
+ * A counting semaphore. Waiting takes one off the count, posting adds to it.
+ */
+typedef struct RTSemaphoreStruct{
+#ifdef WIN32
+	HANDLE sem;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int count;
+	int max;
+#endif
+} RTSemaphore;
+
+/*
+ * Running statistics of a series of samples (in seconds),
+ * such as the period of a loop or the time spent on a frame.
+ */
+typedef struct RTStatsStruct{
+	const char* name;
+	long n;
+	double sum;
+	double sumsq;
+	double min;
+	double max;
+	double last; // time of the previous RT_Tick()
+} RTStats;
+
+/** Number of bins in a histogram. The last bin counts everything beyond the others **/
+#define RT_HISTBINS 16
+
+/*
+ * Histogram of a series of samples in fixed width bins starting at 0.
+ */
+typedef struct RTHistogramStruct{
+	const char* name;
+	double binWidth;
+	double scale; // samples are multiplied by this when printed (e.g. 1000 for seconds in ms)
+	const char* unit; // unit of the printed values
+	long bins[RT_HISTBINS];
+	long n;
+} RTHistogram;
+
+
+/************************************************/
+/*   Threads
+ *
+ */
+/************************************************/
+
+/*
+ * Start a new thread running func(arg).
+ * Returns NULL if the thread could not be created.
+ */
+RTThread* RT_StartThread(RTThreadFunc func, void* arg);
+
+/*
+ * Wait for the thread to return and free it.
+ */
+void RT_JoinThread(RTThread** t);
+
+/*
+ * Put the calling thread to sleep for ms milliseconds.
+ */
+void RT_Sleep(int ms);
+
+
+/************************************************/
+/*   Flags
+ *
+ */
+/************************************************/
+
+void RT_InitFlag(RTFlag* f);
+void RT_ReleaseFlag(RTFlag* f);
+
+/*
+ * Set the flag and wake up every thread that is waiting on it.
+ */
+void RT_SetFlag(RTFlag* f);
+
+void RT_ClearFlag(RTFlag* f);
+
+/*
+ * Returns 1 if the flag is set, 0 otherwise. Never blocks.
+ */
+int RT_IsFlagSet(RTFlag* f);
+
+/*
+ * Wait up to timeout ms (or RT_INFINITE) for the flag to be set.
+ * Returns 1 if the flag is set, 0 if it timed out.
+ */
+int RT_WaitFlag(RTFlag* f, int timeout);
+
+
+/************************************************/
+/*   Mutexes
+ *
+ */
+/************************************************/
+
+void RT_InitMutex(RTMutex* m);
+void RT_ReleaseMutex(RTMutex* m);
+void RT_LockMutex(RTMutex* m);
+void RT_UnlockMutex(RTMutex* m);
+
+
+/************************************************/
+/*   Semaphores
+ *
+ */
+/************************************************/
+
+/*
+ * Start the semaphore at count. It will never count higher than max.
+ */
+void RT_InitSemaphore(RTSemaphore* s, int count, int max);
+void RT_ReleaseSemaphore(RTSemaphore* s);
+
+/*
+ * Add n to the count, waking up to n waiting threads.
+ */
+void RT_PostSemaphore(RTSemaphore* s, int n);
+
+/*
+ * Wait up to timeout ms (or RT_INFINITE) for the count to be above zero and take one off.
+ * A timeout of 0 never blocks.
+ * Returns 1 if one was taken, 0 if it timed out.
+ */
+int RT_WaitSemaphore(RTSemaphore* s, int timeout);
+
+
+/************************************************/
+/*   CPU pinning & priority
+ *
+ */
+/************************************************/
+
+/*
+ * Number of processors on this machine.
+ */
+int RT_NumberOfProcessors();
+
+/*
+ * Pin the calling thread to a single core.
+ */
+int RT_PinThisThread(int core);
+
+/*
+ * Let the calling thread run on any core except this one.
+ */
+int RT_AvoidCore(int core);
+
+/*
+ * Give the calling thread real-time priority.
+ * On POSIX this is SCHED_FIFO, which usually requires root or CAP_SYS_NICE.
+ */
+int RT_SetRealTimePriority();
+
+
+/************************************************/
+/*   Timing statistics
+ *
+ */
+/************************************************/
+
+/*
+ * Current time in seconds on a monotonic clock
+ * (CLOCK_MONOTONIC on POSIX, QueryPerformanceCounter() on Windows).
+ * It does not jump when the wall clock is adjusted, but it has no fixed origin,
+ * so only compare it with other RT_Now() times.
+ */
+double RT_Now();
+
+void RT_ClearStats(RTStats* s, const char* name);
+
+/*
+ * Add a single sample (in seconds)
+ */
+void RT_AddSample(RTStats* s, double x);
+
+/*
+ * Add the time since the previous tick as a sample.
+ * Use this once per loop iteration to measure the loop period.
+ */
+void RT_Tick(RTStats* s);
+
+/*
+ * Print the number of samples, mean, standard deviation (jitter), min and max in ms.
+ */
+void RT_PrintStats(RTStats* s);
+
+/*
+ * Start a new histogram. Samples go in bins of binWidth. They are printed
+ * multiplied by scale, with the unit, e.g. RT_ClearHistogram(&h,"Frame age",0.005,1000,"ms")
+ */
+void RT_ClearHistogram(RTHistogram* h, const char* name, double binWidth, double scale, const char* unit);
+
+void RT_AddToHistogram(RTHistogram* h, double x);
+
+/*
+ * Print the count in each bin that isn't empty, with a bar.
+ */
+void RT_PrintHistogram(RTHistogram* h);
+
+
+#endif /* RTTHREADS_H_ */
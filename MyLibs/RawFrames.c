@@ -0,0 +1,302 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * RawFrames.c
+ *
+ * Lossless raw frame recording and memory mapped replay. See RawFrames.h
+ */
+
+//Standard C headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32   // Windows system specific
+#include <windows.h>
+#else          // Unix based system specific
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "RTThreads.h"
+#include "RawFrames.h"
+
+
+/************************************************/
+/*   Writing
+ *
+ */
+/************************************************/
+
+/*
+ * Writer thread. Writes each full chunk out with a single fwrite().
+ */
+static void RawWriterThread(void* arg){
+	RawWriter* w=(RawWriter*) arg;
+	while (1){
+		RT_WaitFlag(&(w->full),RT_INFINITE);
+		RT_ClearFlag(&(w->full));
+		if (w->nToWrite > 0){
+			size_t n=(size_t) w->nToWrite*w->header.recordSize;
+			if (fwrite(w->chunk[w->toWrite],1,n,w->fp)!=n){
+				printf("Error! Could not write raw frames to %s\n",w->fname);
+				w->error=1;
+			}
+			w->nToWrite=0;
+		}
+		RT_SetFlag(&(w->written));
+		if (w->quit) break;
+	}
+}
+
+/*
+ * Hand the current chunk to the writer thread and start filling the other one.
+ */
+static void FlushRawChunk(RawWriter* w){
+	/** Wait for the writer thread to finish with the previous chunk **/
+	if (!RT_IsFlagSet(&(w->written))){
+		w->stalls++;
+		RT_WaitFlag(&(w->written),RT_INFINITE);
+	}
+	RT_ClearFlag(&(w->written));
+	w->toWrite=w->current;
+	w->nToWrite=w->nInChunk;
+	RT_SetFlag(&(w->full));
+
+	w->current=1-w->current;
+	w->nInChunk=0;
+}
+
+RawWriter* CreateRawWriter(const char* fname, int width, int height, int bitDepth){
+	RawWriter* w=(RawWriter*) malloc(sizeof(RawWriter));
+	memset(w,0,sizeof(RawWriter));
+
+	int bytesPerPixel=(bitDepth > 8) ? 2 : 1;
+	memcpy(w->header.magic,RAW_MAGIC,sizeof(RAW_MAGIC));
+	w->header.version=RAW_VERSION;
+	w->header.width=width;
+	w->header.height=height;
+	w->header.bitDepth=bitDepth;
+	/** Rows are aligned like an IplImage's so that replayed frames can be lent straight to a Frame **/
+	w->header.step=(width*bytesPerPixel+3) & ~3;
+	w->header.recordSize=sizeof(RawRecordHeader)+w->header.step*height;
+	w->header.fps=0;
+	w->header.nframes=0;
+
+	w->fp=fopen(fname,"wb");
+	if (w->fp==NULL){
+		printf("Error! Could not create raw frame file %s\n",fname);
+		free(w);
+		return NULL;
+	}
+	/** Our writes are already large, so don't copy them through stdio's buffer too **/
+	setvbuf(w->fp,NULL,_IONBF,0);
+	if (fwrite(&(w->header),1,RAW_HEADERSIZE,w->fp)!=RAW_HEADERSIZE){
+		printf("Error! Could not write the header of raw frame file %s\n",fname);
+		fclose(w->fp);
+		remove(fname);
+		free(w);
+		return NULL;
+	}
+
+	w->fname=(char*) malloc(strlen(fname)+1);
+	strcpy(w->fname,fname);
+	w->chunk[0]=(unsigned char*) malloc((size_t) RAW_CHUNKFRAMES*w->header.recordSize);
+	w->chunk[1]=(unsigned char*) malloc((size_t) RAW_CHUNKFRAMES*w->header.recordSize);
+	w->current=0;
+	w->nInChunk=0;
+
+	RT_InitFlag(&(w->full));
+	RT_InitFlag(&(w->written));
+	RT_SetFlag(&(w->written));
+	w->thread=RT_StartThread(RawWriterThread,w);
+	if (w->thread==NULL){
+		printf("Error! Could not start the thread that writes raw frames to %s\n",fname);
+		RT_ReleaseFlag(&(w->full));
+		RT_ReleaseFlag(&(w->written));
+		fclose(w->fp);
+		remove(fname);
+		free(w->chunk[0]);
+		free(w->chunk[1]);
+		free(w->fname);
+		free(w);
+		return NULL;
+	}
+	printf("Recording raw frames to %s\n",fname);
+	return w;
+}
+
+int AppendRawFrame(RawWriter* w, unsigned char* data, int step, unsigned int frameNum, double timestamp){
+	if (w->error) return RAW_ERROR;
+	unsigned char* rec=w->chunk[w->current]+(size_t) w->nInChunk*w->header.recordSize;
+
+	RawRecordHeader* rh=(RawRecordHeader*) rec;
+	rh->frameNum=frameNum;
+	rh->reserved=0;
+	rh->timestamp=timestamp;
+
+	int rowBytes=w->header.width*((w->header.bitDepth > 8) ? 2 : 1);
+	unsigned char* pixels=rec+sizeof(RawRecordHeader);
+	if (step==w->header.step) {
+		memcpy(pixels,data,(size_t) step*w->header.height);
+	} else {
+		for (int y=0; y<w->header.height; y++){
+			memcpy(pixels+y*w->header.step,data+y*step,rowBytes);
+		}
+	}
+
+	if (w->nframes==0) w->tFirst=timestamp;
+	w->tLast=timestamp;
+	w->nframes++;
+	w->nInChunk++;
+	if (w->nInChunk==RAW_CHUNKFRAMES) FlushRawChunk(w);
+	return RAW_SUCCESS;
+}
+
+int CloseRawWriter(RawWriter** w){
+	RawWriter* W=*w;
+	if (W==NULL) return RAW_SUCCESS;
+
+	/** Write out the partial chunk and stop the writer thread **/
+	FlushRawChunk(W);
+	RT_WaitFlag(&(W->written),RT_INFINITE);
+	RT_ClearFlag(&(W->written));
+	W->quit=1;
+	W->nToWrite=0;
+	RT_SetFlag(&(W->full));
+	RT_JoinThread(&(W->thread));
+
+	/** Now that we know how many frames there are, fill in the header **/
+	W->header.nframes=(int) W->nframes;
+	if (W->nframes > 1 && W->tLast > W->tFirst) W->header.fps=(W->nframes-1)/(W->tLast-W->tFirst);
+	fseek(W->fp,0,SEEK_SET);
+	fwrite(&(W->header),1,RAW_HEADERSIZE,W->fp);
+	fclose(W->fp);
+
+	printf("Wrote %ld raw frames (%.1f MB, %.1f fps) to %s. The disk held up frame acquisition %ld times.\n",
+			W->nframes,(double) W->nframes*W->header.recordSize/(1024*1024),W->header.fps,W->fname,W->stalls);
+	int ret=(W->error) ? RAW_ERROR : RAW_SUCCESS;
+
+	RT_ReleaseFlag(&(W->full));
+	RT_ReleaseFlag(&(W->written));
+	free(W->chunk[0]);
+	free(W->chunk[1]);
+	free(W->fname);
+	free(W);
+	*w=NULL;
+	return ret;
+}
+
+
+/************************************************/
+/*   Reading
+ *
+ */
+/************************************************/
+
+RawReader* OpenRawFile(const char* fname){
+	RawReader* r=(RawReader*) malloc(sizeof(RawReader));
+	r->base=NULL;
+
+#ifdef WIN32
+	r->file=CreateFile(fname,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+	if (r->file==INVALID_HANDLE_VALUE){
+		printf("Error! Could not open raw frame file %s\n",fname);
+		free(r);
+		return NULL;
+	}
+	LARGE_INTEGER size;
+	GetFileSizeEx(r->file,&size);
+	r->size=(size_t) size.QuadPart;
+	r->mapping=CreateFileMapping(r->file,NULL,PAGE_READONLY,0,0,NULL);
+	if (r->mapping!=NULL) r->base=(unsigned char*) MapViewOfFile(r->mapping,FILE_MAP_READ,0,0,0);
+#else
+	r->fd=open(fname,O_RDONLY);
+	if (r->fd < 0){
+		printf("Error! Could not open raw frame file %s\n",fname);
+		free(r);
+		return NULL;
+	}
+	struct stat st;
+	fstat(r->fd,&st);
+	r->size=(size_t) st.st_size;
+	void* p=mmap(NULL,r->size,PROT_READ,MAP_SHARED,r->fd,0);
+	if (p!=MAP_FAILED) {
+		r->base=(unsigned char*) p;
+		madvise(p,r->size,MADV_SEQUENTIAL);
+	}
+#endif
+
+	if (r->base==NULL){
+		printf("Error! Could not map raw frame file %s into memory.\n",fname);
+		CloseRawFile(&r);
+		return NULL;
+	}
+	if (r->size < RAW_HEADERSIZE){
+		printf("Error! %s is too short to be a raw frame file.\n",fname);
+		CloseRawFile(&r);
+		return NULL;
+	}
+	memcpy(&(r->header),r->base,sizeof(RawFileHeader));
+	if (strncmp(r->header.magic,RAW_MAGIC,sizeof(RAW_MAGIC))!=0 || r->header.recordSize <= 0){
+		printf("Error! %s is not a raw frame file.\n",fname);
+		CloseRawFile(&r);
+		return NULL;
+	}
+
+	/** Go by the size of the file, in case the recording was never finished **/
+	r->nframes=(long) ((r->size-RAW_HEADERSIZE)/r->header.recordSize);
+	printf("Opened %s: %ld frames of %dx%d at %d bits (%.1f fps).\n",fname,r->nframes,
+			r->header.width,r->header.height,r->header.bitDepth,r->header.fps);
+	return r;
+}
+
+int GetRawFrame(RawReader* r, long k, RawRecordHeader** rec, unsigned char** data){
+	if (k < 0 || k >= r->nframes) return RAW_ERROR;
+	unsigned char* p=r->base+RAW_HEADERSIZE+(size_t) k*r->header.recordSize;
+	*rec=(RawRecordHeader*) p;
+	*data=p+sizeof(RawRecordHeader);
+	return RAW_SUCCESS;
+}
+
+void CloseRawFile(RawReader** r){
+	RawReader* R=*r;
+#ifdef WIN32
+	if (R->base!=NULL) UnmapViewOfFile(R->base);
+	if (R->mapping!=NULL) CloseHandle(R->mapping);
+	CloseHandle(R->file);
+#else
+	if (R->base!=NULL) munmap(R->base,R->size);
+	close(R->fd);
+#endif
+	free(R);
+	*r=NULL;
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * RawFrames.h
+ *
+ * A simple raw container for recording every frame losslessly and replaying it exactly.
+ *
+ * A .raw file is a fixed RAW_HEADERSIZE byte header (RawFileHeader) followed by
+ * fixed size frame records. Each record is a RawRecordHeader (frame number and
+ * time stamp) followed by the pixels, row after row, rows header.step bytes apart.
+ * Because every record is the same size, frame k is at
+ *
+ * 		headerSize + k * recordSize
+ *
+ * so any frame can be found without reading the ones before it.
+ *
+ * The writer gathers RAW_CHUNKFRAMES records at a time in memory and hands the
+ * full chunk to its own thread to write to disk with one large sequential write,
+ * so the thread that appends frames rarely waits on the disk.
+ *
+ * The reader maps the whole file into memory. Frames are read straight out of the
+ * mapping without copying. Note that a 32 bit build can only map about a gigabyte and a half.
+ *
+ * Depends on RTThreads.h
+ */
+
+#ifndef RAWFRAMES_H_
+#define RAWFRAMES_H_
+
+#ifndef RTTHREADS_H_
+ #error "#include RTThreads.h" must appear in source files before "#include RawFrames.h"
+#endif
+
+#define RAW_ERROR -1
+#define RAW_SUCCESS 0
+
+#define RAW_MAGIC "MCRAWFR"
+#define RAW_VERSION 1
+#define RAW_HEADERSIZE 64
+
+/** Number of frames the writer gathers before writing them out in one go **/
+#define RAW_CHUNKFRAMES 16
+
+
+/*
+ * File header. Exactly RAW_HEADERSIZE bytes.
+ */
+typedef struct RawFileHeaderStruct{
+	char magic[8]; // RAW_MAGIC
+	int version;
+	int width;
+	int height;
+	int bitDepth;
+	int step; // bytes from one row to the next
+	int recordSize; // bytes per frame record, including the RawRecordHeader
+	double fps; // average frame rate of the recording
+	int nframes; // filled in when the recording is finished
+	char reserved[20];
+} RawFileHeader;
+
+/*
+ * Header of a single frame record. Exactly 16 bytes.
+ */
+typedef struct RawRecordHeaderStruct{
+	unsigned int frameNum; // sequence number from the frame source. Gaps are frames that were dropped
+	int reserved;
+	double timestamp; // time (in seconds) at which the frame arrived
+} RawRecordHeader;
+
+
+/************************************************/
+/*   Writing
+ *
+ */
+/************************************************/
+
+typedef struct RawWriterStruct{
+	char* fname;
+	FILE* fp;
+	RawFileHeader header;
+
+	/** Two chunks: one is filled while the other is written **/
+	unsigned char* chunk[2];
+	int current; // chunk being filled
+	int nInChunk; // records in the current chunk
+
+	/** Writer thread **/
+	RTThread* thread;
+	RTFlag full; // a chunk is waiting to be written
+	RTFlag written; // the writer thread is idle
+	int toWrite; // chunk to write
+	int nToWrite; // records in it
+	volatile int quit;
+	int error;
+
+	/** Statistics **/
+	long nframes;
+	long stalls; // times the appending thread had to wait on the disk
+	double tFirst;
+	double tLast;
+} RawWriter;
+
+/*
+ * Create a .raw file for frames of this size and start the writer thread.
+ * Returns NULL if the file can't be created.
+ */
+RawWriter* CreateRawWriter(const char* fname, int width, int height, int bitDepth);
+
+/*
+ * Append a frame whose rows are step bytes apart.
+ */
+int AppendRawFrame(RawWriter* w, unsigned char* data, int step, unsigned int frameNum, double timestamp);
+
+/*
+ * Write out whatever is left, fill in the header, close the file and free the writer.
+ */
+int CloseRawWriter(RawWriter** w);
+
+
+/************************************************/
+/*   Reading
+ *
+ */
+/************************************************/
+
+typedef struct RawReaderStruct{
+	RawFileHeader header;
+	long nframes;
+	unsigned char* base; // start of the mapping
+	size_t size;
+#ifdef WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+} RawReader;
+
+/*
+ * Map a .raw file into memory.
+ * Returns NULL if it can't be opened or isn't a .raw file.
+ */
+RawReader* OpenRawFile(const char* fname);
+
+/*
+ * Find frame k (counting from 0).
+ * *rec points at its record header and *data at its pixels, both inside the mapping.
+ */
+int GetRawFrame(RawReader* r, long k, RawRecordHeader** rec, unsigned char** data);
+
+/*
+ * Unmap the file and free the reader.
+ */
+void CloseRawFile(RawReader** r);
+
+
+#endif /* RAWFRAMES_H_ */
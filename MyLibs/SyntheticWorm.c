@@ -0,0 +1,358 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * SyntheticWorm.c
+ *
+ * Parametric worm renderer with ground truth. See SyntheticWorm.h
+ */
+
+//Standard C headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "SyntheticWorm.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+
+/*
+ * Fill in a model with sensible values for frames of this size.
+ */
+void SetDefaultSynthWormModel(SynthWormModel* m, int width, int height){
+	int minDim= (width < height) ? width : height;
+	m->fps=50;
+	m->length=0.45*minDim;
+	m->width=m->length/12;
+	m->wavelength=0.65;
+	m->amplitude=0.7;
+	m->waveSpeed=0.5;
+	m->coiling=0;
+	m->crawlSpeed=0.1*m->length;
+	m->noise=8;
+	m->background=20;
+	m->gradient=20;
+	m->body=140;
+}
+
+/*
+ * Override parts of a model with a comma separated list of name=value pairs.
+ * Returns 0 on success and -1 if something couldn't be understood.
+ */
+int ParseSynthWormModel(const char* spec, SynthWormModel* m){
+	if (spec==NULL) return 0;
+	const char* p=spec;
+	char name[32];
+	double value;
+
+	while (*p!='\0'){
+		if (sscanf(p,"%31[^=,]=%lf",name,&value)!=2){
+			printf("Error! Could not understand synthetic worm parameters: %s\n",p);
+			return -1;
+		}
+
+		if (strcmp(name,"fps")==0 && value > 0) m->fps=value;
+		else if (strcmp(name,"length")==0) m->length=value;
+		else if (strcmp(name,"width")==0) m->width=value;
+		else if (strcmp(name,"wavelength")==0 && value > 0) m->wavelength=value;
+		else if (strcmp(name,"amplitude")==0) m->amplitude=value;
+		else if (strcmp(name,"speed")==0) m->waveSpeed=value;
+		else if (strcmp(name,"coil")==0) m->coiling=value;
+		else if (strcmp(name,"crawl")==0) m->crawlSpeed=value;
+		else if (strcmp(name,"noise")==0) m->noise=value;
+		else if (strcmp(name,"background")==0) m->background=(int) value;
+		else if (strcmp(name,"gradient")==0) m->gradient=(int) value;
+		else if (strcmp(name,"body")==0) m->body=(int) value;
+		else {
+			printf("Error! Unknown synthetic worm parameter: %s\n",name);
+			return -1;
+		}
+
+		/** Next pair **/
+		p=strchr(p,',');
+		if (p==NULL) break;
+		p++;
+	}
+	return 0;
+}
+
+static unsigned char ClampGray(double v){
+	if (v < 0) return 0;
+	if (v > 255) return 255;
+	return (unsigned char) v;
+}
+
+/*
+ * Uniformly distributed noise between -amplitude and amplitude
+ */
+static double SynthNoise(unsigned int* seed, double amplitude){
+	if (amplitude <= 0) return 0;
+	*seed=*seed*1103515245u+12345u;
+	double u=(double) ((*seed>>16)&0x7fff)/0x7fff; // 0 to 1
+	return amplitude*(2*u-1);
+}
+
+SynthWormRenderer* CreateSynthWormRenderer(SynthWormModel* m, int width, int height){
+	SynthWormRenderer* r=(SynthWormRenderer*) malloc(sizeof(SynthWormRenderer));
+	r->model=*m;
+	r->width=width;
+	r->height=height;
+
+	unsigned int seed=12345;
+	int x, k;
+
+	/** Background gradient plus noise **/
+	r->bgRows=(unsigned char*) malloc(SW_NOISEROWS*width);
+	for (k=0; k<SW_NOISEROWS; k++){
+		for (x=0; x<width; x++){
+			r->bgRows[k*width+x]=ClampGray(m->background+ (double) m->gradient*x/width+SynthNoise(&seed,m->noise));
+		}
+	}
+
+	/** Body plus noise. Runs start anywhere in the strip, so pad it by a row **/
+	r->bodyStrip=(unsigned char*) malloc(SW_NOISETABLE+width);
+	for (k=0; k<SW_NOISETABLE+width; k++){
+		r->bodyStrip[k]=ClampGray(m->body+SynthNoise(&seed,m->noise));
+	}
+
+	/** Discs along the body are spaced about an eighth of the body width apart **/
+	double spacing=m->width/8;
+	if (spacing < 1) spacing=1;
+	int perPoint=(int) ceil(m->length/(SW_NUMPOINTS-1)/spacing);
+	if (perPoint < 1) perPoint=1;
+	r->nsamples=(SW_NUMPOINTS-1)*perPoint+1;
+	r->samples=(SynthPoint*) malloc(r->nsamples*sizeof(SynthPoint));
+	r->radius=(double*) malloc(r->nsamples*sizeof(double));
+
+	/** Blunt head, full width in the middle, tail tapering to a point **/
+	for (k=0; k<r->nsamples; k++){
+		double s=(double) k/(r->nsamples-1);
+		double rad=m->width/2;
+		if (s < 0.1) rad*=sqrt(s/0.1);
+		if (s > 0.6) rad*=(1-s)/0.4;
+		r->radius[k]=rad;
+	}
+	return r;
+}
+
+void DestroySynthWormRenderer(SynthWormRenderer** r){
+	if (r==NULL || *r==NULL) return;
+	free((*r)->bgRows);
+	free((*r)->bodyStrip);
+	free((*r)->samples);
+	free((*r)->radius);
+	free(*r);
+	*r=NULL;
+}
+
+/*
+ * Work out where the centerline is at time t
+ */
+static void ComputeSynthCenterline(SynthWormRenderer* r, double t){
+	SynthWormModel* m=&(r->model);
+	int n=r->nsamples;
+	double ds=m->length/(n-1);
+	int k;
+
+	/** The middle of the worm travels around a circle in the middle of the image **/
+	double minDim= (r->width < r->height) ? r->width : r->height;
+	double circle=0.15*minDim;
+	double phi= (circle > 0) ? m->crawlSpeed*t/circle : 0;
+	double cx=r->width/2.0+circle*cos(phi);
+	double cy=r->height/2.0+circle*sin(phi);
+
+	/** Head leads, so the body trails behind the direction of travel **/
+	double base=phi+M_PI/2+M_PI;
+
+	double x=0, y=0, sumx=0, sumy=0;
+	r->samples[0].x=0;
+	r->samples[0].y=0;
+	for (k=1; k<n; k++){
+		double s=(k-0.5)/(n-1);
+		double theta=base+m->amplitude*sin(2*M_PI*(s/m->wavelength-m->waveSpeed*t))+m->coiling*2*M_PI*s;
+		x+=ds*cos(theta);
+		y+=ds*sin(theta);
+		r->samples[k].x=x;
+		r->samples[k].y=y;
+		sumx+=x;
+		sumy+=y;
+	}
+
+	/** Center the body on its spot on the circle **/
+	double dx=cx-sumx/n;
+	double dy=cy-sumy/n;
+	for (k=0; k<n; k++){
+		r->samples[k].x+=dx;
+		r->samples[k].y+=dy;
+	}
+}
+
+/*
+ * Render frame seq (at time t seconds) into buf, whose rows are step bytes apart,
+ * and fill in the right answer for it.
+ */
+void RenderSynthWorm(SynthWormRenderer* r, unsigned long seq, double t, unsigned char* buf, int step, SynthWormTruth* truth){
+	int width=r->width;
+	int height=r->height;
+	int y, k;
+
+	ComputeSynthCenterline(r,t);
+
+	/** Pick the noise for this frame **/
+	unsigned int offset=(unsigned int) seq*2654435761u;
+
+	/** Background: each row is one of the noisy background rows **/
+	for (y=0; y<height; y++){
+		int pick=(int) ((offset>>8)+(unsigned int) y*37u)&(SW_NOISEROWS-1);
+		memcpy(buf+y*step,r->bgRows+pick*width,width);
+	}
+
+	/** Body: a disc at every sample, filled with runs from the noisy body strip **/
+	for (k=0; k<r->nsamples; k++){
+		double rad=r->radius[k];
+		if (rad < 0.5) continue;
+		double px=r->samples[k].x;
+		double py=r->samples[k].y;
+		int y0=(int) ceil(py-rad);
+		int y1=(int) floor(py+rad);
+		if (y0 < 0) y0=0;
+		if (y1 > height-1) y1=height-1;
+		for (y=y0; y<=y1; y++){
+			double half=sqrt(rad*rad-(y-py)*(y-py));
+			int x0=(int) ceil(px-half);
+			int x1=(int) floor(px+half);
+			if (x0 < 0) x0=0;
+			if (x1 > width-1) x1=width-1;
+			if (x1 < x0) continue;
+			const unsigned char* strip=r->bodyStrip+((offset+(unsigned int) y*7919u)&(SW_NOISETABLE-1));
+			memcpy(buf+y*step+x0,strip+x0,x1-x0+1);
+		}
+	}
+
+	/** The right answer **/
+	if (truth!=NULL){
+		int perPoint=(r->nsamples-1)/(SW_NUMPOINTS-1);
+		truth->seq=seq;
+		for (k=0; k<SW_NUMPOINTS; k++) truth->Centerline[k]=r->samples[k*perPoint];
+		truth->Head=truth->Centerline[0];
+		truth->Tail=truth->Centerline[SW_NUMPOINTS-1];
+	}
+}
+
+
+/************************************************/
+/*   Scoring the segmentation against the truth
+ *
+ */
+/************************************************/
+
+static double SynthDist(SynthPoint a, SynthPoint b){
+	return sqrt((a.x-b.x)*(a.x-b.x)+(a.y-b.y)*(a.y-b.y));
+}
+
+/*
+ * Distance from p to the line segment ab
+ */
+static double SynthDistToSegment(SynthPoint p, SynthPoint a, SynthPoint b){
+	double vx=b.x-a.x, vy=b.y-a.y;
+	double len2=vx*vx+vy*vy;
+	double u= (len2 > 0) ? ((p.x-a.x)*vx+(p.y-a.y)*vy)/len2 : 0;
+	if (u < 0) u=0;
+	if (u > 1) u=1;
+	SynthPoint q;
+	q.x=a.x+u*vx;
+	q.y=a.y+u*vy;
+	return SynthDist(p,q);
+}
+
+void ClearSynthWormScore(SynthWormScore* s){
+	memset(s,0,sizeof(SynthWormScore));
+}
+
+/*
+ * Score the head, tail and centerline found for a frame against the right answer.
+ */
+void ScoreSynthWorm(SynthWormScore* s, SynthWormTruth* truth, SynthPoint head, SynthPoint tail, SynthPoint* centerline, int n){
+	double eHead=SynthDist(head,truth->Head);
+	double eTail=SynthDist(tail,truth->Tail);
+
+	/** Head and tail the wrong way round? **/
+	double eHeadSwapped=SynthDist(head,truth->Tail);
+	double eTailSwapped=SynthDist(tail,truth->Head);
+	if (eHeadSwapped+eTailSwapped < eHead+eTail){
+		s->nflipped++;
+		eHead=eTailSwapped;
+		eTail=eHeadSwapped;
+	}
+
+	s->sumHead+=eHead;
+	if (eHead > s->maxHead) s->maxHead=eHead;
+	s->sumTail+=eTail;
+	if (eTail > s->maxTail) s->maxTail=eTail;
+
+	/** Mean distance from each point found to the true centerline **/
+	if (centerline!=NULL && n > 0){
+		double sum=0;
+		int i, k;
+		for (i=0; i<n; i++){
+			double best=-1;
+			for (k=0; k<SW_NUMPOINTS-1; k++){
+				double d=SynthDistToSegment(centerline[i],truth->Centerline[k],truth->Centerline[k+1]);
+				if (best < 0 || d < best) best=d;
+			}
+			sum+=best;
+		}
+		double eCenterline=sum/n;
+		s->sumCenterline+=eCenterline;
+		if (eCenterline > s->maxCenterline) s->maxCenterline=eCenterline;
+	}
+	s->n++;
+}
+
+/*
+ * Note that the segmentation failed on a frame.
+ */
+void ScoreSynthWormMissed(SynthWormScore* s){
+	s->nmissed++;
+}
+
+void PrintSynthWormScore(SynthWormScore* s){
+	printf("\nSegmentation accuracy against the synthetic worm:\n");
+	if (s->n==0){
+		printf("  no frames scored (%ld failed)\n",s->nmissed);
+		return;
+	}
+	printf("  frames scored=%ld failed=%ld head/tail flipped=%ld\n",s->n,s->nmissed,s->nflipped);
+	printf("  %-28s mean=%.2f px max=%.2f px\n","Head error",s->sumHead/s->n,s->maxHead);
+	printf("  %-28s mean=%.2f px max=%.2f px\n","Tail error",s->sumTail/s->n,s->maxTail);
+	printf("  %-28s mean=%.2f px max=%.2f px\n","Centerline error",s->sumCenterline/s->n,s->maxCenterline);
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * SyntheticWorm.h
+ *
+ * Renders frames of a crawling worm from a simple parametric model, together with
+ * the right answer (head, tail and centerline) for every frame. This lets us measure
+ * the throughput and the accuracy of the segmentation at image sizes and frame rates
+ * that our cameras can't reach yet.
+ *
+ * The worm's centerline is described by the angle of its tangent along the body
+ *
+ * 		theta(s,t) = heading(t) + amplitude * sin(2 pi (s/wavelength - waveSpeed t)) + coiling 2 pi s
+ *
+ * where s runs from 0 at the head to 1 at the tail. The body is drawn as a chain
+ * of discs along the centerline. The head end is blunt and the tail tapers to a point.
+ * The worm crawls around a circle in the middle of the image.
+ *
+ * The background is a horizontal gradient. Pixel noise is baked into a set of
+ * precomputed background rows and a long strip of body pixels, so that a frame is
+ * drawn with nothing but memcpy() and stays fast at large image sizes and frame rates.
+ *
+ * Does not depend on any other library.
+ */
+
+#ifndef SYNTHETICWORM_H_
+#define SYNTHETICWORM_H_
+
+/** Number of ground truth centerline points per frame **/
+#define SW_NUMPOINTS 100
+
+/** Number of precomputed noisy background rows (must be a power of two) **/
+#define SW_NOISEROWS 64
+
+/** Length of the strip of noisy body pixels (must be a power of two) **/
+#define SW_NOISETABLE 65536
+
+
+typedef struct SynthPointStruct{
+	double x;
+	double y;
+} SynthPoint;
+
+/*
+ * Parameters of the model. Lengths are in pixels, times in seconds.
+ */
+typedef struct SynthWormModelStruct{
+	double fps; // frame rate of the simulated camera
+	double length; // head to tail, along the body
+	double width; // at the widest point
+	double wavelength; // of the body wave, in body lengths
+	double amplitude; // of the body wave, in radians
+	double waveSpeed; // body waves per second passing from head to tail
+	double coiling; // 0 = straight sinusoid, 1 = the body curls around once
+	double crawlSpeed; // speed of the worm around its circle, pixels per second
+	double noise; // peak pixel noise, gray levels
+	int background; // gray level of the background at the left edge
+	int gradient; // change in background gray level from the left edge to the right edge
+	int body; // gray level of the worm
+} SynthWormModel;
+
+/*
+ * The right answer for a single frame
+ */
+typedef struct SynthWormTruthStruct{
+	unsigned long seq; // frame it belongs to
+	SynthPoint Head;
+	SynthPoint Tail;
+	SynthPoint Centerline[SW_NUMPOINTS]; // equally spaced from head to tail
+} SynthWormTruth;
+
+typedef struct SynthWormRendererStruct{
+	SynthWormModel model;
+	int width;
+	int height;
+
+	/** Noisy background rows. Each row of the frame is a copy of one of them **/
+	unsigned char* bgRows;
+
+	/** Noisy body pixels. Each run of body pixels is copied from somewhere in here **/
+	unsigned char* bodyStrip;
+
+	/** Scratch space for the densely sampled centerline and body radius **/
+	int nsamples; // number of discs
+	SynthPoint* samples;
+	double* radius;
+} SynthWormRenderer;
+
+
+/*
+ * Fill in a model with sensible values for frames of this size.
+ */
+void SetDefaultSynthWormModel(SynthWormModel* m, int width, int height);
+
+/*
+ * Override parts of a model with a comma separated list of name=value pairs, e.g.
+ *
+ * 		fps=500,length=600,width=40,speed=2,coil=0.5,noise=10,gradient=30
+ *
+ * Names are fps, length, width, wavelength, amplitude, speed, coil, crawl,
+ * noise, background, gradient and body.
+ * Returns 0 on success and -1 if something couldn't be understood.
+ */
+int ParseSynthWormModel(const char* spec, SynthWormModel* m);
+
+SynthWormRenderer* CreateSynthWormRenderer(SynthWormModel* m, int width, int height);
+
+void DestroySynthWormRenderer(SynthWormRenderer** r);
+
+/*
+ * Render frame seq (at time t seconds) into buf, whose rows are step bytes apart,
+ * and fill in the right answer for it.
+ */
+void RenderSynthWorm(SynthWormRenderer* r, unsigned long seq, double t, unsigned char* buf, int step, SynthWormTruth* truth);
+
+
+/************************************************/
+/*   Scoring the segmentation against the truth
+ *
+ */
+/************************************************/
+
+typedef struct SynthWormScoreStruct{
+	long n; // frames scored
+	long nmissed; // frames where the segmentation failed
+	long nflipped; // frames where head and tail were swapped
+	double sumHead, maxHead; // distance from the true head (pixels)
+	double sumTail, maxTail;
+	double sumCenterline, maxCenterline; // mean distance from each found centerline point to the true centerline
+} SynthWormScore;
+
+void ClearSynthWormScore(SynthWormScore* s);
+
+/*
+ * Score the head, tail and centerline found for a frame against the right answer.
+ */
+void ScoreSynthWorm(SynthWormScore* s, SynthWormTruth* truth, SynthPoint head, SynthPoint tail, SynthPoint* centerline, int n);
+
+/*
+ * Note that the segmentation failed on a frame.
+ */
+void ScoreSynthWormMissed(SynthWormScore* s);
+
+void PrintSynthWormScore(SynthWormScore* s);
+
+
+#endif /* SYNTHETICWORM_H_ */
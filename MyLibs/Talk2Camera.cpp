@@ -72,6 +72,24 @@ void T2Cam_CloseLib() {
 void T2Cam_AllocateCamData(CamData** MyCamera) {
 	printf("inside T2Cam_AllocateCamData\n");
 	*MyCamera = (CamData*) malloc(sizeof(CamData));
+	(*MyCamera)->iFrameNumber=0;
+	(*MyCamera)->iArrivalTime=0;
+	RT_InitFlag(&((*MyCamera)->iFrameArrived));
+}
+
+/*
+ * Block until the camera has delivered a frame newer than lastFrameSeen,
+ * or until timeout ms have passed.
+ *
+ * The callback signals iFrameArrived, so this sleeps instead of spinning.
+ */
+int T2Cam_WaitForNewFrame(CamData* Camera, unsigned long lastFrameSeen, int timeout) {
+	if (Camera->iFrameNumber > lastFrameSeen) return 1;
+	RT_ClearFlag(&(Camera->iFrameArrived));
+	/** Look again in case the frame arrived just before the flag was cleared **/
+	if (Camera->iFrameNumber > lastFrameSeen) return 1;
+	RT_WaitFlag(&(Camera->iFrameArrived), timeout);
+	return (Camera->iFrameNumber > lastFrameSeen);
 }
 
 /*
@@ -162,6 +180,7 @@ void T2Cam_TurnOff(CamData** CameraDataStruct) {
 			printf("Success. There is no valid video capture device opened.\n ");
 		}
 
+		RT_ReleaseFlag(&((*CameraDataStruct)->iFrameArrived));
 		free(*CameraDataStruct);
 		printf("Releasing memory from CamData struct\n");
 	}else{
@@ -194,7 +213,11 @@ void _cdecl callback(HGRABBER hGrabber, unsigned char* pData,
 	//if (!CallBackDataStruct->iProcessing) {
 		//CallBackDataStruct->iProcessing = 1;
 		CallBackDataStruct->iImageData = pData; //Copy the frame data into the structure.
+		CallBackDataStruct->iArrivalTime = RT_Now();
 		CallBackDataStruct->iFrameNumber = frameNumber;
+
+		/** Wake up whoever is waiting for this frame **/
+		RT_SetFlag(&(CallBackDataStruct->iFrameArrived));
 		if (PRINT_DEBUG) {
 			printf("Within callback: iframeNumber %d \n", frameNumber);
 		}
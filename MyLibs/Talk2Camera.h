@@ -36,6 +36,7 @@
 #ifndef TALK2CAMERA_H_
 #define TALK2CAMERA_H_
 #include "../3rdPartyLibs/tisgrabber.h"
+#include "RTThreads.h"
 #include <stdio.h>
 
 #define PRINT_DEBUG 0
@@ -60,6 +61,8 @@ struct CamDataStruct {
 	COLORFORMAT iColorFormat;
 	int iProcessing;
 	unsigned long iFrameNumber;
+	double iArrivalTime; // time (in seconds, on the RT_Now() clock) at which the callback received frame iFrameNumber
+	RTFlag iFrameArrived; // set by the callback every time a frame arrives
 };
 
 /*
@@ -96,6 +99,14 @@ void _cdecl callback(HGRABBER hGrabber, unsigned char* pData,
  */
 void T2Cam_AllocateCamData(CamData** CameraDataStruct);
 
+/*
+ * Block until the camera has delivered a frame newer than lastFrameSeen,
+ * or until timeout ms have passed.
+ *
+ * Returns 1 if a new frame is ready and 0 if it timed out.
+ */
+int T2Cam_WaitForNewFrame(CamData* Camera, unsigned long lastFrameSeen, int timeout);
+
 /*
  * Show the Device Selection Dialog, initilize the camera and store the resulting
  * framegrabber handle in CamData->hgrabber.
@@ -29,6 +29,7 @@
 
 /** C includes **/
 #include    <stdio.h>
+#include    <stdlib.h>
 #include    <conio.h>
 
 /** BitFlow SDK includes **/
@@ -38,6 +39,7 @@
 #include	"DSApi.h"
 #include 	"BiApi.h"
 
+#include "RTThreads.h"
 #include "Talk2FrameGrabber.h"
 
 
@@ -57,6 +59,24 @@ FrameGrabber* CreateFrameGrabberObject(){
 	fg->HostBuf=BFNULL;
 	fg->WasOneShot = FALSE;
 	fg->ContinuousData= FALSE;
+
+	fg->RingRunning=FALSE;
+	fg->NumBuffers=0;
+	for (int k=0; k<T2FG_MAXBUFFERS; k++) fg->RingLent[k]=0;
+	fg->RingFrameCount=0;
+	fg->RingFrameBase=0;
+	fg->RingFrames=0;
+	fg->RingDropped=0;
+	fg->NumLent=0;
+	fg->MaxLent=0;
+	fg->RingStart=0;
+	fg->RingClockOffset=0;
+	fg->RoiX=0;
+	fg->RoiY=0;
+	fg->SensorXsize=0;
+	fg->SensorYsize=0;
+	fg->RoiMoves=0;
+	fg->Sim=NULL;
 	return fg;
 
 }
@@ -142,10 +162,21 @@ int FrameGrabberSetRegionOfInterest(FrameGrabber* fg,int xoff, int yoff,int xsiz
 
 
 	if (ret==CI_OK) printf("FrameGrabberSetRegionOfInterst= is Good!!\n\n");
+	fg->RoiX=xoff;
+	fg->RoiY=yoff;
 	return 1;
 }
 
 
+/*
+ * Set up the board to snap one frame at a time into fg->HostBuf
+ */
+static BFRC SetupSingleFrameAcquisition(FrameGrabber* fg){
+	return CiAqSetup(fg->hBoard, (PBFVOID) fg->HostBuf, fg->ImageSize, 0, CiDMADataMem,
+				CiLutBypass, CiLut8Bit, CiQTabBank0, TRUE, CiQTabModeOneBank,
+				AqEngJ);
+}
+
 int PrepareFrameGrabberForAcquire(FrameGrabber* fg){
 	// find out how big the image is
 		CiBrdInquire(fg->hBoard, CiCamInqFrameSize0, &(fg->ImageSize));
@@ -156,6 +187,10 @@ int PrepareFrameGrabberForAcquire(FrameGrabber* fg){
 		CiBrdInquire(fg->hBoard,CiCamInqXSize,&(fg->xsize));
 		CiBrdInquire(fg->hBoard,CiCamInqYSize0,&(fg->ysize));
 
+		/** The region of interest can later be moved around within this one (see FrameGrabberMoveRegionOfInterest()) **/
+		fg->SensorXsize=fg->xsize;
+		fg->SensorYsize=fg->ysize;
+
 		// allocate host memory to hold the image
 		fg->HostBuf = (PBFU8) malloc(fg->ImageSize);
 			printf("Memory allocated to hold the image.\n");
@@ -170,9 +205,7 @@ int PrepareFrameGrabberForAcquire(FrameGrabber* fg){
 
 		printf("About to setup board for acquisition.\n");
 		// set up board for acquisistion
-		if (CiAqSetup(fg->hBoard, (PBFVOID) fg->HostBuf, fg->ImageSize, 0, CiDMADataMem,
-				CiLutBypass, CiLut8Bit, CiQTabBank0, TRUE, CiQTabModeOneBank,
-				AqEngJ)) {
+		if (SetupSingleFrameAcquisition(fg)) {
 			BFErrorShow(fg->hBoard);
 			printf("Setting up for acquisition failed - exit.\n");
 			free(fg->HostBuf);
@@ -298,6 +331,8 @@ int AcquireFrame(FrameGrabber* fg){
 
 int CloseFrameGrabber(FrameGrabber* fg){
 
+	if (fg->RingRunning) StopContinuousAcquisition(fg);
+
 	// put board back in oneshot mode
 		if (fg->WasOneShot)
 			CiConVTrigModeSet(fg->hBoard, fg->OrigTrigMode, fg->TrigAssign, fg->TrigAPolarity,
@@ -307,8 +342,8 @@ int CloseFrameGrabber(FrameGrabber* fg){
 		if (fg->ContinuousData)
 			CiConSwTrig(fg->hBoard, CiTrigA, CiTrigDeassert);
 
-		// clean up acquisition resources
-		CiAqCleanUp(fg->hBoard, AqEngJ);
+		// clean up acquisition resources (continuous acquisition cleans up after itself)
+		if (fg->NumBuffers==0) CiAqCleanUp(fg->hBoard, AqEngJ);
 
 		// free buffer
 		free(fg->HostBuf);
@@ -321,3 +356,174 @@ int CloseFrameGrabber(FrameGrabber* fg){
 		return 1;
 
 }
+
+
+
+/************************************************/
+/*   Continuous acquisition
+ *
+ */
+/************************************************/
+
+/*
+ * Allocate numBuffers DMA host buffers of the current image size and start
+ * acquiring into them. The ring statistics are left alone.
+ * On failure the board is set up to snap one frame at a time again.
+ */
+static int StartRing(FrameGrabber* fg, int numBuffers){
+	/** The single frame acquisition set up by PrepareFrameGrabberForAcquire() is replaced by the ring **/
+	CiAqCleanUp(fg->hBoard, AqEngJ);
+
+	BFRC ret=BiBufferAllocCam(fg->hBoard, &(fg->BufArray), (BFU32) numBuffers);
+	if (ret!=BI_OK){
+		BiErrorShow(fg->hBoard, ret);
+		printf("Could not allocate host buffers for continuous acquisition.\n");
+		SetupSingleFrameAcquisition(fg);
+		return T2FG_ERROR;
+	}
+
+	/** Never stop on overflow: overwrite the oldest frame that is not lent out **/
+	if (BiCircAqSetup(fg->hBoard, &(fg->BufArray), CirErIgnore, BiAqEngJ)!=BI_OK){
+		printf("Setting up continuous acquisition failed.\n");
+		BiBufferFree(fg->hBoard, &(fg->BufArray));
+		SetupSingleFrameAcquisition(fg);
+		return T2FG_ERROR;
+	}
+
+	fg->NumBuffers=numBuffers;
+	for (int k=0; k<T2FG_MAXBUFFERS; k++) fg->RingLent[k]=0;
+	fg->NumLent=0;
+
+	if (BiCirControl(fg->hBoard, &(fg->BufArray), BISTART, BiAsync)!=BI_OK){
+		printf("Starting continuous acquisition failed.\n");
+		BiCircCleanUp(fg->hBoard, &(fg->BufArray));
+		BiBufferFree(fg->hBoard, &(fg->BufArray));
+		fg->NumBuffers=0;
+		SetupSingleFrameAcquisition(fg);
+		return T2FG_ERROR;
+	}
+	fg->RingRunning=TRUE;
+	return T2FG_SUCCESS;
+}
+
+/*
+ * Stop the ring and free its buffers. The ring statistics are left alone.
+ */
+static void StopRing(FrameGrabber* fg){
+	BiCirControl(fg->hBoard, &(fg->BufArray), BISTOP, BiWait);
+	BiCircCleanUp(fg->hBoard, &(fg->BufArray));
+	BiBufferFree(fg->hBoard, &(fg->BufArray));
+	fg->RingRunning=FALSE;
+}
+
+int StartContinuousAcquisition(FrameGrabber* fg, int numBuffers){
+	if (numBuffers > T2FG_MAXBUFFERS) numBuffers=T2FG_MAXBUFFERS;
+	if (numBuffers < 2) numBuffers=2;
+
+	printf("Allocating %d DMA host buffers for continuous acquisition.\n",numBuffers);
+	fg->RingFrameCount=0;
+	fg->RingFrameBase=0;
+	fg->RingFrames=0;
+	fg->RingDropped=0;
+	fg->MaxLent=0;
+	if (StartRing(fg, numBuffers)!=T2FG_SUCCESS) return T2FG_ERROR;
+	fg->RingStart=RT_Now();
+	return T2FG_SUCCESS;
+}
+
+int AcquireRingBuffer(FrameGrabber* fg, int timeout, unsigned char** buf, double* captured){
+	BiCirHandle h;
+	BFRC ret=BiCirWaitDoneFrame(fg->hBoard, &(fg->BufArray), (BFU32) timeout, &h);
+	if (ret==BI_CIR_STOPPED || ret==BI_CIR_ABORTED) return T2FG_ERROR;
+	if (ret!=BI_OK) return T2FG_TIMEOUT;
+
+	/** Keep the board from writing into this buffer while it is lent out **/
+	BiCirStatusSet(fg->hBoard, &(fg->BufArray), h, BIHOLD);
+
+	int k=(int) h.BufferNumber;
+	fg->RingHandle[k]=h;
+	fg->RingLent[k]=1;
+	fg->NumLent++;
+	if (fg->NumLent > fg->MaxLent) fg->MaxLent=fg->NumLent;
+
+	/** The board stamps each frame as it arrives, on a clock with its own zero.
+	 * A frame can't be taken off of the ring before it arrives, so the smallest
+	 * difference between RT_Now() and a stamp is the offset between the clocks
+	 * (give or take the latency of the freshest frame). **/
+	double offset=RT_Now()-h.HiResTimeStamp.totalSec;
+	if (fg->RingFrames==0 || offset < fg->RingClockOffset) fg->RingClockOffset=offset;
+	*captured=h.HiResTimeStamp.totalSec+fg->RingClockOffset;
+
+	/** Gaps in the frame count are frames that were overwritten before we got to them **/
+	unsigned long count=fg->RingFrameBase+h.FrameCount;
+	if (fg->RingFrames > 0 && count > fg->RingFrameCount+1) fg->RingDropped+=count - fg->RingFrameCount - 1;
+	fg->RingFrameCount=count;
+	fg->RingFrames++;
+
+	*buf=(unsigned char*) h.pBufData;
+	return T2FG_SUCCESS;
+}
+
+int ReleaseRingBuffer(FrameGrabber* fg, unsigned char* buf){
+	for (int k=0; k<fg->NumBuffers; k++){
+		if (fg->RingLent[k] && (unsigned char*) fg->BufArray.BufferArry[k]==buf){
+			BiCirStatusSet(fg->hBoard, &(fg->BufArray), fg->RingHandle[k], BIAVAILABLE);
+			fg->RingLent[k]=0;
+			fg->NumLent--;
+			return T2FG_SUCCESS;
+		}
+	}
+	printf("Error in ReleaseRingBuffer(): this buffer was not lent out by the ring.\n");
+	return T2FG_ERROR;
+}
+
+int StopContinuousAcquisition(FrameGrabber* fg){
+	if (!fg->RingRunning) return T2FG_SUCCESS;
+	StopRing(fg);
+
+	double elapsed=RT_Now()-fg->RingStart;
+	printf("Continuous acquisition: %ld frames in %.1f s (%.1f fps) through %d buffers, %ld dropped, at most %d lent out at once.\n",
+			fg->RingFrames,elapsed,(elapsed > 0) ? fg->RingFrames/elapsed : 0,fg->NumBuffers,fg->RingDropped,fg->MaxLent);
+	if (fg->RoiMoves > 0) printf("The region of interest was moved %ld times.\n",fg->RoiMoves);
+	return T2FG_SUCCESS;
+}
+
+int FrameGrabberMoveRegionOfInterest(FrameGrabber* fg, int xoff, int yoff, int xsize, int ysize){
+	if (xoff==fg->RoiX && yoff==fg->RoiY && xsize==(int) fg->xsize && ysize==(int) fg->ysize) return T2FG_SUCCESS;
+	if (xoff < 0 || yoff < 0 || xsize <= 0 || ysize <= 0 || xsize % 4 != 0
+			|| xoff+xsize > (int) fg->SensorXsize || yoff+ysize > (int) fg->SensorYsize){
+		printf("Error in FrameGrabberMoveRegionOfInterest(): %dx%d at (%d,%d) does not fit the %dx%d sensor.\n",
+				xsize,ysize,xoff,yoff,(int) fg->SensorXsize,(int) fg->SensorYsize);
+		return T2FG_ERROR;
+	}
+
+	/** The ring's buffers are the size of the old region, so the ring has to start over **/
+	int ring=fg->RingRunning;
+	int numBuffers=fg->NumBuffers;
+	if (ring){
+		if (fg->NumLent > 0) return T2FG_TIMEOUT;
+		StopRing(fg);
+		fg->RingFrameBase=fg->RingFrameCount;
+	} else {
+		CiAqCleanUp(fg->hBoard, AqEngJ);
+	}
+
+	if (CiAqROISet(fg->hBoard,(BFU32) xoff,(BFU32) yoff,(BFU32) xsize,(BFU32) ysize, AqEngJ)!=CI_OK){
+		printf("Error in FrameGrabberMoveRegionOfInterest(): the board would not take the new region of interest.\n");
+		xoff=fg->RoiX;
+		yoff=fg->RoiY;
+		xsize=(int) fg->xsize;
+		ysize=(int) fg->ysize;
+	} else {
+		fg->RoiMoves++;
+	}
+	fg->RoiX=xoff;
+	fg->RoiY=yoff;
+	fg->xsize=(BFU32) xsize;
+	fg->ysize=(BFU32) ysize;
+	fg->ImageSize=(BFU32) (xsize*ysize*((fg->BitDepth > 8) ? 2 : 1));
+
+	/** fg->HostBuf was allocated for the whole sensor so it holds any smaller region **/
+	if (ring) return StartRing(fg, numBuffers);
+	return (SetupSingleFrameAcquisition(fg)==CI_OK) ? T2FG_SUCCESS : T2FG_ERROR;
+}
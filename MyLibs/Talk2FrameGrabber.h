@@ -41,9 +41,14 @@
 #include	"BFApi.h"
 #include	"BFErApi.h"
 #include	"DSApi.h"
+#include	"BiApi.h"
 
 #define T2FG_ERROR -1
 #define T2FG_SUCCESS 0
+#define T2FG_TIMEOUT 1
+
+/** Maximum number of host buffers in the ring for continuous acquisition **/
+#define T2FG_MAXBUFFERS 16
 
 /*
  * Thread to update the video display
@@ -69,6 +74,13 @@ typedef struct FrameGrabberStruct {
 	BFU32 xsize;
 	BFU32 ysize;
 
+	/** Region of interest: xsize x ysize pixels of the sensor starting at (RoiX,RoiY) **/
+	int RoiX;
+	int RoiY;
+	BFU32 SensorXsize; // size of the largest region of interest (the one set up by TurnOnFrameGrabber())
+	BFU32 SensorYsize;
+	long RoiMoves; // times the region of interest was moved while acquiring
+
 	int keeplooping;
 	int overflowcount;
 
@@ -77,6 +89,26 @@ typedef struct FrameGrabberStruct {
 
 	BFBOOL ContinuousData;
 
+	/** Continuous acquisition into a ring of DMA host buffers **/
+	BFBOOL RingRunning;
+	int NumBuffers;
+	BIBA BufArray; // BitFlow buffer array
+	BiCirHandle RingHandle[T2FG_MAXBUFFERS]; // handle of each buffer while it is lent out
+	int RingLent[T2FG_MAXBUFFERS]; // 1 if the buffer is lent out
+
+	/** Ring statistics **/
+	unsigned long RingFrameCount; // frame count of the most recently acquired frame
+	unsigned long RingFrameBase; // added to the board's frame count, which starts over when the ring is restarted
+	long RingFrames; // frames lent out
+	long RingDropped; // frames overwritten before they were lent out
+	int NumLent; // buffers currently lent out
+	int MaxLent;
+	double RingStart; // time (in seconds) at which continuous acquisition started
+	double RingClockOffset; // add to the board's time stamps to get RT_Now() times
+
+	/** State of the simulated frame grabber (DontTalk2FrameGrabber.cpp only) **/
+	void* Sim;
+
 } FrameGrabber;
 
 
@@ -115,6 +147,20 @@ int FrameGrabberSetRegionOfInterest(FrameGrabber* fg,int xoff, int yoff,int xsiz
 
 int PrepareFrameGrabberForAcquire(FrameGrabber* fg);
 
+/*
+ * Move the region of interest while acquiring, so that from the next frame on
+ * only xsize x ysize pixels starting at (xoff,yoff) come off the sensor.
+ * xsize must be a multiple of 4 and the region must lie within SensorXsize x SensorYsize.
+ *
+ * During continuous acquisition the ring has to be stopped and started again
+ * with buffers of the new size: frames waiting in the ring are lost and no
+ * buffer may be lent out. Frame counts carry on from where they were.
+ *
+ * Returns T2FG_SUCCESS, T2FG_TIMEOUT if ring buffers are still lent out (try again
+ * once they have been handed back) or T2FG_ERROR
+ */
+int FrameGrabberMoveRegionOfInterest(FrameGrabber* fg, int xoff, int yoff, int xsize, int ysize);
+
 
 /*
  * Set the acquisition timeout time, t, in ms.
@@ -134,4 +180,41 @@ int AcquireFrame(FrameGrabber* fg);
 int CloseFrameGrabber(FrameGrabber* fg);
 
 
+/*
+ * Continuous acquisition
+ *
+ * Instead of snapping one frame at a time into fg->HostBuf, the board
+ * acquires continuously into a ring of numBuffers DMA host buffers.
+ *
+ * Each acquired buffer is lent out as is (no copy) by AcquireRingBuffer()
+ * and must be handed back with ReleaseRingBuffer(). The board never writes
+ * into a buffer that is lent out. If the consumer falls behind, the oldest
+ * frames that are not lent out are overwritten and counted as dropped.
+ *
+ * Run this after PrepareFrameGrabberForAcquire().
+ */
+int StartContinuousAcquisition(FrameGrabber* fg, int numBuffers);
+
+/*
+ * Wait up to timeout ms for the next frame.
+ * On success *buf points to the host buffer holding the frame and *captured
+ * is the time (on the RT_Now() clock) at which the frame arrived in the ring,
+ * which may be well before it was taken off of the ring.
+ *
+ * Returns T2FG_SUCCESS, T2FG_TIMEOUT or T2FG_ERROR
+ */
+int AcquireRingBuffer(FrameGrabber* fg, int timeout, unsigned char** buf, double* captured);
+
+/*
+ * Hand a buffer from AcquireRingBuffer() back to the ring.
+ */
+int ReleaseRingBuffer(FrameGrabber* fg, unsigned char* buf);
+
+/*
+ * Stop continuous acquisition, free the ring and print the ring statistics.
+ * Buffers that are still lent out become invalid.
+ */
+int StopContinuousAcquisition(FrameGrabber* fg);
+
+
 #endif /* TALK2FRAMEGRABBER_H_ */
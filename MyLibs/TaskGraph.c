@@ -0,0 +1,299 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * TaskGraph.c
+ *
+ * A tiny task-graph executor on a persistent pool of worker threads.
+ * See TaskGraph.h for an overview.
+ */
+
+//Standard C headers
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "RTThreads.h"
+#include "TaskGraph.h"
+
+
+/************************************************/
+/*   Building the graph
+ *
+ */
+/************************************************/
+
+void ClearTaskGraph(TaskGraph* g){
+	g->ntasks=0;
+	g->nready=0;
+	g->ncompleted=0;
+	g->nfailed=0;
+}
+
+int AddTask(TaskGraph* g, const char* name, TaskFunc func, void* arg, int priority){
+	if (g->ntasks >= TG_MAXTASKS) {
+		printf("Error in AddTask(): too many tasks in the graph. Increase TG_MAXTASKS.\n");
+		return TG_ERROR;
+	}
+	int k=g->ntasks;
+	Task* t=&(g->tasks[k]);
+	t->name=name;
+	t->func=func;
+	t->arg=arg;
+	t->priority=priority;
+	t->nDeps=0;
+	t->nSucc=0;
+	t->remaining=0;
+	t->failed=0;
+	t->nruns=0;
+	t->nfailures=0;
+	t->busy=0;
+	t->maxBusy=0;
+	g->ntasks++;
+	return k;
+}
+
+int AddTaskDependency(TaskGraph* g, int before, int after){
+	if (before < 0 || before >= g->ntasks || after < 0 || after >= g->ntasks || before==after){
+		printf("Error in AddTaskDependency(): invalid task index.\n");
+		return TG_ERROR;
+	}
+	Task* b=&(g->tasks[before]);
+	if (b->nSucc >= TG_MAXSUCCESSORS){
+		printf("Error in AddTaskDependency(): too many successors for task %s.\n",b->name);
+		return TG_ERROR;
+	}
+	b->succ[b->nSucc]=after;
+	b->nSucc++;
+	g->tasks[after].nDeps++;
+	return TG_SUCCESS;
+}
+
+
+/************************************************/
+/*   Running the graph
+ *
+ */
+/************************************************/
+
+/*
+ * Take the highest priority ready task off of the graph's ready list,
+ * run it and then release any tasks that were waiting on it.
+ *
+ * Only call this after successfully waiting on pool->work.
+ */
+static void ExecuteReadyTask(WorkerPool* pool){
+	RT_LockMutex(&(pool->lock));
+	TaskGraph* g=pool->graph;
+	if (g==NULL || g->nready==0){
+		/** Nothing to do. This should not happen. **/
+		RT_UnlockMutex(&(pool->lock));
+		return;
+	}
+
+	/** Find the ready task with the highest priority **/
+	int best=0;
+	for (int i=1; i<g->nready; i++){
+		if (g->tasks[g->ready[i]].priority > g->tasks[g->ready[best]].priority) best=i;
+	}
+	int k=g->ready[best];
+	g->ready[best]=g->ready[g->nready-1];
+	g->nready--;
+	RT_UnlockMutex(&(pool->lock));
+
+	/** Run the task, unless a task it depends on has failed **/
+	Task* t=&(g->tasks[k]);
+	int failed=t->failed;
+	double elapsed=0;
+	if (!failed){
+		double tStart=RT_Now();
+		failed=(t->func(t->arg)!=TG_SUCCESS);
+		elapsed=RT_Now()-tStart;
+	}
+
+	RT_LockMutex(&(pool->lock));
+	if (failed){
+		t->failed=1;
+		t->nfailures++;
+		g->nfailed++;
+	} else {
+		t->nruns++;
+		t->busy+=elapsed;
+		if (elapsed > t->maxBusy) t->maxBusy=elapsed;
+	}
+
+	/** Release the tasks that were waiting on this one **/
+	int nowReady=0;
+	for (int i=0; i<t->nSucc; i++){
+		Task* s=&(g->tasks[t->succ[i]]);
+		if (failed) s->failed=1;
+		s->remaining--;
+		if (s->remaining==0){
+			g->ready[g->nready]=t->succ[i];
+			g->nready++;
+			nowReady++;
+		}
+	}
+	g->ncompleted++;
+	if (g->ncompleted==g->ntasks) pool->finished=1;
+	RT_UnlockMutex(&(pool->lock));
+
+	RT_PostSemaphore(&(pool->work),nowReady);
+	RT_SetFlag(&(pool->progress));
+}
+
+/*
+ * Each worker thread sleeps until a task is ready.
+ */
+static void TaskWorkerThread(void* arg){
+	WorkerPool* pool=(WorkerPool*) arg;
+	while (1){
+		RT_WaitSemaphore(&(pool->work),RT_INFINITE);
+		if (pool->quit) break;
+		ExecuteReadyTask(pool);
+	}
+}
+
+int RunTaskGraph(WorkerPool* pool, TaskGraph* g){
+	if (g->ntasks==0) return TG_SUCCESS;
+
+	/** Every task with no dependencies is ready to go **/
+	RT_LockMutex(&(pool->lock));
+	pool->graph=g;
+	pool->finished=0;
+	g->nready=0;
+	g->ncompleted=0;
+	g->nfailed=0;
+	for (int k=0; k<g->ntasks; k++){
+		g->tasks[k].remaining=g->tasks[k].nDeps;
+		g->tasks[k].failed=0;
+		if (g->tasks[k].remaining==0){
+			g->ready[g->nready]=k;
+			g->nready++;
+		}
+	}
+	int nready=g->nready;
+	RT_UnlockMutex(&(pool->lock));
+
+	if (nready==0){
+		printf("Error in RunTaskGraph(): every task depends on another task.\n");
+		RT_LockMutex(&(pool->lock));
+		pool->graph=NULL;
+		RT_UnlockMutex(&(pool->lock));
+		return TG_ERROR;
+	}
+	RT_PostSemaphore(&(pool->work),nready);
+
+	/** Help out until the last task is done.
+	 * The flag is cleared before looking for work, so a task that finishes
+	 * after we look always wakes us up again. **/
+	while (1){
+		RT_ClearFlag(&(pool->progress));
+		if (RT_WaitSemaphore(&(pool->work),0)){
+			ExecuteReadyTask(pool);
+			continue;
+		}
+		if (pool->finished) break;
+		RT_WaitFlag(&(pool->progress),RT_INFINITE);
+	}
+
+	RT_LockMutex(&(pool->lock));
+	pool->graph=NULL;
+	int nfailed=g->nfailed;
+	RT_UnlockMutex(&(pool->lock));
+
+	return (nfailed > 0) ? TG_ERROR : TG_SUCCESS;
+}
+
+
+/************************************************/
+/*   Worker Pool
+ *
+ */
+/************************************************/
+
+WorkerPool* CreateWorkerPool(int nworkers){
+	if (nworkers < 0) nworkers=0;
+	WorkerPool* pool=(WorkerPool*) malloc(sizeof(WorkerPool));
+	RT_InitMutex(&(pool->lock));
+	RT_InitSemaphore(&(pool->work),0,TG_MAXTASKS+nworkers);
+	RT_InitFlag(&(pool->progress));
+	pool->finished=0;
+	pool->graph=NULL;
+	pool->quit=0;
+	pool->nworkers=0;
+	pool->threads=(RTThread**) malloc(sizeof(RTThread*)*(nworkers+1));
+
+	for (int k=0; k<nworkers; k++){
+		RTThread* t=RT_StartThread(TaskWorkerThread,(void*) pool);
+		if (t==NULL) {
+			printf("Cannot create worker thread. Running with %d workers.\n",pool->nworkers);
+			break;
+		}
+		pool->threads[pool->nworkers]=t;
+		pool->nworkers++;
+	}
+	return pool;
+}
+
+void DestroyWorkerPool(WorkerPool** pool){
+	WorkerPool* p=*pool;
+	if (p==NULL) return;
+
+	/** Wake every worker up and tell it to exit **/
+	p->quit=1;
+	RT_PostSemaphore(&(p->work),p->nworkers);
+	for (int k=0; k<p->nworkers; k++){
+		RT_JoinThread(&(p->threads[k]));
+	}
+
+	free(p->threads);
+	RT_ReleaseSemaphore(&(p->work));
+	RT_ReleaseFlag(&(p->progress));
+	RT_ReleaseMutex(&(p->lock));
+	free(p);
+	*pool=NULL;
+}
+
+
+/************************************************/
+/*   Statistics
+ *
+ */
+/************************************************/
+
+void PrintTaskGraphReport(TaskGraph* g){
+	printf("\nTask graph report:\n");
+	printf("  %-20s %8s %8s %8s %10s %10s\n","task","priority","runs","failures","mean(ms)","max(ms)");
+	for (int k=0; k<g->ntasks; k++){
+		Task* t=&(g->tasks[k]);
+		printf("  %-20s %8d %8ld %8ld %10.2f %10.2f\n",t->name,t->priority,t->nruns,t->nfailures,
+				(t->nruns > 0) ? 1000*t->busy/t->nruns : 0,
+				1000*t->maxBusy);
+	}
+	printf("\n");
+}
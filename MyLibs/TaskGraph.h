@@ -0,0 +1,182 @@
+/*
+ * Copyright 2010 Andrew Leifer et al <leifer@fas.harvard.edu>
+ * This file is part of MindControl.
+ *
+ * MindControl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU  General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MindControl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MindControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For the most up to date version of this software, see:
+ * http://github.com/samuellab/mindcontrol
+ *
+ *
+ *
+ * NOTE: If you use any portion of this code in your research, kindly cite:
+ * Leifer, A.M., Fang-Yen, C., Gershow, M., Alkema, M., and Samuel A. D.T.,
+ * 	"Optogenetic manipulation of neural activity with high spatial resolution in
+ *	freely moving Caenorhabditis elegans," Nature Methods, Submitted (2010).
+ */
+
+/*
+ * TaskGraph.h
+ *
+ * A tiny task-graph executor that runs on a persistent pool of worker threads.
+ *
+ * A task graph is a handful of tasks (a function and an argument) plus the
+ * dependencies between them. A task is started as soon as every task it depends
+ * on has finished. When more than one task is ready, the one with the highest
+ * priority is started first.
+ *
+ * A task reports failure by returning TG_ERROR. Tasks that depend on a failed
+ * task are skipped and counted as failed too, and RunTaskGraph() returns TG_ERROR.
+ *
+ * The graph is meant to be rebuilt (or simply re-run) every frame, so there is
+ * no dynamic memory: a graph holds at most TG_MAXTASKS tasks.
+ *
+ * The worker threads are created once with CreateWorkerPool() and are reused
+ * for every call to RunTaskGraph(). The thread that calls RunTaskGraph() also
+ * executes tasks, so a pool with zero workers runs the graph sequentially
+ * in priority order.
+ *
+ * Depends on RTThreads.h
+ */
+
+#ifndef TASKGRAPH_H_
+#define TASKGRAPH_H_
+
+#ifndef RTTHREADS_H_
+ #error "#include RTThreads.h" must appear in source files before "#include TaskGraph.h"
+#endif
+
+/** Maximum number of tasks in a graph **/
+#define TG_MAXTASKS 16
+
+/** Maximum number of tasks that can depend on a single task **/
+#define TG_MAXSUCCESSORS 8
+
+/** Error codes **/
+#define TG_ERROR -1
+#define TG_SUCCESS 0
+
+/** Task priorities **/
+#define TG_PRIORITY_LOW 0
+#define TG_PRIORITY_HIGH 10
+
+/** A task returns TG_SUCCESS or TG_ERROR **/
+typedef int (*TaskFunc)(void* arg);
+
+typedef struct TaskStruct{
+	const char* name;
+	TaskFunc func;
+	void* arg;
+	int priority; // when several tasks are ready, the highest priority runs first
+
+	/** Dependencies **/
+	int nDeps; // number of tasks that must finish before this one starts
+	int nSucc; // number of tasks that depend on this one
+	int succ[TG_MAXSUCCESSORS];
+
+	/** Run time state **/
+	int remaining; // dependencies that have not yet finished
+	int failed; // 1 if this task or a task it depends on failed on this run
+
+	/** Timing statistics (seconds) **/
+	long nruns;
+	long nfailures; // runs that failed or were skipped
+	double busy; // total time spent running this task
+	double maxBusy; // longest single run
+} Task;
+
+typedef struct TaskGraphStruct{
+	Task tasks[TG_MAXTASKS];
+	int ntasks;
+
+	/** Run time state **/
+	int ready[TG_MAXTASKS]; // tasks whose dependencies have all finished
+	int nready;
+	int ncompleted;
+	int nfailed; // tasks that failed or were skipped on this run
+} TaskGraph;
+
+typedef struct WorkerPoolStruct{
+	int nworkers;
+	RTThread** threads;
+
+	/** Guards the graph's run time state **/
+	RTMutex lock;
+
+	/** Semaphore counting the ready tasks **/
+	RTSemaphore work;
+
+	/** Set every time a task finishes, so that the calling thread can look for more work **/
+	RTFlag progress;
+
+	/** 1 once the last task of the graph has finished **/
+	volatile int finished;
+
+	/** The graph currently being run (or NULL) **/
+	TaskGraph* graph;
+
+	/** Tells the worker threads to exit **/
+	volatile int quit;
+} WorkerPool;
+
+
+/*
+ * Remove all tasks from a graph and zero its statistics.
+ */
+void ClearTaskGraph(TaskGraph* g);
+
+/*
+ * Add a task to the graph.
+ *
+ * Returns the index of the task, which is used to add dependencies,
+ * or TG_ERROR if the graph is full.
+ */
+int AddTask(TaskGraph* g, const char* name, TaskFunc func, void* arg, int priority);
+
+/*
+ * Declare that the task "after" may not start until the task "before" has finished.
+ *
+ * Returns TG_SUCCESS or TG_ERROR.
+ */
+int AddTaskDependency(TaskGraph* g, int before, int after);
+
+/*
+ * Start a pool of nworkers worker threads that wait for tasks.
+ * nworkers may be zero.
+ */
+WorkerPool* CreateWorkerPool(int nworkers);
+
+/*
+ * Stop the worker threads and free the pool.
+ * Must not be called while a graph is running.
+ */
+void DestroyWorkerPool(WorkerPool** pool);
+
+/*
+ * Run every task in the graph once, respecting dependencies and priorities.
+ * The calling thread helps execute tasks.
+ *
+ * Blocks until every task in the graph has finished.
+ *
+ * Returns TG_SUCCESS, or TG_ERROR if any task failed.
+ */
+int RunTaskGraph(WorkerPool* pool, TaskGraph* g);
+
+/*
+ * Print how many times each task ran, how often it failed and how long it took.
+ */
+void PrintTaskGraphReport(TaskGraph* g);
+
+
+#endif /* TASKGRAPH_H_ */
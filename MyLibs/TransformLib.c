@@ -274,42 +274,22 @@ int cvtPtCam2DLP(CvPoint camPt, CvPoint* DLPpt,CalibData* Calib) {
  * Transform's a sequence from Cameraspace to DLP space
  * This is an internal function only.
  */
-int TransformSeqCam2DLP(CvSeq* camSeq, CvSeq* DLPseq, CalibData* Calib){
+int TransformSeqCam2DLP(PointBuf* camSeq, PointBuf* DLPseq, CalibData* Calib){
 	if (camSeq==NULL || DLPseq==NULL) {
 		printf ("ERROR! TransformSeqCam2DLP() was given NULL sequences\n");
 		return -1;
 	}
-	/** Clear the points in the destination **/
-	cvClearSeq(DLPseq);
-
-	/** Setup CvSeq Reader **/
-	CvSeqReader reader;
-	cvStartReadSeq(camSeq,&reader,0);
-
-	/**Setup CvSeq Writer **/
-	CvSeqWriter writer;
-	cvStartAppendToSeq(DLPseq, &writer);
-
-	/** Temp points **/
-	CvPoint DLPpt;
-	CvPoint camPt;
-	CvPoint* camPtptr;
-	int numpts=camSeq->total;
+	/** Make room for the points in the destination **/
+	int numpts=camSeq->n;
+	DLPseq->n=0;
+	ReservePointBuf(DLPseq,numpts);
+
 	int j;
 	for (j = 0; j < numpts; ++j) {
-
-		camPtptr= (CvPoint*) reader.ptr;
-		camPt=*camPtptr;
-
 		/** Actually do the conversion **/
-		cvtPtCam2DLP(camPt,&DLPpt,Calib);
-
-
-		CV_WRITE_SEQ_ELEM( DLPpt, writer);
-		CV_NEXT_SEQ_ELEM(camSeq->elem_size,reader);
-
+		cvtPtCam2DLP(camSeq->pts[j],&(DLPseq->pts[j]),Calib);
 	}
-	cvEndWriteSeq(&writer);
+	DLPseq->n=numpts;
 	return 1;
 }
 
@@ -325,9 +305,9 @@ int TransformSegWormCam2DLP(SegmentedWorm* camWorm, SegmentedWorm* dlpWorm,Calib
 
 	/** Transform points on centerline, right and left bounds**/
 	ClearSegmentedInfo(dlpWorm);
-	TransformSeqCam2DLP(camWorm->Centerline, dlpWorm->Centerline, Calib);
-	TransformSeqCam2DLP(camWorm->RightBound, dlpWorm->RightBound, Calib);
-	TransformSeqCam2DLP(camWorm->LeftBound, dlpWorm->LeftBound, Calib);
+	TransformSeqCam2DLP(&(camWorm->Centerline), &(dlpWorm->Centerline), Calib);
+	TransformSeqCam2DLP(&(camWorm->RightBound), &(dlpWorm->RightBound), Calib);
+	TransformSeqCam2DLP(&(camWorm->LeftBound), &(dlpWorm->LeftBound), Calib);
 
 
 	/** Transform points on Head and Tail **/
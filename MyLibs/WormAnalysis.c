@@ -27,8 +27,14 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <time.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 //OpenCV Headers
 #include <cxcore.h>
@@ -89,6 +95,27 @@ WormAnalysisData* CreateWormAnalysisDataStruct(){
 	WormPtr->ImgOrig =NULL;
 	WormPtr->ImgSmooth =NULL;
 	WormPtr->ImgThresh =NULL;
+	WormPtr->ImgMask =NULL;
+	WormPtr->SmoothBuf.mem=NULL;
+	WormPtr->SmoothBuf.size=0;
+	WormPtr->ImgBinned =NULL;
+	WormPtr->Bin=1;
+	WormPtr->Refine=0;
+	WormPtr->RefineMem=NULL;
+	WormPtr->RefineSize=0;
+	WormPtr->CurveMem=NULL;
+	WormPtr->CurveSize=0;
+	InitPtSmoother(&(WormPtr->Smoother));
+	WormPtr->ImgOrig16 =NULL;
+	SetConv16Shift(&(WormPtr->Conv),8);
+	WormPtr->Thresh16=0;
+	WormPtr->Search=NULL;
+	WormPtr->TracePts=NULL;
+	WormPtr->TraceCapacity=0;
+	WormPtr->RunLength=0;
+	memset(&(WormPtr->Runs),0,sizeof(RunMask));
+	WormPtr->SearchRect=cvRect(0,0,0,0);
+	WormPtr->SmoothRect=cvRect(0,0,0,0);
 
 	WormPtr->frameNum=0;
 	WormPtr->frameNumCamInternal=0;
@@ -98,13 +125,19 @@ WormAnalysisData* CreateWormAnalysisDataStruct(){
 	WormPtr->SizeOfImage.width= 0;
 
 	WormPtr->timestamp=0;
+	WormPtr->tCaptured=0;
+	WormPtr->tIlluminated=0;
 
 	/*** Initialze Worm Memory Storage***/
 	InitializeWormMemStorage(WormPtr);
 
-	/**** Allocate Memory for CvSeq ***/
-	WormPtr->Boundary=cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),WormPtr->MemStorage);
-	WormPtr->Centerline=cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),WormPtr->MemStorage);
+	/**** Set up the point buffers (allocated as they are first filled) ***/
+	InitPointBuf(&(WormPtr->Boundary),CV_SEQ_POLYGON);
+	InitPointBuf(&(WormPtr->Centerline),CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&(WormPtr->BoundA),CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&(WormPtr->BoundB),CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&(WormPtr->Resampled),CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&(WormPtr->SmoothCenterline),CV_SEQ_ELTYPE_POINT);
 
 
 
@@ -129,6 +162,21 @@ void DestroyWormAnalysisDataStruct(WormAnalysisData* Worm){
 	if (Worm->ImgOrig !=NULL)	cvReleaseImage(&(Worm->ImgOrig));
 	if (Worm->ImgThresh !=NULL) cvReleaseImage(&(Worm->ImgThresh));
 	if (Worm->ImgSmooth !=NULL) cvReleaseImage(&(Worm->ImgSmooth));
+	if (Worm->ImgMask !=NULL) cvReleaseImage(&(Worm->ImgMask));
+	if (Worm->ImgBinned !=NULL) cvReleaseImage(&(Worm->ImgBinned));
+	ReleaseSmoothBuffer(&(Worm->SmoothBuf));
+	ReleaseRunMask(&(Worm->Runs));
+	if (Worm->RefineMem !=NULL) free(Worm->RefineMem);
+	if (Worm->CurveMem !=NULL) cvFree(&(Worm->CurveMem));
+	ReleasePtSmoother(&(Worm->Smoother));
+	if (Worm->Search !=NULL && Worm->Search->Owner==Worm) free(Worm->Search);
+	if (Worm->TracePts !=NULL) free(Worm->TracePts);
+	ReleasePointBuf(&(Worm->Boundary));
+	ReleasePointBuf(&(Worm->Centerline));
+	ReleasePointBuf(&(Worm->BoundA));
+	ReleasePointBuf(&(Worm->BoundB));
+	ReleasePointBuf(&(Worm->Resampled));
+	ReleasePointBuf(&(Worm->SmoothCenterline));
 	cvReleaseMemStorage(&((Worm)->MemScratchStorage));
 	cvReleaseMemStorage(&((Worm)->MemStorage));
 	free((Worm)->Segmented);
@@ -179,6 +227,9 @@ void InitializeEmptyWormImages(WormAnalysisData* Worm, CvSize ImageSize){
 	Worm->ImgOrig= cvCreateImage(ImageSize,IPL_DEPTH_8U,1);
 	Worm->ImgSmooth=cvCreateImage(ImageSize,IPL_DEPTH_8U,1);
 	Worm->ImgThresh=cvCreateImage(ImageSize,IPL_DEPTH_8U,1);
+	Worm->ImgMask=cvCreateImage(ImageSize,IPL_DEPTH_8U,1);
+	cvSetZero(Worm->ImgSmooth);
+	cvSetZero(Worm->ImgThresh);
 
 	/** Clear the Time Stamp **/
 	Worm->timestamp=0;
@@ -186,6 +237,235 @@ void InitializeEmptyWormImages(WormAnalysisData* Worm, CvSize ImageSize){
 }
 
 
+/*
+ * Find the worm's outline on an image binned bin x bin.
+ * Reallocates ImgSmooth, ImgThresh and ImgMask at the size of the analysis image.
+ */
+int SetWormBinning(WormAnalysisData* Worm, int bin){
+	if (bin!=1 && bin!=2 && bin!=4){
+		printf("Error! The worm can only be binned 1, 2 or 4 times in SetWormBinning(), not %d.\n",bin);
+		return -1;
+	}
+	if (Worm->ImgOrig==NULL){
+		printf("Error! Run InitializeEmptyWormImages() before SetWormBinning().\n");
+		return -1;
+	}
+	if (Worm->ImgBinned !=NULL) cvReleaseImage(&(Worm->ImgBinned));
+	if (Worm->ImgSmooth !=NULL) cvReleaseImage(&(Worm->ImgSmooth));
+	if (Worm->ImgThresh !=NULL) cvReleaseImage(&(Worm->ImgThresh));
+	if (Worm->ImgMask !=NULL) cvReleaseImage(&(Worm->ImgMask));
+
+	/** Rows and columns left over at the edge of the frame are left out **/
+	CvSize size=cvSize(Worm->SizeOfImage.width/bin,Worm->SizeOfImage.height/bin);
+	Worm->Bin=bin;
+	if (bin > 1) Worm->ImgBinned=cvCreateImage(size,IPL_DEPTH_8U,1);
+	Worm->ImgSmooth=cvCreateImage(size,IPL_DEPTH_8U,1);
+	Worm->ImgThresh=cvCreateImage(size,IPL_DEPTH_8U,1);
+	Worm->ImgMask=cvCreateImage(size,IPL_DEPTH_8U,1);
+	cvSetZero(Worm->ImgSmooth);
+	cvSetZero(Worm->ImgThresh);
+	Worm->SearchRect=cvRect(0,0,0,0);
+	Worm->SmoothRect=cvRect(0,0,0,0);
+	return 0;
+}
+
+/*
+ * Give Worm a search of its own if it doesn't have one yet.
+ * It starts out with neither a margin nor tracing turned on.
+ */
+static void NeedWormSearch(WormAnalysisData* Worm){
+	if (Worm->Search!=NULL) return;
+	Worm->Search=(WormSearch*) malloc(sizeof(WormSearch));
+	Worm->Search->Owner=Worm;
+	Worm->Search->Margin=0;
+	Worm->Search->Trace=0;
+	for (int k=0; k<2; k++){
+		Worm->Search->nframes[k]=0;
+		Worm->Search->seconds[k]=0;
+		Worm->Search->pixels[k]=0;
+		Worm->Search->ntraced[k]=0;
+		Worm->Search->traceSeconds[k]=0;
+	}
+	Worm->Search->nfallbacks=0;
+	Worm->Search->nmissed=0;
+}
+
+/*
+ * Free Worm's search once neither a margin nor tracing is using it.
+ */
+static void DropUnusedWormSearch(WormAnalysisData* Worm){
+	WormSearch* s=Worm->Search;
+	if (s==NULL || s->Margin > 0 || s->Trace) return;
+	if (s->Owner==Worm) free(s);
+	Worm->Search=NULL;
+}
+
+/*
+ * Only search for the worm where it is predicted to be.
+ */
+int SetWormSearch(WormAnalysisData* Worm, int margin){
+	if (margin <= 0){
+		if (Worm->Search==NULL) return 0;
+		Worm->Search->Margin=0;
+		DropUnusedWormSearch(Worm);
+		return 0;
+	}
+	NeedWormSearch(Worm);
+	Worm->Search->Margin=margin;
+	ForgetWormPosition(Worm);
+	return 0;
+}
+
+/*
+ * Trace only the worm's outline, starting from where it was.
+ */
+int SetWormTrace(WormAnalysisData* Worm, int on){
+	if (!on){
+		if (Worm->Search==NULL) return 0;
+		Worm->Search->Trace=0;
+		DropUnusedWormSearch(Worm);
+		return 0;
+	}
+	NeedWormSearch(Worm);
+	Worm->Search->Trace=1;
+	ForgetWormPosition(Worm);
+	return 0;
+}
+
+void ShareWormSearch(WormAnalysisData* Worm, WormAnalysisData* Master){
+	if (Worm->Search !=NULL && Worm->Search->Owner==Worm) free(Worm->Search);
+	Worm->Search=Master->Search;
+}
+
+void ForgetWormPosition(WormAnalysisData* Worm){
+	if (Worm->Search==NULL) return;
+	Worm->Search->Box=cvRect(0,0,0,0);
+	Worm->Search->Velocity=cvPoint(0,0);
+	Worm->Search->Perimeter=0;
+}
+
+void PrintWormSearch(WormSearch* Search){
+	double ms[2];
+	if (Search->Margin > 0){
+		printf("\nSearching for the worm near where it was (%d pixel margin):\n",Search->Margin);
+		const char* what[2]={"whole frame","predicted region"};
+		for (int k=0; k<2; k++){
+			long n=Search->nframes[k];
+			ms[k]= (n > 0) ? 1000*Search->seconds[k]/n : 0;
+			printf("\t%s: %ld frames, %.3f ms per frame, %.0f pixels per frame\n",what[k],n,ms[k],(n > 0) ? Search->pixels[k]/n : 0.0);
+		}
+		printf("\tthe whole frame had to be searched again %ld times because the worm touched the edge of the region or wasn't in it\n",Search->nfallbacks);
+		if (ms[0] > 0 && ms[1] > 0) printf("\tspeedup: %.1fx\n",ms[0]/ms[1]);
+	}
+	if (Search->Trace){
+		printf("\nTracing the worm's outline from where it was:\n");
+		const char* what[2]={"every blob (cvFindContours)","traced from a seed"};
+		for (int k=0; k<2; k++){
+			long n=Search->ntraced[k];
+			ms[k]= (n > 0) ? 1000*Search->traceSeconds[k]/n : 0;
+			printf("\t%s: %ld outlines, %.3f ms per outline\n",what[k],n,ms[k]);
+		}
+		printf("\tno seed landed on the worm %ld times\n",Search->nmissed);
+		if (ms[0] > 0 && ms[1] > 0) printf("\tspeedup: %.1fx\n",ms[0]/ms[1]);
+	}
+}
+
+
+/*
+ * Copy one block of bin rows of a frame (if dst is not NULL) and, in the same pass,
+ * average each bin x bin block of pixels into one pixel of the binned row.
+ *
+ * Uses SSE2 when the compiler has it: 32 (bin 2) or 64 (bin 4) source pixels
+ * of every row at a time.
+ */
+static void CopyAndBinRows(const unsigned char* src, int srcStep, unsigned char* dst, int dstStep,
+		unsigned char* binned, int width, int bin){
+	int binnedWidth=width/bin;
+	int x=0; // next binned pixel
+	int k;
+#ifdef __SSE2__
+	const __m128i lowBytes=_mm_set1_epi16(0x00FF);
+	if (bin==2){
+		const __m128i two=_mm_set1_epi16(2);
+		for (; x+16 <= binnedWidth; x+=16){
+			__m128i sumA=_mm_setzero_si128();
+			__m128i sumB=_mm_setzero_si128();
+			for (k=0; k<2; k++){
+				__m128i a=_mm_loadu_si128((const __m128i*) (src+k*srcStep+2*x));
+				__m128i b=_mm_loadu_si128((const __m128i*) (src+k*srcStep+2*x+16));
+				if (dst!=NULL){
+					_mm_storeu_si128((__m128i*) (dst+k*dstStep+2*x),a);
+					_mm_storeu_si128((__m128i*) (dst+k*dstStep+2*x+16),b);
+				}
+				/** Add each pair of neighboring pixels into 16 bits **/
+				sumA=_mm_add_epi16(sumA,_mm_add_epi16(_mm_and_si128(a,lowBytes),_mm_srli_epi16(a,8)));
+				sumB=_mm_add_epi16(sumB,_mm_add_epi16(_mm_and_si128(b,lowBytes),_mm_srli_epi16(b,8)));
+			}
+			sumA=_mm_srli_epi16(_mm_add_epi16(sumA,two),2);
+			sumB=_mm_srli_epi16(_mm_add_epi16(sumB,two),2);
+			_mm_storeu_si128((__m128i*) (binned+x),_mm_packus_epi16(sumA,sumB));
+		}
+	} else if (bin==4){
+		const __m128i ones=_mm_set1_epi16(1);
+		const __m128i eight=_mm_set1_epi16(8);
+		for (; x+16 <= binnedWidth; x+=16){
+			__m128i sum[4];
+			int j;
+			for (j=0; j<4; j++) sum[j]=_mm_setzero_si128();
+			for (k=0; k<4; k++){
+				for (j=0; j<4; j++){
+					__m128i a=_mm_loadu_si128((const __m128i*) (src+k*srcStep+4*x+16*j));
+					if (dst!=NULL) _mm_storeu_si128((__m128i*) (dst+k*dstStep+4*x+16*j),a);
+					sum[j]=_mm_add_epi16(sum[j],_mm_add_epi16(_mm_and_si128(a,lowBytes),_mm_srli_epi16(a,8)));
+				}
+			}
+			/** Add neighboring pairs of pairs into 32 bits, 16 pixels each, and narrow back down **/
+			__m128i lo=_mm_packs_epi32(_mm_madd_epi16(sum[0],ones),_mm_madd_epi16(sum[1],ones));
+			__m128i hi=_mm_packs_epi32(_mm_madd_epi16(sum[2],ones),_mm_madd_epi16(sum[3],ones));
+			lo=_mm_srli_epi16(_mm_add_epi16(lo,eight),4);
+			hi=_mm_srli_epi16(_mm_add_epi16(hi,eight),4);
+			_mm_storeu_si128((__m128i*) (binned+x),_mm_packus_epi16(lo,hi));
+		}
+	}
+#endif
+
+	/** Whatever is left of the row **/
+	if (dst!=NULL){
+		for (k=0; k<bin; k++) memcpy(dst+k*dstStep+bin*x,src+k*srcStep+bin*x,width-bin*x);
+	}
+	int area=bin*bin;
+	for (; x<binnedWidth; x++){
+		int sum=0;
+		int i;
+		for (k=0; k<bin; k++){
+			for (i=0; i<bin; i++) sum+=src[k*srcStep+bin*x+i];
+		}
+		binned[x]=(unsigned char) ((sum+area/2)/area);
+	}
+}
+
+/*
+ * Copy a frame into a worm image (if dst is not NULL) and bin it into Worm->ImgBinned in the same pass.
+ */
+static void CopyAndBinWormImg(WormAnalysisData* Worm, IplImage* src, IplImage* dst){
+	int bin=Worm->Bin;
+	int width=Worm->SizeOfImage.width;
+	int height=Worm->SizeOfImage.height;
+	IplImage* binned=Worm->ImgBinned;
+	int y;
+	for (y=0; y<binned->height; y++){
+		CopyAndBinRows((unsigned char*) src->imageData+bin*y*src->widthStep,src->widthStep,
+				(dst==NULL) ? NULL : (unsigned char*) dst->imageData+bin*y*dst->widthStep,dst->widthStep,
+				(unsigned char*) binned->imageData+y*binned->widthStep,width,bin);
+	}
+	/** Rows left over at the bottom **/
+	if (dst!=NULL){
+		for (y=bin*binned->height; y<height; y++)
+			memcpy(dst->imageData+y*dst->widthStep,src->imageData+y*src->widthStep,width);
+	}
+}
+
+
 
 
 /*
@@ -202,6 +482,7 @@ void LoadWormColorOriginal(WormAnalysisData* Worm, IplImage* ImgColorOrig){
 		return;
 	}
 	cvCvtColor( ImgColorOrig, Worm->ImgOrig, CV_BGR2GRAY);
+	if (Worm->Bin > 1) CopyAndBinWormImg(Worm,Worm->ImgOrig,NULL);
 
 	/** Set the TimeStamp **/
 	Worm->timestamp=clock();
@@ -224,8 +505,9 @@ int LoadWormImg(WormAnalysisData* Worm, IplImage* Img){
 	/** Set the TimeStamp **/
 	Worm->timestamp=clock();
 
-	/** Copy the Image **/
-	cvCopy( Img, Worm->ImgOrig,0);
+	/** Copy the Image, binning it on the way if need be **/
+	if (Worm->Bin > 1) CopyAndBinWormImg(Worm,Img,Worm->ImgOrig);
+	else cvCopy( Img, Worm->ImgOrig,0);
 	return 0;
 
 }
@@ -338,10 +620,10 @@ SegWorm->NumSegments=0;
 
 SegWorm->MemSegStorage=cvCreateMemStorage(0);
 
-/*** Allocate Memory for the sequences ***/
-SegWorm->Centerline=cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),SegWorm->MemSegStorage);
-SegWorm->LeftBound=cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),SegWorm->MemSegStorage);
-SegWorm->RightBound=cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),SegWorm->MemSegStorage);
+/*** Set up the point buffers ***/
+InitPointBuf(&(SegWorm->Centerline),CV_SEQ_ELTYPE_POINT);
+InitPointBuf(&(SegWorm->LeftBound),CV_SEQ_ELTYPE_POINT);
+InitPointBuf(&(SegWorm->RightBound),CV_SEQ_ELTYPE_POINT);
 
 return SegWorm;
 }
@@ -365,10 +647,10 @@ SegWorm->NumSegments=0;
 
 SegWorm->MemSegStorage=mem;
 
-/*** Allocate Memory for the sequences ***/
-SegWorm->Centerline=cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),SegWorm->MemSegStorage);
-SegWorm->LeftBound=cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),SegWorm->MemSegStorage);
-SegWorm->RightBound=cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),SegWorm->MemSegStorage);
+/*** Set up the point buffers ***/
+InitPointBuf(&(SegWorm->Centerline),CV_SEQ_ELTYPE_POINT);
+InitPointBuf(&(SegWorm->LeftBound),CV_SEQ_ELTYPE_POINT);
+InitPointBuf(&(SegWorm->RightBound),CV_SEQ_ELTYPE_POINT);
 
 return SegWorm;
 }
@@ -376,6 +658,9 @@ return SegWorm;
 
 void DestroySegmentedWormStruct(SegmentedWorm* SegWorm){
 cvReleaseMemStorage(&(SegWorm->MemSegStorage));
+ReleasePointBuf(&(SegWorm->Centerline));
+ReleasePointBuf(&(SegWorm->LeftBound));
+ReleasePointBuf(&(SegWorm->RightBound));
 free((SegWorm->Head));
 free((SegWorm->Tail));
 free((SegWorm->centerOfWorm));
@@ -390,22 +675,9 @@ void ClearSegmentedInfo(SegmentedWorm* SegWorm){
 	//SegWorm->Head=NULL; /** This is probably a mistake **/
 	//SegWorm->Tail=NULL; /** This is probably a mistake  because memory is not reallocated later.**/
 
-	if (SegWorm->LeftBound!=NULL){
-		cvClearSeq(SegWorm->LeftBound);
-	}else{
-		printf("SegWorm->LeftBound==NULL");
-	}
-	if (SegWorm->RightBound!=NULL){
-			cvClearSeq(SegWorm->RightBound);
-		}else{
-			printf("SegWorm->RightBound==NULL");
-		}
-
-	if (SegWorm->Centerline!=NULL){
-			cvClearSeq(SegWorm->Centerline);
-		}else{
-			printf("SegWorm->Centerline==NULL");
-		}
+	SegWorm->LeftBound.n=0;
+	SegWorm->RightBound.n=0;
+	SegWorm->Centerline.n=0;
 
 
 }
@@ -423,152 +695,678 @@ void ClearSegmentedInfo(SegmentedWorm* SegWorm){
 
 
 /*
- * Smooths, thresholds and finds the worms contour.
- * The original image must already be loaded into Worm.ImgOrig
- * The Smoothed image is deposited into Worm.ImgSmooth
- * The thresholded image is deposited into Worm.ImgThresh
- * The Boundary is placed in Worm.Boundary
+ * Scale a boundary found on an image binned bin x bin back up to full resolution.
  *
+ * Each binned pixel becomes the pixel at the middle of its block and bin-1 points
+ * are filled in between neighboring points, so the boundary ends up with about as
+ * many points as if it had been found at full resolution (which the length scales
+ * used to find the head and tail and to segment the worm assume).
+ * Neighboring points on the boundary are at most one binned pixel apart, so the
+ * points filled in land exactly on pixels.
  */
-void FindWormBoundary(WormAnalysisData* Worm, WormAnalysisParam* Params){
-	/** This function currently takes around 5-7 ms **/
+static void ScaleUpWormBoundary(PointBuf* Boundary, int bin){
+	int n=Boundary->n;
+	if (n==0) return;
+	ReservePointBuf(Boundary,n*bin);
+
 	/**
-	 * Before I forget.. plan to make this faster by:
-	 *  a) using region of interest
-	 *  b) decimating to make it smaller (maybe?)
-	 *  c) resize
-	 *  d) not using CV_GAUSSIAN for smoothing
+	 * Done in place, from the last point back, so each binned point is read before
+	 * the full resolution points overwrite it (point i goes to i*bin onwards)
 	 */
-	TICTOC::timer().tic("cvSmooth");
-	cvSmooth(Worm->ImgOrig,Worm->ImgSmooth,CV_GAUSSIAN,Params->GaussSize*2+1);
-	//cvSmooth(Worm->ImgOrig,Worm->ImgSmooth,CV_MEDIAN,Params->GaussSize*2+1);
-	//cvSmooth(Worm->ImgOrig,Worm->ImgSmooth,CV_BLUR,Params->GaussSize*2+1,Params->GaussSize*2+1);
-	TICTOC::timer().toc("cvSmooth");
-	TICTOC::timer().tic("cvThreshold");
-	cvThreshold(Worm->ImgSmooth,Worm->ImgThresh,Params->BinThresh,255,CV_THRESH_BINARY );
-	TICTOC::timer().toc("cvThreshold");
-	CvSeq* contours;
-	IplImage* TempImage=cvCreateImage(cvGetSize(Worm->ImgThresh),IPL_DEPTH_8U,1);
-	cvCopy(Worm->ImgThresh,TempImage);
-	TICTOC::timer().tic("cvFindContours");
-	cvFindContours(TempImage,Worm->MemStorage, &contours,sizeof(CvContour),CV_RETR_EXTERNAL,CV_CHAIN_APPROX_NONE,cvPoint(0,0));
-	TICTOC::timer().toc("cvFindContours");
-	TICTOC::timer().tic("cvLongestContour");
-	if (contours) LongestContour(contours,&(Worm->Boundary));
-	TICTOC::timer().toc("cvLongestContour");
-	cvReleaseImage(&TempImage);
+	CvPoint* pts=Boundary->pts;
+	CvPoint next=pts[0];
+	int center=(bin-1)/2;
+	int i,k;
+	for (i=n-1; i>=0; i--){
+		CvPoint pt=pts[i];
+		for (k=0; k<bin; k++){
+			pts[i*bin+k].x=bin*pt.x+center+(next.x-pt.x)*k;
+			pts[i*bin+k].y=bin*pt.y+center+(next.y-pt.y)*k;
+		}
+		next=pt;
+	}
+	Boundary->n=n*bin;
+}
 
+/*
+ * Black out the part of a displayed image that was filled in last time (*last)
+ * unless rect is about to cover it, and remember rect for next time.
+ */
+static void ClearLastRect(IplImage* img, CvRect* last, CvRect rect){
+	CvRect l=*last;
+	if (l.width > 0 && (l.x < rect.x || l.y < rect.y || l.x+l.width > rect.x+rect.width || l.y+l.height > rect.y+rect.height)){
+		cvSetImageROI(img,l);
+		cvSetZero(img);
+		cvResetImageROI(img);
+	}
+	*last=rect;
 }
 
+/*
+ * Make room for n points in Worm.TracePts.
+ */
+static void NeedTracePoints(WormAnalysisData* Worm, int n){
+	if (n <= Worm->TraceCapacity) return;
+	if (Worm->TracePts!=NULL) free(Worm->TracePts);
+	Worm->TraceCapacity=2*n;
+	Worm->TracePts=(CvPoint*) malloc(Worm->TraceCapacity*sizeof(CvPoint));
+}
 
 /*
- * Finds the Worm's Head and Tail.
- * Requires Worm->Boundary
+ * Make the n points in Worm.TracePts, which are relative to rect, the worm's boundary.
+ */
+static void SetWormBoundaryFromTrace(WormAnalysisData* Worm, int n, CvRect rect){
+	PointBuf* b=&(Worm->Boundary);
+	b->n=0;
+	ReservePointBuf(b,n);
+	for (int k=0; k<n; k++){
+		b->pts[k].x=Worm->TracePts[k].x+rect.x;
+		b->pts[k].y=Worm->TracePts[k].y+rect.y;
+	}
+	b->n=n;
+}
+
+/** Most blobs on the seed row that are traced before giving up on finding the worm there **/
+#define TRACE_MAXSEEDS 8
+
+/*
+ * Trace the worm's outline in the mask (Worm.ImgMask, whose ROI is rect) starting
+ * from a blob on the row through the middle of where the worm is predicted to be
+ * (see SetWormTrace()). The boundary comes out in analysis image coordinates.
  *
+ * Returns 1 if one of the blobs looked like the worm, 0 if the whole mask has to be searched.
  */
-int GivenBoundaryFindWormHeadTail(WormAnalysisData* Worm, WormAnalysisParam* Params) {
-	if (Worm->Boundary->total < 2*Params->NumSegments) {
-		printf("Error in GivenBoundaryFindWormHeadTail(). The Boundary has too few points.");
-		return -1;
+static int TraceWormBoundary(WormAnalysisData* Worm, CvRect rect){
+	WormSearch* s=Worm->Search;
+	IplImage* mask=Worm->ImgMask;
+	int w=rect.width;
+	int h=rect.height;
+	int bin=Worm->Bin;
+	if (s->Box.width==0 || s->Perimeter==0 || w < 3 || h < 3) return 0;
+
+	/** The edge of the region is background, as it is for cvFindContours(). That is also what stops the tracing there **/
+	int step=mask->widthStep;
+	unsigned char* top=(unsigned char*) mask->imageData+rect.y*step+rect.x;
+	memset(top,0,w);
+	memset(top+(h-1)*step,0,w);
+	for (int y=1; y < h-1; y++){
+		top[y*step]=0;
+		top[y*step+w-1]=0;
 	}
 
-	/*** Clear Out Scratch Storage ***/
-	cvClearMemStorage(Worm->MemScratchStorage);
+	/**
+	 * The worm crosses every row of its own bounding box. Look along the row through the
+	 * middle of the predicted box, from a quarter box to the left of it to a quarter box to the right
+	 */
+	int y=(s->Box.y+s->Box.height/2+s->Velocity.y)/bin-rect.y;
+	int left=(s->Box.x-s->Box.width/4+s->Velocity.x)/bin-rect.x;
+	int right=(s->Box.x+s->Box.width+s->Box.width/4+s->Velocity.x)/bin-rect.x;
+	if (y < 1) y=1;
+	if (y > h-2) y=h-2;
+	if (left < 1) left=1;
+	if (right > w-2) right=w-2;
+
+	const unsigned char* row=top+y*step;
+	int seeds=0;
+	for (int x=left; x <= right && seeds < TRACE_MAXSEEDS; x++){
+		/** A blob starts here **/
+		if (row[x]==0 || row[x-1]!=0) continue;
+		seeds++;
+		CvPoint first;
+		int hole;
+		int n=FollowBlobBorder(mask,cvPoint(x,y),NULL,0,&first,&hole);
+
+		/** Inside a hole of a blob, or nothing like the worm's outline on the last frame **/
+		if (hole || n < s->Perimeter/2 || n > 2*s->Perimeter) continue;
+
+		/** Trace it again from its top left point, where cvFindContours() would have started **/
+		NeedTracePoints(Worm,n);
+		n=FollowBlobBorder(mask,first,Worm->TracePts,Worm->TraceCapacity,&first,&hole);
+		SetWormBoundaryFromTrace(Worm,n,rect);
+		return 1;
+	}
+	return 0;
+}
 
-	/* **********************************************************************/
-	/*  Express the Boundary in the form of a series of vectors connecting 	*/
-	/*  two pixels a Delta pixels apart.									*/
-	/* **********************************************************************/
+/*
+ * Find the worm's outline from the runs of the mask (Worm.Runs, taken from rect):
+ * it is the outline of the blob with the most pixels. The boundary comes out in
+ * analysis image coordinates.
+ *
+ * Returns 1 if there were any blobs.
+ */
+static int RunsWormBoundary(WormAnalysisData* Worm, CvRect rect){
+	RunMask* runs=&(Worm->Runs);
+	LabelRuns(runs);
+	int blob=LargestRunBlob(runs);
+	if (blob < 0) return 0;
+	int n=RunBlobBorder(runs,blob,Worm->TracePts,Worm->TraceCapacity);
+	if (n > Worm->TraceCapacity){
+		NeedTracePoints(Worm,n);
+		n=RunBlobBorder(runs,blob,Worm->TracePts,Worm->TraceCapacity);
+	}
+	SetWormBoundaryFromTrace(Worm,n,rect);
+	return 1;
+}
+
+/** How many binned pixels on either side of the binned outline are looked at again at full resolution **/
+#define REFINE_BAND 1
+
+/*
+ * Find the worm's outline again at full resolution, in a band around the outline
+ * found on the binned frame (Worm.Boundary, binned coordinates). See FindWormBoundary().
+ *
+ * Returns 1 if it was found, leaving it in Worm.Boundary in full resolution coordinates.
+ */
+static int RefineWormBoundary(WormAnalysisData* Worm, WormAnalysisParam* Params){
+	int bin=Worm->Bin;
+	int n=Worm->Boundary.n;
+	CvRect box=PointBufRect(&(Worm->Boundary));
+
+	/** Binned scratch images with a ring of the band's width around the outline's box, then the full resolution one **/
+	int ring=REFINE_BAND+1;
+	int cw=box.width+2*ring;
+	int ch=box.height+2*ring;
+	int cstep=(cw+3) & ~3;
+	int fw=cw*bin;
+	int fh=ch*bin;
+	int fstep=(fw+3) & ~3;
+	int size=2*cstep*ch+fstep*fh;
+	if (Worm->RefineSize < size){
+		if (Worm->RefineMem!=NULL) free(Worm->RefineMem);
+		Worm->RefineSize=size;
+		Worm->RefineMem=(unsigned char*) malloc(size);
+	}
+	unsigned char* inside=Worm->RefineMem;
+	unsigned char* band=inside+cstep*ch;
+	unsigned char* fine=band+cstep*ch;
+
+	/** Which binned pixels are inside the outline, and which are near it **/
+	IplImage img;
+	cvInitImageHeader(&img,cvSize(cw,ch),IPL_DEPTH_8U,1);
+	cvSetData(&img,inside,cstep);
+	cvSetZero(&img);
+	cvDrawContours(&img,PointBufSeq(&(Worm->Boundary)),cvScalarAll(255),cvScalarAll(255),0,CV_FILLED,8,cvPoint(ring-box.x,ring-box.y));
+	memset(band,0,cstep*ch);
+	CvPoint* pts=Worm->Boundary.pts;
+	for (int i=0; i<n; i++){
+		int x=pts[i].x-box.x+ring;
+		int y=pts[i].y-box.y+ring;
+		for (int dy=-REFINE_BAND; dy<=REFINE_BAND; dy++){
+			memset(band+(y+dy)*cstep+x-REFINE_BAND,1,2*REFINE_BAND+1);
+		}
+	}
 
-	/* Create A Matrix to store all of the dot products along the boundary.
+	/**
+	 * Full resolution mask: the band is smoothed and thresholded at full resolution and the rest
+	 * is filled in from the binned pixels. Full resolution pixel (X,Y) of it is (X+ox,Y+oy) in ImgOrig
 	 */
-	CvSeq* DotProds= cvCreateSeq(CV_32SC1,sizeof(CvSeq),sizeof(int),Worm->MemScratchStorage);
+	int ox=(box.x-ring)*bin;
+	int oy=(box.y-ring)*bin;
+	CvSize full=cvGetSize(Worm->ImgOrig);
+	SmoothKernel k;
+	MakeSmoothKernel(&k,Params->GaussSize,Params->BinThresh);
+	TICTOC::timer().tic("SmoothThresholdSpan");
+	for (int Y=0; Y<fh; Y++){
+		unsigned char* out=fine+Y*fstep;
+		if (Y+oy < 0 || Y+oy >= full.height){
+			memset(out,0,fw);
+			continue;
+		}
+		const unsigned char* in=inside+(Y/bin)*cstep;
+		const unsigned char* near=band+(Y/bin)*cstep;
+		int cx=0;
+		while (cx < cw){
+			/** A stretch of binned pixels that are all in the band or all out of it **/
+			int end=cx+1;
+			while (end < cw && near[end]==near[cx]) end++;
+			if (!near[cx]){
+				for (int c=cx; c<end; c++) memset(out+c*bin,in[c],bin);
+			} else {
+				int X0=cx*bin;
+				int X1=end*bin;
+				if (X0+ox < 0) X0=-ox;
+				if (X1+ox > full.width) X1=full.width-ox;
+				if (cx*bin < X0) memset(out+cx*bin,0,X0-cx*bin);
+				if (end*bin > X1) memset(out+X1,0,end*bin-X1);
+				if (X1 > X0) SmoothThresholdSpan(Worm->ImgOrig,cvPoint(X0+ox,Y+oy),X1-X0,out+X0,&k,&(Worm->SmoothBuf));
+			}
+			cx=end;
+		}
+	}
+	TICTOC::timer().toc("SmoothThresholdSpan");
+
+	/** The worm is the biggest blob in it **/
+	cvInitImageHeader(&img,cvSize(fw,fh),IPL_DEPTH_8U,1);
+	cvSetData(&img,fine,fstep);
+	RunMask* runs=&(Worm->Runs);
+	MaskToRuns(&img,runs);
+	LabelRuns(runs);
+	int blob=LargestRunBlob(runs);
+	if (blob < 0) return 0;
+	n=RunBlobBorder(runs,blob,Worm->TracePts,Worm->TraceCapacity);
+	if (n > Worm->TraceCapacity){
+		NeedTracePoints(Worm,n);
+		n=RunBlobBorder(runs,blob,Worm->TracePts,Worm->TraceCapacity);
+	}
+	SetWormBoundaryFromTrace(Worm,n,cvRect(ox,oy,fw,fh));
+	return 1;
+}
 
-	//We walk around the boundary using the high-speed reader and writer objects.
-	CvSeqReader ForeReader; //ForeReader reads delta pixels ahead
-	CvSeqReader Reader; 	//Reader reads delta pixels behind
-	CvSeqReader BackReader; //BackReader reads delta pixels behind
+/*
+ * Smooth, threshold and find the worm's outline in just the rect part of the analysis image.
+ * The boundary comes out in analysis image coordinates.
+ *
+ * Returns 1 if there was an outline.
+ */
+static int FindWormBoundaryInRect(WormAnalysisData* Worm, WormAnalysisParam* Params, CvRect rect){
+	/** Work on the binned image if there is one. The smoothing kernel shrinks with it **/
+	IplImage* ImgAnalysis= (Worm->Bin > 1) ? Worm->ImgBinned : Worm->ImgOrig;
+	int GaussSize=Params->GaussSize/Worm->Bin;
+
+	/** Only fill in the images that are displayed **/
+	IplImage* thresh=NULL;
+	IplImage* smooth=NULL;
+	if (Params->Display==DISPLAY_THRESH){
+		thresh=Worm->ImgThresh;
+		ClearLastRect(thresh,&(Worm->SearchRect),rect);
+		cvSetImageROI(thresh,rect);
+	}
+	if (Params->Display==DISPLAY_SMOOTH){
+		smooth=Worm->ImgSmooth;
+		ClearLastRect(smooth,&(Worm->SmoothRect),rect);
+		cvSetImageROI(smooth,rect);
+	}
 
+	/** The mask goes straight into the image that cvFindContours() works on, or is only kept as runs **/
+	RunMask* runs= (Worm->RunLength) ? &(Worm->Runs) : NULL;
+	cvSetImageROI(ImgAnalysis,rect);
+	cvSetImageROI(Worm->ImgMask,rect);
+	if (Worm->Thresh16 && Worm->ImgOrig16!=NULL && Worm->Bin == 1){
+		/** Threshold the camera's own bits, then smooth the mask and threshold it again halfway up **/
+		TICTOC::timer().tic("ThresholdImage16");
+		cvSetImageROI(Worm->ImgOrig16,rect);
+		if (GaussSize > 0){
+			/** The mask waits in ImgSmooth while it is smoothed (so that is what DISPLAY_SMOOTH shows) **/
+			if (smooth==NULL) ClearLastRect(Worm->ImgSmooth,&(Worm->SmoothRect),rect);
+			cvSetImageROI(Worm->ImgSmooth,rect);
+			ThresholdImage16(Worm->ImgOrig16,Worm->ImgSmooth,Conv16Level(&(Worm->Conv),Params->BinThresh));
+			if (runs!=NULL) SmoothThresholdRuns(Worm->ImgSmooth,runs,thresh,NULL,GaussSize,127,&(Worm->SmoothBuf));
+			else SmoothThreshold(Worm->ImgSmooth,Worm->ImgMask,thresh,NULL,GaussSize,127,&(Worm->SmoothBuf));
+		} else {
+			ThresholdImage16(Worm->ImgOrig16,Worm->ImgMask,Conv16Level(&(Worm->Conv),Params->BinThresh));
+			if (thresh!=NULL) cvCopy(Worm->ImgMask,thresh);
+			if (smooth!=NULL) cvCopy(Worm->ImgMask,smooth);
+			if (runs!=NULL) MaskToRuns(Worm->ImgMask,runs);
+		}
+		cvResetImageROI(Worm->ImgOrig16);
+		TICTOC::timer().toc("ThresholdImage16");
+	} else {
+		TICTOC::timer().tic("SmoothThreshold");
+		if (runs!=NULL) SmoothThresholdRuns(ImgAnalysis,runs,thresh,smooth,GaussSize,Params->BinThresh,&(Worm->SmoothBuf));
+		else SmoothThreshold(ImgAnalysis,Worm->ImgMask,thresh,smooth,GaussSize,Params->BinThresh,&(Worm->SmoothBuf));
+		TICTOC::timer().toc("SmoothThreshold");
+	}
+	cvResetImageROI(ImgAnalysis);
+	cvResetImageROI(Worm->ImgSmooth);
+	cvResetImageROI(Worm->ImgThresh);
+
+	if (runs!=NULL){
+		cvResetImageROI(Worm->ImgMask);
+		TICTOC::timer().tic("RunsWormBoundary");
+		int found=RunsWormBoundary(Worm,rect);
+		TICTOC::timer().toc("RunsWormBoundary");
+		return found;
+	}
 
-	/**** Local Variables ***/
-	int i;
-	CvPoint* Pt;
-	CvPoint* AheadPt;
-	CvPoint* BehindPt;
-	CvPoint AheadVec;
-	CvPoint BehindVec;
-	int TotalBPts = Worm->Boundary->total;
+	/** Try tracing just the worm first **/
+	WormSearch* s=Worm->Search;
+	int tracing=(s!=NULL && s->Trace);
+	double t0=(double) cvGetTickCount();
+	if (tracing){
+		TICTOC::timer().tic("TraceWormBoundary");
+		int traced=TraceWormBoundary(Worm,rect);
+		TICTOC::timer().toc("TraceWormBoundary");
+		if (traced){
+			cvResetImageROI(Worm->ImgMask);
+			s->ntraced[1]++;
+			s->traceSeconds[1]+=((double) cvGetTickCount()-t0)/(cvGetTickFrequency()*1e6);
+			return 1;
+		}
+		if (s->Box.width > 0) s->nmissed++;
+	}
 
-	/*** Initializing Read & Write Apparatus ***/
-	int AheadPtr=0;
-	int BehindPtr=0;
-	int Ptr=0;
-	int* DotProdPtr;
-	int DotProdVal;
+	/** The offset puts the contour back in the coordinates of the whole image **/
+	CvSeq* contours=NULL;
+	TICTOC::timer().tic("cvFindContours");
+	cvFindContours(Worm->ImgMask,Worm->MemStorage, &contours,sizeof(CvContour),CV_RETR_EXTERNAL,CV_CHAIN_APPROX_NONE,cvPoint(rect.x,rect.y));
+	TICTOC::timer().toc("cvFindContours");
+	cvResetImageROI(Worm->ImgMask);
+	TICTOC::timer().tic("cvLongestContour");
+	if (contours){
+		CvSeq* longest=NULL;
+		LongestContour(contours,&longest);
+		SetPointBufFromSeq(&(Worm->Boundary),longest);
+	}
+	TICTOC::timer().toc("cvLongestContour");
+	if (tracing){
+		s->ntraced[0]++;
+		s->traceSeconds[0]+=((double) cvGetTickCount()-t0)/(cvGetTickFrequency()*1e6);
+	}
+	return (contours!=NULL);
+}
 
+/*
+ * Stretch the interval from lo to hi by d in the direction of d
+ */
+static void StretchInterval(int* lo, int* hi, int d){
+	if (d < 0) *lo+=d;
+	else *hi+=d;
+}
 
-	/*
-	 * Loop through all the boundary and compute the dot products between the ForeVec and BackVec.
-	 *
-	 * Note: ForeVec and BackVec have the same "handedness" along the boundary.
+/*
+ * Where the worm is predicted to be on this frame, in analysis image coordinates.
+ * The whole analysis image if there is no prediction.
+ */
+static CvRect PredictWormSearchRect(WormAnalysisData* Worm, WormAnalysisParam* Params){
+	WormSearch* s=Worm->Search;
+	int bin=Worm->Bin;
+	CvSize size=cvGetSize(Worm->ImgThresh);
+	if (s==NULL || s->Margin==0 || s->Box.width==0) return cvRect(0,0,size.width,size.height);
+
+	int left=s->Box.x;
+	int top=s->Box.y;
+	int right=s->Box.x+s->Box.width;
+	int bottom=s->Box.y+s->Box.height;
+
+	/** Where the worm is headed on its own **/
+	StretchInterval(&left,&right,s->Velocity.x);
+	StretchInterval(&top,&bottom,s->Velocity.y);
+
+	/**
+	 * The stage drags the worm toward the stage's target. Its velocity is proportional to
+	 * how far the worm is from the target (see AdjustStageToKeepObjectAtTarget()), so it
+	 * moves the worm at most the rest of the way there in between frames.
+	 */
+	int speed=Params->stageSpeedFactor;
+	if (speed > 0){
+		StretchInterval(&left,&right,Worm->stageVelocity.x/speed);
+		StretchInterval(&top,&bottom,Worm->stageVelocity.y/(speed+speed/2));
+	}
+
+	/** Add the margin and go to analysis image coordinates, rounding outward **/
+	left=(left-s->Margin)/bin;
+	top=(top-s->Margin)/bin;
+	right=(right+s->Margin+bin-1)/bin;
+	bottom=(bottom+s->Margin+bin-1)/bin;
+	if (left < 0) left=0;
+	if (top < 0) top=0;
+	if (right > size.width) right=size.width;
+	if (bottom > size.height) bottom=size.height;
+	if (right <= left || bottom <= top) return cvRect(0,0,size.width,size.height);
+	return cvRect(left,top,right-left,bottom-top);
+}
+
+/*
+ * Smooths, thresholds and finds the worms contour.
+ * The original image must already be loaded into Worm.ImgOrig
+ * The Smoothed image is deposited into Worm.ImgSmooth
+ * The thresholded image is deposited into Worm.ImgThresh
+ * The Boundary is placed in Worm.Boundary
+ *
+ */
+void FindWormBoundary(WormAnalysisData* Worm, WormAnalysisParam* Params){
+	/** This function currently takes around 5-7 ms **/
+	/**
+	 * Before I forget.. plan to make this faster by:
+	 *  a) using region of interest -- see SetWormSearch()
+	 *  b) decimating to make it smaller (maybe?) -- see SetWormBinning()
+	 *  c) resize
+	 *  d) not using CV_GAUSSIAN for smoothing -- see SmoothThreshold()
+	 *  e) only tracing the worm instead of every blob -- see SetWormTrace()
 	 */
-	//printf ("total boundary elements = %d\n", TotalBPts); //debug MHG 10/19/09
-	for (i = 0; i < TotalBPts; i++) {
-		AheadPtr = (i+Params->LengthScale)%TotalBPts;
-		BehindPtr = (i+TotalBPts-Params->LengthScale)%TotalBPts;
-		Ptr = (i)%TotalBPts;
+	WormSearch* s=Worm->Search;
+	double t0=(double) cvGetTickCount();
+	CvSize size=cvGetSize(Worm->ImgThresh);
+	CvRect rect=PredictWormSearchRect(Worm,Params);
+	int part=(rect.width < size.width || rect.height < size.height);
+	int found=FindWormBoundaryInRect(Worm,Params,rect);
+	double pixels=(double) rect.width*rect.height;
+
+	CvRect box=cvRect(0,0,0,0);
+	if (found) box=PointBufRect(&(Worm->Boundary));
+	if (part){
+		/** The worm (or part of it) may be outside of the region: look everywhere **/
+		int touches= (box.x <= rect.x && rect.x > 0) || (box.y <= rect.y && rect.y > 0)
+				|| (box.x+box.width >= rect.x+rect.width && rect.x+rect.width < size.width)
+				|| (box.y+box.height >= rect.y+rect.height && rect.y+rect.height < size.height);
+		if (!found || touches){
+			s->nfallbacks++;
+			rect=cvRect(0,0,size.width,size.height);
+			found=FindWormBoundaryInRect(Worm,Params,rect);
+			if (found) box=PointBufRect(&(Worm->Boundary));
+			pixels+=(double) rect.width*rect.height;
+			part=0;
+		}
+	}
+
+	int perimeter= found ? Worm->Boundary.n : 0;
+	if (found && Worm->Bin > 1){
+		int refined=0;
+		if (Worm->Refine){
+			TICTOC::timer().tic("RefineWormBoundary");
+			refined=RefineWormBoundary(Worm,Params);
+			TICTOC::timer().toc("RefineWormBoundary");
+		}
+		if (!refined) ScaleUpWormBoundary(&(Worm->Boundary),Worm->Bin);
+	}
 
-		//printf("AheadPtr=%d, BehindPtr=%d,Ptr=%d\n", AheadPtr,BehindPtr,Ptr);
+	if (s!=NULL){
+		/** Remember where the worm is for next time (full resolution) **/
+		if (found){
+			int bin=Worm->Bin;
+			CvRect next=cvRect(box.x*bin,box.y*bin,box.width*bin,box.height*bin);
+			if (s->Box.width > 0){
+				s->Velocity.x=(next.x+next.width/2)-(s->Box.x+s->Box.width/2);
+				s->Velocity.y=(next.y+next.height/2)-(s->Box.y+s->Box.height/2);
+			}
+			s->Box=next;
+			s->Perimeter=perimeter;
+		} else {
+			ForgetWormPosition(Worm);
+		}
+		double dt=((double) cvGetTickCount()-t0)/(cvGetTickFrequency()*1e6);
+		s->nframes[part]++;
+		s->seconds[part]+=dt;
+		s->pixels[part]+=pixels;
+	}
+}
 
 
-		AheadPt = (CvPoint*) cvGetSeqElem(Worm->Boundary,AheadPtr);
-		Pt = (CvPoint*) cvGetSeqElem(Worm->Boundary,Ptr);
-		BehindPt=(CvPoint*) cvGetSeqElem(Worm->Boundary,BehindPtr);
+/*
+ * Dot products along the boundary are kept in blocks of this many points,
+ * along with the smallest one in each block, so that the head can be found
+ * without going back over the whole boundary.
+ */
+#define CURVE_BLOCK 64
 
+#ifdef __SSE2__
+/*
+ * Narrows count points to pairs of shorts (x,y). The caller makes sure
+ * that the coordinates fit.
+ */
+static void PackPoints16(const CvPoint* src, int count, short* dst){
+	int k=0;
+	for (; k+4 <= count; k+=4){
+		__m128i a=_mm_loadu_si128((const __m128i*) (src+k));
+		__m128i b=_mm_loadu_si128((const __m128i*) (src+k+2));
+		_mm_storeu_si128((__m128i*) (dst+2*k),_mm_packs_epi32(a,b));
+	}
+	for (; k<count; k++){
+		dst[2*k]=(short) src[k].x;
+		dst[2*k+1]=(short) src[k].y;
+	}
+}
+#endif
 
-		/** Compute the Forward Vector **/
-		AheadVec = cvPoint((AheadPt->x) - (Pt->x), (AheadPt->y)
-				- (Pt->y));
+/*
+ * For each point i on a closed boundary of n points, finds the dot product
+ * of the vector from the point delta behind i to i with the vector from i
+ * to the point delta ahead of it, and stores it in dots[i].
+ * blockMin[b] gets the smallest of dots[b*CURVE_BLOCK] up to the end of
+ * that block.
+ *
+ * With SSE2, and when fits16 says that the coordinates fit in 16 bits,
+ * four points are done at a time from a copy of the boundary in pad
+ * (2*(n+2*delta+4) shorts) that has delta points of the other end
+ * stuck on to either end, so that nothing has to wrap around.
+ */
+static void BoundaryDotProducts(const CvPoint* pts, int n, int delta, int fits16,
+		short* pad, int* dots, int* blockMin){
+	int b, i;
+	int nblocks=(n+CURVE_BLOCK-1)/CURVE_BLOCK;
+#ifdef __SSE2__
+	if (fits16){
+		PackPoints16(pts+n-delta,delta,pad);
+		PackPoints16(pts,n,pad+2*delta);
+		PackPoints16(pts,delta,pad+2*(n+delta));
+
+		for (b=0; b<nblocks; b++){
+			int end=(b+1)*CURVE_BLOCK;
+			if (end>n) end=n;
+			i=b*CURVE_BLOCK;
+			__m128i lowest=_mm_set1_epi32(0x7FFFFFFF);
+			for (; i+4 <= end; i+=4){
+				__m128i behind=_mm_loadu_si128((const __m128i*) (pad+2*i));
+				__m128i pt=_mm_loadu_si128((const __m128i*) (pad+2*(i+delta)));
+				__m128i ahead=_mm_loadu_si128((const __m128i*) (pad+2*(i+2*delta)));
+				/** Dot product ax*bx + ay*by of the ahead and behind vectors, four points at once **/
+				__m128i d=_mm_madd_epi16(_mm_sub_epi16(ahead,pt),_mm_sub_epi16(pt,behind));
+				_mm_storeu_si128((__m128i*) (dots+i),d);
+				__m128i less=_mm_cmplt_epi32(d,lowest);
+				lowest=_mm_or_si128(_mm_and_si128(less,d),_mm_andnot_si128(less,lowest));
+			}
+			int lanes[4];
+			_mm_storeu_si128((__m128i*) lanes,lowest);
+			int smallest=lanes[0];
+			int k;
+			for (k=1; k<4; k++) if (lanes[k]<smallest) smallest=lanes[k];
+			for (; i<end; i++){
+				const short* p=pad+2*(i+delta);
+				const short* behindPt=pad+2*i;
+				const short* aheadPt=pad+2*(i+2*delta);
+				dots[i]=(aheadPt[0]-p[0])*(p[0]-behindPt[0]) + (aheadPt[1]-p[1])*(p[1]-behindPt[1]);
+				if (dots[i]<smallest) smallest=dots[i];
+			}
+			blockMin[b]=smallest;
+		}
+		return;
+	}
+#endif
+	for (b=0; b<nblocks; b++){
+		int end=(b+1)*CURVE_BLOCK;
+		if (end>n) end=n;
+		int smallest=0x7FFFFFFF;
+		for (i=b*CURVE_BLOCK; i<end; i++){
+			int ahead=i+delta;
+			if (ahead>=n) ahead-=n;
+			int behind=i-delta;
+			if (behind<0) behind+=n;
+			const CvPoint* p=pts+i;
+			dots[i]=(pts[ahead].x-p->x)*(p->x-pts[behind].x) + (pts[ahead].y-p->y)*(p->y-pts[behind].y);
+			if (dots[i]<smallest) smallest=dots[i];
+		}
+		blockMin[b]=smallest;
+	}
+}
 
-		/** Compute the Rear Vector **/
-		BehindVec= cvPoint((Pt->x) - (BehindPt->x), (Pt->y)
-				- (BehindPt->y));
+/*
+ * Finds the first of dots[start] up to (not including) dots[end] that is
+ * smaller than *best. Whole blocks are only looked at through blockMin.
+ * Updates *best and returns the index, or returns -1 if there is none.
+ */
+static int FirstSmallestDot(const int* dots, const int* blockMin, int start, int end, int* best){
+	int found=-1;
+	int foundBlock=-1;
+	int i=start;
+	while (i<end){
+		int b=i/CURVE_BLOCK;
+		int blockEnd=(b+1)*CURVE_BLOCK;
+		if (i==b*CURVE_BLOCK && blockEnd<=end){
+			if (blockMin[b] < *best){
+				*best=blockMin[b];
+				foundBlock=b;
+			}
+			i=blockEnd;
+		} else {
+			if (blockEnd>end) blockEnd=end;
+			for (; i<blockEnd; i++){
+				if (dots[i] < *best){
+					*best=dots[i];
+					found=i;
+					foundBlock=-1;
+				}
+			}
+		}
+	}
+	/** The first point in the winning block that has its smallest value **/
+	if (foundBlock>=0){
+		found=foundBlock*CURVE_BLOCK;
+		while (dots[found]!=*best) found++;
+	}
+	return found;
+}
 
-		/** Store the Dot Product in our Mat **/
-		DotProdVal=PointDot(&AheadVec,&BehindVec);
-		cvSeqPush(DotProds,&DotProdVal); //<--- ANDY CONTINUE HERE!
 
-	//	printf("i= %d, DotProdVal=%d\n", i, DotProdVal);
-	//	cvWaitKey(0);
+/*
+ * Finds the Worm's Head and Tail.
+ * Requires Worm->Boundary
+ *
+ * The tail is the curviest point on the boundary: the one where the vectors
+ * to and from the points Params->LengthScale behind and ahead of it have the
+ * smallest dot product. The head is the curviest point more than a quarter
+ * of the boundary away from the tail. Only dot products smaller than 1000
+ * count; without one the head or tail is point 0.
+ *
+ */
+int GivenBoundaryFindWormHeadTail(WormAnalysisData* Worm, WormAnalysisParam* Params) {
+	if (Worm->Boundary.n < 2*Params->NumSegments) {
+		printf("Error in GivenBoundaryFindWormHeadTail(). The Boundary has too few points.");
+		return -1;
+	}
 
+	int TotalBPts = Worm->Boundary.n;
+	CvPoint* BPts = Worm->Boundary.pts;
+	int delta=Params->LengthScale % TotalBPts;
+
+	/*** Scratch: the padded boundary, the dot products and the smallest in each block ***/
+	int nblocks=(TotalBPts+CURVE_BLOCK-1)/CURVE_BLOCK;
+	int padShorts=(2*(TotalBPts+2*delta+4)+7) & ~7;
+	int dotInts=(TotalBPts+3) & ~3;
+	int size=padShorts*sizeof(short)+(dotInts+nblocks)*sizeof(int);
+	if (Worm->CurveSize < size){
+		if (Worm->CurveMem!=NULL) cvFree(&(Worm->CurveMem));
+		Worm->CurveSize=2*size;
+		Worm->CurveMem=cvAlloc(Worm->CurveSize);
 	}
+	short* pad=(short*) Worm->CurveMem;
+	int* DotProds=(int*) (pad+padShorts);
+	int* blockMin=DotProds+dotInts;
 
+	/** The boundary lies in the image, so the SSE2 kernel's 16 bit differences can't overflow **/
+	int fits16= Worm->SizeOfImage.width<32768 && Worm->SizeOfImage.height<32768;
+	BoundaryDotProducts(BPts,TotalBPts,delta,fits16,pad,DotProds,blockMin);
 
 	/* **********************************************************************/
 	/*  Find the Tail 													 	*/
-	/*  Take dot product of neighboring vectors. Tail is location of		*/
-	/*	 smallest dot product												*/
+	/*  Tail is location of smallest dot product							*/
 	/* **********************************************************************/
-
-
-	/*
-	 * Now Let's loop through the entire boundary to find the tail, which will be the curviest point.
-	 */
-	float MostCurvy = 1000; //Smallest value.
-	float CurrentCurviness; //Metric of CurrentCurviness. In this case the dot product.
-	int MostCurvyIndex = 0;
-	int TailIndex;
-
-	for (i = 0; i < TotalBPts; i++) {
-		DotProdPtr = (int*) cvGetSeqElem(DotProds,i);
-		if (*DotProdPtr < MostCurvy) { //If this locaiton is curvier than the previous MostCurvy location
-			MostCurvy = *DotProdPtr; //replace the MostCurvy point
-			MostCurvyIndex = i;
-		}
-	}
+	int MostCurvy = 1000;
+	int MostCurvyIndex=FirstSmallestDot(DotProds,blockMin,0,TotalBPts,&MostCurvy);
+	if (MostCurvyIndex<0) MostCurvyIndex=0;
 
 	//Set the tail to be the point on the boundary that is most curvy.
-	Worm->Tail = (CvPoint*) cvGetSeqElem(Worm->Boundary, MostCurvyIndex);
+	Worm->Tail = &(BPts[MostCurvyIndex]);
 	Worm->TailIndex=MostCurvyIndex;
 
 	/* **********************************************************************/
@@ -577,31 +1375,26 @@ int GivenBoundaryFindWormHeadTail(WormAnalysisData* Worm, WormAnalysisParam* Par
 	/*	 the smallest dot product											*/
 	/* **********************************************************************/
 
-	float SecondMostCurvy = 1000;
-	int SecondMostCurvyIndex = 0;
-	int DistBetPtsOnBound;
-	DistBetPtsOnBound = 0;
-
-
-	for (i = 0; i < TotalBPts; i++) {
-		DotProdPtr =(int*) cvGetSeqElem(DotProds,i);
-
-		DistBetPtsOnBound = DistBetPtsOnCircBound(TotalBPts, i, MostCurvyIndex);
-		//If we are at least a 1/4 of the total boundary away from the most curvy point.
-		if (DistBetPtsOnBound > (TotalBPts / 4)) {
-			//If this location is curvier than the previous SecondMostCurvy location
-			if (*DotProdPtr< SecondMostCurvy) {
-				SecondMostCurvy = *DotProdPtr; //replace the MostCurvy point
-				SecondMostCurvyIndex = i;
-			}
-		}
-	}
-
-	Worm->Head = (CvPoint*) cvGetSeqElem(Worm->Boundary,
-			SecondMostCurvyIndex);
-
+	/*
+	 * The points more than a quarter of the boundary away from the tail either
+	 * way round are those before MostCurvyIndex-quarter and after
+	 * MostCurvyIndex+quarter, but no further than the same distance the other
+	 * way round.
+	 */
+	int quarter=TotalBPts/4;
+	int SecondMostCurvy = 1000;
+	int SecondMostCurvyIndex=0;
+	int start=MostCurvyIndex-TotalBPts+quarter+1;
+	int end=MostCurvyIndex-quarter;
+	int index=FirstSmallestDot(DotProds,blockMin,(start<0) ? 0 : start,end,&SecondMostCurvy);
+	if (index>=0) SecondMostCurvyIndex=index;
+	start=MostCurvyIndex+quarter+1;
+	end=MostCurvyIndex+TotalBPts-quarter;
+	index=FirstSmallestDot(DotProds,blockMin,start,(end>TotalBPts) ? TotalBPts : end,&SecondMostCurvy);
+	if (index>=0) SecondMostCurvyIndex=index;
+
+	Worm->Head = &(BPts[SecondMostCurvyIndex]);
 	Worm->HeadIndex = SecondMostCurvyIndex;
-	cvClearMemStorage(Worm->MemScratchStorage);
 	return 0;
 }
 
@@ -665,22 +1458,16 @@ int SimpleIlluminateWorm(WormAnalysisData* Worm, Frame* IllumFrame,int start, in
 		}
 
 
-	/** Check to See if the Worm->Segmented has any NULL values**/
-	if (Worm->Segmented->Centerline==NULL || Worm->Segmented->LeftBound==NULL || Worm->Segmented->RightBound ==NULL ){
-		printf("Error! The Worm->Segmented had NULL children. in SimpleIlluminateWorm()\n");
-		return -1;
-	}
-
 	/** Check to See that the Segmented Values are Not Zero **/
-	if (Worm->Segmented->Centerline->total==0 || Worm->Segmented->LeftBound->total==0 || Worm->Segmented->RightBound->total ==0 ){
+	if (Worm->Segmented->Centerline.n==0 || Worm->Segmented->LeftBound.n==0 || Worm->Segmented->RightBound.n ==0 ){
 		printf("Error! At least one of the following: Centerline or Right and Left Boundaries in Worm->Segmented has zero points in SimpleIlluminateWorm()\n");
 		return -1;
 	}
 
 	int i;
 	for (i=start; i<end; i++){
-	IlluminateWormSegment(TempImage,Worm->Segmented->Centerline,Worm->Segmented->LeftBound,i);
-	IlluminateWormSegment(TempImage,Worm->Segmented->Centerline,Worm->Segmented->RightBound,i);
+	IlluminateWormSegment(TempImage,&(Worm->Segmented->Centerline),&(Worm->Segmented->LeftBound),i);
+	IlluminateWormSegment(TempImage,&(Worm->Segmented->Centerline),&(Worm->Segmented->RightBound),i);
 	}
 		LoadFrameWithImage(TempImage,IllumFrame);
 	//	cvShowImage("TestOut",IllumFrame);
@@ -717,22 +1504,16 @@ int SimpleIlluminateWormLR(SegmentedWorm* SegWorm, Frame* IllumFrame,int center,
 //	printf("startSeg=%d,endSeg=%d\n",startSeg,endSeg);
 
 
-	/** Check to See if the SegWorm has any NULL values**/
-	if (SegWorm->Centerline==NULL || SegWorm->LeftBound==NULL || SegWorm->RightBound ==NULL ){
-		printf("Error! The SegWorm had NULL children. in SimpleIlluminateWorm()\n");
-		return -1;
-	}
-
 	/** Check to See that the Segmented Values are Not Zero **/
-	if (SegWorm->Centerline->total==0 || SegWorm->LeftBound->total==0 || SegWorm->RightBound->total ==0 ){
+	if (SegWorm->Centerline.n==0 || SegWorm->LeftBound.n==0 || SegWorm->RightBound.n ==0 ){
 		printf("Error! At least one of the following: Centerline or Right and Left Boundaries in SegWorm has zero points in SimpleIlluminateWorm()\n");
 		return -1;
 	}
 
 	int i;
 	for (i=startSeg; i<endSeg; i++){
-	if (lrc==1 || lrc==3) IlluminateWormSegment(TempImage,SegWorm->Centerline,SegWorm->LeftBound,i);
-	if (lrc >1) IlluminateWormSegment(TempImage,SegWorm->Centerline,SegWorm->RightBound,i);
+	if (lrc==1 || lrc==3) IlluminateWormSegment(TempImage,&(SegWorm->Centerline),&(SegWorm->LeftBound),i);
+	if (lrc >1) IlluminateWormSegment(TempImage,&(SegWorm->Centerline),&(SegWorm->RightBound),i);
 	}
 		LoadFrameWithImage(TempImage,IllumFrame);
 	//	cvShowImage("TestOut",IllumFrame);
@@ -749,12 +1530,16 @@ int SimpleIlluminateWormLR(SegmentedWorm* SegWorm, Frame* IllumFrame,int center,
  * along the centerline, than draws a rectangle perpendicular to this vector, a radius rsquared pixels
  * away from the centerline
  */
-void IlluminateWormSegment(IplImage* image, CvSeq* centerline, CvSeq* Boundary, int segment){
+void IlluminateWormSegment(IplImage* image, PointBuf* centerline, PointBuf* Boundary, int segment){
 	int PRINTOUT=0;
 	if (segment <1) {
 		if (PRINTOUT) printf("ERROR: segment <1 :  Choose a segment along the worm that is at least 1.\n ");
 		return;
 	}
+	if (segment >= centerline->n || segment >= Boundary->n) {
+		if (PRINTOUT) printf("ERROR: segment is past the end of the worm.\n ");
+		return;
+	}
 
 	int rfactor=2;
 
@@ -767,11 +1552,11 @@ void IlluminateWormSegment(IplImage* image, CvSeq* centerline, CvSeq* Boundary,
 	CvPoint VecToBound; //Vector Perpendicular to the segment
 	CvPoint PrevVecToBound;
 
-	PtAlongCenterline=(CvPoint*) cvGetSeqElem(centerline,segment);
-	PrevPtAlongCenterline=(CvPoint*) cvGetSeqElem(centerline,segment-1);
+	PtAlongCenterline=&(centerline->pts[segment]);
+	PrevPtAlongCenterline=&(centerline->pts[segment-1]);
 
-	PtAlongBoundary=(CvPoint*) cvGetSeqElem(Boundary,segment);
-	PrevPtAlongBoundary=(CvPoint*) cvGetSeqElem(Boundary,segment-1);
+	PtAlongBoundary=&(Boundary->pts[segment]);
+	PrevPtAlongBoundary=&(Boundary->pts[segment-1]);
 
 	VecToBound= cvPoint(PtAlongBoundary->x - PtAlongCenterline->x ,PtAlongBoundary->y - PtAlongCenterline->y );
 	PrevVecToBound= cvPoint(PrevPtAlongBoundary->x - PrevPtAlongCenterline->x ,PrevPtAlongBoundary->y - PrevPtAlongCenterline->y );
@@ -810,6 +1595,40 @@ void IlluminateWormSegment(IplImage* image, CvSeq* centerline, CvSeq* Boundary,
 
 
 
+/*
+ * Copy the points of Worm.Boundary from index start up to (but not including) end
+ * into dst, going round past the last point back to the first if end comes before
+ * start, as cvSeqSlice() does.
+ */
+static void SliceWormBoundary(WormAnalysisData* Worm, int start, int end, PointBuf* dst){
+	int total=Worm->Boundary.n;
+	int n=end-start;
+	if (n < 0) n+=total;
+	dst->n=0;
+	ReservePointBuf(dst,n);
+	int first=total-start; // points before going round
+	if (first >= n){
+		memcpy(dst->pts,Worm->Boundary.pts+start,n*sizeof(CvPoint));
+	} else {
+		memcpy(dst->pts,Worm->Boundary.pts+start,first*sizeof(CvPoint));
+		memcpy(dst->pts+first,Worm->Boundary.pts,(n-first)*sizeof(CvPoint));
+	}
+	dst->n=n;
+}
+
+/*
+ * Reverse the order of the points in buf.
+ */
+static void ReversePoints(PointBuf* buf){
+	CvPoint* a=buf->pts;
+	CvPoint* b=buf->pts+buf->n-1;
+	for (; a<b; a++, b--){
+		CvPoint t=*a;
+		*a=*b;
+		*b=t;
+	}
+}
+
 /*
  * This Function segments a worm.
  * It requires that certain information be present in the WormAnalysisData struct Worm
@@ -818,7 +1637,7 @@ void IlluminateWormSegment(IplImage* image, CvSeq* centerline, CvSeq* Boundary,
  *
  */
 int SegmentWorm(WormAnalysisData* Worm, WormAnalysisParam* Params){
-	if (cvSeqExists(Worm->Boundary) == 0){
+	if (Worm->Boundary.n == 0){
 		printf("Error! No boundary found in SegmentWorm()\n");
 		return -1;
 	}
@@ -842,32 +1661,36 @@ int SegmentWorm(WormAnalysisData* Worm, WormAnalysisParam* Params){
 
 	/*** Slice the boundary into left and right components ***/
 	if (Worm->HeadIndex==Worm->TailIndex) printf("Error! Worm->HeadIndex==Worm->TailIndex in SegmentWorm()!\n");
-	CvSeq* OrigBoundA=cvSeqSlice(Worm->Boundary,cvSlice(Worm->HeadIndex,Worm->TailIndex),Worm->MemScratchStorage,1);
-	CvSeq* OrigBoundB=cvSeqSlice(Worm->Boundary,cvSlice(Worm->TailIndex,Worm->HeadIndex),Worm->MemScratchStorage,1);
+	PointBuf* OrigBoundA=&(Worm->BoundA);
+	PointBuf* OrigBoundB=&(Worm->BoundB);
+	SliceWormBoundary(Worm,Worm->HeadIndex,Worm->TailIndex,OrigBoundA);
+	SliceWormBoundary(Worm,Worm->TailIndex,Worm->HeadIndex,OrigBoundB);
 
-	if (OrigBoundA->total < Params->NumSegments || OrigBoundB->total < Params->NumSegments ){
+	if (OrigBoundA->n < Params->NumSegments || OrigBoundB->n < Params->NumSegments ){
 		printf("Error in SegmentWorm():\n\tWhen splitting  the original boundary into two, one or the other has less than the number of desired segments!\n");
-		printf("OrigBoundA->total=%d\nOrigBoundB->total=%d\nParams->NumSegments=%d\n",OrigBoundA->total,OrigBoundB->total,Params->NumSegments);
+		printf("OrigBoundA->total=%d\nOrigBoundB->total=%d\nParams->NumSegments=%d\n",OrigBoundA->n,OrigBoundB->n,Params->NumSegments);
 		printf("Worm->HeadIndex=%d\nWorm->TailIndex=%d\n",Worm->HeadIndex,Worm->TailIndex);
 		return -1; /** Andy make this return -1 **/
 
 	}
 
-	cvSeqInvert(OrigBoundB);
+	ReversePoints(OrigBoundB);
 
 
 	/*** Resample One of the Two Boundaries so that both are the same length ***/
 
-	//Create sequences to store the Normalized Boundaries
-	CvSeq* NBoundA=	cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),Worm->MemScratchStorage);
-	CvSeq* NBoundB=cvCreateSeq(CV_SEQ_ELTYPE_POINT,sizeof(CvSeq),sizeof(CvPoint),Worm->MemScratchStorage);
+	//The Normalized Boundaries
+	PointBuf* NBoundA;
+	PointBuf* NBoundB;
 
 	//Resample L&R boundary to have the same number of points as min(L,R)
-	if (OrigBoundA->total > OrigBoundB->total){
-		resampleSeq(OrigBoundA,NBoundA,OrigBoundB->total );
+	if (OrigBoundA->n > OrigBoundB->n){
+		NBoundA=&(Worm->Resampled);
+		resampleSeq(OrigBoundA,NBoundA,OrigBoundB->n );
 		NBoundB=OrigBoundB;
 	}else{
-		resampleSeq(OrigBoundB,NBoundB,OrigBoundA->total );
+		NBoundB=&(Worm->Resampled);
+		resampleSeq(OrigBoundB,NBoundB,OrigBoundA->n );
 		NBoundA=OrigBoundA;
 	}
 	//Now both NBoundA and NBoundB are the same length.
@@ -879,27 +1702,25 @@ int SegmentWorm(WormAnalysisData* Worm, WormAnalysisParam* Params){
 	 *
 	 */
 
-	/*** Clear out Stale Centerline Information ***/
-	cvClearSeq(Worm->Centerline);
-
-	/*** Compute Centerline, from Head To Tail ***/
-	FindCenterline(NBoundA,NBoundB,Worm->Centerline);
+	/*** Compute Centerline, from Head To Tail (replacing the stale one) ***/
+	FindCenterline(NBoundA,NBoundB,&(Worm->Centerline));
 
 
 
 	/*** Smooth the Centerline***/
-	CvSeq* SmoothUnresampledCenterline = smoothPtSequence (Worm->Centerline, 0.5*Worm->Centerline->total/Params->NumSegments, Worm->MemScratchStorage);
+	PointBuf* SmoothUnresampledCenterline = &(Worm->SmoothCenterline);
+	SmoothPointBuf (&(Worm->Smoother), &(Worm->Centerline), SmoothUnresampledCenterline, 0.5*Worm->Centerline.n/Params->NumSegments);
 
 	/*** Note: If you wanted to you could smooth the centerline a second time here. ***/
 
 
 	/*** Resample the Centerline So it has the specified Number of Points ***/
-	//resampleSeq(SmoothUnresampledCenterline,Worm->Segmented->Centerline,Params->NumSegments);
+	//resampleSeq(SmoothUnresampledCenterline,&(Worm->Segmented->Centerline),Params->NumSegments);
 
-	resampleSeqConstPtsPerArcLength(SmoothUnresampledCenterline,Worm->Segmented->Centerline,Params->NumSegments);
+	resampleSeqConstPtsPerArcLength(SmoothUnresampledCenterline,&(Worm->Segmented->Centerline),Params->NumSegments);
 
 	/** Save the location of the centerOfWorm as the point halfway down the segmented centerline **/
-	Worm->Segmented->centerOfWorm= CV_GET_SEQ_ELEM( CvPoint , Worm->Segmented->Centerline, Worm->Segmented->NumSegments / 2 );
+	Worm->Segmented->centerOfWorm= &(Worm->Segmented->Centerline.pts[Worm->Segmented->NumSegments / 2]);
 
 	/*** Remove Repeat Points***/
 	//RemoveSequentialDuplicatePoints (Worm->Segmented->Centerline);
@@ -907,7 +1728,7 @@ int SegmentWorm(WormAnalysisData* Worm, WormAnalysisParam* Params){
 	/*** Use Marc's Perpendicular Segmentation Algorithm
 	 *   To Segment the Left and Right Boundaries and store them
 	 */
-	SegmentSides(OrigBoundA,OrigBoundB,Worm->Segmented->Centerline,Worm->Segmented->LeftBound,Worm->Segmented->RightBound);
+	SegmentSides(OrigBoundA,OrigBoundB,&(Worm->Segmented->Centerline),&(Worm->Segmented->LeftBound),&(Worm->Segmented->RightBound));
 	return 0;
 
 }
@@ -932,7 +1753,7 @@ int CreateWormHUDS(IplImage* TempImage, WormAnalysisData* Worm, WormAnalysisPara
 	cvAddWeighted(Worm->ImgOrig,1,IlluminationFrame->iplimg,weighting,0,TempImage);
 
 	//Want to also display boundary!
-	cvDrawContours(TempImage, Worm->Boundary, cvScalar(255,0,0),cvScalar(0,255,0),100);
+	cvDrawContours(TempImage, PointBufSeq(&(Worm->Boundary)), cvScalar(255,0,0),cvScalar(0,255,0),100);
 
 //	DrawSequence(&TempImage,Worm->Segmented->LeftBound);
 //	DrawSequence(&TempImage,Worm->Segmented->RightBound);
@@ -997,10 +1818,10 @@ int CreateWormHUDS(IplImage* TempImage, WormAnalysisData* Worm, WormAnalysisPara
  */
 void DisplayWormHeadTail(WormAnalysisData* Worm, char* WindowName){
 	int CircleDiameterSize=10;
-	IplImage* TempImage=cvCreateImage(cvGetSize(Worm->ImgSmooth),IPL_DEPTH_8U,1);
+	IplImage* TempImage=cvCreateImage(cvGetSize(Worm->ImgOrig),IPL_DEPTH_8U,1);
 	cvCopy(Worm->ImgOrig,TempImage,0);
 	//Want to also display boundary!
-	cvDrawContours(TempImage, Worm->Boundary, cvScalar(255,0,0),cvScalar(0,255,0),100);
+	cvDrawContours(TempImage, PointBufSeq(&(Worm->Boundary)), cvScalar(255,0,0),cvScalar(0,255,0),100);
 	cvCircle(TempImage,*(Worm->Tail),CircleDiameterSize,cvScalar(255,255,255),1,CV_AA,0);
 	cvCircle(TempImage,*(Worm->Head),CircleDiameterSize/2,cvScalar(255,255,255),1,CV_AA,0);
 	cvShowImage(WindowName,TempImage);
@@ -1033,14 +1854,14 @@ void DisplayWormSegmentation(WormAnalysisData* Worm, IplImage* ImgOut){
 	cvCopyImage(Worm->ImgOrig,TempImage);
 
 	int i;
-	for (i = 0; i < Worm->Segmented->Centerline->total; i++) {
-		CvPoint* tempPt = (CvPoint*) cvGetSeqElem(Worm->Segmented->Centerline, i);
-		CvPoint* tempPtA = (CvPoint*) cvGetSeqElem(Worm->Segmented->RightBound, i);
-		CvPoint* tempPtB = (CvPoint*) cvGetSeqElem(Worm->Segmented->LeftBound, i);
+	for (i = 0; i < Worm->Segmented->Centerline.n; i++) {
+		CvPoint* tempPt = &(Worm->Segmented->Centerline.pts[i]);
+		CvPoint* tempPtA = &(Worm->Segmented->RightBound.pts[i]);
+		CvPoint* tempPtB = &(Worm->Segmented->LeftBound.pts[i]);
 		cvCircle(TempImage, *tempPt, 1, cvScalar(255, 255, 255), 1);
 		cvCircle(TempImage, *tempPtA, 1, cvScalar(255, 255, 255), 1);
 		cvCircle(TempImage, *tempPtB, 1, cvScalar(255, 255, 255), 1);
-		cvDrawContours(TempImage,Worm->Boundary,cvScalar(255,255,255),cvScalar(255,255,255),1,1,CV_AA);
+		cvDrawContours(TempImage,PointBufSeq(&(Worm->Boundary)),cvScalar(255,255,255),cvScalar(255,255,255),1,1,CV_AA);
 
 		cvLine(TempImage,*tempPt,*tempPtA,cvScalar(255,255,255),1,CV_AA,0);
 		cvLine(TempImage,*tempPt,*tempPtB,cvScalar(255,255,255),1,CV_AA,0);
@@ -1066,20 +1887,20 @@ void DisplaySegPts(WormAnalysisData* Worm, char* WindowName){
 	cvCopyImage(Worm->ImgOrig,TempImage);
 	int CircleDiameterSize=10;
 	int i;
-	printf("Worm->Segmented->Centerline->total=%d\n",Worm->Segmented->Centerline->total);
-	for (i = 0; i < Worm->Segmented->Centerline->total; i++) {
-		CvPoint* tempPt = (CvPoint*) cvGetSeqElem(Worm->Segmented->Centerline, i);
+	printf("Worm->Segmented->Centerline.n=%d\n",Worm->Segmented->Centerline.n);
+	for (i = 0; i < Worm->Segmented->Centerline.n; i++) {
+		CvPoint* tempPt = &(Worm->Segmented->Centerline.pts[i]);
 
 		cvCircle(TempImage,*tempPt,1,cvScalar(255,255,255),1,CV_AA,0);
 
 		cvWaitKey(30);cvShowImage(WindowName, TempImage); printf("( %d , %d )\n",tempPt->x, tempPt->y);
 		}
 
-	printf("Worm->Segmented->RightBound->total=%d\n",Worm->Segmented->RightBound->total);
-	for (i = 0; i < Worm->Segmented->RightBound->total; i++) {
+	printf("Worm->Segmented->RightBound.n=%d\n",Worm->Segmented->RightBound.n);
+	for (i = 0; i < Worm->Segmented->RightBound.n; i++) {
 
-		CvPoint* tempPtA = (CvPoint*) cvGetSeqElem(Worm->Segmented->RightBound, i);
-		CvPoint* tempPtB = (CvPoint*) cvGetSeqElem(Worm->Segmented->LeftBound, i);
+		CvPoint* tempPtA = &(Worm->Segmented->RightBound.pts[i]);
+		CvPoint* tempPtB = &(Worm->Segmented->LeftBound.pts[i]);
 
 		cvCircle(TempImage,*tempPtA,1,cvScalar(255,255,255),1,CV_AA,0);
 		cvCircle(TempImage,*tempPtB,1,cvScalar(255,255,255),1,CV_AA,0);
@@ -1108,7 +1929,7 @@ void DisplayIlluminatedWorm(WormAnalysisData* Worm, Frame* IllumFrame,char* Wind
 	IplImage* TempImage=cvCreateImage(cvGetSize(Worm->ImgOrig),IPL_DEPTH_8U,1);
 	cvCopy(Worm->ImgOrig,TempImage,0);
 	/** ANDY IMPLEMENTED cvAddWeighted() Here **/
-	cvDrawContours(TempImage, Worm->Boundary, cvScalar(255,0,0),cvScalar(0,255,0),100);
+	cvDrawContours(TempImage, PointBufSeq(&(Worm->Boundary)), cvScalar(255,0,0),cvScalar(0,255,0),100);
 	cvCircle(TempImage,*(Worm->Tail),CircleDiameterSize,cvScalar(255,255,255),1,CV_AA,0);
 	cvCircle(TempImage,*(Worm->Head),CircleDiameterSize/2,cvScalar(255,255,255),1,CV_AA,0);
 
@@ -1149,6 +1970,9 @@ void ClearWormGeom(WormGeom* SimpleWorm){
 	SimpleWorm->Perimeter=0;
 	SimpleWorm->Tail.x=0;
 	SimpleWorm->Tail.y=0;
+	SimpleWorm->HeadIndex=0;
+	SimpleWorm->TailIndex=0;
+	SimpleWorm->frameNum=0;
 }
 
 /*
@@ -1172,7 +1996,10 @@ void LoadWormGeom(WormGeom* SimpleWorm, WormAnalysisData* Worm){
 	ClearWormGeom(SimpleWorm);
 	SimpleWorm->Head=*(Worm->Head);
 	SimpleWorm->Tail=*(Worm->Tail);
-	SimpleWorm->Perimeter=Worm->Boundary->total;
+	SimpleWorm->Perimeter=Worm->Boundary.n;
+	SimpleWorm->HeadIndex=Worm->HeadIndex;
+	SimpleWorm->TailIndex=Worm->TailIndex;
+	SimpleWorm->frameNum=Worm->frameNum;
 }
 
 
@@ -1243,6 +2070,241 @@ int PrevFrameImproveWormHeadTail(WormAnalysisData* Worm,
 }
 
 
+/*********************************************
+ * Head/Tail Tracker
+ */
+
+/** Gains of the alpha-beta filter **/
+#define TRACK_ALPHA 0.5f
+#define TRACK_BETA 0.2f
+
+/** The windows searched around the predicted head and tail reach 1/TRACK_WINDOW of the boundary either way **/
+#define TRACK_WINDOW 32
+
+/** Frames in a row that can go by without a worm, or between predictions, before the tracker starts over **/
+#define TRACK_MAXMISSES 5
+
+WormTracker* CreateWormTracker(){
+	WormTracker* Tracker=(WormTracker*) malloc(sizeof(WormTracker));
+	memset(Tracker,0,sizeof(WormTracker));
+	ResetWormTracker(Tracker);
+	return Tracker;
+}
+
+void ResetWormTracker(WormTracker* Tracker){
+	if (Tracker==NULL) return;
+	Tracker->Newest=0;
+	Tracker->Count=0;
+	Tracker->Misses=0;
+}
+
+void DestroyWormTracker(WormTracker** Tracker){
+	if (*Tracker==NULL) return;
+	free(*Tracker);
+	*Tracker=NULL;
+}
+
+WormGeom* RecentWormGeom(WormTracker* Tracker, int age){
+	if (Tracker==NULL || age < 0 || age >= Tracker->Count || age >= TRACK_HISTORY) return NULL;
+	return &(Tracker->History[(Tracker->Newest-age+TRACK_HISTORY) % TRACK_HISTORY]);
+}
+
+/** Wraps a difference between two fractions of the boundary into [-0.5,0.5) **/
+static float WrapAlong(float d){
+	return d-floorf(d+0.5f);
+}
+
+/*
+ * Looks for the smallest dot product (see BoundaryDotProducts()) among the
+ * 2*half+1 points of the boundary centered on point center. Sets *best to
+ * it and returns the offset of the first point that has it from the start
+ * of the window.
+ */
+static int WindowSmallestDot(const CvPoint* pts, int n, int delta, int center, int half, int* best){
+	int found=0;
+	*best=0x7FFFFFFF;
+	int i=((center-half) % n + n) % n;
+	int ahead=(i+delta) % n;
+	int behind=(i-delta+n) % n;
+	for (int k=0; k <= 2*half; k++){
+		const CvPoint* p=pts+i;
+		int d=(pts[ahead].x-p->x)*(p->x-pts[behind].x) + (pts[ahead].y-p->y)*(p->y-pts[behind].y);
+		if (d < *best){
+			*best=d;
+			found=k;
+		}
+		if (++i==n) i=0;
+		if (++ahead==n) ahead=0;
+		if (++behind==n) behind=0;
+	}
+	return found;
+}
+
+int TrackWormHeadTail(WormAnalysisData* Worm, WormAnalysisParam* Params, WormTracker* Tracker){
+	if (Tracker==NULL) return GivenBoundaryFindWormHeadTail(Worm,Params);
+	if (Worm->Boundary.n < 2*Params->NumSegments) {
+		printf("Error in TrackWormHeadTail(). The Boundary has too few points.");
+		return -1;
+	}
+	double t0=(double) cvGetTickCount();
+	int n=Worm->Boundary.n;
+	CvPoint* pts=Worm->Boundary.pts;
+	int dt=Worm->frameNum-Tracker->frameNum;
+	if (dt < 1) dt=1;
+
+	/** It takes two frames to have a velocity **/
+	int havePrediction= Tracker->Count >= 2 && Tracker->Misses==0 && dt <= TRACK_MAXMISSES;
+	int predicted=havePrediction;
+	WormGeom Prediction;
+	int index[2];
+	int k;
+	if (havePrediction){
+		ClearWormGeom(&Prediction);
+		Prediction.Perimeter=n;
+		CvPoint* where[2]={&(Prediction.Head),&(Prediction.Tail)};
+		int gate=Params->MaxLocationChange*Params->MaxLocationChange;
+		int half=n/TRACK_WINDOW;
+		int delta=Params->LengthScale % n;
+		for (k=0; k<2; k++){
+			*(where[k])=cvPoint(cvRound(Tracker->Pos[k].x+Tracker->Vel[k].x*dt),cvRound(Tracker->Pos[k].y+Tracker->Vel[k].y*dt));
+			if (!predicted) continue;
+			float along=Tracker->Along[k]+Tracker->AlongVel[k]*dt;
+			int center=cvRound((along-floorf(along))*n);
+
+			/** Only dot products smaller than 1000 count, as in GivenBoundaryFindWormHeadTail() **/
+			int best;
+			int offset=WindowSmallestDot(pts,n,delta,center,half,&best);
+			index[k]=((center-half+offset) % n + n) % n;
+			predicted= best < 1000 && offset > 0 && offset < 2*half && sqDist(pts[index[k]],*(where[k])) <= gate;
+		}
+		/** And they have to be as far apart as GivenBoundaryFindWormHeadTail() keeps them **/
+		if (predicted && DistBetPtsOnCircBound(n,index[0],index[1]) <= n/4) predicted=0;
+		if (!predicted) Tracker->nfallbacks++;
+	}
+
+	if (predicted){
+		Worm->Head=&(pts[index[0]]);
+		Worm->HeadIndex=index[0];
+		Worm->Tail=&(pts[index[1]]);
+		Worm->TailIndex=index[1];
+	} else {
+		int e=GivenBoundaryFindWormHeadTail(Worm,Params);
+		if (e) return e;
+
+		/** Which way round agrees with the prediction, or failing that the last frame **/
+		WormGeom* Prev= havePrediction ? &Prediction : RecentWormGeom(Tracker,0);
+		if (Prev!=NULL && PrevFrameImproveWormHeadTail(Worm,Params,Prev)==0) Tracker->nswaps++;
+	}
+
+	double seconds=((double) cvGetTickCount()-t0)/(cvGetTickFrequency()*1e6);
+	Tracker->nframes[predicted]++;
+	Tracker->seconds[predicted]+=seconds;
+	return 0;
+}
+
+void UpdateWormTracker(WormTracker* Tracker, WormAnalysisData* Worm, WormAnalysisParam* Params){
+	if (Tracker==NULL || Worm->Head==NULL || Worm->Tail==NULL || Worm->Boundary.n==0) return;
+	int n=Worm->Boundary.n;
+	CvPoint2D32f Pos[2]={cvPoint2D32f(Worm->Head->x,Worm->Head->y),cvPoint2D32f(Worm->Tail->x,Worm->Tail->y)};
+	float Along[2]={(float) Worm->HeadIndex/n,(float) Worm->TailIndex/n};
+	int dt=Worm->frameNum-Tracker->frameNum;
+	if (dt < 1) dt=1;
+	if (Tracker->Misses > 0 || dt > TRACK_MAXMISSES) ResetWormTracker(Tracker);
+	int k;
+
+	if (Tracker->Count==0){
+		/** Start from here, standing still **/
+		for (k=0; k<2; k++){
+			Tracker->Pos[k]=Pos[k];
+			Tracker->Vel[k]=cvPoint2D32f(0,0);
+			Tracker->Along[k]=Along[k];
+			Tracker->AlongVel[k]=0;
+		}
+	} else {
+		float gate=(float) Params->MaxLocationChange;
+		for (k=0; k<2; k++){
+			float x=Tracker->Pos[k].x+Tracker->Vel[k].x*dt;
+			float y=Tracker->Pos[k].y+Tracker->Vel[k].y*dt;
+			float rx=Pos[k].x-x;
+			float ry=Pos[k].y-y;
+			if (rx*rx+ry*ry > gate*gate){
+				/** Not where it was heading at all: start again from here **/
+				Tracker->Pos[k]=Pos[k];
+				Tracker->Vel[k]=cvPoint2D32f(0,0);
+			} else {
+				Tracker->Pos[k]=cvPoint2D32f(x+TRACK_ALPHA*rx,y+TRACK_ALPHA*ry);
+				Tracker->Vel[k].x+=TRACK_BETA*rx/dt;
+				Tracker->Vel[k].y+=TRACK_BETA*ry/dt;
+			}
+
+			/** The boundary starts from its top left point, which jumps when another part of the worm becomes the top **/
+			float along=Tracker->Along[k]+Tracker->AlongVel[k]*dt;
+			float r=WrapAlong(Along[k]-along);
+			if (fabsf(r) > 1.0f/TRACK_WINDOW){
+				Tracker->Along[k]=Along[k];
+				Tracker->AlongVel[k]=0;
+			} else {
+				along+=TRACK_ALPHA*r;
+				Tracker->Along[k]=along-floorf(along);
+				Tracker->AlongVel[k]+=TRACK_BETA*r/dt;
+			}
+		}
+	}
+	Tracker->frameNum=Worm->frameNum;
+	Tracker->Misses=0;
+
+	Tracker->Newest=(Tracker->Newest+1) % TRACK_HISTORY;
+	LoadWormGeom(&(Tracker->History[Tracker->Newest]),Worm);
+	Tracker->Count++;
+}
+
+void MissWormTracker(WormTracker* Tracker){
+	if (Tracker==NULL) return;
+	Tracker->Misses++;
+	if (Tracker->Misses > TRACK_MAXMISSES) ResetWormTracker(Tracker);
+}
+
+void ReverseWormTracker(WormTracker* Tracker){
+	if (Tracker==NULL) return;
+	CvPoint2D32f p=Tracker->Pos[0];
+	Tracker->Pos[0]=Tracker->Pos[1];
+	Tracker->Pos[1]=p;
+	p=Tracker->Vel[0];
+	Tracker->Vel[0]=Tracker->Vel[1];
+	Tracker->Vel[1]=p;
+	float a=Tracker->Along[0];
+	Tracker->Along[0]=Tracker->Along[1];
+	Tracker->Along[1]=a;
+	a=Tracker->AlongVel[0];
+	Tracker->AlongVel[0]=Tracker->AlongVel[1];
+	Tracker->AlongVel[1]=a;
+	for (int k=0; k<TRACK_HISTORY; k++){
+		WormGeom* g=&(Tracker->History[k]);
+		CvPoint pt=g->Head;
+		g->Head=g->Tail;
+		g->Tail=pt;
+		int i=g->HeadIndex;
+		g->HeadIndex=g->TailIndex;
+		g->TailIndex=i;
+	}
+}
+
+void PrintWormTracker(WormTracker* Tracker){
+	double ms[2];
+	if (Tracker->nframes[0]+Tracker->nframes[1]==0) return;
+	printf("\nTracking the worm's head and tail:\n");
+	const char* what[2]={"whole boundary","windows around the prediction"};
+	for (int k=0; k<2; k++){
+		long n=Tracker->nframes[k];
+		ms[k]= (n > 0) ? 1000*Tracker->seconds[k]/n : 0;
+		printf("\t%s: %ld frames, %.3f ms per frame\n",what[k],n,ms[k]);
+	}
+	printf("\tthe whole boundary had to be searched again %ld times\n",Tracker->nfallbacks);
+	printf("\thead and tail were swapped %ld times to agree with the prediction or the last frame\n",Tracker->nswaps);
+	if (ms[0] > 0 && ms[1] > 0) printf("\tspeedup: %.1fx\n",ms[0]/ms[1]);
+}
+
+
 /*
  * Converts the slider bar used to specify an origin into a coordinate on wormspace.
  *
@@ -48,6 +48,10 @@
 #endif
 
 
+/** Displays that need FindWormBoundary() to fill in an image that it otherwise doesn't **/
+#define DISPLAY_THRESH 2 // Worm->ImgThresh
+#define DISPLAY_SMOOTH 7 // Worm->ImgSmooth
+
 typedef struct WormAnalysisParamStruct{
 	/** Turn Analysis On Generally **/
 	int OnOff;
@@ -70,7 +74,7 @@ typedef struct WormAnalysisParamStruct{
 
 	/** Display Stuff**/
 	int DispRate; //Deprecated
-	int Display;
+	int Display; // which image to display (see PrepareSelectedDisplay())
 
 	/** Defaul Wormspace GridSize for illumination **/
 	CvSize DefaultGridSize;
@@ -115,9 +119,9 @@ typedef struct WormAnalysisParamStruct{
 } WormAnalysisParam;
 
 typedef struct SegmentedWormStruct{
-	CvSeq* Centerline;
-	CvSeq* LeftBound;
-	CvSeq* RightBound;
+	PointBuf Centerline;
+	PointBuf LeftBound;
+	PointBuf RightBound;
 	CvPoint* Head;
 	CvPoint* Tail;
 	CvMemStorage* MemSegStorage;
@@ -129,33 +133,109 @@ typedef struct SegmentedWormStruct{
 
 
 
+/*
+ * Where to look for the worm on the next frame (see SetWormSearch()).
+ *
+ * Frames are segmented in order, so worm objects that take turns analyzing
+ * frames of the same video (the pipeline's slots) share one of these.
+ */
+typedef struct WormSearchStruct{
+	int Margin; // pixels added on every side of where the worm is predicted to be
+
+	/** Prediction, in full resolution coordinates **/
+	CvRect Box; // bounding box of the worm on the previous frame (zero width = lost, search everywhere)
+	CvPoint Velocity; // how far the center of the box moved between the last two frames (pixels per frame)
+
+	/** Trace only the worm's outline, starting from where it was (see SetWormTrace()) **/
+	int Trace;
+	int Perimeter; // points on the outline on the previous frame (analysis image, before it is scaled up)
+
+	/** Statistics: [0] whole frame searches, [1] searches of a predicted region **/
+	long nframes[2];
+	double seconds[2]; // time spent in FindWormBoundary()
+	double pixels[2]; // pixels searched
+	long nfallbacks; // region searches that had to be redone on the whole frame
+
+	/** Statistics: [0] outlines found by cvFindContours(), [1] outlines traced from a seed **/
+	long ntraced[2];
+	double traceSeconds[2];
+	long nmissed; // frames where tracing was tried but no seed landed on the worm
+
+	void* Owner; // the worm object that frees it
+} WormSearch;
+
+
 typedef struct WormImageAnalysisStruct{
 	CvSize SizeOfImage;
 
 	/** Frame Info **/
 	int frameNum;
-	int frameNumCamInternal;
+	int frameNumCamInternal; // sequence number from the camera or frame grabber
 
 	/** Images **/
 	IplImage* ImgOrig;
-	IplImage* ImgSmooth;
-	IplImage* ImgThresh;
+	IplImage* ImgSmooth; // the size of the analysis image (ImgBinned if there is one). Only filled in for DISPLAY_SMOOTH
+	IplImage* ImgThresh; // the size of the analysis image (ImgBinned if there is one). Only filled in for DISPLAY_THRESH
+	IplImage* ImgMask; // the thresholded analysis image that cvFindContours() takes apart
+
+	/** 1 = only keep the thresholded analysis image as runs (Runs) and pick the worm out of its blobs **/
+	int RunLength;
+	RunMask Runs;
+
+	/** Scratch rows for smoothing and thresholding **/
+	SmoothBuffer SmoothBuf;
+
+	/** Reduced resolution analysis image: ImgOrig averaged over Bin x Bin blocks (NULL if Bin is 1) **/
+	int Bin;
+	IplImage* ImgBinned;
+
+	/** 1 = go back to full resolution in a band around the outline found on ImgBinned (see FindWormBoundary()) **/
+	int Refine;
+	unsigned char* RefineMem; // scratch images for it
+	int RefineSize;
+
+	/** The frame at the camera's own bit depth when it has more than 8 bits (NULL otherwise). Belongs to the Frame it came from **/
+	IplImage* ImgOrig16;
+	Conv16 Conv; // how ImgOrig16 was converted to ImgOrig
+	int Thresh16; // 1 = threshold ImgOrig16 instead of the 8 bit image, when there is one
+
+	/** Only search for the worm near where it was (NULL = always search the whole frame) **/
+	WormSearch* Search;
+	CvPoint* TracePts; // the worm's outline when only it is traced (see SetWormTrace() and RunLength)
+	int TraceCapacity;
+	CvRect SearchRect; // part of ImgThresh that was last filled in (analysis image coordinates)
+	CvRect SmoothRect; // part of ImgSmooth that was last filled in
 
 	/** Memory **/
 	CvMemStorage* MemStorage;
 	CvMemStorage* MemScratchStorage;
 
 	/** Features **/
-	CvSeq* Boundary;
-	CvPoint* Head;
+	PointBuf Boundary;
+	CvPoint* Head; // points into Boundary
 	CvPoint* Tail;
 	int TailIndex;
 	int HeadIndex;
-	CvSeq* Centerline;
+	PointBuf Centerline;
+
+	/** Scratch for SegmentWorm(), kept so that it is only allocated once **/
+	PointBuf BoundA; // the boundary from the head to the tail one way round
+	PointBuf BoundB; // and the other way round
+	PointBuf Resampled; // the longer of the two resampled to the length of the shorter
+	PointBuf SmoothCenterline;
+	PtSmoother Smoother; // smooths the centerline
+
+	/** Scratch for GivenBoundaryFindWormHeadTail(): the padded boundary and its dot products **/
+	void* CurveMem;
+	int CurveSize;
 
 	/** TimeStamp **/
 	unsigned long timestamp;
 
+	/** When the camera captured this frame and when its illumination pattern went to the DLP (seconds, 0 = not yet) **/
+	double tCaptured;
+	double tIlluminated;
+
 	/** Segmented Worm **/
 	SegmentedWorm* Segmented;
 
@@ -182,9 +262,46 @@ typedef struct WormGeomStruct{
 	CvPoint Head;
 	CvPoint Tail;
 	int Perimeter;
+	int HeadIndex; // where the head and tail are on the boundary
+	int TailIndex;
+	int frameNum;
 }WormGeom;
 
 
+/** Frames of geometry kept by the head/tail tracker **/
+#define TRACK_HISTORY 16
+
+/*
+ * Follows the worm's head and tail from frame to frame (see TrackWormHeadTail()).
+ *
+ * An alpha-beta filter on where the head and tail are, both in the image and
+ * along the boundary, predicts where they will be on the next frame so that
+ * only small windows of the boundary around the predictions have to be
+ * searched. Positions along the boundary are kept as fractions of it, from
+ * its first point, since the number of points changes from frame to frame.
+ */
+typedef struct WormTrackerStruct{
+	/** The last frames' geometry, History[Newest] being the most recent **/
+	WormGeom History[TRACK_HISTORY];
+	int Newest;
+	int Count; // frames in History since the tracker was last reset
+
+	/** Filter state: [0] head, [1] tail **/
+	CvPoint2D32f Pos[2];
+	CvPoint2D32f Vel[2]; // pixels per frame
+	float Along[2]; // fraction of the boundary from its first point
+	float AlongVel[2]; // per frame
+	int frameNum; // frame the state is for
+	int Misses; // frames in a row that couldn't be segmented
+
+	/** Statistics: [0] whole boundary searches, [1] searches of windows around the predictions **/
+	long nframes[2];
+	double seconds[2];
+	long nfallbacks; // window searches that weren't trusted and were done again on the whole boundary
+	long nswaps; // head and tail swapped to agree with the prediction or the last frame
+} WormTracker;
+
+
 /*
  *
  * Every function here should have the word Worm in it
@@ -252,6 +369,64 @@ void DeallocateWormMemStorage(WormAnalysisData* Worm);
  */
 void InitializeEmptyWormImages(WormAnalysisData* Worm, CvSize ImageSize);
 
+/*
+ * Find the worm's outline on an image binned bin x bin (1, 2 or 4) instead of on
+ * the full resolution original. LoadWormImg() bins the frame as it copies it in.
+ * The boundary is scaled back up to full resolution coordinates, so everything
+ * downstream of FindWormBoundary() is unaffected. ImgOrig stays full resolution.
+ *
+ * Run after InitializeEmptyWormImages(). Reallocates ImgSmooth, ImgThresh and ImgMask.
+ * Returns 0, or -1 if bin is not 1, 2 or 4.
+ */
+int SetWormBinning(WormAnalysisData* Worm, int bin);
+
+/*
+ * Have FindWormBoundary() search only the part of the frame where the worm is
+ * predicted to be, so that the time it takes goes with the size of the worm
+ * instead of the size of the frame. The prediction is the worm's bounding box on
+ * the previous frame, stretched by the worm's own velocity and by how far the
+ * stage may drag it (Worm.stageVelocity), plus margin pixels on every side.
+ *
+ * The whole frame is searched on the first frame, after the worm was lost
+ * (see ForgetWormPosition()) and whenever the worm touches the edge of the region.
+ *
+ * A margin of 0 turns it off. Returns 0.
+ */
+int SetWormSearch(WormAnalysisData* Worm, int margin);
+
+/*
+ * Have FindWormBoundary() trace only the worm's outline instead of every blob in
+ * the thresholded image.
+ *
+ * The tracing starts where the row through the middle of the worm's predicted
+ * bounding box crosses into a blob, and walks around that blob's outer border
+ * (see FollowBlobBorder()). The first blob whose outline has at least half as many
+ * points as the worm's did on the previous frame is taken to be the worm. Its
+ * outline is the same one cvFindContours() would have found.
+ *
+ * When the worm's position isn't known or none of the blobs on that row
+ * look like the worm, all of the blobs are found and the longest one is kept, as before.
+ *
+ * Works with or without SetWormSearch(). Pass on=0 to turn it off. Returns 0.
+ */
+int SetWormTrace(WormAnalysisData* Worm, int on);
+
+/*
+ * Let Worm share the search of Master (see WormSearch).
+ */
+void ShareWormSearch(WormAnalysisData* Worm, WormAnalysisData* Master);
+
+/*
+ * Search the whole frame next time, e.g. because segmentation failed.
+ */
+void ForgetWormPosition(WormAnalysisData* Worm);
+
+/*
+ * Print how often the predicted region was searched instead of the whole frame and how much faster it was,
+ * and how often the worm's outline could be traced from where it was.
+ */
+void PrintWormSearch(WormSearch* Search);
+
 /*
  * This function is run after IntializeEmptyImages.
  * And it loads a color original into the WoirmAnalysisData strucutre.
@@ -266,6 +441,9 @@ void LoadWormColorOriginal(WormAnalysisData* Worm, IplImage* ImgColorOrig);
  * This function is run after IntializeEmptyImages.
  * And it loads a properly formated 8 bit grayscale image
  * into the WormAnalysisData strucutre.
+ *
+ * If the worm is binned (see SetWormBinning()) the binned image
+ * is made in the same pass as the copy.
  */
 int LoadWormImg(WormAnalysisData* Worm, IplImage* Img);
 
@@ -327,10 +505,38 @@ void ClearSegmentedInfo(SegmentedWorm* SegWorm);
 /*
  * Smooths, thresholds and finds the worms contour.
  * The original image must already be loaded into Worm.ImgOrig
- * The Smoothed image is deposited into Worm.ImgSmooth
- * The thresholded image is deposited into Worm.ImgThresh
+ * The Smoothed image is deposited into Worm.ImgSmooth, but only when Params->Display is DISPLAY_SMOOTH
+ * The thresholded image is deposited into Worm.ImgThresh, but only when Params->Display is DISPLAY_THRESH
  * The Boundary is placed in Worm.Boundary
  *
+ * Smoothing and thresholding happen in one pass (see SmoothThreshold()).
+ *
+ * If the worm is binned, this all happens on Worm.ImgBinned and the boundary
+ * is then scaled back up to full resolution, with the points in between the
+ * binned pixels filled in so it is as finely spaced as a full resolution one.
+ *
+ * If Worm.Refine is also set, the outline is instead found again at full resolution,
+ * smoothing and thresholding only the full resolution pixels within a binned pixel
+ * of the binned outline (see SmoothThresholdSpan()). Pixels inside the binned
+ * outline count as worm and pixels outside it as background. The boundary comes
+ * out the same as if the whole frame had been searched at full resolution,
+ * unless the binned outline is more than a binned pixel off.
+ *
+ * If Worm.Thresh16 is set and the frame has more than 8 bits (and the worm isn't
+ * binned), Worm.ImgOrig16 is thresholded at the 16 bit level that corresponds to
+ * Params->BinThresh instead, and the mask is then smoothed and thresholded again.
+ *
+ * If there is a search (see SetWormSearch()) only the predicted part of the frame
+ * is searched. The rest of Worm.ImgThresh and Worm.ImgSmooth is left black.
+ *
+ * If tracing is on (see SetWormTrace()) only the worm's outline is traced.
+ *
+ * If Worm.RunLength is set, the mask is only kept as runs (Worm.Runs) and never
+ * written out to Worm.ImgMask. The worm is the blob with the most pixels (see
+ * LabelRuns()) and only its outline is traced. Unlike cvFindContours(), pixels
+ * on the edge of the searched part of the frame count as worm. Tracing (see
+ * SetWormTrace()) isn't used when this is on.
+ *
  */
 void FindWormBoundary(WormAnalysisData* Worm, WormAnalysisParam* WormParams);
 
@@ -372,7 +578,7 @@ int SimpleIlluminateWorm(WormAnalysisData* Worm, Frame* IllumFrame,int start, in
  * along the centerline, than draws a rectangle perpendicular to this vector, a radius rsquared pixels
  * away from the centerline
  */
-void IlluminateWormSegment(IplImage* image, CvSeq* centerline, CvSeq* Boundary, int segment);
+void IlluminateWormSegment(IplImage* image, PointBuf* centerline, PointBuf* Boundary, int segment);
 
 
 /*
@@ -480,6 +686,51 @@ void LoadWormGeom(WormGeom* SimpleWorm, WormAnalysisData* Worm);
  */
 int PrevFrameImproveWormHeadTail(WormAnalysisData* Worm, WormAnalysisParam* Params, WormGeom* PrevWorm);
 
+/*
+ * Create, clear (forget every frame but keep the statistics) and free a head/tail tracker
+ */
+WormTracker* CreateWormTracker();
+void ResetWormTracker(WormTracker* Tracker);
+void DestroyWormTracker(WormTracker** Tracker);
+
+/*
+ * The geometry of the worm age frames before the last one that was
+ * given to UpdateWormTracker() (age 0 is that one). NULL if there isn't one.
+ */
+WormGeom* RecentWormGeom(WormTracker* Tracker, int age);
+
+/*
+ * Finds the Worm's Head and Tail, like GivenBoundaryFindWormHeadTail(),
+ * but with the help of the tracker.
+ *
+ * When the tracker has a prediction, only windows of the boundary around the
+ * predicted head and tail are searched. If what is found there can't be
+ * trusted (it is at the edge of a window, too far from the prediction or not
+ * curvy enough) the whole boundary is searched instead, and the head and tail
+ * are swapped if that agrees better with the prediction.
+ *
+ * Requires Worm->Boundary. Returns 0, or -1 if the boundary is too short.
+ */
+int TrackWormHeadTail(WormAnalysisData* Worm, WormAnalysisParam* Params, WormTracker* Tracker);
+
+/*
+ * Give the tracker the worm's head and tail once it has been segmented.
+ */
+void UpdateWormTracker(WormTracker* Tracker, WormAnalysisData* Worm, WormAnalysisParam* Params);
+
+/*
+ * Tell the tracker that the worm couldn't be segmented on this frame.
+ * After a few such frames it starts over.
+ */
+void MissWormTracker(WormTracker* Tracker);
+
+/*
+ * Swap the tracker's head and tail, to go along with ReverseWormHeadTail().
+ */
+void ReverseWormTracker(WormTracker* Tracker);
+
+void PrintWormTracker(WormTracker* Tracker);
+
 /*
  * Converts the slider bar used to specify an origin into a coordinate on wormspace.
  *
@@ -112,6 +112,7 @@ WriteOut* CreateDataWriter(){
 	DataWriter->error=0;
 	DataWriter->filename=NULL;
 	DataWriter->fs=NULL;
+	DataWriter->writingFrames=0;
 	return DataWriter;
 }
 
@@ -169,6 +170,7 @@ WriteOut* SetUpWriteToDisk(const char* dirfilename, const char* outfilename,  Cv
  */
 void BeginToWriteOutFrames(WriteOut* DataWriter){
 	cvStartWriteStruct(DataWriter->fs,"Frames",CV_NODE_SEQ,NULL);
+	DataWriter->writingFrames=1;
 	return;
 }
 
@@ -225,6 +227,8 @@ int AppendWormFrameToDisk(WormAnalysisData* Worm, WormAnalysisParam* Params, Wri
 	cvStartWriteStruct(fs,NULL,CV_NODE_MAP,NULL);
 		/** Frame Number Info **/
 		cvWriteInt(fs,"FrameNumber",Worm->frameNum);
+		cvWriteInt(fs,"CamFrameNumber",Worm->frameNumCamInternal);
+		if (Worm->tIlluminated > 0) cvWriteReal(fs,"msCaptureToDLP",1000*(Worm->tIlluminated-Worm->tCaptured));
 
 		/** TimeStamp **/
 		cvWriteInt(fs,"sElapsed",GetSeconds(Worm->timestamp));
@@ -247,9 +251,9 @@ int AppendWormFrameToDisk(WormAnalysisData* Worm, WormAnalysisParam* Params, Wri
 		}
 
 
-		if(cvSeqExists(Worm->Segmented->LeftBound)) cvWrite(fs,"BoundaryA",Worm->Segmented->LeftBound);
-		if(cvSeqExists(Worm->Segmented->RightBound)) cvWrite(fs,"BoundaryB",Worm->Segmented->RightBound);
-		if(cvSeqExists(Worm->Segmented->Centerline)) cvWrite(fs,"SegmentedCenterline",Worm->Segmented->Centerline);
+		if(Worm->Segmented->LeftBound.n > 0) cvWrite(fs,"BoundaryA",PointBufSeq(&(Worm->Segmented->LeftBound)));
+		if(Worm->Segmented->RightBound.n > 0) cvWrite(fs,"BoundaryB",PointBufSeq(&(Worm->Segmented->RightBound)));
+		if(Worm->Segmented->Centerline.n > 0) cvWrite(fs,"SegmentedCenterline",PointBufSeq(&(Worm->Segmented->Centerline)));
 
 		/** Illumination Information **/
 		cvWriteInt(fs,"DLPIsOn",Params->DLPOn);
@@ -292,6 +296,33 @@ int DestroyDataWriter(WriteOut** DataWriter){
 	return 0;
 }
 
+/*
+ * Write out what happened to the frames between the camera and the DLP.
+ */
+void WriteOutFrameAccounting(WriteOut* DataWriter, long nframes, long nskipped, long nmissing, long ngaps, long nlate,
+		double msMeanAge, double msMaxAge, const long* ageHist, int nbins, double msBinWidth){
+	CvFileStorage* fs=DataWriter->fs;
+
+	/** Finish the Frames sequence first **/
+	if (DataWriter->writingFrames) cvEndWriteStruct(fs);
+	DataWriter->writingFrames=0;
+
+	cvStartWriteStruct(fs,"FrameAccounting",CV_NODE_MAP,NULL);
+		cvWriteInt(fs,"FramesGrabbed",(int) nframes);
+		cvWriteInt(fs,"FramesSkipped",(int) nskipped);
+		cvWriteInt(fs,"FramesMissing",(int) nmissing);
+		cvWriteInt(fs,"Gaps",(int) ngaps);
+		cvWriteInt(fs,"FramesLate",(int) nlate);
+		cvWriteReal(fs,"msMeanCaptureToDLP",msMeanAge);
+		cvWriteReal(fs,"msMaxCaptureToDLP",msMaxAge);
+		cvWriteReal(fs,"msHistogramBinWidth",msBinWidth);
+		cvStartWriteStruct(fs,"CaptureToDLPHistogram",CV_NODE_SEQ | CV_NODE_FLOW,NULL);
+		int k;
+		for (k=0; k<nbins; k++) cvWriteInt(fs,NULL,(int) ageHist[k]);
+		cvEndWriteStruct(fs);
+	cvEndWriteStruct(fs);
+}
+
 /*
  * Finish writing to disk and close the file and such.
  * Destroys the Data Writer
@@ -300,7 +331,8 @@ int DestroyDataWriter(WriteOut** DataWriter){
 int FinishWriteToDisk(WriteOut** DataWriter){
 	CvFileStorage* fs=(*DataWriter)->fs;
 	/** Finish writing this structure **/
-	cvEndWriteStruct(fs);
+	if ((*DataWriter)->writingFrames) cvEndWriteStruct(fs);
+	(*DataWriter)->writingFrames=0;
 
 	/** Close File Storage and Finish Writing Out to File **/
 	DestroyDataWriter(DataWriter);
@@ -55,6 +55,7 @@ typedef struct WriteOutStruct{
 	CvFileStorage* fs; //Experiment data in YAML format
 	char* filename;
 	int error;
+	int writingFrames; // 1 while the Frames sequence is open
 
 
 } WriteOut;
@@ -114,6 +115,15 @@ void WriteOutDefaultGridSize(WriteOut* DataWriter, WormAnalysisParam* Param);
  */
 int AppendWormFrameToDisk(WormAnalysisData* Worm, WormAnalysisParam* Params, WriteOut* DataWriter);
 
+/*
+ * Write out what happened to the frames between the camera and the DLP:
+ * frames grabbed, skipped, missing and late, the age of the frames at illumination
+ * and a histogram of the age (nbins bins, msBinWidth ms wide).
+ * Ends the Frames sequence, so no frames can be written after this.
+ */
+void WriteOutFrameAccounting(WriteOut* DataWriter, long nframes, long nskipped, long nmissing, long ngaps, long nlate,
+		double msMeanAge, double msMaxAge, const long* ageHist, int nbins, double msBinWidth);
+
 /*
  * Finish writing to disk and close the file and such.
  * Destroys the Data Writer
@@ -41,6 +41,7 @@
 //Standard C headers
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <conio.h>
 #include <math.h>
@@ -57,6 +58,11 @@
 
 //Andy's Personal Headers
 #include "AndysOpenCVLib.h"
+#include "RTThreads.h"
+#include "TaskGraph.h"
+#include "SyntheticWorm.h"
+#include "FrameSource.h"
+#include "RawFrames.h"
 #include "Talk2Camera.h"
 #include "Talk2FrameGrabber.h"
 #include "Talk2DLP.h"
@@ -67,6 +73,7 @@
 #include "IllumWormProtocol.h"
 #include "TransformLib.h"
 #include "WriteOutWorm.h"
+#include "Journal.h"
 #include "version.h"
 
 
@@ -105,23 +112,32 @@ Experiment* CreateExperimentStruct() {
 	exp->infname = NULL;
 	exp->dirname = NULL;
 	exp->protocolfname = NULL;
+	exp->journalfname = NULL;
 
 	/** Protocol Data **/
 	exp->p = NULL;
 	exp->pflag = 0;
 
-	/** Camera Input**/
-	exp->MyCamera = NULL;
-
-	/** FrameGrabber Input **/
-	exp->fg = NULL;
+	/** Frame Source **/
+	exp->src = NULL;
 	exp->UseFrameGrabber = FALSE;
-
-	/** Video input **/
-	exp->capture = NULL;
-
-	/** Last Observerd CamFrameNumber **/
-	exp->lastFrameSeenOutside = 0;
+	exp->NumRingBuffers = 0;
+	exp->UseSyntheticSource = 0;
+	SetDefaultSynthWormModel(&(exp->SynthModel), NSIZEX, NSIZEY);
+	exp->SynthModel.fps = EXP_SYNTHETIC_FPS;
+	exp->Accuracy = NULL;
+	exp->VidUnpaced = 0;
+	exp->Admission = EXP_ADMIT_AUTO;
+	exp->ROIMargin = 0;
+	exp->ROI = NULL;
+	SetConv16Shift(&(exp->Conv), 8);
+	exp->Thresh16 = 0;
+	exp->HasPendingFrame = 0;
+	exp->PendingFrame.data = NULL;
+	exp->FrameMeta.seq = 0;
+	exp->FrameMeta.timestamp = 0;
+	exp->FrameMeta.bitDepth = 8;
+	exp->Account = NULL;
 
 	/** DLP Output **/
 	exp->myDLP = 0;
@@ -135,8 +151,8 @@ Experiment* CreateExperimentStruct() {
 	/** Information about Our Worm **/
 	exp->Worm = NULL;
 
-	/** Information about the Previous frame's Worm **/
-	exp->PrevWorm = NULL;
+	/** Follows the worm's head and tail from frame to frame **/
+	exp->Tracker = NULL;
 
 	/** Segmented Worm in DLP Space **/
 	exp->segWormDLP = NULL;
@@ -157,6 +173,11 @@ Experiment* CreateExperimentStruct() {
 	/** Write Video To File **/
 	exp->Vid = NULL; //Video Writer
 	exp->VidHUDS = NULL;
+	exp->RawRecorder = NULL;
+
+	/** Session Journal **/
+	exp->SessionJournal = NULL;
+	exp->Replay = NULL;
 
 	/** Timing  Information **/
 	exp->now = 0;
@@ -173,6 +194,19 @@ Experiment* CreateExperimentStruct() {
 	exp->prevFrames = 0;
 	exp->prevTime = 0;
 
+	/** Runtime Mode **/
+	exp->UsePipeline = 0;
+	exp->UseTaskGraph = 0;
+	exp->PinCore = -1;
+	exp->RealTime = 0;
+	exp->Headless = 0;
+
+	/** Intra-frame task graph **/
+	exp->Workers = NULL;
+	exp->FrameGraph = NULL;
+	exp->FrameMontage = NULL;
+	exp->FrameGridSize = cvSize(0, 0);
+
 	/** Stage Control **/
 	exp->stageIsPresent=0;
 	exp->stage=NULL;
@@ -183,6 +217,7 @@ Experiment* CreateExperimentStruct() {
 
 	/** Macros **/
 	exp->RECORDVID = 0;
+	exp->RECORDRAW = 0;
 	exp->RECORDDATA = 0;
 
 	/** Error Handling **/
@@ -210,14 +245,35 @@ void displayHelp() {
 	printf("Optional arguments:\n");
 	printf(
 			"\t-o  baseFileName\n\t\tWrite video and data output to file using the specified base file name.\n\n");
+	printf(
+			"\t-r\n\t\tWith -o, also record every frame losslessly to a .raw file that can be replayed exactly with -i.\n\n");
 	printf(
 			"\t-d  D:/Path/To/My/Directory/\n\t\tWrite the video and data output to the specified directory. NOTE: it is important to have the trailing slash.\n\n");
 	printf(
-			"\t-i  InputVideo.avi\n\t\tNo camera. Use video file source instead.\n\n");
+			"\t-i  InputVideo.avi\n\t\tNo camera. Use video file source instead. Frames arrive at the video's own frame rate.\n\t\tA .raw file (see -r) is replayed frame for frame with the timing it was recorded with.\n\n");
+	printf("\t-f\n\t\tWith -i, replay the video as fast as it can be decoded and analyzed (for benchmarking).\n\n");
+	printf("\t-a  newest\n\t\tWhen the closed loop falls behind the camera, skip the frames that have piled up and take the newest (newest),\n\t\tor work through every one of them (all). Defaults to all with -f or -J and to newest otherwise.\n\n");
 	printf(
 			"\t-s\n\t\tSimulate the existence of DLP. (No physical DLP required.)\n\n");
+	printf("\t-m\n\t\tNo camera. Use frames of a synthetic crawling worm instead (no hardware or video file required).\n\n");
+	printf("\t-M  fps=500,length=300,width=25,speed=0.5,coil=0,noise=8,gradient=20\n\t\tLike -m, with the synthetic worm's parameters (any of fps, length, width, wavelength, amplitude, speed, coil, crawl, noise, background, gradient and body).\n\t\tHead, tail and centerline are compared against the known answer and the accuracy is reported at the end.\n\n");
 	printf("\t-g\n\t\tUse camera attached to FrameGrabber.\n\n");
+	printf("\t-b  8\n\t\tWith -g, acquire continuously into a ring of the specified number of DMA buffers and process each frame in place without copying it.\n\n");
+	printf("\t-G  64\n\t\tWith -g, only acquire the part of the sensor around the worm, with a margin of the specified number of pixels. The window follows the worm.\n\n");
+	printf("\t-w  200,3000\n\t\tWith a camera that has more than 8 bits per pixel, map this window of its levels onto the 8 bit image (by default the top 8 bits are kept).\n\n");
+	printf("\t-W\n\t\tWith a camera that has more than 8 bits per pixel, find the worm by thresholding its own bits instead of the 8 bit image.\n\n");
+	printf("\t-B  2\n\t\tFind the worm's outline on the frame binned 2x2 (or 4x4) for speed. Recording and display keep the full resolution frame.\n\n");
+	printf("\t-S  32\n\t\tOnly look for the worm near where it was on the previous frame (allowing for its motion and the stage's), with a margin of the specified number of pixels.\n\t\tThe whole frame is searched whenever the worm is lost or touches the edge of that region.\n\n");
+	printf("\t-L\n\t\tTrace only the worm's outline, starting from the blob on the middle row of where it was on the previous frame, instead of finding every blob.\n\t\tEvery blob is found whenever none on that row looks like the worm.\n\n");
+	printf("\t-E\n\t\tKeep the thresholded frame only as runs of worm pixels instead of as an image, and take the worm to be the blob with the most pixels.\n\n");
+	printf("\t-F\n\t\tWith -B, find the worm's outline again at full resolution, smoothing and thresholding only a band around the binned outline.\n\n");
+	printf("\t-K  8\n\t\tSmooth the worm's centerline with a recursive Gaussian, whose cost doesn't depend on its width, whenever its sigma is at least the specified number of points.\n\n");
 	printf("\t-t\n\t\tUse USB stage tracker.\n\n");
+	printf("\t-P\n\t\tRun the closed loop as a multithreaded pipeline (acquisition, segmentation, illumination and output overlap across frames).\n\n");
+	printf("\t-c  2\n\t\tPin the closed loop (segmentation and DLP) thread to the specified core and keep all other threads off of it.\n\n");
+	printf("\t-R\n\t\tRun the closed loop thread with real-time priority (SCHED_FIFO on Linux, TIME_CRITICAL on Windows).\n\n");
+	printf("\t-T\n\t\tWithin each frame, send the DLP pattern first and build the camera space illumination, display and recording on another core.\n\n");
+	printf("\t-J  worm.journal\n\t\tWith -i worm.raw, replay a recorded session headless (no GUI, no keyboard, no stage) with every parameter change applied on the frame it was made.\n\t\tAdd -f to replay as fast as possible. Without -s the DLP patterns are sent as usual (VirtualMC checksums them instead).\n\n");
 	printf("\t-x\n\tx 100\tSpecifies the x offset from center for the worm's location in the stage feedback trap. +x is to the right of screen.\n\n");
 	printf("\t-y\n\ty -100\tSpecifies the y offset from center for the worm's location in the stage feedback trap. +y is towards bottom of screen.\n\n");
 	printf(
@@ -237,7 +293,7 @@ int HandleCommandLineArguments(Experiment* exp) {
 	opterr = 0;
 
 	int c;
-	while ((c = getopt(exp->argc, exp->argv, "si:d:o:p:gtx:y:?")) != -1) {
+	while ((c = getopt(exp->argc, exp->argv, "si:fd:o:rp:gmM:tx:y:PTc:Rb:B:G:S:LEFK:w:WJ:a:?")) != -1) {
 		switch (c) {
 		case 'i': /** specify input video file **/
 			exp->VidFromFile = 1;
@@ -249,6 +305,10 @@ int HandleCommandLineArguments(Experiment* exp) {
 			}
 			break;
 
+		case 'f': /** Replay the video as fast as possible **/
+			exp->VidUnpaced = 1;
+			break;
+
 		case 'd': /** specifiy directory **/
 			dflag = 1;
 			if (optarg != NULL) {
@@ -268,6 +328,10 @@ int HandleCommandLineArguments(Experiment* exp) {
 			exp->RECORDDATA = 1;
 			break;
 
+		case 'r': /** Record raw frames too **/
+			exp->RECORDRAW = 1;
+			break;
+
 		case 's': /** Run in DLP simulation Mode **/
 			exp->SimDLP = 1;
 			break;
@@ -293,9 +357,108 @@ int HandleCommandLineArguments(Experiment* exp) {
 				exp->UseFrameGrabber = TRUE;
 			}
 			break;
+		case 'm': /** Generate frames instead of using a camera **/
+			exp->UseSyntheticSource=1;
+			break;
+		case 'M': /** Generate frames of a synthetic worm with these parameters **/
+			exp->UseSyntheticSource=1;
+			if (ParseSynthWormModel(optarg, &(exp->SynthModel)) != 0) {
+				displayHelp();
+				return -1;
+			}
+			break;
 		case 't': /** Use the stage tracking software **/
 			exp->stageIsPresent=1;
 			break;
+		case 'P': /** Run the closed loop as a multithreaded pipeline **/
+			exp->UsePipeline=1;
+			break;
+		case 'T': /** Run camera space and DLP space work concurrently within each frame **/
+			exp->UseTaskGraph=1;
+			break;
+		case 'c': /** Pin the closed loop thread to this core **/
+			if (optarg != NULL) {
+				exp->PinCore = atoi(optarg);
+			}
+			break;
+		case 'R': /** Run the closed loop thread with real-time priority **/
+			exp->RealTime=1;
+			break;
+		case 'b': /** Acquire continuously from the frame grabber into a ring of buffers **/
+			if (optarg != NULL) {
+				exp->NumRingBuffers = atoi(optarg);
+			}
+			break;
+		case 'B': /** Find the worm on a binned frame **/
+			if (optarg == NULL || SetWormBinning(exp->Worm, atoi(optarg)) != 0) {
+				displayHelp();
+				return -1;
+			}
+			break;
+		case 'S': /** Only search for the worm near where it was **/
+			if (optarg == NULL || atoi(optarg) <= 0) {
+				printf("Error. -S takes the margin (in pixels) to search around where the worm is predicted to be.\n");
+				displayHelp();
+				return -1;
+			}
+			SetWormSearch(exp->Worm, atoi(optarg));
+			break;
+		case 'L': /** Trace only the worm's outline, starting from where it was **/
+			SetWormTrace(exp->Worm, 1);
+			break;
+		case 'E': /** Keep the thresholded frame as runs of worm pixels **/
+			exp->Worm->RunLength = 1;
+			break;
+		case 'F': /** With -B, find the outline again at full resolution near the binned one **/
+			exp->Worm->Refine = 1;
+			break;
+		case 'K': /** Smooth the centerline with a recursive Gaussian for large sigmas **/
+			if (optarg == NULL || atof(optarg) < 0.5) {
+				printf("Error. -K takes the smallest sigma (in points, at least 0.5) to smooth the centerline with a recursive Gaussian.\n");
+				displayHelp();
+				return -1;
+			}
+			exp->Worm->Smoother.IIRSigma = atof(optarg);
+			break;
+		case 'G': /** Region of interest that follows the worm **/
+			if (optarg == NULL || atoi(optarg) <= 0) {
+				printf("Error. -G takes the margin (in pixels) to keep around the worm.\n");
+				displayHelp();
+				return -1;
+			}
+			exp->ROIMargin = atoi(optarg);
+			break;
+		case 'w': /** Window of a high bit depth camera's levels to convert to 8 bits **/
+			{
+				int low, high;
+				if (optarg == NULL || sscanf(optarg, "%d,%d", &low, &high) != 2
+						|| SetConv16Window(&(exp->Conv), 16, low, high) != 0) {
+					printf("Error. -w takes the low and high levels of the window, e.g. -w 200,3000\n");
+					displayHelp();
+					return -1;
+				}
+			}
+			break;
+		case 'W': /** Threshold high bit depth frames at their own bit depth **/
+			exp->Thresh16 = 1;
+			break;
+		case 'J': /** Replay a session journal without a GUI **/
+			if (optarg != NULL) {
+				exp->journalfname = optarg;
+				exp->Headless = 1;
+			}
+			break;
+		case 'a': /** Frame admission policy **/
+			if (optarg != NULL && strcmp(optarg, "newest") == 0) {
+				exp->Admission = EXP_ADMIT_NEWEST;
+			} else if (optarg != NULL && strcmp(optarg, "all") == 0) {
+				exp->Admission = EXP_ADMIT_ALL;
+			} else {
+				printf("Error. -a takes either newest or all.\n");
+				displayHelp();
+				return -1;
+			}
+			break;
 		case 'x': /** adjust the target for stage feedback loop by these certain number of pixels **/
 				if (optarg != NULL) {
 					exp->stageFeedbackTargetOffset.x = atoi(optarg);
@@ -317,7 +480,7 @@ int HandleCommandLineArguments(Experiment* exp) {
 			}
 			/** What is this? This looks bening but wrong to me.. -andy 26 Feb 2010 **/
 			if (optopt == 'i' || optopt == 'c' || optopt == 'd' || optopt
-					== 's') {
+					== 's' || optopt == 'J' || optopt == 'a' || optopt == 'B' || optopt == 'G' || optopt == 'S' || optopt == 'w') {
 				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 				displayHelp();
 				return -1;
@@ -696,54 +859,91 @@ void UpdateGUI(Experiment* exp) {
 /*** Start Video Camera ***/
 
 /*
- * Initialize camera library
- * Allocate Camera Data
- * Select Camera and Show Properties dialog box
- * Start Grabbing Frames as quickly as possible
- * *
- * OR open up the video file for reading.
+ * Create the frame source:
+ * 	the video or raw file (-i), the synthetic generator (-m),
+ * 	the frame grabber (-g) or the ImagingSource USB camera.
+ * and start grabbing frames.
  */
 void RollVideoInput(Experiment* exp) {
 	if (exp->VidFromFile) { /** Use source from file **/
-		/** Define the File catpure **/
-		exp->capture = cvCreateFileCapture(exp->infname);
-
+		const char* ext = strrchr(exp->infname, '.');
+		if (ext != NULL && strcmp(ext, ".raw") == 0) {
+			exp->src = CreateRawFileSource(exp->infname, NSIZEX, NSIZEY, !(exp->VidUnpaced));
+		} else {
+			exp->src = CreateVideoFileSource(exp->infname, NSIZEX, NSIZEY, !(exp->VidUnpaced));
+		}
+	} else if (exp->UseSyntheticSource) {
+		exp->src = CreateSyntheticSource(NSIZEX, NSIZEY, &(exp->SynthModel));
+		exp->Accuracy = (SynthWormScore*) malloc(sizeof(SynthWormScore));
+		ClearSynthWormScore(exp->Accuracy);
+	} else if (exp->UseFrameGrabber) {
+		exp->src = CreateBitFlowSource(NSIZEX, NSIZEY, exp->NumRingBuffers);
 	} else {
-		/** Use source from camera **/
-		if (exp->UseFrameGrabber) {
-			exp->fg = TurnOnFrameGrabber();
-
-			printf("Checking frame size of frame grabber..\n");
-			/** Check to see that our image sizes are all the same. **/
-			if ((int) exp->fg->xsize != exp->fromCCD->size.width
-					|| (int) exp->fg->ysize != exp->fromCCD->size.height) {
-				printf("Error in RollVideoInput!\n");
-				printf(
-						"Size from framegrabber does not match size in IplImage fromCCD!\n");
-				printf(" exp->fg->xsize=%d\n", (int) exp->fg->xsize);
-				printf(" exp->fromCCD->size.width=%d\n",
-						exp->fromCCD->size.width);
-				printf(" exp->fg->ysize=%d\n", (int) exp->fg->ysize);
-				printf(" exp->fromCCD->size.height=%d\n",
-						exp->fromCCD->size.height);
-				return;
-			}
+		exp->src = CreateImagingSourceSource(NSIZEX, NSIZEY);
+	}
 
-			printf("Frame size checks out..");
+	exp->Account = (FrameAccount*) malloc(sizeof(FrameAccount));
+	ClearFrameAccount(exp->Account);
 
-			/**Use Frame Grabber **/
+	/** Live, only the newest frame matters. A benchmark or a journal replay has to see every frame **/
+	if (exp->Admission == EXP_ADMIT_AUTO)
+		exp->Admission = ((exp->VidFromFile && exp->VidUnpaced) || exp->Headless) ? EXP_ADMIT_ALL : EXP_ADMIT_NEWEST;
+	if (exp->Admission == EXP_ADMIT_NEWEST) printf("When behind, the closed loop will skip to the newest frame.\n");
+	else printf("The closed loop will work through every frame.\n");
+
+	/** Keep the source's own threads off of the closed loop's core **/
+	exp->src->avoidCore = exp->PinCore;
+	if (StartFrameSource(exp->src) != FS_SUCCESS) {
+		printf("Error in RollVideoInput!\n");
+	}
+
+	/** The source only knows its bit depth once it has started **/
+	if (exp->src->bitDepth > 8) {
+		exp->Conv.bitDepth = exp->src->bitDepth;
+		if (exp->Conv.mode == CONV16_WINDOW)
+			printf("Frames are %d bit. Mapping levels %d to %d onto 8 bits.\n", exp->Conv.bitDepth, exp->Conv.low, exp->Conv.high);
+		else {
+			SetConv16Shift(&(exp->Conv), exp->src->bitDepth);
+			printf("Frames are %d bit. Keeping the top 8 bits.\n", exp->Conv.bitDepth);
+		}
+		if (exp->Thresh16) printf("The worm will be found by thresholding all %d bits.\n", exp->Conv.bitDepth);
+	}
+
+	if (exp->ROIMargin > 0) {
+		if (exp->src->setROI == NULL || !(exp->src->running)) {
+			printf("The %s has no region of interest to follow the worm with. Ignoring -G.\n", exp->src->name);
 		} else {
-			/** Use ImagingSource USB Camera **/
-
-			/** Turn on Camera **/
-			T2Cam_InitializeLib();
-			T2Cam_AllocateCamData(&(exp->MyCamera));
-			T2Cam_ShowDeviceSelectionDialog(&(exp->MyCamera));
-			/** Start Grabbing Frames and Update the Internal Frame Number iFrameNumber **/
-			T2Cam_GrabFramesAsFastAsYouCan(&(exp->MyCamera));
+			exp->ROI = (ROITracker*) malloc(sizeof(ROITracker));
+			InitROITracker(exp->ROI, exp->src, exp->ROIMargin);
+			printf("The region of interest will follow the worm with a %d pixel margin.\n", exp->ROIMargin);
 		}
+	}
+}
 
+/*
+ * Hand back any frames that are still lent out, stop the frame source and free it.
+ */
+void StopVideoInput(Experiment* exp) {
+	if (exp->src == NULL) return;
+	if (exp->ROI != NULL) {
+		PrintROITracker(exp->ROI, exp->src);
+		free(exp->ROI);
+		exp->ROI = NULL;
+	}
+	if (exp->Account != NULL) {
+		PrintFrameAccount(exp->Account);
+		free(exp->Account);
+		exp->Account = NULL;
 	}
+	if (exp->Accuracy != NULL) {
+		PrintSynthWormScore(exp->Accuracy);
+		free(exp->Accuracy);
+		exp->Accuracy = NULL;
+	}
+	if (exp->HasPendingFrame) ReleaseFrameBuffer(exp->src, exp->PendingFrame.data);
+	exp->HasPendingFrame = 0;
+	ReleaseFrameBuffer(exp->src, ReclaimFrameBuffer(exp->fromCCD));
+	DestroyFrameSource(&(exp->src));
 }
 
 /**** Read in Calibration Data ***/
@@ -808,9 +1008,8 @@ void InitializeExperiment(Experiment* exp) {
 	exp->Worm = Worm;
 	exp->Params = Params;
 
-	/** Setup Previous Worm **/
-	WormGeom* PrevWorm = CreateWormGeom();
-	exp->PrevWorm = PrevWorm;
+	/** Setup the head/tail tracker **/
+	exp->Tracker = CreateWormTracker();
 
 }
 
@@ -828,6 +1027,10 @@ void ReleaseExperiment(Experiment* exp) {
 	if (exp->IlluminationFrame != NULL)
 		DestroyFrame(&(exp->IlluminationFrame));
 
+	/** Free up the journal being replayed **/
+	if (exp->Replay != NULL)
+		CloseJournalReplay(&(exp->Replay));
+
 	/** Free up Strings **/
 	exp->dirname = NULL;
 	exp->infname = NULL;
@@ -847,9 +1050,9 @@ void ReleaseExperiment(Experiment* exp) {
 		DestroyWormAnalysisParam((exp->Params));
 		exp->Params = NULL;
 	}
-	if (exp->PrevWorm != NULL) {
-		DestroyWormGeom(&(exp->PrevWorm));
-		exp->PrevWorm = NULL;
+	if (exp->Tracker != NULL) {
+		DestroyWormTracker(&(exp->Tracker));
+		exp->Tracker = NULL;
 	}
 
 	/** Free up internal iplImages **/
@@ -862,6 +1065,14 @@ void ReleaseExperiment(Experiment* exp) {
 	if (exp->Calib != NULL)
 		DestroyCalibData(exp->Calib);
 
+	/** Free up the intra-frame task graph **/
+	if (exp->Workers != NULL)
+		DestroyWorkerPool(&(exp->Workers));
+	if (exp->FrameGraph != NULL) {
+		free(exp->FrameGraph);
+		exp->FrameGraph = NULL;
+	}
+
 	/** Release Window Names **/
 	ReleaseWindowNames(exp);
 
@@ -881,69 +1092,76 @@ void DestroyExperiment(Experiment** exp) {
  *
  */
 
-/** Grab a Frame from either camera or video source
+/** Grab a Frame from the frame source
  *
  */
 int GrabFrame(Experiment* exp) {
+	FrameBuffer* buf = &(exp->PendingFrame);
 
-	if (!(exp->VidFromFile)) {
-		/** Acquire from Physical Camera **/
-		if (exp->UseFrameGrabber) {
-			/** Use BitFlow SDK to acquire from Frame Grabber **/
-			if (AcquireFrame(exp->fg)==T2FG_ERROR){
-				return EXP_ERROR;
-			}
-
-			/** Check to see if file sizes match **/
-
-			LoadFrameWithBin(exp->fg->HostBuf, exp->fromCCD);
-
-		} else {
-
-			/** Acqure from ImagingSource USB Cam **/
-
-			exp->lastFrameSeenOutside = exp->MyCamera->iFrameNumber;
-			/*** Create a local copy of the image***/
-			LoadFrameWithBin(exp->MyCamera->iImageData, exp->fromCCD);
-
-		}
-
-	} else {
-
-		/** Acquire  from file **/
+	/** Hand back the buffer this frame object was holding from last time **/
+	ReleaseFrameBuffer(exp->src, ReclaimFrameBuffer(exp->fromCCD));
 
-		IplImage* tempImg;
-		/** Grab the frame from the video **/
-		tempImg = cvQueryFrame(exp->capture);
-
-		/** Stall for a little bit **/
-		//Sleep(50);
-
-
-		if (tempImg == NULL) {
+	/** WaitForFrame() has usually already acquired the next frame **/
+	if (!(exp->HasPendingFrame)) {
+		int ret = AcquireFrameBuffer(exp->src, EXP_FRAME_TIMEOUT, buf);
+		if (ret == FS_END) {
 			printf("There was an error querying the frame from video!\n");
 			return EXP_VIDEO_RAN_OUT;
 		}
-
-		/** Create a new temp image that is grayscale and of the same size **/
-		IplImage* tempImgGray = cvCreateImage(cvGetSize(tempImg), IPL_DEPTH_8U,
-				1);
-
-		/** Convert Color to GrayScale **/
-		cvCvtColor(tempImg, tempImgGray, CV_RGB2GRAY);
-
-		/** Load the frame into the fromCCD frame object **/
-		/*** ANDY! THIS WILL FAIL BECAUSE THE SIZING ISN'T RIGHT **/
-		LoadFrameWithImage(tempImgGray, exp->fromCCD);
-		cvReleaseImage(&tempImgGray);
+		if (ret != FS_SUCCESS) return EXP_ERROR;
+	}
+	exp->HasPendingFrame = 0;
+
+	/** Don't work through stale frames **/
+	if (exp->Admission == EXP_ADMIT_NEWEST)
+		SkipToNewestFrame(exp->src, buf, exp->Account);
+
+	exp->FrameMeta = buf->info;
+	AccountForCapture(exp->Account, &(exp->FrameMeta));
+	exp->Worm->frameNumCamInternal = (int) exp->FrameMeta.seq;
+	exp->Worm->tCaptured = exp->FrameMeta.timestamp;
+	exp->Worm->tIlluminated = 0;
+
+	/** A region of interest goes back where it came from on the sensor, so coordinates don't change **/
+	CvRect roi = cvRect(buf->info.roiX, buf->info.roiY, buf->info.roiWidth, buf->info.roiHeight);
+	int whole = (roi.width == exp->fromCCD->size.width && roi.height == exp->fromCCD->size.height);
+
+	/** Record exactly the pixels that the tracker is about to see **/
+	if (exp->RawRecorder != NULL && whole)
+		AppendRawFrame(exp->RawRecorder, buf->data, buf->step, (unsigned int) buf->info.seq, buf->info.timestamp);
+
+	exp->Worm->ImgOrig16 = NULL;
+	if (buf->info.bitDepth > 8) {
+		/** Keep the camera's own bits and convert them to 8 bits in the same pass **/
+		LoadFrameRegionWithBuffer16(buf->data, buf->step, roi, &(exp->Conv), exp->fromCCD);
+		ReleaseFrameBuffer(exp->src, buf->data);
+		exp->Worm->ImgOrig16 = exp->fromCCD->iplimg16;
+		exp->Worm->Conv = exp->Conv;
+		exp->Worm->Thresh16 = exp->Thresh16;
+	} else if (whole && exp->ROI == NULL && buf->step == exp->fromCCD->iplimg->widthStep) {
+		/** No copy: fromCCD simply points at the source's buffer until the next frame **/
+		LendBufferToFrame(buf->data, exp->fromCCD);
+	} else {
 		/*
-		 * Note: for some reason thinks crash when you go cvReleaseImage(&tempImg)
-		 * And there don't seem to be memory leaks if you leave it. So I'm going to leave it in place.
-		 *
+		 * Copy the frame (or region) and hand the buffer straight back: the rows don't line up,
+		 * or the region of interest follows the worm and can only be moved while no buffer is lent out.
 		 */
+		LoadFrameRegionWithBuffer(buf->data, buf->step, roi, exp->fromCCD);
+		ReleaseFrameBuffer(exp->src, buf->data);
+	}
+
+	/** A partial frame is recorded whole, as it was put back together **/
+	if (exp->RawRecorder != NULL && !whole) {
+		IplImage* rec = (exp->Worm->ImgOrig16 != NULL) ? exp->fromCCD->iplimg16 : exp->fromCCD->iplimg;
+		AppendRawFrame(exp->RawRecorder, (unsigned char*) rec->imageData, rec->widthStep, (unsigned int) buf->info.seq, buf->info.timestamp);
 	}
 
 	exp->Worm->frameNum++;
+
+	/** Replay what the user did on this frame, or journal what they did since the last one **/
+	if (ReplayJournal(exp->Replay, exp->Worm->frameNum, exp->Params) == JOURNAL_STOP)
+		return EXP_VIDEO_RAN_OUT;
+	JournalFrame(exp->SessionJournal, exp->Worm->frameNum, exp->Params);
 	return EXP_SUCCESS;
 }
 
@@ -952,18 +1170,19 @@ int GrabFrame(Experiment* exp) {
  *
  */
 int isFrameReady(Experiment* exp) {
-	if (!(exp->VidFromFile) && !(exp->UseFrameGrabber)) {
-		/** If This isn't a simulation.. **/
-		/** And if we arent using the frame grabber **/
-		return (exp->MyCamera->iFrameNumber > exp->lastFrameSeenOutside);
-	} else {
-		/** Otherwise just keep chugging... **/
+	if (exp->HasPendingFrame) return 1;
+	int ret = AcquireFrameBuffer(exp->src, 0, &(exp->PendingFrame));
+	if (ret == FS_SUCCESS) exp->HasPendingFrame = 1;
+	/** Let GrabFrame() report the end of the video or an error **/
+	return (ret != FS_TIMEOUT);
+}
 
-		/** Unless we're reading from video, in which case we should fake like we're waiting for something **/
-		if (exp->VidFromFile)
-			cvWaitKey(100);
-		return 1;
-	}
+int WaitForFrame(Experiment* exp, int timeout) {
+	if (exp->HasPendingFrame) return 1;
+	/** Sleep until the source has a frame for us and hold on to it for GrabFrame() **/
+	int ret = AcquireFrameBuffer(exp->src, timeout, &(exp->PendingFrame));
+	if (ret == FS_SUCCESS) exp->HasPendingFrame = 1;
+	return (ret != FS_TIMEOUT);
 }
 
 /*********************** RECORDING *******************/
@@ -1028,6 +1247,25 @@ int SetupRecording(Experiment* exp) {
 		DestroyFilename(&HUDSFileName);
 		printf("Initialized video recording\n");
 	}
+
+	/** Set Up Lossless Raw Frame Recording **/
+	if (exp->RECORDRAW) {
+		if (exp->dirname == NULL || exp->outfname == NULL) {
+			printf("Raw frame recording requires -o. Not recording raw frames.\n");
+		} else {
+			char* RawFileName = CreateFileName(exp->dirname, exp->outfname, ".raw");
+			int bitDepth = (exp->src != NULL) ? exp->src->bitDepth : 8;
+			exp->RawRecorder = CreateRawWriter(RawFileName, NSIZEX, NSIZEY, bitDepth);
+			DestroyFilename(&RawFileName);
+		}
+	}
+
+	/** Set Up the Session Journal (not when we are replaying one) **/
+	if (exp->RECORDDATA && exp->Replay == NULL) {
+		char* JournalFileName = CreateFileName(exp->dirname, exp->outfname, ".journal");
+		exp->SessionJournal = CreateJournal(JournalFileName, exp->Params);
+		DestroyFilename(&JournalFileName);
+	}
 	return 0;
 
 }
@@ -1044,9 +1282,23 @@ void FinishRecording(Experiment* exp) {
 	if (exp->VidHUDS != NULL)
 		cvReleaseVideoWriter(&(exp->VidHUDS));
 
-	/** Finish Writing to Disk **/
-	if (exp->RECORDDATA)
+	/** Finish Writing Raw Frames **/
+	if (exp->RawRecorder != NULL)
+		CloseRawWriter(&(exp->RawRecorder));
+
+	/** Finish the Session Journal **/
+	if (exp->SessionJournal != NULL)
+		CloseJournal(&(exp->SessionJournal));
+
+	/** Finish Writing to Disk, with what happened to the frames at the end **/
+	if (exp->RECORDDATA) {
+		FrameAccount* a = exp->Account;
+		if (a != NULL)
+			WriteOutFrameAccounting(exp->DataWriter, a->nframes, a->nskipped, a->nmissing, a->ngaps, a->nlate,
+					(a->Age.n > 0) ? 1000 * a->Age.sum / a->Age.n : 0, 1000 * a->Age.max,
+					a->AgeHist.bins, RT_HISTBINS, 1000 * a->AgeHist.binWidth);
 		FinishWriteToDisk(&(exp->DataWriter));
+	}
 
 }
 
@@ -1118,17 +1370,18 @@ void DoSegmentation(Experiment* exp) {
 	TICTOC::timer().toc("_FindWormBoundary",exp->e);
 
 	/*** Find Worm Head and Tail ***/
-	if (!(exp->e))
-		exp->e = GivenBoundaryFindWormHeadTail(exp->Worm, exp->Params);
-
-	/** If we are doing temporal analysis, improve the WormHeadTail estimate based on prev frame **/
-	if (exp->Params->TemporalOn && !(exp->e)){
-		PrevFrameImproveWormHeadTail(exp->Worm, exp->Params, exp->PrevWorm);
+	/** If we are doing temporal analysis, search where the tracker predicts them to be and keep them the right way round **/
+	if (!(exp->e)){
+		if (exp->Params->TemporalOn)
+			exp->e = TrackWormHeadTail(exp->Worm, exp->Params, exp->Tracker);
+		else
+			exp->e = GivenBoundaryFindWormHeadTail(exp->Worm, exp->Params);
 	}
 
 	/** if the user is manually inducing a head/tail flip **/
 	if (exp->Params->InduceHeadTailFlip){
 		ReverseWormHeadTail(exp->Worm);
+		ReverseWormTracker(exp->Tracker);
 		/** Turn the flag off **/
 		exp->Params->InduceHeadTailFlip=0;
 		/*
@@ -1142,14 +1395,91 @@ void DoSegmentation(Experiment* exp) {
 	if (!(exp->e))
 		exp->e = SegmentWorm(exp->Worm, exp->Params);
 
-	/** Update PrevWorm Info **/
+	/** Update the tracker **/
 	if (!(exp->e))
-		LoadWormGeom(exp->PrevWorm, exp->Worm);
+		UpdateWormTracker(exp->Tracker, exp->Worm, exp->Params);
+	else {
+		MissWormTracker(exp->Tracker);
+		ForgetWormPosition(exp->Worm); // look everywhere next time
+	}
+
+	/** Synthetic frames come with the right answer **/
+	if (exp->Accuracy != NULL)
+		ScoreSegmentation(exp);
+
+	if (exp->ROI != NULL)
+		FollowWormWithROI(exp);
 
 	/*** </segmentworm> ***/
 _TICTOC_TOC_FUNC
 }
 
+/*
+ * Note that the illumination pattern for this frame has just been sent to the DLP
+ */
+void MarkFrameIlluminated(Experiment* exp) {
+	exp->Worm->tIlluminated = RT_Now();
+	if (exp->Account != NULL)
+		AccountForIllumination(exp->Account, exp->Worm->tCaptured, exp->Worm->tIlluminated);
+}
+
+/*
+ * Send forDLP to the DLP (if the DLP is on) and mark the frame illuminated
+ */
+int SendFrameToDLP(Experiment* exp) {
+	if (exp->Params->DLPOn && !(exp->SimDLP)) {
+		if (T2DLP_SendFrame((unsigned char *) exp->forDLP->binary, exp->myDLP) < 0) {
+			printf("ERROR in SendFrameToDLP(): T2DLP_SendFrame() failed.\n");
+			return EXP_ERROR;
+		}
+	}
+	MarkFrameIlluminated(exp);
+	return EXP_SUCCESS;
+}
+
+/*
+ * Move the source's region of interest along with the worm that was just segmented
+ */
+void FollowWormWithROI(Experiment* exp) {
+	if (exp->e || exp->Worm->Boundary.n == 0) {
+		UpdateROITracker(exp->ROI, exp->src, 0, 0, 0, 0, 0);
+		return;
+	}
+	CvRect box = PointBufRect(&(exp->Worm->Boundary));
+	UpdateROITracker(exp->ROI, exp->src, 1, box.x, box.y, box.x + box.width - 1, box.y + box.height - 1);
+}
+
+/*
+ * Compare the segmented worm against the right answer from the frame source
+ */
+void ScoreSegmentation(Experiment* exp) {
+	SynthWormTruth truth;
+	if (GetFrameTruth(exp->src, exp->FrameMeta.seq, &truth) != FS_SUCCESS)
+		return;
+	if (exp->e) {
+		ScoreSynthWormMissed(exp->Accuracy);
+		return;
+	}
+
+	SegmentedWorm* seg = exp->Worm->Segmented;
+	SynthPoint head, tail;
+	head.x = seg->Head->x;
+	head.y = seg->Head->y;
+	tail.x = seg->Tail->x;
+	tail.y = seg->Tail->y;
+
+	int n = seg->Centerline.n;
+	SynthPoint* centerline = (SynthPoint*) malloc(n * sizeof(SynthPoint));
+	int k;
+	for (k = 0; k < n; k++) {
+		CvPoint* pt = &(seg->Centerline.pts[k]);
+		centerline[k].x = pt->x;
+		centerline[k].y = pt->y;
+	}
+	ScoreSynthWorm(exp->Accuracy, &truth, head, tail, centerline, n);
+	free(centerline);
+}
+
 /*
  * Prepare the Selected Display
  *
@@ -1166,7 +1496,7 @@ void PrepareSelectedDisplay(Experiment* exp) {
 		//			cvShowImage(exp->WinDisp,exp->HUDS);
 		exp->CurrentSelectedImg = exp->HUDS;
 		break;
-	case 2:
+	case DISPLAY_THRESH:
 		//			 cvShowImage(exp->WinDisp,exp->Worm->ImgThresh);
 		exp->CurrentSelectedImg = exp->Worm->ImgThresh;
 		break;
@@ -1188,6 +1518,9 @@ void PrepareSelectedDisplay(Experiment* exp) {
 		//			cvShowImage(exp->WinDisp, exp->forDLP->iplimg);
 		exp->CurrentSelectedImg = exp->forDLP->iplimg;
 		break;
+	case DISPLAY_SMOOTH:
+		exp->CurrentSelectedImg = exp->Worm->ImgSmooth;
+		break;
 	default:
 		break;
 	}
@@ -1365,7 +1698,7 @@ int HandleKeyStroke(int c, Experiment* exp) {
  * Write video and data to Disk
  *
  */
-void DoWriteToDisk(Experiment* exp) {
+int DoWriteToDisk(Experiment* exp) {
 
 	/** Throw error if the user has asked to record, but the system is not in record mode **/
 	if (exp->Params->Record && (exp->RECORDVID!=1)  ){
@@ -1375,21 +1708,20 @@ void DoWriteToDisk(Experiment* exp) {
 
 	/** Record VideoFrame to Disk**/
 	if (exp->RECORDVID && exp->Params->Record) {
+		if (exp->Vid==NULL ) printf("\tERROR in DoWriteToDisk!\n\texp->Vid is NULL\n");
+		if (exp->VidHUDS==NULL ) printf("\tERROR in DoWriteToDisk!\n\texp->VidHUDS is NULL\n");
+		if (exp->SubSampled ==NULL ) printf("\tERROR in DoWriteToDisk!\n\texp->exp->Subsampled==NULL\n");
+		if (exp->Vid==NULL || exp->VidHUDS==NULL || exp->SubSampled==NULL) return EXP_ERROR;
+
 		TICTOC::timer().tic("cvResize");
 		cvResize(exp->Worm->ImgOrig, exp->SubSampled, CV_INTER_LINEAR);
 		TICTOC::timer().toc("cvResize");
 
 		TICTOC::timer().tic("cvWriteFrame");
 		cvWriteFrame(exp->Vid, exp->SubSampled);
-		if (exp->Vid==NULL ) printf("\tERROR in DoWriteToDisk!\n\texp->Vid is NULL\n");
-		if (exp->SubSampled ==NULL ) printf("\tERROR in DoWriteToDisk!\n\texp->exp->Subsampled==NULL\n");
-
 		TICTOC::timer().toc("cvWriteFrame");
 
 		cvResize(exp->HUDS, exp->SubSampled, CV_INTER_LINEAR);
-		if (exp->VidHUDS==NULL ) printf("\tERROR in DoWriteToDisk!\n\texp->VidHUDS is NULL\n");
-		if (exp->SubSampled ==NULL ) printf("\tERROR in DoWriteToDisk!\n\texp->exp->Subsampled==NULL\n");
-
 		cvWriteFrame(exp->VidHUDS, exp->SubSampled);
 	}
 
@@ -1397,58 +1729,233 @@ void DoWriteToDisk(Experiment* exp) {
 
 	if (exp->RECORDDATA && exp->Params->Record) {
 		TICTOC::timer().tic("AppendWormFrameToDisk");
-		AppendWormFrameToDisk(exp->Worm, exp->Params, exp->DataWriter);
-TICTOC	::timer().toc("AppendWormFrameToDisk");
+		int e=AppendWormFrameToDisk(exp->Worm, exp->Params, exp->DataWriter);
+		TICTOC::timer().toc("AppendWormFrameToDisk");
+		if (e < 0) return EXP_ERROR;
+	}
+	return EXP_SUCCESS;
 }
+
+/*
+ * Invert a single illumination frame, so white becomes black and vice-versa.
+ */
+static void InvertIlluminationFrame(Frame* frame){
+	IplImage* temp= cvCreateImage( cvSize(frame->iplimg->width,frame->iplimg->height),
+			IPL_DEPTH_8U, 1);
+	cvXorS(frame->iplimg,cvScalar(255,255,255),temp);
+	LoadFrameWithImage(temp,frame);
+	cvReleaseImage(&temp);
+}
+
+/**
+ * Invert the illumination, so white becomes black and vice-versa.
+ */
+void InvertIllumination(Experiment* exp){
+	/** Invert Illumination Frame **/
+	InvertIlluminationFrame(exp->IlluminationFrame);
+
+	/** Invert DLP Frame **/
+	InvertIlluminationFrame(exp->forDLP);
 }
 
 /*
- * Use the slider bar to generate a rectangle in an arbitrary location and illuminate with it on the fly
+ * Generate the montage that both camera space and DLP space are illuminated
+ * from this frame: the slider bar rectangle on the fly, or the current step of
+ * the protocol. Leaves exp->FrameMontage NULL when flooding everything.
  *
+ * GetMontageFromProtocolInterp() allocates from the protocol's memory storage,
+ * which is not thread safe, so the montage is built once per frame rather than
+ * once per space.
  */
-int DoOnTheFlyIllumination(Experiment* exp) {
+static void PrepareIlluminationMontage(Experiment* exp){
+	exp->FrameMontage=NULL;
+	if (exp->Params->IllumFloodEverything) return;
+
+	if (!(exp->Params->ProtocolUse)) {
+		/** Note, out of laziness I am hardcoding the grid dimensions to be Numsegments by number of segments **/
+		exp->FrameMontage = CreateIlluminationMontage(exp->Worm->MemScratchStorage);
+		CvPoint origin = ConvertSlidlerToWormSpace(exp->Params->IllumSquareOrig,exp->Params->DefaultGridSize);
+		GenerateSimpleIllumMontage(exp->FrameMontage, origin, exp->Params->IllumSquareRad, exp->Params->DefaultGridSize);
+		exp->FrameGridSize=exp->Params->DefaultGridSize;
+	} else {
+		exp->FrameMontage = GetMontageFromProtocolInterp(exp->p,exp->Params->ProtocolStep);
+		exp->FrameGridSize=exp->p->GridSize;
+	}
+}
 
-	CvSeq* montage = CreateIlluminationMontage(exp->Worm->MemScratchStorage);
+/*
+ * Done with this frame's montage.
+ */
+static void FinishIlluminationMontage(Experiment* exp){
+	/** The on-the-fly montage lives in the worm's scratch storage **/
+	if (exp->FrameMontage!=NULL && !(exp->Params->ProtocolUse)) cvClearSeq(exp->FrameMontage);
+	exp->FrameMontage=NULL;
+}
 
-	/** Note, out of laziness I am hardcoding the grid dimensions to be Numsegments by number of segments **/
-	;
+/*
+ * Render the illumination pattern for one space: the segmented worm segworm
+ * into dest. Floods everything, or illuminates the worm with exp->FrameMontage,
+ * and then inverts if asked to.
+ *
+ * Camera space is Worm->Segmented into IlluminationFrame and DLP space is
+ * segWormDLP into forDLP. DoIllumination() and the task graph both render
+ * each space with this.
+ *
+ * Returns EXP_ERROR if there is no segmented worm to illuminate.
+ */
+static int RenderIllumination(Experiment* exp, SegmentedWorm* segworm, Frame* dest){
+	int ret=EXP_SUCCESS;
+
+	/** Clear the illumination pattern **/
+	SetFrame(dest,0);
+
+	if (exp->Params->IllumFloodEverything) {
+		SetFrame(dest,128); // Turn all of the pixels on
+	} else if (exp->FrameMontage!=NULL) {
+		if (segworm->Centerline.n==0 || segworm->LeftBound.n==0 || segworm->RightBound.n==0){
+			printf("Error! At least one of the following: Centerline or Right and Left Boundaries of the segmented worm has zero points in RenderIllumination()\n");
+			ret=EXP_ERROR;
+		} else {
+			IllumWorm(segworm, exp->FrameMontage, dest->iplimg, exp->FrameGridSize, exp->Params->IllumFlipLR);
+			LoadFrameWithImage(dest->iplimg, dest);
+		}
+	}
 
-	CvPoint origin = ConvertSlidlerToWormSpace(exp->Params->IllumSquareOrig,exp->Params->DefaultGridSize);
-	GenerateSimpleIllumMontage(montage, origin, exp->Params->IllumSquareRad, exp->Params->DefaultGridSize);
+	/** If InvertIllumination is on, then do that now **/
+	if (exp->Params->IllumInvert) InvertIlluminationFrame(dest);
+	return ret;
+}
 
-	/** Illuminate the worm **/
-	/** ...in camera space **/
-	IllumWorm(exp->Worm->Segmented, montage, exp->IlluminationFrame->iplimg,
-			exp->Params->DefaultGridSize,exp->Params->IllumFlipLR);
-	LoadFrameWithImage(exp->IlluminationFrame->iplimg, exp->IlluminationFrame);
-	/** ... in DLP space **/
-	IllumWorm(exp->segWormDLP, montage, exp->forDLP->iplimg,
-			exp->Params->DefaultGridSize,exp->Params->IllumFlipLR);
-	LoadFrameWithImage(exp->forDLP->iplimg, exp->forDLP);
+/*
+ * Generate the illumination pattern for the current frame
+ * in both camera space (IlluminationFrame) and DLP space (forDLP)
+ *
+ * Depending on the parameters this floods everything, illuminates
+ * according to the on-the-fly slider bar rectangle or illuminates
+ * according to the loaded protocol.
+ *
+ * Requires that the worm has already been segmented and transformed
+ * into DLP space.
+ */
+void DoIllumination(Experiment* exp){
+	TICTOC::timer().tic("DoIllumination()");
+	PrepareIlluminationMontage(exp);
+
+	/** Illuminate the worm in camera space for display **/
+	if (RenderIllumination(exp,exp->Worm->Segmented,exp->IlluminationFrame)!=EXP_SUCCESS) exp->e=EXP_ERROR;
 
-	cvClearSeq(montage);
+	/** Illuminate the worm in DLP space **/
+	if (RenderIllumination(exp,exp->segWormDLP,exp->forDLP)!=EXP_SUCCESS) exp->e=EXP_ERROR;
 
+	FinishIlluminationMontage(exp);
+	TICTOC::timer().toc("DoIllumination()");
 }
 
-/**
- * Invert the illumination, so white becomes black and vice-versa.
+
+void SetupClosedLoopThread(Experiment* exp){
+	if (exp->PinCore >= 0){
+		if (RT_PinThisThread(exp->PinCore)==RT_SUCCESS) printf("Closed loop thread pinned to core %d.\n",exp->PinCore);
+		else printf("WARNING: Could not pin the closed loop thread to core %d.\n",exp->PinCore);
+	}
+	if (exp->RealTime){
+		if (RT_SetRealTimePriority()==RT_SUCCESS) printf("Closed loop thread running with real-time priority.\n");
+		else printf("WARNING: Could not give the closed loop thread real-time priority. (Insufficient privileges?)\n");
+	}
+}
+
+void SetupAuxiliaryThread(Experiment* exp){
+	if (exp->PinCore >= 0 && RT_AvoidCore(exp->PinCore)!=RT_SUCCESS){
+		printf("WARNING: Could not move this thread off of core %d.\n",exp->PinCore);
+	}
+}
+
+
+/************************************************/
+/*   Intra-frame task graph
+ *
  */
-void InvertIllumination(Experiment* exp){
-	IplImage* temp= cvCreateImage( cvSize(exp->IlluminationFrame->iplimg->width,exp->IlluminationFrame->iplimg->height),
-			IPL_DEPTH_8U, 1);
+/************************************************/
 
-	/** Invert Illumination Frame **/
+/** Tasks. Each takes the experiment as its argument and returns TG_SUCCESS or TG_ERROR **/
 
-	cvXorS(exp->IlluminationFrame->iplimg,cvScalar(255,255,255),temp);
-	LoadFrameWithImage(temp,exp->IlluminationFrame);
+static int TaskRenderDLP(void* arg){
+	Experiment* exp=(Experiment*) arg;
+	if (RenderIllumination(exp,exp->segWormDLP,exp->forDLP)!=EXP_SUCCESS) return TG_ERROR;
+	return TG_SUCCESS;
+}
 
+static int TaskSendToDLP(void* arg){
+	Experiment* exp=(Experiment*) arg;
+	TICTOC::timer().tic("SendFrameToDLP");
+	int e=SendFrameToDLP(exp);
+	TICTOC::timer().toc("SendFrameToDLP");
+	TICTOC::timer().toc("FrameToDLP");
+	return (e==EXP_SUCCESS) ? TG_SUCCESS : TG_ERROR;
+}
 
+static int TaskRenderCamera(void* arg){
+	Experiment* exp=(Experiment*) arg;
+	if (RenderIllumination(exp,exp->Worm->Segmented,exp->IlluminationFrame)!=EXP_SUCCESS) return TG_ERROR;
+	return TG_SUCCESS;
+}
 
-	/** Invert DLP Frame **/
-	cvXorS(exp->forDLP->iplimg,cvScalar(255,255,255),temp);
-	LoadFrameWithImage(temp,exp->forDLP);
+static int TaskCreateHUDS(void* arg){
+	Experiment* exp=(Experiment*) arg;
+	if (CreateWormHUDS(exp->HUDS,exp->Worm,exp->Params,exp->IlluminationFrame) < 0) return TG_ERROR;
+	return TG_SUCCESS;
+}
 
+static int TaskPrepareDisplay(void* arg){
+	Experiment* exp=(Experiment*) arg;
+	if (EverySoOften(exp->Worm->frameNum,exp->Params->DispRate) ){
+		TICTOC::timer().tic("DisplayOnScreen");
+		PrepareSelectedDisplay(exp);
+		TICTOC::timer().toc("DisplayOnScreen");
+	}
+	return TG_SUCCESS;
+}
+
+static int TaskWriteToDisk(void* arg){
+	Experiment* exp=(Experiment*) arg;
+	TICTOC::timer().tic("DoWriteToDisk()");
+	int e=DoWriteToDisk(exp);
+	TICTOC::timer().toc("DoWriteToDisk()");
+	return (e==EXP_SUCCESS) ? TG_SUCCESS : TG_ERROR;
+}
+
+void SetupFrameTaskGraph(Experiment* exp){
+	/** The graph only ever has two branches running at once, so one worker is enough **/
+	int nworkers = (RT_NumberOfProcessors() > 1) ? 1 : 0;
+	exp->Workers=CreateWorkerPool(nworkers);
+	printf("Running camera space and DLP space work concurrently on %d worker thread(s).\n",exp->Workers->nworkers);
+
+	TaskGraph* g=(TaskGraph*) malloc(sizeof(TaskGraph));
+	ClearTaskGraph(g);
+
+	/** DLP space branch: on the critical path to the mirrors **/
+	int renderDLP=AddTask(g,"RenderDLP",TaskRenderDLP,(void*) exp,TG_PRIORITY_HIGH);
+	int sendDLP=AddTask(g,"SendFrameToDLP",TaskSendToDLP,(void*) exp,TG_PRIORITY_HIGH);
+	AddTaskDependency(g,renderDLP,sendDLP);
+
+	/** Camera space branch: monitoring and recording **/
+	int renderCam=AddTask(g,"RenderCamera",TaskRenderCamera,(void*) exp,TG_PRIORITY_LOW);
+	int huds=AddTask(g,"CreateWormHUDS",TaskCreateHUDS,(void*) exp,TG_PRIORITY_LOW);
+	int disp=AddTask(g,"PrepareDisplay",TaskPrepareDisplay,(void*) exp,TG_PRIORITY_LOW);
+	int disk=AddTask(g,"DoWriteToDisk",TaskWriteToDisk,(void*) exp,TG_PRIORITY_LOW);
+	AddTaskDependency(g,renderCam,huds);
+	AddTaskDependency(g,huds,disp);
+	AddTaskDependency(g,disp,disk);
+
+	/** The display may show the DLP frame, so wait until it is finished **/
+	AddTaskDependency(g,renderDLP,disp);
+
+	exp->FrameGraph=g;
+}
 
+void DoFrameTaskGraph(Experiment* exp){
+	PrepareIlluminationMontage(exp);
+	if (RunTaskGraph(exp->Workers,exp->FrameGraph)!=TG_SUCCESS) exp->e=EXP_ERROR;
+	FinishIlluminationMontage(exp);
 }
 
 
@@ -65,12 +65,38 @@
 #ifndef ANDYSOPENCVLIB_H_
  #error "#include AndysOpenCVLib.h" must appear in source files before "#include experiment.h"
 #endif
+#ifndef TASKGRAPH_H_
+ #error "#include TaskGraph.h" must appear in source files before "#include experiment.h"
+#endif
+#ifndef SYNTHETICWORM_H_
+ #error "#include SyntheticWorm.h" must appear in source files before "#include experiment.h"
+#endif
+#ifndef FRAMESOURCE_H_
+ #error "#include FrameSource.h" must appear in source files before "#include experiment.h"
+#endif
+#ifndef RAWFRAMES_H_
+ #error "#include RawFrames.h" must appear in source files before "#include experiment.h"
+#endif
+#ifndef JOURNAL_H_
+ #error "#include Journal.h" must appear in source files before "#include experiment.h"
+#endif
 
 
 #define EXP_ERROR -1
 #define EXP_SUCCESS 0
 #define EXP_VIDEO_RAN_OUT 1
 
+/** How long the main loop waits for a new frame before checking if the user wants to stop (ms) **/
+#define EXP_FRAME_TIMEOUT 100
+
+/** Frame rate of the synthetic frame source **/
+#define EXP_SYNTHETIC_FPS 50
+
+/** Frame admission policy: which frame the closed loop takes when it has fallen behind the camera **/
+#define EXP_ADMIT_AUTO -1 // newest for live frames, all for replay that isn't paced or is from a journal
+#define EXP_ADMIT_NEWEST 0 // skip the backlog and take the newest frame that has arrived
+#define EXP_ADMIT_ALL 1 // work through every frame in order
+
 typedef struct ExperimentStruct{
 	/** Simulation? True/false **/
 	int SimDLP; //1= simulate the DLP, 0= real DLP
@@ -90,23 +116,38 @@ typedef struct ExperimentStruct{
 	char* outfname;
 	char* infname;
 	char* protocolfname;
+	char* journalfname;
 
 	/** Protocol Data **/
     Protocol* p;
     int pflag;
 
-	/** Camera Input**/
-	CamData* MyCamera;
-
-	/** FrameGrabber Input**/
-	FrameGrabber* fg;
+	/** Where the frames come from: USB camera, frame grabber, video file or synthetic generator **/
+	FrameSource* src;
 	bool UseFrameGrabber;
+	int NumRingBuffers; // > 0 = acquire continuously into this many DMA buffers (zero copy)
+	int UseSyntheticSource; // 1 = no camera or video, generate frames of a synthetic worm instead
+	SynthWormModel SynthModel;
+	int VidUnpaced; // 1 = replay the video file as fast as possible instead of at its own frame rate
+	int Admission; // EXP_ADMIT_NEWEST or EXP_ADMIT_ALL (EXP_ADMIT_AUTO until RollVideoInput() decides)
+
+	/** Region of interest that follows the worm **/
+	int ROIMargin; // > 0 = keep this many pixels around the worm and acquire nothing else
+	ROITracker* ROI; // NULL unless the source has a region of interest and ROIMargin > 0
+
+	/** Frames with more than 8 bits per pixel **/
+	Conv16 Conv; // how they are converted to 8 bits
+	int Thresh16; // 1 = find the worm by thresholding the camera's own bits
+
+	/** Frame acquired by WaitForFrame() that GrabFrame() has not yet taken **/
+	FrameBuffer PendingFrame;
+	int HasPendingFrame;
 
-	/** Video Capture (for simulation mode) **/
-	CvCapture* capture;
+	/** Sequence number, arrival time and bit depth of the most recently grabbed frame **/
+	FrameInfo FrameMeta;
 
-	/** MostRecently Observed CameraFrameNumber **/
-	unsigned long lastFrameSeenOutside;
+	/** Frames missing and late between the camera and the DLP **/
+	FrameAccount* Account;
 
 	/** DLP Output **/
 	long myDLP;
@@ -120,8 +161,8 @@ typedef struct ExperimentStruct{
 	/** Information about Our Worm **/
 	WormAnalysisData* Worm;
 
-	/** Information about the Previous frame's Worm **/
-	WormGeom* PrevWorm;
+	/** Follows the worm's head and tail from frame to frame **/
+	WormTracker* Tracker;
 
 	/** Segmented Worm in DLP Space **/
 	SegmentedWorm* segWormDLP;
@@ -136,6 +177,9 @@ typedef struct ExperimentStruct{
 	Frame* forDLP;
 	Frame* IlluminationFrame;
 
+	/** Accuracy of the segmentation against the synthetic worm (NULL for real frames) **/
+	SynthWormScore* Accuracy;
+
 	/** Write Data To File **/
 	WriteOut* DataWriter;
 
@@ -143,6 +187,15 @@ typedef struct ExperimentStruct{
 	CvVideoWriter* Vid;  //Video Writer
 	CvVideoWriter* VidHUDS;
 
+	/** Write every frame losslessly to a .raw file **/
+	RawWriter* RawRecorder;
+
+	/** Session journal of every parameter change and key stroke **/
+	Journal* SessionJournal;
+
+	/** Journal being replayed (headless replay) **/
+	JournalReplay* Replay;
+
 	/** Timing  Information **/
 	clock_t now;
 	clock_t last;
@@ -162,6 +215,20 @@ typedef struct ExperimentStruct{
 	/** Macros **/
 	int RECORDVID;
 	int RECORDDATA;
+	int RECORDRAW;
+
+	/** Runtime Mode **/
+	int UsePipeline; // 1 = run the closed loop as a multithreaded pipeline, 0 = sequential loop
+	int UseTaskGraph; // 1 = within each frame, run camera space and DLP space work concurrently
+	int PinCore; // core that the closed loop thread is pinned to (-1 = don't pin)
+	int RealTime; // 1 = run the closed loop thread with real-time priority
+	int Headless; // 1 = no GUI, no keyboard and no stage (replaying a session journal)
+
+	/** Intra-frame task graph **/
+	WorkerPool* Workers;
+	TaskGraph* FrameGraph;
+	CvSeq* FrameMontage; // illumination montage shared by both branches (NULL when flooding)
+	CvSize FrameGridSize;
 
 	/** Stage Control **/
 	int stageIsPresent;
@@ -238,17 +305,24 @@ void UpdateGUI(Experiment* exp);
 
 
 /*
- * Initialize camera library
- * Allocate Camera Data
- * Select Camera and Show Properties dialog box
- * Start Grabbing Frames as quickly as possible
- *
- * OR open up the video file for reading.
+ * Create the frame source that the command line asked for
+ * (video file, synthetic generator, frame grabber or USB camera)
+ * and start it. Also settles the frame admission policy.
  */
 void RollVideoInput(Experiment* exp);
 
-/** Grab a Frame from either camera or video source
+/*
+ * Hand back any frames that are still lent out, stop the frame source and free it.
+ */
+void StopVideoInput(Experiment* exp);
+
+/** Grab a Frame from the frame source
  *
+ * With EXP_ADMIT_NEWEST any frames that are already waiting behind this one are
+ * skipped, so the closed loop is never more than one frame behind the camera.
+ *
+ * The frame is lent to exp->fromCCD without copying whenever its rows line up.
+ * fromCCD holds on to it until the next call.
  */
 int GrabFrame(Experiment* exp);
 
@@ -295,6 +369,16 @@ void ReleaseExperiment(Experiment* exp);
  */
 int isFrameReady(Experiment* exp);
 
+/*
+ * Block until a new frame is ready or until timeout ms have passed.
+ *
+ * The frame is acquired from the frame source (which sleeps rather than spins)
+ * and held for the next GrabFrame().
+ *
+ * Returns 1 if a frame is ready and 0 if it timed out.
+ */
+int WaitForFrame(Experiment* exp, int timeout);
+
 /******************
  * Recording
  */
@@ -365,25 +449,97 @@ void ClearDLPifNotDisplayingNow(Experiment* exp);
  */
 void DoSegmentation(Experiment* exp);
 
+/*
+ * Note that the illumination pattern for this frame has just been sent to the DLP
+ * (or would have been, if the DLP were on). Records how old the frame was.
+ */
+void MarkFrameIlluminated(Experiment* exp);
 
 /*
- * Preparesthe Selected Display
+ * Send forDLP to the DLP (if the DLP is on and not simulated) and
+ * call MarkFrameIlluminated().
  *
+ * Returns EXP_SUCCESS, or EXP_ERROR if the DLP rejected the frame.
  */
-void PrepareSelectedDisplay(Experiment* exp);
+int SendFrameToDLP(Experiment* exp);
+
+/*
+ * If the frame source knows the right answer for this frame (the synthetic worm),
+ * score the segmentation against it. Called at the end of DoSegmentation().
+ */
+void ScoreSegmentation(Experiment* exp);
+
+/*
+ * Move the source's region of interest along with the worm that was just segmented.
+ * Called at the end of DoSegmentation().
+ */
+void FollowWormWithROI(Experiment* exp);
 
 
 /*
- * Use the slider bar to generate a rectangle in an arbitrary location and illuminate with it on the fly
+ * Preparesthe Selected Display
  *
  */
-int DoOnTheFlyIllumination(Experiment* exp);
+void PrepareSelectedDisplay(Experiment* exp);
+
 
 /**
  * Invert the illumination, so white becomes black and vice-versa.
  */
 void InvertIllumination(Experiment* exp);
 
+/*
+ * Generate the illumination pattern for the current frame
+ * in both camera space (IlluminationFrame) and DLP space (forDLP)
+ * either by flooding, on-the-fly with the slider bar rectangle or from the protocol.
+ *
+ * Sets exp->e if there is no segmented worm to illuminate.
+ *
+ * Requires the worm to be segmented and transformed into DLP space.
+ */
+void DoIllumination(Experiment* exp);
+
+/*
+ * Call from the time critical closed loop thread (the thread that segments
+ * and talks to the DLP). Pins the calling thread to exp->PinCore and, if
+ * exp->RealTime is set, gives it real-time priority.
+ */
+void SetupClosedLoopThread(Experiment* exp);
+
+/*
+ * Call from every other long running thread (display, stage, recording)
+ * to keep it off of the closed loop thread's core.
+ */
+void SetupAuxiliaryThread(Experiment* exp);
+
+/*
+ * Create the worker pool and the per-frame task graph used by DoFrameTaskGraph().
+ *
+ * The graph has two independent branches:
+ *
+ * 		DLP space (high priority)	- render forDLP, then T2DLP_SendFrame()
+ * 		Camera space (low priority)	- render IlluminationFrame, CreateWormHUDS(),
+ * 									  PrepareSelectedDisplay() and DoWriteToDisk()
+ */
+void SetupFrameTaskGraph(Experiment* exp);
+
+/*
+ * Illuminate the worm, send the pattern to the DLP, build the HUDS,
+ * prepare the display and write to disk by running the per-frame task graph.
+ *
+ * This replaces DoIllumination() and everything after it in the sequential loop.
+ * The calling thread and the worker thread each take whichever ready task has
+ * the highest priority, so the DLP space branch is started first and the camera
+ * space branch runs alongside it on the other thread. Either branch may run on
+ * either thread. With a worker, the time from frame to mirrors no longer includes
+ * the camera space render, the HUDS or the disk write.
+ *
+ * Sets exp->e if any task fails. Tasks that depend on a failed task are skipped.
+ *
+ * Requires the worm to be segmented and transformed into DLP space.
+ */
+void DoFrameTaskGraph(Experiment* exp);
+
 
 /*
  *
@@ -397,8 +553,10 @@ int HandleKeyStroke(int c, Experiment* exp);
 /*
  * Write video and data to Disk
  *
+ * Returns EXP_SUCCESS, or EXP_ERROR if a video writer is missing
+ * or the data frame could not be written.
  */
-void DoWriteToDisk(Experiment* exp);
+int DoWriteToDisk(Experiment* exp);
 
 /*********************
  *
@@ -74,6 +74,11 @@ using namespace std;
 
 //Andy's Personal Headers
 #include "MyLibs/AndysOpenCVLib.h"
+#include "MyLibs/RTThreads.h"
+#include "MyLibs/TaskGraph.h"
+#include "MyLibs/SyntheticWorm.h"
+#include "MyLibs/FrameSource.h"
+#include "MyLibs/RawFrames.h"
 #include "MyLibs/Talk2Camera.h"
 #include "MyLibs/Talk2FrameGrabber.h"
 #include "MyLibs/Talk2DLP.h"
@@ -83,19 +88,21 @@ using namespace std;
 #include "MyLibs/WriteOutWorm.h"
 #include "MyLibs/IllumWormProtocol.h"
 #include "MyLibs/TransformLib.h"
+#include "MyLibs/Journal.h"
 #include "MyLibs/experiment.h"
+#include "MyLibs/Pipeline.h"
 
 
 //3rd Party Libraries
 #include "3rdPartyLibs/tictoc.h"
 
 /** Global Variables (for multithreading) **/
-UINT Thread(LPVOID lpdwParam);
+void Thread(void* lpdwParam);
 IplImage* CurrentImg;
-bool DispThreadHasStarted;
-bool MainThreadHasStopped;
-bool DispThreadHasStopped;
-bool UserWantsToStop;
+RTFlag DispThreadHasStarted;
+RTFlag MainThreadHasStopped;
+RTFlag DispThreadHasStopped;
+RTFlag UserWantsToStop;
 
 int main (int argc, char** argv){
 	int DEBUG=0;
@@ -129,6 +136,12 @@ int main (int argc, char** argv){
 
 	VerifyProtocol(exp->p);
 
+	/** Load the session journal to replay. This sets the parameters to how they were at the start of the session **/
+	if (exp->journalfname!=NULL){
+		exp->Replay=OpenJournal(exp->journalfname,exp->Params);
+		if (exp->Replay==NULL) return -1;
+	}
+
 	/** Start Camera or Vid Input **/
 	RollVideoInput(exp);
 
@@ -142,9 +155,11 @@ int main (int argc, char** argv){
 
 
 	/** Start New Thread **/
-	DWORD dwThreadId;
-	HANDLE hThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) Thread, (void*) exp,
-				0, &dwThreadId);
+	RT_InitFlag(&DispThreadHasStarted);
+	RT_InitFlag(&DispThreadHasStopped);
+	RT_InitFlag(&MainThreadHasStopped);
+	RT_InitFlag(&UserWantsToStop);
+	RTThread* hThread = RT_StartThread(Thread, (void*) exp);
 	if (hThread == NULL) {
 		printf("Cannot create thread.\n");
 		return -1;
@@ -153,11 +168,7 @@ int main (int argc, char** argv){
 
 
 	// wait for thread
-	DispThreadHasStarted=FALSE;
-	DispThreadHasStopped=FALSE;
-	MainThreadHasStopped=FALSE;
-	while (!DispThreadHasStarted)
-		Sleep(10);
+	RT_WaitFlag(&DispThreadHasStarted,RT_INFINITE);
 
 
 
@@ -176,11 +187,30 @@ int main (int argc, char** argv){
 	/** Giant While Loop Where Everything Happens **/
 	TICTOC::timer().tic("WholeLoop");
 	int VideoRanOut=0;
-	UserWantsToStop=0;
-	while (UserWantsToStop!=1) {
+
+	/** Jitter statistics for the closed loop **/
+	RTStats LoopPeriod, FrameTime, ArrivalDelay;
+	RT_ClearStats(&LoopPeriod,"Closed loop period");
+	RT_ClearStats(&FrameTime,"Grab to end of frame");
+	RT_ClearStats(&ArrivalDelay,"Arrival to processing");
+	double tGrab=0;
+
+	/** Run camera space and DLP space work concurrently within each frame **/
+	if (exp->UseTaskGraph && !(exp->UsePipeline)) SetupFrameTaskGraph(exp);
+
+	/** Give the closed loop thread its own core. In pipeline mode the stages take care of themselves **/
+	if (exp->UsePipeline) SetupAuxiliaryThread(exp);
+	else SetupClosedLoopThread(exp);
+
+	/** Alternatively, overlap acquisition, segmentation, illumination and output across frames **/
+	if (exp->UsePipeline){
+		if (RunPipeline(exp,&UserWantsToStop)==EXP_VIDEO_RAN_OUT) VideoRanOut=1;
+	}
+
+	while (!(exp->UsePipeline) && !RT_IsFlagSet(&UserWantsToStop)) {
 		_TICTOC_TIC_FUNC
 		TICTOC::timer().tic("OneLoop");
-		if (isFrameReady(exp)) {
+		if (WaitForFrame(exp,EXP_FRAME_TIMEOUT)) {
 
 			/** Set error to zero **/
 			exp->e=0;
@@ -189,6 +219,7 @@ int main (int argc, char** argv){
 			int ret=0;
 			ret=GrabFrame(exp);
 			TICTOC::timer().toc("GrabFrame()");
+			tGrab=RT_Now();
 
 			if (ret==EXP_VIDEO_RAN_OUT){
 				VideoRanOut=1;
@@ -199,11 +230,14 @@ int main (int argc, char** argv){
 			if (ret==EXP_ERROR){
 				/** Loop again to try to get another frame **/
 				printf("Trying again to grab a frame...\n");
-				if (UserWantsToStop) break;
+				if (RT_IsFlagSet(&UserWantsToStop)) break;
 				continue;
 			}
 
 
+			RT_Tick(&LoopPeriod);
+			RT_AddSample(&ArrivalDelay,tGrab-exp->FrameMeta.timestamp);
+
 			/** Calculate the frame rate and every second print the result **/
 			CalculateAndPrintFrameRate(exp);
 
@@ -226,7 +260,7 @@ int main (int argc, char** argv){
 
 
 			/** Load Image into Our Worm Objects **/
-
+			TICTOC::timer().tic("FrameToDLP");
 			if (exp->e == 0) exp->e=RefreshWormMemStorage(exp->Worm);
 			if (exp->e == 0) exp->e=LoadWormImg(exp->Worm,exp->fromCCD->iplimg);
 
@@ -241,74 +275,45 @@ int main (int argc, char** argv){
 			}
 			TICTOC::timer().toc("TransformSegWormCam2DLP");
 
-			/*** Do Some Illumination ***/
-
-			if (exp->e == 0) {
-				/** Clear the illumination pattern **/
-				SetFrame(exp->forDLP,0);
-				SetFrame(exp->IlluminationFrame,0);
-
-
-				if (exp->Params->IllumFloodEverything) {
-					SetFrame(exp->IlluminationFrame,128); // Turn all of the pixels on
-					SetFrame(exp->forDLP,128); // Turn all of the pixels o
-
-				} else {
-					if (!(exp->Params->ProtocolUse)) /** if not running the protocol **/{
-						/** Otherwise Actually illuminate the  region of the worm your interested in **/
-						/** Do the Illumination in Camera space for Display **/
+			if (exp->UseTaskGraph){
+				/*** Illuminate, send to DLP, display and record, with the DLP branch first ***/
+				if (exp->e == 0) DoFrameTaskGraph(exp);
+				else TICTOC::timer().toc("FrameToDLP");
+			} else {
 
-						DoOnTheFlyIllumination(exp);
-					//	SimpleIlluminateWormLR(exp->Worm->Segmented, exp->IlluminationFrame, exp->Params->IllumSegCenter, exp->Params->IllumSegRadius, exp->Params->IllumLRC);
+				/*** Do Some Illumination ***/
+				if (exp->e == 0) DoIllumination(exp);
 
-						/** Repeat but for the DLP space for sending to DLP **/
-					//	SimpleIlluminateWormLR(exp->segWormDLP, exp->forDLP, exp->Params->IllumSegCenter, exp->Params->IllumSegRadius, exp->Params->IllumLRC);
-					} else{
 
 
-						/** Illuminate The worm in Camera Space **/
-						TICTOC::timer().tic("IlluminateFromProtocol()");
+				TICTOC::timer().tic("SendFrameToDLP");
+				if (exp->e == 0) exp->e=SendFrameToDLP(exp); // Send image to DLP
+				TICTOC::timer().toc("SendFrameToDLP");
+				TICTOC::timer().toc("FrameToDLP");
 
-						IlluminateFromProtocol(exp->Worm->Segmented,exp->IlluminationFrame,exp->p,exp->Params);
 
-						/** Illuminate the worm in DLP space **/
-						IlluminateFromProtocol(exp->segWormDLP,exp->forDLP,exp->p,exp->Params);
-						TICTOC::timer().toc("IlluminateFromProtocol()");
-
-					}
+				/*** DIsplay Some Monitoring Output ***/
+				if (exp->e == 0) CreateWormHUDS(exp->HUDS,exp->Worm,exp->Params,exp->IlluminationFrame);
 
+				if (exp->e == 0 &&  EverySoOften(exp->Worm->frameNum,exp->Params->DispRate) ){
+					TICTOC::timer().tic("DisplayOnScreen");
+					/** Setup Display but don't actually send to screen **/
+					PrepareSelectedDisplay(exp);
+					TICTOC::timer().toc("DisplayOnScreen");
 				}
-				/** If InvertIllumination is on, then do that now in both cam space and DLP space**/
-				if (exp->Params->IllumInvert) InvertIllumination(exp);
-			}
 
 
 
-			TICTOC::timer().tic("SendFrameToDLP");
-			if (exp->e == 0 && exp->Params->DLPOn && !(exp->SimDLP)) T2DLP_SendFrame((unsigned char *) exp->forDLP->binary, exp->myDLP); // Send image to DLP
-			TICTOC::timer().toc("SendFrameToDLP");
 
 
-			/*** DIsplay Some Monitoring Output ***/
-			if (exp->e == 0) CreateWormHUDS(exp->HUDS,exp->Worm,exp->Params,exp->IlluminationFrame);
-
-			if (exp->e == 0 &&  EverySoOften(exp->Worm->frameNum,exp->Params->DispRate) ){
-				TICTOC::timer().tic("DisplayOnScreen");
-				/** Setup Display but don't actually send to screen **/
-				PrepareSelectedDisplay(exp);
-				TICTOC::timer().toc("DisplayOnScreen");
-			}
-
-
-
-
-
-			if (exp->e == 0) {
-				TICTOC::timer().tic("DoWriteToDisk()");
-				DoWriteToDisk(exp);
-				TICTOC::timer().toc("DoWriteToDisk()");
+				if (exp->e == 0) {
+					TICTOC::timer().tic("DoWriteToDisk()");
+					exp->e=DoWriteToDisk(exp);
+					TICTOC::timer().toc("DoWriteToDisk()");
+				}
 			}
 
+			if (exp->e == 0) RT_AddSample(&FrameTime,RT_Now()-tGrab);
 
 			if (exp->e != 0) {
 				printf("\nError in main loop. :(\n");
@@ -320,7 +325,7 @@ int main (int argc, char** argv){
 			}
 
 		}
-		if (UserWantsToStop) break;
+		if (RT_IsFlagSet(&UserWantsToStop)) break;
 			TICTOC::timer().toc("OneLoop");
 
 	}
@@ -329,7 +334,7 @@ int main (int argc, char** argv){
 
 	TICTOC::timer().toc("WholeLoop");
 	/** Tell the display thread that the main thread is shutting down**/
-	MainThreadHasStopped=TRUE;
+	RT_SetFlag(&MainThreadHasStopped);
 
 	TICTOC::timer().tic("FinishRecording()");
 	FinishRecording(exp);
@@ -341,28 +346,28 @@ int main (int argc, char** argv){
 		T2DLP_off(exp->myDLP);
 	}
 
-	if (!(exp->VidFromFile) && !(exp->UseFrameGrabber)){
-		/***** Turn off Camera & DLP ****/
-		T2Cam_TurnOff(&(exp->MyCamera));
-		T2Cam_CloseLib();
-	}
-
-	if (!(exp->VidFromFile) && (exp->UseFrameGrabber)){
-		CloseFrameGrabber(exp->fg);
-	}
+	/***** Turn off Camera or Frame Grabber (or close the video) ****/
+	StopVideoInput(exp);
 
 
 
 	printf("%s",TICTOC::timer().generateReportCstr());
-    if (!DispThreadHasStopped){
-	   printf("Waiting for DisplayThread to Stop...");
-
-    }
-	while (!DispThreadHasStopped){
+	if (exp->Worm->Search!=NULL) PrintWormSearch(exp->Worm->Search);
+	if (exp->Tracker!=NULL) PrintWormTracker(exp->Tracker);
+	if (exp->FrameGraph!=NULL) PrintTaskGraphReport(exp->FrameGraph);
+	if (!(exp->UsePipeline)){
+		printf("\nClosed loop timing (core %d, %s priority):\n",exp->PinCore,exp->RealTime ? "real-time" : "normal");
+		RT_PrintStats(&LoopPeriod);
+		RT_PrintStats(&FrameTime);
+		RT_PrintStats(&ArrivalDelay);
+	}
+	if (!RT_IsFlagSet(&DispThreadHasStopped)){
+		printf("Waiting for DisplayThread to Stop...");
+	}
+	while (!RT_WaitFlag(&DispThreadHasStopped,500)){
 		printf(".");
-		Sleep(500);
-		cvWaitKey(10);
 	}
+	RT_JoinThread(&hThread);
 
 
 
@@ -382,17 +387,29 @@ int main (int argc, char** argv){
 /**
  * Thread to display image. 
  */
-UINT Thread(LPVOID lpdwParam) {
+void Thread(void* lpdwParam) {
 	Experiment* exp= (Experiment*) lpdwParam;
 	printf("DisplayThread: Hello!\n");
+
+	/** Stay off of the closed loop thread's core **/
+	SetupAuxiliaryThread(exp);
 	MSG Msg;
 
+	/** Headless replay: no windows, no keyboard and no stage. Just wait for the main thread to finish **/
+	if (exp->Headless){
+		RT_SetFlag(&DispThreadHasStarted);
+		RT_WaitFlag(&MainThreadHasStopped,RT_INFINITE);
+		RT_SetFlag(&DispThreadHasStopped);
+		printf("\nDisplayThread: Goodbye!\n");
+		return;
+	}
+
 	SetupGUI(exp);
 	cvWaitKey(30);
 //	SetPriorityClass(GetCurrentProcess(), BELOW_NORMAL_PRIORITY_CLASS);
 
 	printf("Beginning ProtocolStep Display\n");
-	DispThreadHasStarted = TRUE;
+	RT_SetFlag(&DispThreadHasStarted);
 	cvWaitKey(30);
 
 	/** Protocol WormSpace Display **/
@@ -414,7 +431,7 @@ UINT Thread(LPVOID lpdwParam) {
 
 	int key;
 	int k=0;
-	while (!MainThreadHasStopped) {
+	while (!RT_IsFlagSet(&MainThreadHasStopped)) {
 
 
 
@@ -432,7 +449,7 @@ UINT Thread(LPVOID lpdwParam) {
 			}
 			TICTOC::timer().toc("cvShowImage");
 
-			if (MainThreadHasStopped==1) continue;
+			if (RT_IsFlagSet(&MainThreadHasStopped)) continue;
 
 
 
@@ -453,22 +470,23 @@ UINT Thread(LPVOID lpdwParam) {
 			key=cvWaitKey(100);
 
 
-			if (MainThreadHasStopped==1) continue;
+			if (RT_IsFlagSet(&MainThreadHasStopped)) continue;
 
+			JournalKey(exp->SessionJournal,key);
 			if (HandleKeyStroke(key,exp)) {
 				printf("\n\nEscape key pressed!\n\n");
 
 				/** Let the Other thread know that the user wants to stop **/
-				UserWantsToStop=1;
+				RT_SetFlag(&UserWantsToStop);
 
 				/** Emergency Shut off the Stage **/
 				printf("Emergency stage shut off.");
 				if (exp->stageIsPresent) ShutOffStage(exp);
 
 				/** Exit the display thread immediately **/
-				DispThreadHasStopped=TRUE;
+				RT_SetFlag(&DispThreadHasStopped);
 				printf("\nDisplayThread: Goodbye!\n");
-				return 0;
+				return;
 
 
 			}
@@ -501,7 +519,7 @@ UINT Thread(LPVOID lpdwParam) {
 
 	//	printf("%s",TICTOC::timer().generateReportCstr());
 		printf("\nDisplayThread: Goodbye!\n");
-		DispThreadHasStopped=TRUE;
-	return 0;
+		RT_SetFlag(&DispThreadHasStopped);
+	return;
 }
 
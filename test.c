@@ -56,6 +56,7 @@ using namespace std;
 
 //Andy's Headers
 #include "MyLibs/AndysOpenCvLib.h"
+#include "MyLibs/AndysComputations.h"
 #include "MyLibs/WormAnalysis.h"
 #include "MyLibs/IllumWormProtocol.h"
 #include "MyLibs/version.h"
@@ -154,6 +155,445 @@ Protocol* CreateTestProtocol(char* name){
 
 
 
+/************************************************/
+/*   Segmentation kernel tests
+ *
+ * Each test runs a fast kernel and a plain version of the same
+ * computation on synthetic worms, checks that they agree and
+ * times the two.
+ */
+/************************************************/
+
+/*
+ * Processor time in seconds
+ */
+static double TestSeconds(){
+	return (double) clock()/CLOCKS_PER_SEC;
+}
+
+/*
+ * Append the 8-connected points that lead from the last point in buf to pt.
+ */
+static void AppendLineTo(PointBuf* buf, CvPoint pt){
+	CvPoint last=buf->pts[buf->n-1];
+	int dx=pt.x-last.x;
+	int dy=pt.y-last.y;
+	int steps= (abs(dx) > abs(dy)) ? abs(dx) : abs(dy);
+	ReservePointBuf(buf,buf->n+steps);
+	for (int k=1; k<=steps; k++){
+		CvPoint p=cvPoint(last.x+cvRound((double) dx*k/steps),last.y+cvRound((double) dy*k/steps));
+		CvPoint* prev=&(buf->pts[buf->n-1]);
+		if (p.x==prev->x && p.y==prev->y) continue;
+		buf->pts[buf->n]=p;
+		buf->n++;
+	}
+}
+
+/*
+ * Draw a sinusoidal worm at time t. SideA and SideB run along either side
+ * from the head to the tail and the centerline has numSegments points.
+ * With noise set the points are jittered by a couple of pixels, which
+ * makes for plenty of ties.
+ */
+static void MakeTestWorm(double t, int numSegments, int noise, PointBuf* sideA, PointBuf* sideB, PointBuf* centerline){
+	const int samples=400;
+	const double length=500;
+	double X[samples+1];
+	double Y[samples+1];
+	double angle=0.3+0.01*t;
+	int s;
+
+	/** The centerline, sampled finely **/
+	for (s=0; s<=samples; s++){
+		double u=length*s/samples;
+		double v=40*sin(2*CV_PI*(1.2*u/length)-0.15*t);
+		X[s]=700+(u-length/2)*cos(angle)-v*sin(angle);
+		Y[s]=500+(u-length/2)*sin(angle)+v*cos(angle);
+	}
+
+	/** Both sides start at the head **/
+	CvPoint head=cvPoint(cvRound(X[0]),cvRound(Y[0]));
+	SetPointBuf(sideA,&head,1);
+	SetPointBuf(sideB,&head,1);
+	for (s=1; s<=samples; s++){
+		double f=(double) s/samples;
+		double width=22*sqrt((f/0.08 < 1) ? f/0.08 : 1)*(((1-f)/0.3 < 1) ? (1-f)/0.3 : 1);
+		int behind=s-1;
+		int ahead= (s<samples) ? s+1 : s;
+		double tx=X[ahead]-X[behind];
+		double ty=Y[ahead]-Y[behind];
+		double norm=sqrt(tx*tx+ty*ty);
+		AppendLineTo(sideA,cvPoint(cvRound(X[s]-width*ty/norm),cvRound(Y[s]+width*tx/norm)));
+		AppendLineTo(sideB,cvPoint(cvRound(X[s]+width*ty/norm),cvRound(Y[s]-width*tx/norm)));
+	}
+
+	ReservePointBuf(centerline,numSegments);
+	for (s=0; s<numSegments; s++){
+		int k=cvRound((double) s*samples/(numSegments-1));
+		centerline->pts[s]=cvPoint(cvRound(X[k]),cvRound(Y[k]));
+	}
+	centerline->n=numSegments;
+
+	if (noise){
+		for (s=0; s<sideA->n; s++) sideA->pts[s].x+=rand()%5-2;
+		for (s=0; s<centerline->n; s++) centerline->pts[s].y+=rand()%5-2;
+	}
+}
+
+/*
+ * SegmentSides() as it was before its window search went four points at a
+ * time: every window is searched one point at a time by FindPerpPoint().
+ */
+static void SegmentSidesOneAtATime(const PointBuf* contourA, const PointBuf* contourB, const PointBuf* centerline, PointBuf* segmentedA, PointBuf* segmentedB){
+	int ptincrement = 3*((contourA->n > contourB->n ? contourA->n : contourB->n) / centerline->n + 1);
+	ReservePointBuf(segmentedA,centerline->n);
+	ReservePointBuf(segmentedB,centerline->n);
+	const CvPoint* c=centerline->pts;
+	int lastA=0;
+	int lastB=0;
+	for (int j = 0; j < centerline->n; j++) {
+		CvPoint backward= (j==0) ? contourA->pts[0] : c[j-1];
+		CvPoint forward= (j==centerline->n-1) ? contourA->pts[centerline->n-1] : c[j+1];
+		CvPoint tangent=cvPoint(forward.x-backward.x,forward.y-backward.y);
+		lastA = FindPerpPoint (c[j], tangent, contourA, lastA - ptincrement, lastA + ptincrement);
+		lastB = FindPerpPoint (c[j], tangent, contourB, lastB - ptincrement, lastB + ptincrement);
+		segmentedA->pts[j] = contourA->pts[lastA];
+		segmentedB->pts[j] = contourB->pts[lastB];
+	}
+	segmentedA->n=centerline->n;
+	segmentedB->n=centerline->n;
+}
+
+/*
+ * Check SegmentSides() against SegmentSidesOneAtATime() on worms with
+ * random numbers of segments, half of them noisy, and time the two
+ * for a range of NumSegments.
+ *
+ * Returns the number of worms on which they disagree.
+ */
+int TestSegmentSides(){
+	PointBuf sideA, sideB, centerline, fastA, fastB, slowA, slowB;
+	InitPointBuf(&sideA,CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&sideB,CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&centerline,CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&fastA,CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&fastB,CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&slowA,CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&slowB,CV_SEQ_ELTYPE_POINT);
+
+	int bad=0;
+	int trials=4000;
+	srand(5);
+	for (int trial=0; trial<trials; trial++){
+		int numSegments=10+rand()%200;
+		MakeTestWorm(0.7*trial,numSegments,trial%2,&sideA,&sideB,&centerline);
+		SegmentSides(&sideA,&sideB,&centerline,&fastA,&fastB);
+		SegmentSidesOneAtATime(&sideA,&sideB,&centerline,&slowA,&slowB);
+		if (fastA.n!=slowA.n || fastB.n!=slowB.n
+				|| memcmp(fastA.pts,slowA.pts,slowA.n*sizeof(CvPoint))
+				|| memcmp(fastB.pts,slowB.pts,slowB.n*sizeof(CvPoint))) bad++;
+	}
+	printf("SegmentSides(): %d of %d worms differ from FindPerpPoint()\n",bad,trials);
+
+	int numSegments[]={20,50,100,200,400};
+	for (int k=0; k<5; k++){
+		MakeTestWorm(3,numSegments[k],0,&sideA,&sideB,&centerline);
+		int reps=5000;
+		double t0=TestSeconds();
+		for (int r=0; r<reps; r++) SegmentSidesOneAtATime(&sideA,&sideB,&centerline,&slowA,&slowB);
+		double t1=TestSeconds();
+		for (int r=0; r<reps; r++) SegmentSides(&sideA,&sideB,&centerline,&fastA,&fastB);
+		double t2=TestSeconds();
+		printf("\tNumSegments %3d: one at a time %7.2f us, SegmentSides() %7.2f us\n",numSegments[k],
+				1e6*(t1-t0)/reps,1e6*(t2-t1)/reps);
+	}
+
+	ReleasePointBuf(&sideA);
+	ReleasePointBuf(&sideB);
+	ReleasePointBuf(&centerline);
+	ReleasePointBuf(&fastA);
+	ReleasePointBuf(&fastB);
+	ReleasePointBuf(&slowA);
+	ReleasePointBuf(&slowB);
+	return bad;
+}
+
+
+/*
+ * Fill boundary with the closed outline of a worm of about n points, lying
+ * at a random angle. With jitter set the points are moved by up to a pixel.
+ */
+static void MakeTestBoundary(int n, int jitter, PointBuf* boundary){
+	double length=n/2.2;
+	double width=length/10;
+	double angle=2*CV_PI*rand()/RAND_MAX;
+	int samples=20*n;
+	boundary->n=0;
+	ReservePointBuf(boundary,samples);
+	for (int s=0; s<samples; s++){
+		double t=2*CV_PI*s/samples;
+		double u=cos(t)*length/2;
+		double v=sin(t)*width*(0.3+0.7*sin(t/2+1)*sin(t/2+1)) + 2*width*sin(6*u/length+angle);
+		CvPoint p=cvPoint(cvRound(600+u*cos(angle)-v*sin(angle)),cvRound(500+u*sin(angle)+v*cos(angle)));
+		if (jitter) p.x+=rand()%3-1;
+		if (boundary->n>0 && p.x==boundary->pts[boundary->n-1].x && p.y==boundary->pts[boundary->n-1].y) continue;
+		boundary->pts[boundary->n]=p;
+		boundary->n++;
+	}
+}
+
+/*
+ * GivenBoundaryFindWormHeadTail() as it was before it was vectorized, with
+ * its dot products in an array (dots, one per boundary point) instead of a CvSeq.
+ */
+static void FindHeadTailOnePointAtATime(const PointBuf* boundary, int lengthScale, int* dots, int* head, int* tail){
+	int n=boundary->n;
+	const CvPoint* b=boundary->pts;
+	int i;
+	for (i=0; i<n; i++){
+		const CvPoint* ahead=&(b[(i+lengthScale)%n]);
+		const CvPoint* behind=&(b[(i+n-lengthScale)%n]);
+		dots[i]=(ahead->x-b[i].x)*(b[i].x-behind->x) + (ahead->y-b[i].y)*(b[i].y-behind->y);
+	}
+
+	float MostCurvy=1000;
+	*tail=0;
+	for (i=0; i<n; i++){
+		if (dots[i] < MostCurvy){
+			MostCurvy=dots[i];
+			*tail=i;
+		}
+	}
+
+	float SecondMostCurvy=1000;
+	*head=0;
+	for (i=0; i<n; i++){
+		if (DistBetPtsOnCircBound(n,i,*tail) > n/4 && dots[i] < SecondMostCurvy){
+			SecondMostCurvy=dots[i];
+			*head=i;
+		}
+	}
+}
+
+/*
+ * Check GivenBoundaryFindWormHeadTail() against FindHeadTailOnePointAtATime()
+ * on random worms and on boxes of noise full of ties, with random
+ * LengthScale, and time the two for boundaries of 500 to 5000 points.
+ *
+ * Returns the number of boundaries on which they disagree.
+ */
+int TestHeadTail(){
+	WormAnalysisData* Worm=CreateWormAnalysisDataStruct();
+	WormAnalysisParam* Params=CreateWormAnalysisParam();
+	Worm->SizeOfImage=cvSize(1600,1200);
+	/** MakeTestBoundary() makes at most 20 points for every point asked for **/
+	int* dots=(int*) malloc(20*6000*sizeof(int));
+	int head, tail;
+
+	int bad=0;
+	int tested=0;
+	srand(1);
+	for (int trial=0; trial<6000; trial++){
+		if (trial%3==0){
+			/** Noise **/
+			int n=200+rand()%6000;
+			ReservePointBuf(&(Worm->Boundary),n);
+			for (int i=0; i<n; i++) Worm->Boundary.pts[i]=cvPoint(rand()%6,rand()%6);
+			Worm->Boundary.n=n;
+		} else {
+			MakeTestBoundary(300+rand()%5000,trial%3==2,&(Worm->Boundary));
+		}
+		if (Worm->Boundary.n < 2*Params->NumSegments) continue;
+		Params->LengthScale=1+rand()%40;
+		FindHeadTailOnePointAtATime(&(Worm->Boundary),Params->LengthScale,dots,&head,&tail);
+		GivenBoundaryFindWormHeadTail(Worm,Params);
+		if (head!=Worm->HeadIndex || tail!=Worm->TailIndex) bad++;
+		tested++;
+	}
+	printf("GivenBoundaryFindWormHeadTail(): %d of %d boundaries differ from one point at a time\n",bad,tested);
+
+	int lengths[]={500,1000,2000,3000,5000};
+	Params->LengthScale=12;
+	for (int k=0; k<5; k++){
+		MakeTestBoundary((int) (0.647*lengths[k]),0,&(Worm->Boundary));
+		int reps=20000;
+		double t0=TestSeconds();
+		for (int r=0; r<reps; r++) FindHeadTailOnePointAtATime(&(Worm->Boundary),Params->LengthScale,dots,&head,&tail);
+		double t1=TestSeconds();
+		for (int r=0; r<reps; r++) GivenBoundaryFindWormHeadTail(Worm,Params);
+		double t2=TestSeconds();
+		printf("\t%5d boundary points: one at a time %7.2f us, GivenBoundaryFindWormHeadTail() %7.2f us\n",Worm->Boundary.n,
+				1e6*(t1-t0)/reps,1e6*(t2-t1)/reps);
+	}
+
+	free(dots);
+	DestroyWormAnalysisParam(Params);
+	DestroyWormAnalysisDataStruct(Worm);
+	return bad;
+}
+
+/*
+ * Fill centerline with n points along a wavy line at time t, jittered by up to a pixel.
+ */
+static void MakeTestCenterline(int n, double t, PointBuf* centerline){
+	ReservePointBuf(centerline,n);
+	for (int i=0; i<n; i++){
+		double u=500.0*i/n;
+		centerline->pts[i]=cvPoint(cvRound(400+0.9*u+30*sin(u/60+t)) + rand()%3-1,
+				cvRound(300+0.4*u+40*sin(u/80-t)) + rand()%3-1);
+	}
+	centerline->n=n;
+}
+
+/*
+ * smoothPtSequence() as it was before its kernels were cached: a new
+ * kernel with an exp() per tap every call, and x and y copied out and
+ * convolved separately by ConvolveInt1D().
+ */
+static void SmoothPointsOldWay(const PointBuf* src, PointBuf* dst, double sigma){
+	int ll = (int) (-3 * sigma) - 1;
+	int ul = (int) (3 * sigma) + 1;
+	int klength = ul - ll + 1;
+	int* kernel = (int*) malloc (klength * sizeof(int));
+	int normfactor = 0;
+	double norm = exp(-1.0*ll*ll/(2*sigma*sigma));
+	int j;
+	for (j = 0; j < klength; j++) {
+		kernel[j] = (int) (exp(-1.0*(j+ll)*(j+ll)/(2*sigma*sigma))/norm + 0.5);
+		normfactor += kernel[j];
+	}
+
+	int* x = (int *) malloc (src->n * sizeof(int));
+	int* y = (int *) malloc (src->n * sizeof(int));
+	int* xc = (int *) malloc (src->n * sizeof(int));
+	int* yc = (int *) malloc (src->n * sizeof(int));
+	for (j = 0; j < src->n; j++) {
+		x[j] = src->pts[j].x;
+		y[j] = src->pts[j].y;
+	}
+	ConvolveInt1D(x, xc, src->n, kernel, klength, normfactor);
+	ConvolveInt1D(y, yc, src->n, kernel, klength, normfactor);
+	ReservePointBuf(dst,src->n);
+	for (j = 0; j < src->n; j++) dst->pts[j] = cvPoint(xc[j],yc[j]);
+	dst->n=src->n;
+
+	free(x);
+	free(y);
+	free(xc);
+	free(yc);
+	free(kernel);
+}
+
+/*
+ * Check smoothPtSequence() and SmoothPointBuf() against SmoothPointsOldWay().
+ *
+ * At any sigma smoothPtSequence() must match exactly, also for coordinates
+ * too big for the SSE2 path. So must SmoothPointBuf() when sigma is a whole
+ * number of 1/PTSMOOTH_STEPS. For the sigmas SegmentWorm() really uses,
+ * and for the recursive Gaussian, prints how far off SmoothPointBuf() is.
+ * Then times each of them.
+ *
+ * Returns the number of sequences that should have matched but did not.
+ */
+int TestSmoothing(){
+	PointBuf src, old, smooth;
+	InitPointBuf(&src,CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&old,CV_SEQ_ELTYPE_POINT);
+	InitPointBuf(&smooth,CV_SEQ_ELTYPE_POINT);
+	PtSmoother cached;
+	InitPtSmoother(&cached);
+	PtSmoother recursive;
+	InitPtSmoother(&recursive);
+	recursive.IIRSigma=0.5;
+	int i, t;
+
+	int bad=0;
+	int trials=5000;
+	srand(1);
+	for (t=0; t<trials; t++){
+		MakeTestCenterline(1+rand()%800,t,&src);
+		if (t%8==0) for (i=0; i<src.n; i++) src.pts[i].x+=70000;
+		double sigma=0.3+(rand()%4000)/100.0;
+		SmoothPointsOldWay(&src,&old,sigma);
+		smoothPtSequence(&src,&smooth,sigma);
+		if (smooth.n!=old.n || memcmp(smooth.pts,old.pts,old.n*sizeof(CvPoint))) bad++;
+
+		sigma=(double) (10+rand()%1270)/PTSMOOTH_STEPS;
+		SmoothPointsOldWay(&src,&old,sigma);
+		SmoothPointBuf(&cached,&src,&smooth,sigma);
+		if (smooth.n!=old.n || memcmp(smooth.pts,old.pts,old.n*sizeof(CvPoint))) bad++;
+	}
+	printf("smoothPtSequence() and SmoothPointBuf(): %d of %d sequences differ from the old way\n",bad,2*trials);
+
+	/** Sigma as SegmentWorm() picks it, 0.5*points/NumSegments with NumSegments 100 **/
+	long coords=0;
+	long differ=0;
+	int worst=0;
+	for (t=0; t<trials; t++){
+		MakeTestCenterline(400+rand()%200,0.01*t,&src);
+		double sigma=0.5*src.n/100;
+		SmoothPointsOldWay(&src,&old,sigma);
+		SmoothPointBuf(&cached,&src,&smooth,sigma);
+		for (i=0; i<src.n; i++){
+			int d=abs(old.pts[i].x-smooth.pts[i].x)+abs(old.pts[i].y-smooth.pts[i].y);
+			if (d>0) differ++;
+			if (d>worst) worst=d;
+		}
+		coords+=2*src.n;
+	}
+	printf("\tSegmentWorm() sigmas: %ld of %ld coordinates differ, by at most %d\n",differ,coords,worst);
+
+	/** The recursive Gaussian, away from the ends **/
+	double sigmas[]={2,4,8,16,32};
+	for (int k=0; k<5; k++){
+		long total=0;
+		long n=0;
+		worst=0;
+		for (t=0; t<200; t++){
+			MakeTestCenterline(500,0.1*t,&src);
+			SmoothPointsOldWay(&src,&old,sigmas[k]);
+			SmoothPointBuf(&recursive,&src,&smooth,sigmas[k]);
+			int edge=(int) (3*sigmas[k])+1;
+			for (i=edge; i<src.n-edge; i++){
+				int d=abs(old.pts[i].x-smooth.pts[i].x);
+				if (abs(old.pts[i].y-smooth.pts[i].y) > d) d=abs(old.pts[i].y-smooth.pts[i].y);
+				if (d>worst) worst=d;
+				total+=d;
+				n++;
+			}
+		}
+		printf("\tRecursive Gaussian, sigma %4.1f: mean difference %.3f pixels, largest %d\n",sigmas[k],(double) total/n,worst);
+	}
+
+	int lengths[]={250,500,1000};
+	int numSegments[]={100,50,20};
+	for (int k=0; k<3; k++){
+		MakeTestCenterline(lengths[k],0,&src);
+		for (int m=0; m<3; m++){
+			double sigma=0.5*lengths[k]/numSegments[m];
+			int reps=3000;
+			double t0=TestSeconds();
+			for (int r=0; r<reps; r++) SmoothPointsOldWay(&src,&old,sigma);
+			double t1=TestSeconds();
+			for (int r=0; r<reps; r++) smoothPtSequence(&src,&smooth,sigma);
+			double t2=TestSeconds();
+			for (int r=0; r<reps; r++) SmoothPointBuf(&cached,&src,&smooth,sigma);
+			double t3=TestSeconds();
+			for (int r=0; r<reps; r++) SmoothPointBuf(&recursive,&src,&smooth,sigma);
+			double t4=TestSeconds();
+			printf("\t%4d points, sigma %5.2f: old way %7.2f us, smoothPtSequence() %7.2f us, cached %7.2f us, recursive %7.2f us\n",
+					lengths[k],sigma,1e6*(t1-t0)/reps,1e6*(t2-t1)/reps,1e6*(t3-t2)/reps,1e6*(t4-t3)/reps);
+		}
+	}
+
+	ReleasePtSmoother(&cached);
+	ReleasePtSmoother(&recursive);
+	ReleasePointBuf(&src);
+	ReleasePointBuf(&old);
+	ReleasePointBuf(&smooth);
+	return bad;
+}
+
 
 int main(){
 
@@ -167,6 +607,10 @@ int main(){
 	CvMemStorage* mem= cvCreateMemStorage();
 	CvSeq* test=cvCreateSeq(CV_SEQ_ELTYPE_POINT, sizeof(CvSeq), sizeof(CvPoint),mem);
 	GetLineFromEndPts(cvPoint(0,0),cvPoint(10,15),test);
+
+	TestSegmentSides();
+	TestHeadTail();
+	TestSmoothing();
 	return 0;
 
 	CvMemStorage* MyMem= cvCreateMemStorage();